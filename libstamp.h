@@ -0,0 +1,83 @@
+/* libstamp, the notes of Stamp from C.
+ *
+ * Copyright (C) 2014 Reinier Schoof <reinier@skoef.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * A handle gives access to the notes of one category, the same files
+ * the stamp command uses. Calls on one handle are serialized, so a
+ * handle can be shared by threads; handles can be used from different
+ * threads at the same time. Appends and rewrites lock the category
+ * file, so notes added through different handles or processes get
+ * distinct ids and aren't lost to a delete or replace.
+ * Functions return -1 on failure.
+ */
+
+#ifndef _LIBSTAMP_H
+#define _LIBSTAMP_H
+
+#include <stddef.h>
+
+#define STAMP_NO_DATE (-2147483647 - 1)
+
+struct Stamp;
+
+/* A note as it is in the category file. message and line point into
+ * the buffer of the reader and are only valid during the callback,
+ * they aren't nul-terminated.
+ */
+struct StampNote {
+    int         id;
+    int         date;         /* days since 1970-01-01, or STAMP_NO_DATE */
+    const char *message;
+    size_t      length;       /* of message */
+    const char *line;         /* the whole line, without newline */
+    size_t      line_length;
+};
+
+/* Return nonzero to stop iterating */
+typedef int (*StampCallback)(const struct StampNote *note, void *arg);
+
+/* Open category in the stamp path dir, or the one configured for the
+ * stamp command when dir is NULL. The category file is created when
+ * the first note is added.
+ */
+struct Stamp *stamp_open(const char *dir, const char *category);
+void          stamp_close(struct Stamp *h);
+
+/* Add notes dated date (yyyy-MM-dd), today when it's NULL. Returns the
+ * id of the (first) note added. The batch is written at once.
+ */
+int stamp_append(struct Stamp *h, const char *message, const char *date);
+int stamp_append_batch(struct Stamp *h, const char *const *messages,
+    size_t count, const char *date);
+
+/* Call callback for every note, or those containing term. Returns the
+ * number of notes it was called for.
+ */
+int stamp_iterate(struct Stamp *h, StampCallback callback, void *arg);
+int stamp_search(struct Stamp *h, const char *term, StampCallback callback,
+    void *arg);
+
+/* Delete note id, or replace its message and/or date where not NULL */
+int stamp_delete(struct Stamp *h, int id);
+int stamp_replace(struct Stamp *h, int id, const char *message,
+    const char *date);
+
+/* Format a date of a note as yyyy-MM-dd into buf of at least 11 bytes */
+int stamp_format_date(int day, char *buf);
+
+/* The stamp command */
+int stamp_main(int argc, char *argv[]);
+
+#endif /* _LIBSTAMP_H */
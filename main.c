@@ -0,0 +1,25 @@
+/* Stamp is a Unix-style note-taking software.
+ *
+ * Copyright (C) 2014 Reinier Schoof <reinier@skoef.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The stamp command, all of it is in libstamp.
+ */
+
+#include "libstamp.h"
+
+int main(int argc, char *argv[])
+{
+	return stamp_main(argc, argv);
+}
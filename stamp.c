@@ -32,22 +32,74 @@
 
 /* enable prototyping getline() */
 #define _WITH_GETLINE
+/* and the POSIX and BSD interfaces with glibc's -std=c99 */
+#define _DEFAULT_SOURCE
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "libstamp.h"
 #include "stamp.h"
 
+/* --stats / STAMP_STATS state */
+static int             stats_enabled = 0;
+static struct Stats    stats;
+static __thread int    stats_main_thread = 0;
+static Phase_t         stats_current_phase = PHASE_NONE;
+static struct timespec stats_phase_start;
+static struct timespec stats_command_start;
+
+/* --trace / STAMP_TRACE state */
+static int                 trace_enabled = 0;
+static char               *trace_path = NULL;
+static struct TraceBuffer *trace_buffers = NULL;
+static int                 trace_next_tid = 0;
+static __thread struct TraceBuffer *trace_local = NULL;
+
+static int           export_incremental = 0;
+static int           query_enabled = 0;
+static int           ignore_case = 0;
+static int           count_only = 0;
+static SortKey_t     sort_key = SORT_NONE;
+static int           sort_reverse = 0;
+static int           dedup_same_date = 0;
+static int           skip_duplicates = 0;
+static ImportFormat_t import_format = IMPORT_NONE;
+static int           include_archive = 0;
+static int           select_search = 0;
+static struct Page   page = { 0, -1, 0, 0 };
+static struct Cache  cache;
+static struct Sorter sorter;
+
+/* Stamp path of the libstamp handle being used by this thread */
+static __thread const char *stamp_dir = NULL;
+
+/* Buffered writer for everything listing and search commands print */
+static char          output_buffer[OUTPUT_BUFFER_SIZE];
+static struct Output output = { STDOUT_FILENO, output_buffer };
+
 /* Check if given date is in valid date format.
  * Stamp assumes the date format to be yyyy-MM-dd.
  *
@@ -100,6 +152,40 @@ static int is_valid_date_format(const char *date, int silent_errors)
 }
 
 
+/* The fast path of is_valid_date_format for the importer: the len bytes
+ * at str must be exactly yyyy-MM-dd and a day of the calendar.
+ *
+ * Returns 0 when they are and -1 when they aren't.
+ */
+static int is_valid_date(const char *str, size_t len)
+{
+	static const unsigned char day_count[12] = { 31, 29, 31, 30, 31, 30,
+						     31, 31, 30, 31, 30, 31 };
+	const unsigned char *s = (const unsigned char *)str;
+
+	if (len != DATE_LEN || s[4] != '-' || s[7] != '-')
+		return -1;
+
+	for (int i = 0; i < DATE_LEN; i++) {
+		if (i != 4 && i != 7 && (unsigned char)(s[i] - '0') > 9)
+			return -1;
+	}
+
+	int y = (s[0] - '0') * 1000 + (s[1] - '0') * 100 + (s[2] - '0') * 10 +
+		(s[3] - '0');
+	int m = (s[5] - '0') * 10 + (s[6] - '0');
+	int d = (s[8] - '0') * 10 + (s[9] - '0');
+
+	if (m < 1 || m > 12 || d < 1 || d > day_count[m - 1])
+		return -1;
+
+	if (m == 2 && d == 29 && (y % 4 != 0 || (y % 100 == 0 && y % 400 != 0)))
+		return -1;
+
+	return 0;
+}
+
+
 /* Functions checks if file exists.
  * This should be more reliable than using access().
  *
@@ -115,7 +201,7 @@ static int file_exists(const char *path)
 	int retval = 0;
 	struct stat buffer;
 
-	if (stat(path, &buffer) == 0)
+	if (stamp_stat(path, &buffer) == 0)
 		retval = 1;
 
 	return retval;
@@ -145,6 +231,8 @@ static int count_file_lines(FILE *fp)
 		return -1;
 	}
 
+	TRACE_BEGIN("count_file_lines");
+
 	/* Count lines by new line characters */
 	while (!feof(fp)) {
 		ch = fgetc(fp);
@@ -153,9 +241,12 @@ static int count_file_lines(FILE *fp)
 			count++;
 	}
 
+	STAT_ADD(bytes_read, ftell(fp));
+
 
 	/* Go to beginning of the file */
 	rewind(fp);
+	TRACE_END();
 
 	/* return the count, ignoring the last empty line */
 	if (count == 0)
@@ -176,814 +267,10047 @@ static void fail(const char *fmt, ...)
 }
 
 
-/* Get open FILE* for stamp file.
- * Returns NULL of failure.
- * Caller must close the file pointer after calling the function
- * succesfully.
- */
-static FILE *get_memo_file_ptr(char *category, char *mode, char *suffix)
+static double timespec_diff(const struct timespec *from,
+	const struct timespec *to)
 {
-	FILE *fp = NULL;
-	char *path = get_memo_file_path(category);
-
-	if (path == NULL) {
-		fail("%s: error getting stamp path\n", __func__);
-		return NULL;
-	}
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_nsec - from->tv_nsec) / 1e9;
+}
 
-	// append suffix to filename
-	if (strlen(suffix) > 0) {
-		char *path_suffix = (char*) malloc(sizeof(char) * (strlen(path) + strlen(suffix) + 1));
-		if (path_suffix == NULL) {
-			fail("%s: malloc failed\n", __func__);
-			return NULL;
-		}
 
-		strcpy(path_suffix, path);
-		strcat(path_suffix, suffix);
+/* Switch the phase wall time is currently attributed to.  Time spent
+ * so far is booked on the phase being left, so nested phases (config
+ * lookups while opening a file, for instance) are counted exclusively.
+ *
+ * Returns the phase that was active before the switch, which the
+ * caller hands back to us when its own phase ends.
+ */
+static Phase_t stats_phase(Phase_t phase)
+{
+	struct timespec now;
+	Phase_t prev = stats_current_phase;
 
-		fp = fopen(path_suffix, mode);
-		free(path_suffix);
-	} else
-		fp = fopen(path, mode);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	if (fp == NULL)
-		fail("%s: error opening file: %s\n", __func__, strerror(errno));
+	if (prev != PHASE_NONE)
+		stats.phase_time[prev] += timespec_diff(&stats_phase_start, &now);
 
-	free(path);
+	stats_phase_start = now;
+	stats_current_phase = phase;
 
-	return fp;
+	return prev;
 }
 
 
-/* Function reads multiple lines from stdin until
- * the end of transmission (^D).
- *
- * Each line is assumed to be the content part of the note.
- *
- * Notes are added to the stamp file. Returns -1 on failure, 0 on
- * success.
+/* Print the counters gathered while running command to stderr
+ * and reset them for the next command.
  */
-static int add_notes_from_stdin(char *category)
+static void stats_report(int command)
 {
-	/* First get the whole buffer from stdin. Then parse the buffer;
-	 * each note is separated by a new line character in the
-	 * buffer. Call add_note for each line.
-	 */
+	static const char *phase_names[PHASE_COUNT] = {
+		"config", "open", "parse", "filter", "output"
+	};
+	struct timespec now;
 
-	int length = 128;
-	char *buffer = NULL;
-	int count = 0;
-	char ch;
-	char *line = NULL;
+	if (!stats_enabled)
+		return;
 
-	if ((buffer = (char*)malloc(sizeof(char) * length)) == NULL) {
-		fail("%s: malloc failed\n", __func__);
-		return -1;
-	}
+	/* flush pending output first, so it's accounted for */
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	fail("stamp stats for -%c\n", command);
+	fail("  bytes read        %lu\n", stats.bytes_read);
+	fail("  bytes written     %lu\n", stats.bytes_written);
+	fail("  files opened      %lu\n", stats.files_opened);
+	fail("  stat calls        %lu\n", stats.stat_calls);
+	fail("  mkdir calls       %lu\n", stats.mkdir_calls);
+	fail("  rename calls      %lu\n", stats.rename_calls);
+	fail("  note allocations  %lu\n", stats.note_allocs);
+	fail("  notes scored      %lu\n", stats.notes_scored);
+
+	for (int i = 0; i < PHASE_COUNT; i++)
+		fail("  %-6s time       %.6fs\n", phase_names[i],
+			stats.phase_time[i]);
+
+	fail("  total time        %.6fs\n",
+		timespec_diff(&stats_command_start, &now));
+
+	memset(&stats, 0, sizeof(stats));
+	stats_current_phase = PHASE_NONE;
+	stats_command_start = now;
+}
 
-	ch = getc(stdin);
 
-	while (ch != EOF) {
-		if (count == length) {
-			length += 128;
-			if ((buffer = realloc(buffer, length)) == NULL) {
-				fail("%s realloc failed\n", __func__);
-				return -1;
-			}
-		}
+static uint64_t trace_now()
+{
+	struct timespec now;
 
-		buffer[count] = ch;
-		count++;
-		ch = getc(stdin);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	buffer[count] = '\0';
-	buffer = realloc(buffer, count + 1);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
-	line = strtok(buffer, "\n");
 
-	while (line != NULL) {
-		add_note(category, line, NULL);
-		line = strtok(NULL, "\n");
-	}
+/* Enable span tracing, the trace is written to path on exit. */
+static void trace_open(const char *path)
+{
+	if (trace_enabled)
+		return;
 
-	free(buffer);
+	trace_path = strdup(path);
+	if (trace_path == NULL) {
+		fail("%s: strdup failed\n", __func__);
+		return;
+	}
 
-	return 0;
+	trace_enabled = 1;
+	atexit(trace_write);
 }
 
 
-/* Reads a line from source pointed by FILE*.
- *
- * This function is used to read .stamp as well as ~/.stamprc
- * files line by line.
- *
- * Return NULL on failure.
- * Caller is responsible for freeing the return value
+/* Returns the buffer of the calling thread, creating and publishing
+ * it on first use. Publishing is a compare-and-swap push on the list
+ * of buffers, recording itself never touches shared state.
  */
-static char *read_file_line(FILE *fp)
+static struct TraceBuffer *trace_buffer()
 {
-	if (!fp)
-		return NULL;
+	struct TraceBuffer *buf = trace_local;
 
-	char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
+	if (buf != NULL)
+		return buf;
 
-	if ((read = getline(&line, &len, fp)) == -1) {
+	buf = (struct TraceBuffer *)calloc(1, sizeof(struct TraceBuffer));
+	if (buf == NULL)
 		return NULL;
-	}
 
-	/* strip trailing whitespace */
-	char *retval = strtok(line, "\n");
+	buf->tid = __sync_add_and_fetch(&trace_next_tid, 1);
 
-	return retval;
+	do {
+		buf->next = trace_buffers;
+	} while (!__sync_bool_compare_and_swap(&trace_buffers, buf->next, buf));
+
+	trace_local = buf;
+
+	return buf;
 }
 
-/* Wrapper to read_file_line that returns Note instead of char
- *
- * Return NULL on failure.
- */
-static struct Note read_file_note(FILE *fp)
+
+static struct TraceSpan trace_begin(const char *name)
 {
-	struct Note note;
-	char *line = read_file_line(fp);
-	if (line) {
-		note = line_to_Note(line);
-		free(line);
+	struct TraceSpan span = { name, trace_now() };
+
+	return span;
+}
+
+
+static void trace_end(struct TraceSpan *span)
+{
+	uint64_t now = trace_now();
+	struct TraceBuffer *buf = trace_buffer();
+
+	if (buf == NULL)
+		return;
+
+	if (buf->tail == NULL || buf->tail->used == TRACE_CHUNK_EVENTS) {
+		struct TraceChunk *chunk = (struct TraceChunk *)malloc(sizeof(struct TraceChunk));
+		if (chunk == NULL)
+			return;
+
+		chunk->used = 0;
+		chunk->next = NULL;
+
+		if (buf->tail)
+			buf->tail->next = chunk;
+		else
+			buf->head = chunk;
+
+		buf->tail = chunk;
 	}
 
-	return note;
+	struct TraceEvent *ev = &buf->tail->events[buf->tail->used++];
+	ev->name = span->name;
+	ev->start = span->start;
+	ev->duration = now - span->start;
 }
 
-/* Simply read all the lines from the .stamp file
- * and return the id of the last line plus one.
- * If the file is missing or is empty, return 0
- * On error, returns -1
+
+/* Write all recorded spans in Chrome Trace Event format, which can be
+ * loaded in chrome://tracing, Perfetto or speedscope.
  */
-static int get_next_id(char *category)
+static void trace_write()
 {
-	int id = 0;
 	FILE *fp = NULL;
-	struct Note note;
-	int lines = 0;
-	int current = 0;
+	int first = 1;
+	long pid = (long)getpid();
 
-	fp = get_memo_file_ptr(category, "r", "");
+	if (!trace_enabled)
+		return;
 
-	lines = count_file_lines(fp);
+	trace_enabled = 0;
 
-	if (lines == -1) {
-		fail("%s: counting lines failed\n", __func__);
-		return -1;
+	if ((fp = fopen(trace_path, "w")) == NULL) {
+		fail("%s: error opening %s: %s\n", __func__, trace_path,
+			strerror(errno));
+		return;
 	}
 
-	if (lines == -2) {
-		fclose(fp);
-		return id + 1;
-	}
+	fprintf(fp, "{\"traceEvents\":[\n");
 
-	for (;;) {
-		note = read_file_note(fp);
+	for (struct TraceBuffer *buf = trace_buffers; buf; buf = buf->next) {
+		struct TraceChunk *chunk = buf->head;
 
-		/* Check if we're at the last line */
-		if (note.id && current == lines) {
-			id = note.id;
-			FREENOTE(note);
-			break;
-		}
+		while (chunk) {
+			for (int i = 0; i < chunk->used; i++) {
+				struct TraceEvent *ev = &chunk->events[i];
 
-		current++;
+				fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"stamp\","
+					"\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+					"\"pid\":%ld,\"tid\":%d}",
+					first ? "" : ",\n", ev->name,
+					ev->start / 1000.0, ev->duration / 1000.0,
+					pid, buf->tid);
+				first = 0;
+			}
 
-		if (note.id)
-			FREENOTE(note);
+			struct TraceChunk *next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
 	}
 
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
 	fclose(fp);
-
-	return id + 1;
+	free(trace_path);
 }
 
-/* Convert stamp line to Note struct
+
+/* Account for the return value of a printf family call.
+ * Never wrap a side effect in STAT_ADD itself, it's only evaluated
+ * with --stats.
  */
-static struct Note line_to_Note(char *line)
+static void stats_written(int written)
 {
-	struct Note note;
-	char *token = NULL;
+	if (written > 0)
+		STAT_ADD(bytes_written, written);
+}
 
-	token = strtok(line, "\t");
-	if (token)
-		note.id = atoi(token);
 
-	token = strtok(NULL, "\t");
-	if (token && strlen(token) == 10)
-		strcpy(note.date, token);
+/* Thin wrappers around the calls --stats keeps track of */
+static FILE *stamp_fopen(const char *path, const char *mode)
+{
+	FILE *fp = fopen(path, mode);
 
-	token = strtok(NULL, "\n");
-	if (token) {
-		note.message = (char *) malloc((strlen(token) + 1) * sizeof(char));
-		strcpy(note.message, token);
-	}
+	if (fp != NULL)
+		STAT_ADD(files_opened, 1);
 
-	return note;
+	return fp;
 }
 
-/* Show all notes.
+
+/* Open a tmp file of its own next to path for writing, to be renamed
+ * over path, as other processes may be writing it at the same time.
+ * *tmp is set to its newly allocated name.
  *
- * Returns the number of notes. Returns -1 on failure
+ * Returns NULL on failure.
  */
-static int show_notes(char *category)
+static FILE *stamp_fopen_tmp(const char *path, char **tmp)
 {
+	size_t len = strlen(path) + 8;
 	FILE *fp = NULL;
-	int count = 0;
-	int lines = 0;
-	struct Note note;
+	int fd;
 
-	fp = get_memo_file_ptr(category, "r", "");
+	if ((*tmp = (char *)malloc(len)) == NULL)
+		return NULL;
 
-	lines = count_file_lines(fp);
-	count = lines;
+	snprintf(*tmp, len, "%s.XXXXXX", path);
 
-	if (lines == -1) {
-		fail("%s: counting lines failed\n", __func__);
-		return -1;
+	if ((fd = mkstemp(*tmp)) != -1 && (fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		remove(*tmp);
 	}
 
-	/* Ignore empty note file and exit */
-	if (lines == -2) {
-		fclose(fp);
-		return -1;
-	}
+	if (fp == NULL) {
+		free(*tmp);
+		*tmp = NULL;
+	} else
+		STAT_ADD(files_opened, 1);
 
-	for (int i = 0; i <= lines; i++) {
-		note = read_file_note(fp);
+	return fp;
+}
 
-		if (!note.id)
-			continue;
 
-		output_default(note);
-		FREENOTE(note);
-	}
+static int stamp_stat(const char *path, struct stat *st)
+{
+	STAT_ADD(stat_calls, 1);
 
-	fclose(fp);
+	return stat(path, st);
+}
 
-	return count;
+
+static int stamp_mkdir(const char *path, mode_t mode)
+{
+	STAT_ADD(mkdir_calls, 1);
+
+	return mkdir(path, mode);
 }
 
-static void output_without_date(struct Note note)
+
+static int stamp_rename(const char *from, const char *to)
 {
-	printf("\t%d\t%s\n",
-		note.id,
-		note.message
-	);
+	STAT_ADD(rename_calls, 1);
+
+	return rename(from, to);
 }
 
 
-/* Function displays notes ordered by date.
- *
- * For example:
- *
- *   2014-11-01
- *         1   Do dishes
- *         2   Pay rent
- *   2014-11-02
- *         3   Go shopping
+/* Region allocator for data that lives as long as one command, such
+ * as notes that have to outlive a NoteReader's buffer.
  *
- * Returns the count of the notes. On failure returns -1.
+ * Memory is handed out by bumping a pointer in the current block and
+ * is only given back all at once by arena_free().
  */
-static int show_notes_tree(char *category)
+static void *arena_alloc(struct Arena *arena, size_t size)
 {
-	int lines = 0;
-	FILE *fp = NULL;
-	int date_index = 0;
-	struct Note note;
+	struct ArenaBlock *block = arena->head;
 
-	fp = get_memo_file_ptr(category, "r", "");
-	lines = count_file_lines(fp);
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
 
-	if (lines == -1) {
-		fail("%s: counting lines failed\n", __func__);
-		return -1;
-	}
+	if (block == NULL || block->used + size > block->size) {
+		size_t bsize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
 
-	/* Ignore empty note file and exit */
-	if (lines == -2) {
-		fclose(fp);
-		return -1;
-	}
+		block = (struct ArenaBlock *)malloc(sizeof(struct ArenaBlock) + bsize);
+		if (block == NULL) {
+			fail("%s: malloc failed\n", __func__);
+			return NULL;
+		}
 
-	char *dates[lines + 1];
-	memset(dates, 0, sizeof(dates));
+		STAT_ADD(note_allocs, 1);
+		block->size = bsize;
+		block->used = 0;
+		block->next = arena->head;
+		arena->head = block;
+	}
 
-	/* Get the date of each note and store the pointer
-	 * of it to dates array
-	 */
-	for (int n = 0; n <= lines; n++) {
-		note = read_file_note(fp);
-		if (!note.id)
-			continue;
+	void *ptr = block->data + block->used;
+	block->used += size;
 
-		int has_date = 0;
-		if (note.date == NULL) {
-			FREENOTE(note);
-			fclose(fp);
-			fail("%s problem getting date\n",
-				__func__);
-			return -1;
-		}
+	return ptr;
+}
 
-		/* Prevent storing duplicate dates */
-		for (int i = 0; i < date_index; i++) {
-			if (!dates[i])
-				continue;
 
-			if (strcmp(dates[i], note.date) == 0) {
-				has_date = 1;
-				break;
-			}
-		}
+/* Copy len bytes of str into the arena and nul terminate it */
+static char *arena_strndup(struct Arena *arena, const char *str, size_t len)
+{
+	char *copy = (char *)arena_alloc(arena, len + 1);
 
-		/* If dates does not contain date, store it
-		 * otherwise free it
-		 */
-		if (!has_date) {
-			dates[date_index] = (char *)malloc((strlen(note.date) + 1) * sizeof(char));
-			strcpy(dates[date_index], note.date);
-			date_index++;
-		}
+	if (copy == NULL)
+		return NULL;
 
-		FREENOTE(note);
-	}
+	memcpy(copy, str, len);
+	copy[len] = '\0';
 
-	/* Loop through all dates and print all notes for
-	 * the date.
-	 */
-	for (int i = 0; i <= lines; i++) {
-		/* Rewind file pointer to beginning every time to
-		 * loop all the notes in the file.
-		 * It's possible that the array is not fully populated (because
-		 * it's allocated to have as many elements as we have notes,
-		 * however duplicate dates are not stored at all.
-		 * so do a check if the value is null.
-		 */
-		if (dates[i]) {
-			rewind(fp);
-			printf("%s\n", dates[i]);
-			for (int j = 0; j <= lines; j++) {
-				note = read_file_note(fp);
-				if (!note.id)
-					continue;
-
-				if (note.date == NULL) {
-					FREENOTE(note);
-					fclose(fp);
-					return -1;
-				}
+	return copy;
+}
 
-				if (strcmp(note.date, dates[i]) == 0)
-					output_without_date(note);
 
-				FREENOTE(note);
-			}
+static void arena_free(struct Arena *arena)
+{
+	struct ArenaBlock *block = arena->head;
 
-			free(dates[i]);
-		}
+	while (block) {
+		struct ArenaBlock *next = block->next;
+		free(block);
+		block = next;
 	}
 
-	fclose(fp);
-
-	return lines;
+	arena->head = NULL;
 }
 
-/* Show all categories of notes
+
+/* Write all pending output. Spans are written straight from the memory
+ * they point to, so this must be called before that memory is reused,
+ * see note_reader_fill().
  *
- * Basically just lists files of stamp directory.
- * Returns number of categories on success or -1 if function fails.
+ * When the reader went away (EPIPE) output is marked broken and
+ * dropped from then on; scan loops check output_broken() to stop
+ * early. Returns 0 on success and -1 on failure.
  */
-static int show_categories()
+static int output_flush(struct Output *out)
 {
-	char *path = get_memo_file_path("");
-	if (path == NULL) {
-		fail("%s: error getting stamp path\n",
-			__func__);
-		return -1;
-	}
+	struct iovec *iov = out->iov;
+	int iovcnt;
 
-	DIR *dir;
-	if ((dir = opendir(path)) == NULL) {
-		fail("%s: could not open stamp path\n", __func__);
-		return -1;
+	if (out->mark < out->length) {
+		out->iov[out->iovcnt].iov_base = out->buffer + out->mark;
+		out->iov[out->iovcnt].iov_len = out->length - out->mark;
+		out->iovcnt++;
 	}
 
-	struct dirent *ent;
-	FILE *fp;
-	int categories = 0;
-	while ((ent = readdir(dir)) != NULL) {
-		/* only files */
-		if (ent->d_type != DT_REG)
-			continue;
+	iovcnt = out->iovcnt;
 
-		fp = get_memo_file_ptr(ent->d_name, "r", "");
-		if (fp == NULL) {
-			printf("%s\n", ent->d_name);
-			continue;
+	if (out->tee)
+		cache_capture(out->tee, iov, iovcnt);
+
+	/* anything printed through stdio has to go out first */
+	if (iovcnt > 0)
+		fflush(stdout);
+
+	while (iovcnt > 0 && !out->broken) {
+		ssize_t written = writev(out->fd, iov, iovcnt);
+
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EPIPE)
+				fail("%s: write failed: %s\n", __func__, strerror(errno));
+
+			out->broken = 1;
+			break;
 		}
 
-		categories++;
+		STAT_ADD(bytes_written, written);
 
-		int num = count_file_lines(fp);
-		if (num < 0)
-			printf("%s (empty)\n", ent->d_name);
-		else {
-			num++;
-			printf("%s (%d %s)\n", ent->d_name, num, (num != 1 ? "notes" : "note"));
+		/* skip what was written, resume partial writes */
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
 		}
 
-		fclose(fp);
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
 	}
 
-	closedir(dir);
+	out->length = 0;
+	out->mark = 0;
+	out->iovcnt = 0;
 
-	return categories;
+	return out->broken ? -1 : 0;
 }
 
-/* Search if a note contains the search term.
- * Returns the count of found notes or -1 if function fails.
- */
-static int search_notes(char *category, const char *search)
+
+static int output_broken(struct Output *out)
 {
-	FILE *fp = NULL;
-	int count = 0;
-	int lines = 0;
-	struct Note note;
+	return out->broken || out->done;
+}
 
-	fp = get_memo_file_ptr(category, "r", "");
 
-	lines = count_file_lines(fp);
+/* Copy len bytes of data into the output buffer */
+static void output_bytes(struct Output *out, const char *data, size_t len)
+{
+	while (len > 0) {
+		size_t room = OUTPUT_BUFFER_SIZE - out->length;
 
-	if (lines == -1) {
-		fail("%s: counting lines failed\n", __func__);
-		return -1;
-	}
+		if (room == 0) {
+			output_flush(out);
+			continue;
+		}
 
-	/* Ignore empty note file and exit */
-	if (lines == -2) {
-		fclose(fp);
-		return -1;
+		if (room > len)
+			room = len;
+
+		memcpy(out->buffer + out->length, data, room);
+		out->length += room;
+		data += room;
+		len -= room;
 	}
+}
 
-	for (int i = 0; i <= lines; i++) {
-		note = read_file_note(fp);
 
-		if (!note.id)
-			continue;
+/* Output len bytes of data without copying them, unless they are
+ * so few that copying is cheaper than another iovec. data must stay
+ * valid until the next output_flush().
+ */
+static void output_span(struct Output *out, const char *data, size_t len)
+{
+	if (len < OUTPUT_SPAN_MIN) {
+		output_bytes(out, data, len);
+		return;
+	}
 
-		/* Check if the search term matches */
-		if ((strstr(note.message, search)) != NULL){
-			output_default(note);
-			count++;
-		}
+	/* the span and the buffered bytes around it take three slots */
+	if (out->iovcnt + 3 > OUTPUT_IOV_MAX)
+		output_flush(out);
 
-		FREENOTE(note);
+	if (out->mark < out->length) {
+		out->iov[out->iovcnt].iov_base = out->buffer + out->mark;
+		out->iov[out->iovcnt].iov_len = out->length - out->mark;
+		out->iovcnt++;
+		out->mark = out->length;
 	}
 
-	fclose(fp);
-
-	return count;
+	out->iov[out->iovcnt].iov_base = (char *)data;
+	out->iov[out->iovcnt].iov_len = len;
+	out->iovcnt++;
 }
 
 
-/* Search using regular expressions (POSIX Basic Regular Expression syntax)
- * Returns the count of found notes or -1 if functions fails.
- */
-static int search_regexp(char *category, const char *regexp)
+static void output_str(struct Output *out, const char *str)
 {
-	int count = 0;
-	regex_t regex;
-	int ret;
-	char lines = 0;
-	FILE *fp = NULL;
-	char buffer[100];
-	struct Note note;
-
-	ret = regcomp(&regex, regexp, REG_ICASE);
+	output_bytes(out, str, strlen(str));
+}
 
-	if (ret != 0) {
-		fail("%s: invalid regexp\n", __func__);
-		return -1;
-	}
 
-	fp = get_memo_file_ptr(category, "r", "");
-	lines = count_file_lines(fp);
+static void output_char(struct Output *out, char c)
+{
+	if (out->length == OUTPUT_BUFFER_SIZE)
+		output_flush(out);
 
-	if (lines == -1) {
-		regfree(&regex);
-		fail("%s: counting lines failed\n", __func__);
-		return -1;
-	}
+	out->buffer[out->length++] = c;
+}
 
-	/* Ignore empty note file and exit */
-	if (lines == -2) {
-		regfree(&regex);
-		return -1;
-	}
 
-	for (int i = 0; i <= lines; i++) {
-		note = read_file_note(fp);
+/* Output v in decimal, formatted by hand to stay out of printf */
+static void output_int(struct Output *out, int v)
+{
+	char buf[12];
+	char *p = buf + sizeof(buf);
+	unsigned int u = v < 0 ? -(unsigned int)v : (unsigned int)v;
 
-		if (!note.id)
-			continue;
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
 
-		ret = regexec(&regex, note.message, 0, NULL, 0);
+	if (v < 0)
+		*--p = '-';
 
-		if (ret == 0) {
-			output_default(note);
-			count++;
-		} else if (ret != 0 && ret != REG_NOMATCH) {
-			/* Something went wrong while executing
-			   regexp. Clean up and exit loop. */
-			regerror(ret, &regex, buffer, sizeof(buffer));
-			fail("%s: %s\n", __func__, buffer);
-			FREENOTE(note);
-			break;
-		}
+	output_bytes(out, p, buf + sizeof(buf) - p);
+}
 
-		FREENOTE(note);
-	}
 
-	regfree(&regex);
-	fclose(fp);
+static void output_date(struct Output *out, const struct NoteView *note)
+{
+	size_t len;
+	const char *date = note_date_text(note, &len);
 
-	return count;
+	output_bytes(out, date, len);
 }
 
 
-/* This functions handles the output of one line.
- * Postponed notes are ignored.
+/* Set up out for buffered writing to fd, which is closed again by
+ * output_close(). Returns 0 on success and -1 on failure.
  */
-static void output_default(struct Note note)
+static int output_open(struct Output *out, int fd)
 {
-	printf(NOTE_FMT,
-		note.id,
-		note.date,
-		note.message
-	);
+	memset(out, 0, sizeof(*out));
+	out->fd = fd;
+	out->buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);
+
+	if (out->buffer == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	return 0;
 }
 
 
-/* Export current .stamp file to a html file
- * Return the path of the html file, or NULL on failure.
+/* Flush and close out. Returns 0 when all output was written and -1
+ * otherwise.
  */
-static const char *export_html(char *category, const char *path)
+static int output_close(struct Output *out)
 {
-	FILE *fp = NULL;
-	FILE *fpm = NULL;
-	struct Note note;
-	int lines = 0;
+	int retval = output_flush(out);
 
-	fp = fopen(path, "w");
+	if (close(out->fd) != 0)
+		retval = -1;
 
-	if (!fp) {
-		fail("%s: failed to open %s\n", __func__, path);
-		return NULL;
-	}
+	free(out->buffer);
+	out->buffer = NULL;
+
+	return retval;
+}
 
-	fpm = get_memo_file_ptr(category, "r", "");
-	lines = count_file_lines(fpm);
 
-	if (lines == -1) {
-		fail("%s: counting lines failed\n", __func__);
-		return NULL;
+/* Byte-at-a-time work is skipped for runs of 8 bytes that need no
+ * escaping. A word is tested for the special bytes of a format in a
+ * few arithmetic operations, see
+ * https://graphics.stanford.edu/~seander/bithacks.html#ZeroInWord
+ */
+#define SWAR_ONES  0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+#define SWAR_HAS_ZERO(w)    (((w) - SWAR_ONES) & ~(w) & SWAR_HIGHS)
+#define SWAR_HAS_BYTE(w, c) SWAR_HAS_ZERO((w) ^ (SWAR_ONES * (unsigned char)(c)))
+#define SWAR_HAS_LESS(w, n) (((w) - SWAR_ONES * (n)) & ~(w) & SWAR_HIGHS)
+
+static uint64_t needs_escape(uint64_t w, ExportFormat_t format)
+{
+	switch (format) {
+	case EXPORT_HTML:
+		return SWAR_HAS_BYTE(w, '<') | SWAR_HAS_BYTE(w, '>') |
+			SWAR_HAS_BYTE(w, '&') | SWAR_HAS_BYTE(w, '"') |
+			SWAR_HAS_BYTE(w, '\'');
+	case EXPORT_JSON:
+		/* bytes past ASCII are checked for valid UTF-8 */
+		return SWAR_HAS_LESS(w, 0x20) | SWAR_HAS_BYTE(w, '"') |
+			SWAR_HAS_BYTE(w, '\\') | (w & SWAR_HIGHS);
+	case EXPORT_CSV:
+		return SWAR_HAS_BYTE(w, '"');
 	}
 
-	if (lines == -2) {
-		printf("Nothing to export.\n");
-		return NULL;
+	return 1;
+}
+
+
+/* Returns the escape sequence for c in format or NULL when c can be
+ * written as is. JSON control characters use buf.
+ */
+static const char *escape_char(unsigned char c, ExportFormat_t format,
+	char *buf)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	switch (format) {
+	case EXPORT_HTML:
+		switch (c) {
+		case '<':  return "&lt;";
+		case '>':  return "&gt;";
+		case '&':  return "&amp;";
+		case '"':  return "&quot;";
+		case '\'': return "&#39;";
+		}
+		break;
+	case EXPORT_JSON:
+		if (c == '"')
+			return "\\\"";
+		if (c == '\\')
+			return "\\\\";
+		if (c < 0x20) {
+			memcpy(buf, "\\u00", 4);
+			buf[4] = hex[c >> 4];
+			buf[5] = hex[c & 0xf];
+			buf[6] = '\0';
+			return buf;
+		}
+		break;
+	case EXPORT_CSV:
+		if (c == '"')
+			return "\"\"";
+		break;
 	}
 
-	fprintf(fp,"<!DOCTYPE html>\n");
-	fprintf(fp, "<html>\n<head>\n");
-	fprintf(fp, "<meta charset=\"UTF-8\">\n");
-	fprintf(fp, "<title>Stamp notes: %s</title>\n", category);
-	fprintf(fp, "<style>td{font-family: monospace; white-space: pre;}</style>\n");
-	fprintf(fp, "</head>\n<body>\n");
-	fprintf(fp, "<h1>Notes from Stamp, %s</h1>\n", category);
-	fprintf(fp, "<table>\n");
+	return NULL;
+}
 
-	for (int i = 0; i <= lines; i++) {
-		note = read_file_note(fpm);
 
-		if (!note.id)
-			continue;
+/* Length of the valid UTF-8 sequence at p, before end, or 0 when it
+ * isn't one: overlong, a surrogate, past U+10FFFF or cut short.
+ */
+static int utf8_length(const unsigned char *p, const unsigned char *end)
+{
+	unsigned char lo = 0x80, hi = 0xbf;
+	int len;
+
+	if (*p < 0x80)
+		return 1;
+	else if (*p >= 0xc2 && *p <= 0xdf)
+		len = 2;
+	else if (*p >= 0xe0 && *p <= 0xef) {
+		len = 3;
+		if (*p == 0xe0)
+			lo = 0xa0;
+		else if (*p == 0xed)
+			hi = 0x9f;
+	} else if (*p >= 0xf0 && *p <= 0xf4) {
+		len = 4;
+		if (*p == 0xf0)
+			lo = 0x90;
+		else if (*p == 0xf4)
+			hi = 0x8f;
+	} else
+		return 0;
 
-		fprintf(fp, "<tr><td>%d</td><td>%s</td><td>%s</td></tr>\n", note.id, note.date, note.message);
-		FREENOTE(note);
-	}
+	if (end - p < len || p[1] < lo || p[1] > hi)
+		return 0;
 
-	fprintf(fp, "</table>\n</body>\n</html>\n");
-	fclose(fp);
-	fclose(fpm);
+	for (int i = 2; i < len; i++) {
+		if (p[i] < 0x80 || p[i] > 0xbf)
+			return 0;
+	}
 
-	return path;
+	return len;
 }
 
 
-/* Show latest n notes */
-static void show_latest(char *category, int n)
+/* Output len bytes of data escaped for format. Runs without special
+ * bytes are passed on as spans. JSON has to be UTF-8, bytes that
+ * aren't are replaced by U+FFFD.
+ */
+static void output_escaped(struct Output *out, const char *data, size_t len,
+	ExportFormat_t format)
 {
-	FILE *fp = NULL;
-	struct Note note;
-	int lines = 0;
-	int start;
-	int current = 0;
+	const char *p = data;
+	const char *run = data;
+	const char *end = data + len;
+	char buf[8];
 
-	fp = get_memo_file_ptr(category, "r", "");
+	while (p < end) {
+		while (end - p >= 8) {
+			uint64_t w;
 
-	lines = count_file_lines(fp);
+			memcpy(&w, p, sizeof(w));
+			if (needs_escape(w, format))
+				break;
+			p += 8;
+		}
 
-	if (lines == -1) {
-		fail("%s: counting lines failed\n", __func__);
-		return;
-	}
+		if (p == end)
+			break;
 
-	/* If n is bigger than the count of lines or smaller
-	 * than zero we will show all the lines.
-	 */
-	if (n > lines || n < 0)
-		start = -1;
-	else
-		start = lines - n;
+		if (format == EXPORT_JSON && (unsigned char)*p >= 0x80) {
+			int n = utf8_length((const unsigned char *)p,
+				(const unsigned char *)end);
 
-	for (int i = 0; i <= lines; i++) {
-		note = read_file_note(fp);
+			if (n > 0) {
+				p += n;
+				continue;
+			}
 
-		if (!note.id)
+			output_span(out, run, p - run);
+			output_str(out, "\\ufffd");
+			run = ++p;
 			continue;
+		}
 
-		if (current++ > start)
-			output_default(note);
+		const char *esc = escape_char((unsigned char)*p, format, buf);
+		if (esc) {
+			output_span(out, run, p - run);
+			output_bytes(out, esc, strlen(esc));
+			run = p + 1;
+		}
 
-		FREENOTE(note);
+		p++;
 	}
 
-	fclose(fp);
+	output_span(out, run, end - run);
 }
 
 
-/* Deletes all notes. Function actually
- * simply removes category file in .stamp directory
- * Returns 0 on success, -1 on failure.
+/* Get open FILE* for stamp file.
+ * Returns NULL of failure.
+ * Caller must close the file pointer after calling the function
+ * succesfully.
  */
-static int delete_all(char *category)
+static FILE *get_memo_file_ptr(char *category, char *mode, char *suffix)
 {
-	char *confirm = NULL;
-	int ask = 1;
-
-	confirm = get_memo_conf_value("STAMP_CONFIRM_DELETE");
-
-	if (confirm && strcmp(confirm, "no") == 0)
-		ask = 0;
-
+	FILE *fp = NULL;
+	PHASE_BEGIN(PHASE_OPEN);
 	char *path = get_memo_file_path(category);
 
 	if (path == NULL) {
-		fail("%s error getting stamp file path\n", __func__);
-		return -1;
+		fail("%s: error getting stamp path\n", __func__);
+		PHASE_END();
+		return NULL;
 	}
 
-	if (ask) {
-		printf("Really delete (y/N)? ");
-		char ch = getc(stdin);
-		if (ch == 'y' || ch == 'Y') {
-			if (remove(path) != 0) {
-				fail(
-					"%s error removing %s\n", __func__, 
-					path);
-			}
+	// append suffix to filename
+	if (strlen(suffix) > 0) {
+		char *path_suffix = (char*) malloc(sizeof(char) * (strlen(path) + strlen(suffix) + 1));
+		if (path_suffix == NULL) {
+			fail("%s: malloc failed\n", __func__);
+			free(path);
+			PHASE_END();
+			return NULL;
 		}
-	} else {
-		if (remove(path) != 0)
-			fail("%s error removing %s\n", __func__, path);
-	}
+
+		strcpy(path_suffix, path);
+		strcat(path_suffix, suffix);
+
+		fp = stamp_fopen(path_suffix, mode);
+		free(path_suffix);
+	} else
+		fp = stamp_fopen(path, mode);
+
+	if (fp == NULL)
+		fail("%s: error opening file: %s\n", __func__, strerror(errno));
 
 	free(path);
+	PHASE_END();
 
-	return 0;
+	return fp;
 }
 
 
-/* Delete a note by id.
- * This functions loops over all lines from original file,
- * adds them to a temporary file, except the line you want delete,
- * and moves the temporary file over the original file
+/* Function reads multiple lines from stdin until
+ * the end of transmission (^D).
  *
- * Returns 0 on success and -1 on failure.
+ * Each line is assumed to be the content part of the note.
+ *
+ * Notes are added to the stamp file. Returns -1 on failure, 0 on
+ * success.
  */
-static int delete_note(char *category, int id)
+static int add_notes_from_stdin(char *category)
 {
-	FILE *tmpfp = NULL;
-	FILE *fp = NULL;
-	char *memofile = NULL;
-	char *tmpfile = NULL;
+	/* First get the whole buffer from stdin. Then parse the buffer;
+	 * each note is separated by a new line character in the
+	 * buffer. Call add_note for each line.
+	 */
 
-	tmpfp = get_memo_file_ptr(category, "w", ".tmp");
-	if (tmpfp == NULL)
+	int length = 128;
+	char *buffer = NULL;
+	int count = 0;
+	char ch;
+	char *line = NULL;
+
+	if ((buffer = (char*)malloc(sizeof(char) * length)) == NULL) {
+		fail("%s: malloc failed\n", __func__);
 		return -1;
+	}
 
-	fp = get_memo_file_ptr(category, "r", "");
+	ch = getc(stdin);
+
+	while (ch != EOF) {
+		if (count == length) {
+			length += 128;
+			if ((buffer = realloc(buffer, length)) == NULL) {
+				fail("%s realloc failed\n", __func__);
+				return -1;
+			}
+		}
+
+		buffer[count] = ch;
+		count++;
+		ch = getc(stdin);
+	}
+
+	buffer[count] = '\0';
+	buffer = realloc(buffer, count + 1);
+	STAT_ADD(bytes_read, count);
+
+	/* --skip-duplicates checks lines against the category and each
+	 * other, those added are found in buffer
+	 */
+	struct DedupTable table;
+	struct NoteReader reader;
+	struct NoteView note;
+	int skipped = 0;
+	int got = 0;
+
+	memset(&table, 0, sizeof(table));
+	table.fd = -1;
+
+	if (skip_duplicates && note_reader_open(&reader, category) == 0) {
+		table.fd = reader.fd;
+
+		while ((got = read_file_note(&reader, &note)) > 0) {
+			if (note.message != NULL && dedup_insert(&table,
+			    dedup_hash(note.message, note.length, note.date),
+			    note_offset(&reader, &note)) == -1) {
+				got = -1;
+				break;
+			}
+		}
+	}
+
+	if (got == -1) {
+		if (table.fd != -1)
+			note_reader_close(&reader);
+		dedup_free(&table);
+		free(buffer);
+		return -1;
+	}
+
+	if (skip_duplicates) {
+		time_t t = time(NULL);
+		char today[DATE_LEN + 1];
+
+		strftime(today, sizeof(today), "%Y-%m-%d", localtime(&t));
+		table.memory = buffer;
+		table.memory_date = parse_date(today, DATE_LEN);
+	}
+
+	line = strtok(buffer, "\n");
+
+	while (line != NULL) {
+		if (skip_duplicates) {
+			size_t len = strlen(line);
+			uint64_t hash = dedup_hash(line, len, table.memory_date);
+			int id;
+			int found = dedup_find(&table, hash, line, len,
+				table.memory_date, &id);
+
+			if (found == 1) {
+				skipped++;
+				line = strtok(NULL, "\n");
+				continue;
+			}
+
+			if (found == -1 || dedup_insert(&table, hash,
+			    DEDUP_MEMORY | (uint64_t)(line - buffer)) == -1)
+				break;
+		}
+
+		add_note(category, line, NULL);
+		line = strtok(NULL, "\n");
+	}
+
+	if (skipped > 0)
+		printf("skipped %d duplicate notes\n", skipped);
+
+	if (table.fd != -1)
+		note_reader_close(&reader);
+	dedup_free(&table);
+	free(buffer);
+
+	return 0;
+}
+
+
+/* Bulk import notes in format from stdin into category, with their
+ * dates and optionally their ids:
+ *
+ *   csv    [id,]date,message with RFC 4180 quoting, as exported by -e
+ *   tsv    [id<tab>]date<tab>message, like the category file itself
+ *   jsonl  an object with "id", "date" and "message" (or "content") a line
+ *
+ * CSV and TSV records all have the fields of the header, or of the
+ * first record without one, see import_layout. An empty date means
+ * today, notes without an id are numbered on from
+ * the previous one. Parsing and validating runs on worker threads while
+ * the category is copied to its tmp file with the notes added, which
+ * replaces the category only when all of them were fine.
+ *
+ * Returns the number of notes imported or -1 on failure.
+ */
+static int import_notes(char *category, ImportFormat_t format)
+{
+	struct Import imp;
+	struct NoteReader reader;
+	struct NoteView note;
+	struct TagIndex tags;
+	pthread_t threads[IMPORT_MAX_THREADS];
+	int started = 0;
+	int imported = 0;
+	int retval = 0;
+	int last = 0;
+	off_t offset = 0;
+	time_t t = time(NULL);
+	int existed;
+	int lock;
+
+	memset(&imp, 0, sizeof(imp));
+	imp.format = format;
+	strftime(imp.today, sizeof(imp.today), "%Y-%m-%d", localtime(&t));
+	imp.line = 1;
+	imp.size = IMPORT_CHUNK;
+
+	if ((imp.buffer = (char *)malloc(imp.size)) == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	char *memofile = get_memo_file_path(category);
+	char *tmpfile = get_temp_memo_path(category);
+
+	/* held until the tmp file replaces the category, like add_note */
+	existed = memofile && file_exists(memofile);
+	if (memofile == NULL || tmpfile == NULL ||
+	    (lock = category_lock(category, 1)) == -1) {
+		free(imp.buffer);
+		free(memofile);
+		free(tmpfile);
+		return -1;
+	}
+
+	FILE *tmpfp = get_memo_file_ptr(category, "w", ".tmp");
+
+	if (tmpfp == NULL) {
+		fail("%s: failed to open stamp tmp path\n", __func__);
+		close(lock);
+		free(imp.buffer);
+		free(memofile);
+		free(tmpfile);
+		return -1;
+	}
+
+	int keep_tags = index_exists(category, TAG_SUFFIX);
+	memset(&tags, 0, sizeof(tags));
+
+	TRACE_BEGIN("import_notes");
+
+	/* the notes already there go first */
+	if (note_reader_open(&reader, category) == -1)
+		retval = -1;
+	else {
+		while (read_file_note(&reader, &note) > 0) {
+			if (keep_tags && tag_index_add(&tags, note.id, offset,
+			    note.message, note.length) == -1)
+				keep_tags = 0;
+			offset += note.line_length + 1;
+			last = note.id;
+
+			if (fwrite(note.line, 1, note.line_length, tmpfp) != note.line_length ||
+			    fputc('\n', tmpfp) == EOF) {
+				fail("%s: failed writing tmpfile: %s (%d)\n",
+					__func__, strerror(errno), errno);
+				retval = -1;
+				break;
+			}
+
+			STAT_ADD(bytes_written, note.line_length + 1);
+		}
+
+		note_reader_close(&reader);
+	}
+
+	pthread_mutex_init(&imp.lock, NULL);
+	pthread_cond_init(&imp.cond, NULL);
+
+	int nthreads = import_threads();
+
+	for (int i = 0; i < nthreads && retval == 0; i++) {
+		if (pthread_create(&threads[i], NULL, import_worker, &imp) != 0)
+			break;
+		started++;
+	}
+
+	if (retval == 0 && started == 0) {
+		fail("%s: could not start worker threads\n", __func__);
+		retval = -1;
+	}
+
+	while (retval == 0) {
+		struct ImportChunk *chunk;
+
+		/* keep twice as many chunks as workers in flight */
+		while (!imp.eof && imp.queued < 2 * started &&
+		       (chunk = import_read(&imp)) != NULL) {
+			pthread_mutex_lock(&imp.lock);
+			if (imp.tail)
+				imp.tail->next = chunk;
+			else
+				imp.head = chunk;
+			imp.tail = chunk;
+			imp.queued++;
+			pthread_cond_broadcast(&imp.cond);
+			pthread_mutex_unlock(&imp.lock);
+		}
+
+		if (imp.eof == -1) {
+			retval = -1;
+			break;
+		}
+
+		pthread_mutex_lock(&imp.lock);
+		if ((chunk = imp.head) == NULL) {
+			pthread_mutex_unlock(&imp.lock);
+			break;
+		}
+
+		while (chunk->parsed != 2)
+			pthread_cond_wait(&imp.cond, &imp.lock);
+
+		if ((imp.head = chunk->next) == NULL)
+			imp.tail = NULL;
+		imp.queued--;
+		pthread_mutex_unlock(&imp.lock);
+
+		const char *p = chunk->notes;
+
+		for (int i = 0; i < chunk->count && retval == 0; i++) {
+			const char *end = memchr(p, '\n', chunk->notes + chunk->notes_length - p);
+			int id = chunk->ids[i] ? chunk->ids[i] : last + 1;
+
+			if (id <= last) {
+				fail("note id %d is not above %d\n", id, last);
+				retval = -1;
+				break;
+			}
+
+			int written = fprintf(tmpfp, "%d\t", id);
+
+			if (written < 0 || fwrite(p, 1, end - p + 1, tmpfp) != (size_t)(end - p + 1)) {
+				fail("%s: failed writing tmpfile: %s (%d)\n",
+					__func__, strerror(errno), errno);
+				retval = -1;
+				break;
+			}
+
+			written += end - p + 1;
+			STAT_ADD(bytes_written, written);
+
+			if (keep_tags && tag_index_add(&tags, id, offset,
+			    p + DATE_LEN + 1, end - p - DATE_LEN - 1) == -1)
+				keep_tags = 0;
+			offset += written;
+			last = id;
+			imported++;
+			p = end + 1;
+		}
+
+		if (chunk->error) {
+			fail("line %ld: %s\n", chunk->error, chunk->reason);
+			retval = -1;
+		}
+
+		import_chunk_free(chunk);
+	}
+
+	/* on failure the workers stop at the chunk they're parsing */
+	pthread_mutex_lock(&imp.lock);
+	imp.done = 1;
+	pthread_cond_broadcast(&imp.cond);
+	pthread_mutex_unlock(&imp.lock);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	while (imp.head) {
+		struct ImportChunk *next = imp.head->next;
+
+		import_chunk_free(imp.head);
+		imp.head = next;
+	}
+
+	pthread_mutex_destroy(&imp.lock);
+	pthread_cond_destroy(&imp.cond);
+	free(imp.buffer);
+	TRACE_END();
+
+	if (fclose(tmpfp) != 0)
+		retval = -1;
+
+	if (retval == 0 && imported > 0) {
+		if ((retval = stamp_rename(tmpfile, memofile)) == 0) {
+			watermark_invalidate(category);
+			sa_invalidate(category);
+			tag_index_replace(category, memofile, &tags, keep_tags);
+		} else
+			fail("could not rename %s to %s\n", tmpfile, memofile);
+	}
+
+	if (retval != 0 || imported == 0) {
+		remove(tmpfile);
+
+		/* the lock created it */
+		if (!existed)
+			remove(memofile);
+	}
+
+	close(lock);
+
+	if (retval == 0)
+		printf("imported %d notes into %s\n", imported, category);
+	else
+		fail("nothing imported into %s\n", category);
+
+	tag_index_free(&tags);
+	free(memofile);
+	free(tmpfile);
+
+	return retval == 0 ? imported : -1;
+}
+
+
+/* Read stdin until it holds at least IMPORT_CHUNK bytes and cut off its
+ * whole records, which end at a newline; in CSV only outside quotes.
+ * What's left is kept for the next chunk, a record longer than the
+ * buffer makes it grow.
+ *
+ * Returns NULL at the end of the input, or with imp->eof set to -1 on
+ * failure.
+ */
+static struct ImportChunk *import_read(struct Import *imp)
+{
+	for (;;) {
+		while (!imp->eof && imp->length < imp->size) {
+			ssize_t n = read(STDIN_FILENO, imp->buffer + imp->length,
+				imp->size - imp->length);
+
+			if (n == -1 && errno == EINTR)
+				continue;
+
+			if (n == -1) {
+				fail("%s: error reading stdin: %s\n", __func__,
+					strerror(errno));
+				imp->eof = -1;
+				return NULL;
+			}
+
+			if (n == 0)
+				imp->eof = 1;
+
+			imp->length += n;
+			STAT_ADD(bytes_read, n);
+		}
+
+		if (imp->format == IMPORT_CSV) {
+			for (size_t i = imp->scanned; i < imp->length; i++) {
+				if (imp->buffer[i] == '"')
+					imp->quoted = !imp->quoted;
+				else if (imp->buffer[i] == '\n') {
+					imp->scanned_lines++;
+					if (!imp->quoted) {
+						imp->cut = i + 1;
+						imp->cut_lines = imp->scanned_lines;
+					}
+				}
+			}
+		} else {
+			const char *p = imp->buffer + imp->scanned;
+			const char *end = imp->buffer + imp->length;
+
+			while ((p = memchr(p, '\n', end - p)) != NULL) {
+				imp->cut = ++p - imp->buffer;
+				imp->cut_lines = ++imp->scanned_lines;
+			}
+		}
+
+		imp->scanned = imp->length;
+
+		/* at the end, a last record without a newline is whole too */
+		if (imp->eof && imp->cut < imp->length) {
+			imp->cut = imp->length;
+			imp->cut_lines = imp->scanned_lines;
+		}
+
+		if (imp->cut > 0)
+			break;
+
+		if (imp->eof)
+			return NULL;
+
+		char *grown = (char *)realloc(imp->buffer, imp->size * 2);
+
+		if (grown == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			imp->eof = -1;
+			return NULL;
+		}
+
+		imp->buffer = grown;
+		imp->size *= 2;
+	}
+
+	struct ImportChunk *chunk = (struct ImportChunk *)calloc(1, sizeof(*chunk));
+	char *rest = (char *)malloc(imp->size);
+
+	if (chunk == NULL || rest == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		free(chunk);
+		free(rest);
+		imp->eof = -1;
+		return NULL;
+	}
+
+	/* the chunk takes the buffer, the rest moves to a new one */
+	chunk->data = imp->buffer;
+	chunk->length = imp->cut;
+	chunk->line = imp->line;
+	chunk->lines = imp->cut_lines;
+	chunk->first = imp->line == 1;
+
+	if (chunk->first && imp->format != IMPORT_JSONL &&
+	    import_layout(imp, chunk) == -1) {
+		free(chunk);
+		free(rest);
+		imp->eof = -1;
+		return NULL;
+	}
+
+	memcpy(rest, imp->buffer + imp->cut, imp->length - imp->cut);
+	imp->buffer = rest;
+	imp->length -= imp->cut;
+	imp->scanned -= imp->cut;
+	imp->scanned_lines -= imp->cut_lines;
+	imp->line += imp->cut_lines;
+	imp->cut = 0;
+	imp->cut_lines = 0;
+
+	return chunk;
+}
+
+
+/* Find the fields of the CSV or TSV records from the first chunk: a
+ * header, as written by -e, of id,date,message or date,message, which
+ * is skipped, or else the number of fields of the first record. Every
+ * record has to have those, so none is guessed at on its own.
+ *
+ * Returns 0 on success and -1 when neither tells.
+ */
+static int import_layout(struct Import *imp, struct ImportChunk *chunk)
+{
+	const char *p = chunk->data;
+	const char *end = p + chunk->length;
+	char sep = imp->format == IMPORT_CSV ? ',' : '\t';
+	char *field = (char *)malloc(chunk->length + 1);
+	const char *names[3] = { NULL, NULL, NULL };
+	int header = 1;
+	int fields = 0;
+	int last = 1;
+	long line = chunk->line;
+	long len;
+
+	if (field == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	/* blank lines before it don't count */
+	do {
+		const char *record = p;
+
+		fields = 0;
+		do {
+			if ((len = import_field(&p, end, sep, field, &last)) == -1)
+				break;
+
+			if (fields < 3) {
+				static const char *header_names[] = { "id", "date", "message" };
+				int match = 0;
+
+				for (int i = 0; i < 3; i++) {
+					if ((size_t)len == strlen(header_names[i]) &&
+					    strncmp(field, header_names[i], len) == 0) {
+						names[fields] = header_names[i];
+						match = 1;
+					}
+				}
+
+				header &= match;
+			}
+
+			fields++;
+		} while (!last);
+
+		if (len != -1 && fields == 1 && len == 0) {
+			for (const char *s = record; s < p; s++)
+				line += *s == '\n';
+			continue;
+		}
+
+		break;
+	} while (p < end);
+
+	free(field);
+
+	if (len == -1) {
+		fail("line %ld: unterminated quote\n", line);
+		return -1;
+	}
+
+	/* nothing but blank lines */
+	if (fields == 1 && len == 0)
+		return 0;
+
+	/* only the header of -e, or of it without ids */
+	if (header && fields == 3 && strcmp(names[0], "id") == 0 &&
+	    strcmp(names[1], "date") == 0 && strcmp(names[2], "message") == 0)
+		imp->columns = 3;
+	else if (header && fields == 2 && strcmp(names[0], "date") == 0 &&
+	    strcmp(names[1], "message") == 0)
+		imp->columns = 2;
+	else if (header) {
+		fail("line %ld: header must be id,date,message or date,message\n",
+			line);
+		return -1;
+	} else if (fields == 2 || fields == 3) {
+		imp->columns = fields;
+		return 0;
+	} else {
+		fail("line %ld: expected a header or [id,]date,message\n", line);
+		return -1;
+	}
+
+	chunk->skip = p - chunk->data;
+
+	return 0;
+}
+
+
+static void *import_worker(void *arg)
+{
+	struct Import *imp = (struct Import *)arg;
+	struct ImportChunk *chunk;
+
+	pthread_mutex_lock(&imp->lock);
+
+	while (!imp->done) {
+		for (chunk = imp->head; chunk && chunk->parsed; chunk = chunk->next)
+			;
+
+		if (chunk == NULL) {
+			pthread_cond_wait(&imp->cond, &imp->lock);
+			continue;
+		}
+
+		chunk->parsed = 1;
+		pthread_mutex_unlock(&imp->lock);
+
+		import_parse(imp, chunk);
+
+		pthread_mutex_lock(&imp->lock);
+		chunk->parsed = 2;
+		pthread_cond_broadcast(&imp->cond);
+	}
+
+	pthread_mutex_unlock(&imp->lock);
+
+	return NULL;
+}
+
+
+/* Parse the records of chunk into its notes. Each note takes at most
+ * its record and a date, so notes are allocated once.
+ */
+static void import_parse(struct Import *imp, struct ImportChunk *chunk)
+{
+	const char *p = chunk->data + chunk->skip;
+	const char *end = chunk->data + chunk->length;
+
+	chunk->notes = (char *)malloc(chunk->length +
+		(chunk->lines + 1) * (DATE_LEN + 2));
+	chunk->ids = (int *)malloc((chunk->lines + 1) * sizeof(int));
+
+	if (chunk->notes == NULL || chunk->ids == NULL) {
+		chunk->error = chunk->line;
+		chunk->reason = "out of memory";
+		return;
+	}
+
+	while (p && p < end) {
+		const char *record = p;
+
+		if (imp->format == IMPORT_JSONL)
+			p = import_json(imp, chunk, p, end);
+		else
+			p = import_csv(imp, chunk, p, end,
+				imp->format == IMPORT_CSV ? ',' : '\t');
+
+		if (p == NULL) {
+			chunk->error = chunk->line;
+			for (const char *s = chunk->data; s < record; s++)
+				chunk->error += *s == '\n';
+		}
+	}
+}
+
+
+/* Parse the CSV or TSV field at *p into out, quotes are only special in
+ * CSV and newlines in quotes are dropped. *p is left past the separator
+ * or newline that ended the field.
+ *
+ * Returns the length of the field, with *last set when it ended the
+ * record, or -1 when a quote isn't closed.
+ */
+static long import_field(const char **p, const char *end, char sep, char *out,
+	int *last)
+{
+	const char *s = *p;
+	long len = 0;
+	int quoted = 0;
+
+	*last = 1;
+
+	while (s < end) {
+		char c = *s++;
+
+		if (quoted) {
+			if (c == '"' && s < end && *s == '"')
+				out[len++] = *s++;
+			else if (c == '"')
+				quoted = 0;
+			else if (c != '\n' && c != '\r')
+				out[len++] = c;
+			continue;
+		}
+
+		if (c == sep) {
+			*last = 0;
+			break;
+		}
+
+		if (c == '\n')
+			break;
+
+		if (c == '"' && sep == ',')
+			quoted = 1;
+		else if (c != '\r' || (s < end && *s != '\n'))
+			out[len++] = c;
+	}
+
+	*p = s;
+
+	return quoted ? -1 : len;
+}
+
+
+/* Parse the [id,]date,message record at p into a note of chunk, with
+ * the fields import_layout found. Blank records and those with an empty
+ * message are skipped.
+ *
+ * Returns the start of the next record or NULL on a bad record.
+ */
+static const char *import_csv(struct Import *imp, struct ImportChunk *chunk,
+	const char *p, const char *end, char sep)
+{
+	char *note = chunk->notes + chunk->notes_length;
+	char *out = note + DATE_LEN + 1;
+	const char *date = imp->today;
+	const char *fields = imp->columns == 3 ?
+		"expected 3 fields: id, date and message" :
+		"expected 2 fields: date and message";
+	char field[DATE_LEN];
+	int last;
+	int id = 0;
+	long len = import_field(&p, end, sep, out, &last);
+
+	if (len == -1) {
+		chunk->reason = "unterminated quote";
+		return NULL;
+	}
+
+	if (last && len == 0)
+		return p;
+
+	/* an id, maybe empty */
+	if (imp->columns == 3) {
+		for (long i = 0; i < len && id != -1; i++)
+			id = out[i] >= '0' && out[i] <= '9' && i < 9 ?
+				id * 10 + (out[i] - '0') : -1;
+
+		if (id == -1 || (id == 0 && len > 0)) {
+			chunk->reason = "invalid id";
+			return NULL;
+		}
+
+		if (last) {
+			chunk->reason = fields;
+			return NULL;
+		}
+
+		len = import_field(&p, end, sep, out, &last);
+
+		if (len == -1) {
+			chunk->reason = "unterminated quote";
+			return NULL;
+		}
+	}
+
+	if (last) {
+		chunk->reason = fields;
+		return NULL;
+	}
+
+	if (len > 0 && is_valid_date(out, len) == -1) {
+		chunk->reason = "invalid date";
+		return NULL;
+	}
+
+	if (len > 0) {
+		memcpy(field, out, DATE_LEN);
+		date = field;
+	}
+
+	len = import_field(&p, end, sep, out, &last);
+
+	if (len == -1) {
+		chunk->reason = "unterminated quote";
+		return NULL;
+	}
+
+	if (!last) {
+		chunk->reason = fields;
+		return NULL;
+	}
+
+	if (len > 0) {
+		memcpy(note, date, DATE_LEN);
+		note[DATE_LEN] = '\t';
+		out[len] = '\n';
+		chunk->notes_length += DATE_LEN + 2 + len;
+		chunk->ids[chunk->count++] = id;
+	}
+
+	return p;
+}
+
+
+/* Copy the JSON string at *p, just past its opening quote, to out with
+ * its escapes resolved and newlines dropped, like
+ * remove_content_newlines does. out may be NULL to skip the string.
+ *
+ * Returns the length of the string or -1 when it's malformed.
+ */
+static long import_json_string(const char **p, const char *end, char *out)
+{
+	const char *s = *p;
+	long len = 0;
+
+	while (s < end && *s != '"') {
+		unsigned long cp;
+
+		if ((unsigned char)*s < 0x20)
+			return -1;
+
+		if (*s != '\\') {
+			if (out)
+				out[len] = *s;
+			len++;
+			s++;
+			continue;
+		}
+
+		if (++s == end)
+			return -1;
+
+		switch (*s++) {
+		case '"':  cp = '"'; break;
+		case '\\': cp = '\\'; break;
+		case '/':  cp = '/'; break;
+		case 'b':  cp = '\b'; break;
+		case 'f':  cp = '\f'; break;
+		case 'n':  cp = '\n'; break;
+		case 'r':  cp = '\r'; break;
+		case 't':  cp = '\t'; break;
+		case 'u': {
+			char hex[5] = { 0 };
+			char *hex_end;
+
+			if (end - s < 4)
+				return -1;
+
+			memcpy(hex, s, 4);
+			cp = strtoul(hex, &hex_end, 16);
+			if (hex_end != hex + 4)
+				return -1;
+			s += 4;
+
+			/* a surrogate pair is one code point */
+			if (cp >= 0xd800 && cp <= 0xdbff && end - s >= 6 &&
+			    s[0] == '\\' && s[1] == 'u') {
+				unsigned long low;
+
+				memcpy(hex, s + 2, 4);
+				low = strtoul(hex, &hex_end, 16);
+				if (hex_end == hex + 4 && low >= 0xdc00 && low <= 0xdfff) {
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+					s += 6;
+				}
+			}
+
+			if (cp >= 0xd800 && cp <= 0xdfff)
+				cp = 0xfffd;
+			break;
+		}
+		default:
+			return -1;
+		}
+
+		if (cp == '\n' || cp == 0)
+			continue;
+
+		/* UTF-8 never takes more than the escape did */
+		char utf8[4];
+		int n;
+
+		if (cp < 0x80) {
+			utf8[0] = cp;
+			n = 1;
+		} else if (cp < 0x800) {
+			utf8[0] = 0xc0 | (cp >> 6);
+			utf8[1] = 0x80 | (cp & 0x3f);
+			n = 2;
+		} else if (cp < 0x10000) {
+			utf8[0] = 0xe0 | (cp >> 12);
+			utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+			utf8[2] = 0x80 | (cp & 0x3f);
+			n = 3;
+		} else {
+			utf8[0] = 0xf0 | (cp >> 18);
+			utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+			utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+			utf8[3] = 0x80 | (cp & 0x3f);
+			n = 4;
+		}
+
+		if (out)
+			memcpy(out + len, utf8, n);
+		len += n;
+	}
+
+	if (s == end)
+		return -1;
+
+	*p = s + 1;
+
+	return len;
+}
+
+
+static const char *import_json_space(const char *p, const char *end)
+{
+	while (p < end && isspace((unsigned char)*p))
+		p++;
+
+	return p;
+}
+
+
+/* Skip the JSON value at *p, objects and arrays included.
+ *
+ * Returns 0 on success and -1 when the value is malformed.
+ */
+static int import_json_skip(const char **p, const char *end)
+{
+	const char *s = *p;
+	int depth = 0;
+
+	do {
+		s = import_json_space(s, end);
+
+		if (s == end)
+			return -1;
+
+		if (*s == '"') {
+			s++;
+			if (import_json_string(&s, end, NULL) == -1)
+				return -1;
+		} else if (*s == '{' || *s == '[') {
+			depth++;
+			s++;
+		} else if (*s == '}' || *s == ']') {
+			if (depth-- == 0)
+				return -1;
+			s++;
+		} else if (*s == ',' || *s == ':') {
+			if (depth == 0)
+				return -1;
+			s++;
+		} else {
+			const char *start = s;
+
+			while (s < end && (isalnum((unsigned char)*s) ||
+			       *s == '-' || *s == '+' || *s == '.'))
+				s++;
+
+			if (s == start)
+				return -1;
+		}
+	} while (depth > 0);
+
+	*p = s;
+
+	return 0;
+}
+
+
+/* Parse the JSON object on the line at p into a note of chunk. Its
+ * "message" (or "content") is required, "id" and "date" may be missing
+ * or null and other members are ignored. Blank lines are skipped.
+ *
+ * Returns the start of the next line or NULL on a bad one.
+ */
+static const char *import_json(struct Import *imp, struct ImportChunk *chunk,
+	const char *p, const char *end)
+{
+	char *note = chunk->notes + chunk->notes_length;
+	char *out = note + DATE_LEN + 1;
+	const char *nl = memchr(p, '\n', end - p);
+	const char *date = imp->today;
+	char field[DATE_LEN];
+	long length = -1;
+	int id = 0;
+
+	end = nl ? nl : end;
+
+	p = import_json_space(p, end);
+	if (p == end)
+		return nl ? nl + 1 : end;
+
+	if (*p++ != '{') {
+		chunk->reason = "expected a JSON object";
+		return NULL;
+	}
+
+	p = import_json_space(p, end);
+	if (p < end && *p == '}')
+		p++;
+
+	while (p < end && p[-1] != '}') {
+		const char *key;
+		size_t key_length;
+
+		p = import_json_space(p, end);
+		if (p == end || *p != '"')
+			break;
+
+		key = ++p;
+		if (import_json_string(&p, end, NULL) == -1)
+			break;
+		key_length = p - key - 1;
+
+		p = import_json_space(p, end);
+		if (p == end || *p++ != ':')
+			break;
+		p = import_json_space(p, end);
+		if (p == end)
+			break;
+
+		if (key_length == 2 && strncmp(key, "id", 2) == 0 && *p != 'n') {
+			const char *digits = p;
+
+			while (p < end && *p >= '0' && *p <= '9' && p - digits < 10)
+				id = id * 10 + (*p++ - '0');
+
+			if (p == digits || p - digits > 9 || id == 0 ||
+			    (p < end && *p >= '0' && *p <= '9')) {
+				chunk->reason = "invalid id";
+				return NULL;
+			}
+		} else if (key_length == 4 && strncmp(key, "date", 4) == 0 && *p == '"') {
+			const char *value = ++p;
+
+			if (import_json_string(&p, end, NULL) == -1)
+				break;
+
+			if (p - value - 1 > 0) {
+				if (is_valid_date(value, p - value - 1) == -1) {
+					chunk->reason = "invalid date";
+					return NULL;
+				}
+
+				memcpy(field, value, DATE_LEN);
+				date = field;
+			}
+		} else if (((key_length == 7 && strncmp(key, "message", 7) == 0) ||
+			    (key_length == 7 && strncmp(key, "content", 7) == 0)) &&
+			   *p == '"') {
+			p++;
+			if ((length = import_json_string(&p, end, out)) == -1)
+				break;
+		} else if (import_json_skip(&p, end) == -1)
+			break;
+
+		p = import_json_space(p, end);
+		if (p == end || (*p != ',' && *p != '}'))
+			break;
+		p++;
+	}
+
+	if (p[-1] != '}') {
+		chunk->reason = "malformed JSON object";
+		return NULL;
+	}
+
+	p = import_json_space(p, end);
+
+	if (p != end) {
+		chunk->reason = "expected one JSON object a line";
+		return NULL;
+	}
+
+	if (length == -1) {
+		chunk->reason = "no message";
+		return NULL;
+	}
+
+	if (length > 0) {
+		memcpy(note, date, DATE_LEN);
+		note[DATE_LEN] = '\t';
+		out[length] = '\n';
+		chunk->notes_length += DATE_LEN + 2 + length;
+		chunk->ids[chunk->count++] = id;
+	}
+
+	return nl ? nl + 1 : end;
+}
+
+
+static void import_chunk_free(struct ImportChunk *chunk)
+{
+	free(chunk->data);
+	free(chunk->notes);
+	free(chunk->ids);
+	free(chunk);
+}
+
+
+static int import_threads()
+{
+	long cpus = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > IMPORT_MAX_THREADS)
+		cpus = IMPORT_MAX_THREADS;
+
+	return (int)cpus;
+}
+
+
+/* Reads a line from source pointed by FILE*.
+ *
+ * This function is used to read .stamp as well as ~/.stamprc
+ * files line by line.
+ *
+ * Return NULL on failure.
+ * Caller is responsible for freeing the return value
+ */
+static char *read_file_line(FILE *fp)
+{
+	if (!fp)
+		return NULL;
+
+	char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+
+	if ((read = getline(&line, &len, fp)) == -1) {
+		return NULL;
+	}
+
+	STAT_ADD(bytes_read, read);
+
+	/* strip trailing whitespace */
+	char *retval = strtok(line, "\n");
+
+	return retval;
+}
+
+/* Convert a civil date to the number of days since 1970-01-01 and
+ * back. See http://howardhinnant.github.io/date_algorithms.html
+ */
+static int days_from_civil(int y, int m, int d)
+{
+	y -= m <= 2;
+
+	int era = (y >= 0 ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+
+static void civil_from_days(int days, int *y, int *m, int *d)
+{
+	days += 719468;
+
+	int era = (days >= 0 ? days : days - 146096) / 146097;
+	int doe = days - era * 146097;
+	int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int mp = (5 * doy + 2) / 153;
+
+	*d = doy - (153 * mp + 2) / 5 + 1;
+	*m = mp + (mp < 10 ? 3 : -9);
+	*y = yoe + era * 400 + (*m <= 2);
+}
+
+
+/* Parse the yyyy-MM-dd date of len bytes at str into a day number.
+ * Only the shape is checked, see is_valid_date_format for calendar
+ * validation.
+ *
+ * Returns NOTE_NO_DATE when str is not a date.
+ */
+static int parse_date(const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)str;
+
+	/* a day past the end of its month isn't one of the next */
+	if (is_valid_date(str, len) == -1)
+		return NOTE_NO_DATE;
+
+	return days_from_civil((s[0] - '0') * 1000 + (s[1] - '0') * 100 +
+		(s[2] - '0') * 10 + (s[3] - '0'), (s[5] - '0') * 10 + (s[6] - '0'),
+		(s[8] - '0') * 10 + (s[9] - '0'));
+}
+
+
+/* Format day number as yyyy-MM-dd into buf, which must have room for
+ * DATE_LEN + 1 bytes. Returns the number of bytes written, without
+ * the terminating nul byte.
+ */
+static int format_date(int day, char *buf)
+{
+	int y, m, d;
+
+	if (day == NOTE_NO_DATE) {
+		buf[0] = '\0';
+		return 0;
+	}
+
+	civil_from_days(day, &y, &m, &d);
+
+	buf[0] = '0' + (y / 1000) % 10;
+	buf[1] = '0' + (y / 100) % 10;
+	buf[2] = '0' + (y / 10) % 10;
+	buf[3] = '0' + y % 10;
+	buf[4] = '-';
+	buf[5] = '0' + m / 10;
+	buf[6] = '0' + m % 10;
+	buf[7] = '-';
+	buf[8] = '0' + d / 10;
+	buf[9] = '0' + d % 10;
+	buf[10] = '\0';
+
+	return DATE_LEN;
+}
+
+
+/* The date of note as it's written in its line, len bytes of it, which
+ * needn't be a valid one. Output shows dates like this, so it shows
+ * what's in the category file.
+ */
+static const char *note_date_text(const struct NoteView *note, size_t *len)
+{
+	const char *end = note->line + note->line_length;
+	const char *p = memchr(note->line, '\t', note->line_length);
+	const char *tab;
+
+	if (p == NULL) {
+		*len = 0;
+		return end;
+	}
+
+	p++;
+	tab = memchr(p, '\t', end - p);
+	*len = (tab ? tab : end) - p;
+
+	return p;
+}
+
+
+/* Parse one note line of len bytes, without its newline, into note.
+ *
+ * Nothing is copied or modified: the message of note points into line.
+ * Parts missing from line are left zeroed, a malformed date is stored
+ * as NOTE_NO_DATE. Safe to call from any number of threads.
+ *
+ * Returns 0 on success and -1 when line does not start with an id.
+ */
+static int parse_note(const char *line, size_t len, struct NoteView *note)
+{
+	const char *p = line;
+	const char *end = line + len;
+	const char *tab;
+	int id = 0;
+
+	memset(note, 0, sizeof(*note));
+	note->date = NOTE_NO_DATE;
+	note->line = line;
+	note->line_length = len;
+
+	while (p < end && *p >= '0' && *p <= '9')
+		id = id * 10 + (*p++ - '0');
+
+	if (p == line || id == 0)
+		return -1;
+
+	note->id = id;
+
+	if (p == end || *p != '\t')
+		return 0;
+
+	p++;
+	tab = memchr(p, '\t', end - p);
+	note->date = parse_date(p, (tab ? tab : end) - p);
+
+	if (tab == NULL)
+		return 0;
+
+	note->message = tab + 1;
+	note->length = end - note->message;
+
+	return 0;
+}
+
+
+/* Open the file of category for reading notes.
+ * Returns 0 on success and -1 on failure.
+ */
+static int note_reader_open(struct NoteReader *reader, char *category)
+{
+	int retval;
+
+	PHASE_BEGIN(PHASE_OPEN);
+	char *path = get_memo_file_path(category);
+
+	if (path == NULL) {
+		fail("%s: error getting stamp path\n", __func__);
+		PHASE_END();
+		return -1;
+	}
+
+	retval = note_reader_open_path(reader, path);
+	free(path);
+	PHASE_END();
+
+	return retval;
+}
+
+
+/* Open the category file at path for reading notes. Unlike
+ * note_reader_open this doesn't look at the configuration, so it's
+ * safe to use from worker threads.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int note_reader_open_path(struct NoteReader *reader, const char *path)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->sink = stamp_dir ? NULL : &output;
+	reader->archive_fd = reader->category_fd = -1;
+	reader->fd = open(path, O_RDONLY);
+
+	if (reader->fd == -1) {
+		fail("%s: error opening file: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	STAT_ADD(files_opened, 1);
+
+	return 0;
+}
+
+
+static void note_reader_close(struct NoteReader *reader)
+{
+	if (reader->archive_fd != -1) {
+		close(reader->archive_fd);
+		close(reader->category_fd);
+	} else if (reader->fd != -1)
+		close(reader->fd);
+
+	free(reader->buffer);
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = reader->archive_fd = reader->category_fd = -1;
+}
+
+
+/* Start reading notes from the beginning of the file again */
+static int note_reader_rewind(struct NoteReader *reader)
+{
+	if (reader->archive_fd != -1) {
+		if (lseek(reader->category_fd, 0, SEEK_SET) == -1)
+			return -1;
+		reader->fd = reader->archive_fd;
+	}
+
+	if (lseek(reader->fd, 0, SEEK_SET) == -1)
+		return -1;
+
+	reader->offset = 0;
+	reader->length = 0;
+	reader->pos = 0;
+	reader->eof = 0;
+
+	return 0;
+}
+
+
+/* Move the unread tail of the buffer to its front and read more of the
+ * file behind it, growing the buffer when a single line doesn't fit.
+ * One byte is always kept spare to terminate a last line that has no
+ * newline.
+ *
+ * Returns 0 on success and -1 on read errors.
+ */
+static int note_reader_fill(struct NoteReader *reader)
+{
+	ssize_t got;
+
+	/* pending output may point into our buffer */
+	if (reader->sink)
+		output_flush(reader->sink);
+
+	if (reader->pos > 0) {
+		memmove(reader->buffer, reader->buffer + reader->pos,
+			reader->length - reader->pos);
+		reader->length -= reader->pos;
+		reader->offset += reader->pos;
+		reader->pos = 0;
+	}
+
+	if (reader->size == 0 || reader->length + 1 >= reader->size) {
+		size_t size = reader->size ? reader->size * 2 : READER_BUFFER_SIZE;
+		char *buffer = (char *)realloc(reader->buffer, size);
+
+		if (buffer == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			return -1;
+		}
+
+		reader->buffer = buffer;
+		reader->size = size;
+	}
+
+	do {
+		got = read(reader->fd, reader->buffer + reader->length,
+			reader->size - reader->length - 1);
+	} while (got == -1 && errno == EINTR);
+
+	if (got == -1) {
+		fail("%s: read failed: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	/* the archive ends where the category starts */
+	if (got == 0 && reader->fd == reader->archive_fd &&
+	    reader->fd != reader->category_fd) {
+		reader->fd = reader->category_fd;
+		return 0;
+	}
+
+	if (got == 0)
+		reader->eof = 1;
+
+	STAT_ADD(bytes_read, got);
+	reader->length += got;
+
+	return 0;
+}
+
+
+/* Read the next note from reader into note.
+ *
+ * The file is read in large blocks and note points straight into the
+ * reader's buffer, so it stays valid until the next call only. The
+ * newline ending each line is replaced by a nul byte in that buffer,
+ * which makes note->message usable as a C string as well.
+ *
+ * Returns 1 when a note was read, 0 at the end of the file, in which
+ * case note is zeroed, and -1 on read errors.
+ */
+static int read_file_note(struct NoteReader *reader, struct NoteView *note)
+{
+	int retval = 0;
+
+	memset(note, 0, sizeof(*note));
+
+	if (reader->fd == -1)
+		return 0;
+
+	TRACE_BEGIN("read_file_note");
+	PHASE_BEGIN(PHASE_PARSE);
+
+	for (;;) {
+		char *line = reader->buffer + reader->pos;
+		size_t avail = reader->length - reader->pos;
+		char *nl = avail ? memchr(line, '\n', avail) : NULL;
+
+		if (nl == NULL) {
+			if (!reader->eof) {
+				if (note_reader_fill(reader) == -1) {
+					retval = -1;
+					break;
+				}
+				continue;
+			}
+
+			/* last line without a trailing newline */
+			if (avail == 0)
+				break;
+
+			nl = line + avail;
+		}
+
+		size_t len = nl - line;
+		*nl = '\0';
+		reader->pos += len + (reader->pos + len < reader->length);
+
+		if (len == 0 || parse_note(line, len, note) == -1)
+			continue;
+
+		retval = 1;
+		break;
+	}
+
+	PHASE_END();
+	TRACE_END();
+
+	return retval;
+}
+
+
+/* Offset in the category file of the line of note, which must be the
+ * note last returned by read_file_note.
+ */
+static off_t note_offset(const struct NoteReader *reader,
+	const struct NoteView *note)
+{
+	return reader->offset + (note->line - reader->buffer);
+}
+
+
+/* Read the note whose line starts at offset of the category file fd
+ * into *buffer of *size bytes, growing it as needed. Indexes use this
+ * to fetch the notes they found without reading the whole file.
+ *
+ * Returns 1 when a note was read, 0 when the line isn't a note and -1
+ * on failure.
+ */
+static int note_pread(int fd, off_t offset, char **buffer, size_t *size,
+	struct NoteView *note)
+{
+	size_t length = 0;
+	char *nl = NULL;
+
+	while (nl == NULL) {
+		if (*size - length < 256) {
+			size_t grown_size = *size ? *size * 2 : 4096;
+			char *grown = (char *)realloc(*buffer, grown_size);
+
+			if (grown == NULL) {
+				fail("%s: realloc failed\n", __func__);
+				return -1;
+			}
+
+			*buffer = grown;
+			*size = grown_size;
+		}
+
+		ssize_t got = pread(fd, *buffer + length, *size - length - 1,
+			offset + length);
+
+		if (got == -1 && errno == EINTR)
+			continue;
+
+		if (got == -1) {
+			fail("%s: read failed: %s\n", __func__, strerror(errno));
+			return -1;
+		}
+
+		STAT_ADD(bytes_read, got);
+
+		if (got == 0)
+			nl = *buffer + length;
+		else
+			nl = memchr(*buffer + length, '\n', got);
+
+		length += got;
+	}
+
+	*nl = '\0';
+
+	return parse_note(*buffer, nl - *buffer, note) == 0;
+}
+
+
+/* Copy note and its message into arena, so it outlives the reader's
+ * buffer. Returns NULL on failure.
+ */
+static struct NoteView *note_view_copy(struct Arena *arena,
+	const struct NoteView *note)
+{
+	struct NoteView *copy = (struct NoteView *)arena_alloc(arena, sizeof(*copy));
+
+	if (copy == NULL)
+		return NULL;
+
+	*copy = *note;
+	copy->line = arena_strndup(arena, note->line, note->line_length);
+	if (copy->line == NULL)
+		return NULL;
+
+	if (note->message)
+		copy->message = copy->line + (note->message - note->line);
+
+	return copy;
+}
+
+/* Simply read all the lines from the .stamp file
+ * and return the id of the last line plus one.
+ * If the file is missing or is empty, return 1
+ * On error, returns -1
+ */
+static int get_next_id(char *category)
+{
+	int id = 0;
+	struct NoteReader reader;
+	struct NoteView note;
+	struct stat st;
+	char *path = get_memo_file_path(category);
+
+	if (path == NULL)
+		return -1;
+
+	/* a category gets its file with its first note */
+	if (stamp_stat(path, &st) == -1) {
+		free(path);
+		return errno == ENOENT ? 1 : -1;
+	}
+
+	free(path);
+
+	if (note_reader_open(&reader, category) == -1)
+		return -1;
+
+	/* the last note read holds the highest id */
+	while (read_file_note(&reader, &note) > 0)
+		id = note.id;
+
+	note_reader_close(&reader);
+
+	return id + 1;
+}
+
+
+/* Take an exclusive lock on the category file, creating it when it's
+ * missing and create is set, so appends and rewrites of the category
+ * can't interleave, be it from other processes or other handles of
+ * libstamp. Rewrites hold it until their tmp file is renamed over the
+ * category; when the file was replaced while waiting for the lock, the
+ * new one is locked instead.
+ *
+ * Returns the descriptor holding the lock, to be closed to release
+ * it, or -1 on failure.
+ */
+static int category_lock(char *category, int create)
+{
+	struct stat locked, current;
+	char *path = get_memo_file_path(category);
+	int flags = O_WRONLY | O_APPEND | (create ? O_CREAT : 0);
+	int fd = -1;
+
+	if (path == NULL)
+		return -1;
+
+	for (;;) {
+		if ((fd = open(path, flags, 0666)) == -1)
+			break;
+
+		STAT_ADD(files_opened, 1);
+
+		if (flock(fd, LOCK_EX) == -1 || fstat(fd, &locked) == -1) {
+			close(fd);
+			fd = -1;
+			break;
+		}
+
+		if (stamp_stat(path, &current) == 0 &&
+		    current.st_ino == locked.st_ino && current.st_dev == locked.st_dev)
+			break;
+
+		close(fd);
+	}
+
+	if (fd == -1)
+		fail("%s: error locking %s: %s\n", __func__, path, strerror(errno));
+
+	free(path);
+
+	return fd;
+}
+
+/* Show all notes.
+ *
+ * Returns the number of notes. Returns -1 on failure
+ */
+static int show_notes(char *category)
+{
+	int count = 0;
+	struct NoteReader reader;
+	struct NoteView note;
+
+	if (note_reader_open_archived(&reader, category) == -1)
+		return -1;
+
+	/* skip to the page straight away, unless it's sorted first */
+	if (page.offset > 0 && !sorter.active)
+		page.seen = count = checkpoint_seek(&reader, category, page.offset);
+
+	while (!output_broken(&output) && read_file_note(&reader, &note) > 0) {
+		output_default(&note);
+		count++;
+	}
+
+	output_flush(&output);
+	note_reader_close(&reader);
+
+	/* Empty note file */
+	if (count == 0)
+		return -1;
+
+	return count;
+}
+
+static void output_without_date(const struct NoteView *note)
+{
+	PHASE_BEGIN(PHASE_OUTPUT);
+	output_char(&output, '\t');
+	output_int(&output, note->id);
+	output_char(&output, '\t');
+	output_span(&output, note->message, note->length);
+	output_char(&output, '\n');
+	PHASE_END();
+}
+
+
+/* Check if note belongs under td, notes without a valid date go by
+ * their date as written.
+ */
+static int tree_date_is(const struct TreeDate *td, const struct NoteView *note)
+{
+	size_t a, b;
+	const char *x, *y;
+
+	if (td->date != note->date)
+		return 0;
+
+	if (note->date != NOTE_NO_DATE)
+		return 1;
+
+	x = note_date_text(td->head->note, &a);
+	y = note_date_text(note, &b);
+
+	return a == b && memcmp(x, y, a) == 0;
+}
+
+
+/* Function displays notes ordered by date.
+ *
+ * For example:
+ *
+ *   2014-11-01
+ *         1   Do dishes
+ *         2   Pay rent
+ *   2014-11-02
+ *         3   Go shopping
+ *
+ * Dates are listed in order of first appearance. The notes are read
+ * once and grouped per date in an arena.
+ *
+ * Returns the count of the notes. On failure returns -1.
+ */
+static int show_notes_tree(char *category)
+{
+	int count = 0;
+	int ndates = 0;
+	int last = -1;
+	struct TreeDate *dates = NULL;
+	struct NoteReader reader;
+	struct Arena arena = { NULL };
+	struct NoteView note;
+
+	if (note_reader_open_archived(&reader, category) == -1)
+		return -1;
+
+	if (page.offset > 0)
+		page.seen = checkpoint_seek(&reader, category, page.offset);
+
+	while (!output.done && read_file_note(&reader, &note) > 0) {
+		struct TreeNote *tn = NULL;
+		int index = -1;
+
+		if (!page_take())
+			continue;
+
+		/* notes of one date usually follow each other, so
+		 * check the last date used first
+		 */
+		if (last != -1 && tree_date_is(&dates[last], &note))
+			index = last;
+
+		for (int i = 0; index == -1 && i < ndates; i++) {
+			if (tree_date_is(&dates[i], &note))
+				index = i;
+		}
+
+		if (index == -1) {
+			if ((ndates & (ndates - 1)) == 0) {
+				int size = ndates ? ndates * 2 : 16;
+				struct TreeDate *grown = (struct TreeDate *)realloc(dates,
+					size * sizeof(struct TreeDate));
+
+				if (grown == NULL) {
+					fail("%s: realloc failed\n", __func__);
+					count = -1;
+					break;
+				}
+
+				dates = grown;
+			}
+
+			index = ndates++;
+			dates[index].date = note.date;
+			dates[index].head = NULL;
+			dates[index].tail = NULL;
+		}
+
+		tn = (struct TreeNote *)arena_alloc(&arena, sizeof(*tn));
+		if (tn == NULL || (tn->note = note_view_copy(&arena, &note)) == NULL) {
+			count = -1;
+			break;
+		}
+
+		tn->next = NULL;
+		if (dates[index].tail)
+			dates[index].tail->next = tn;
+		else
+			dates[index].head = tn;
+		dates[index].tail = tn;
+
+		last = index;
+		count++;
+	}
+
+	note_reader_close(&reader);
+
+	/* the page is complete, now it's output */
+	output.done = 0;
+
+	for (int i = 0; count > 0 && i < ndates && !output_broken(&output); i++) {
+		output_date(&output, dates[i].head->note);
+		output_char(&output, '\n');
+
+		for (struct TreeNote *tn = dates[i].head; tn; tn = tn->next)
+			output_without_date(tn->note);
+	}
+
+	/* the notes are output straight from the arena */
+	output_flush(&output);
+	arena_free(&arena);
+	free(dates);
+
+	/* Ignore empty note file */
+	if (count == 0)
+		return -1;
+
+	return count;
+}
+
+/* Whether the next note output falls in the page of --offset and
+ * --limit. Output is marked done after the last one, which stops the
+ * scan loops like a reader that went away does.
+ */
+static int page_take(void)
+{
+	if (page.seen++ < page.offset)
+		return 0;
+
+	if (page.limit >= 0 && ++page.shown >= page.limit)
+		output.done = 1;
+
+	return page.limit != 0;
+}
+
+
+/* Load the checkpoints of category: the offset of every
+ * CHECKPOINT_INTERVAL-th note. They remain valid while notes are only
+ * appended; then they are extended from where they left off, otherwise
+ * rebuilt. reader is used for that and left anywhere.
+ *
+ * Returns 0 on success and -1 on failure, ck is filled in either way.
+ */
+static int checkpoint_load(struct NoteReader *reader, char *category,
+	struct Checkpoints *ck)
+{
+	struct CheckpointHeader *h = &ck->header;
+	struct NoteView note;
+	struct stat st;
+	char *index = index_path(category, CHECKPOINT_SUFFIX);
+	FILE *fp;
+	int retval = 0;
+
+	memset(ck, 0, sizeof(*ck));
+
+	if (index == NULL || fstat(reader->fd, &st) == -1) {
+		free(index);
+		return -1;
+	}
+
+	if ((fp = stamp_fopen(index, "r")) != NULL) {
+		if (fread(h, sizeof(*h), 1, fp) == 1 &&
+		    memcmp(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic)) == 0 &&
+		    h->ino == (uint64_t)st.st_ino && h->size <= (uint64_t)st.st_size &&
+		    h->interval == CHECKPOINT_INTERVAL &&
+		    (ck->offsets = (uint64_t *)malloc((h->count + 1) *
+		    sizeof(uint64_t))) != NULL &&
+		    fread(ck->offsets, sizeof(uint64_t), h->count, fp) == h->count)
+			ck->size = h->count + 1;
+		else {
+			free(ck->offsets);
+			ck->offsets = NULL;
+		}
+
+		fclose(fp);
+	}
+
+	if (ck->offsets == NULL) {
+		memset(h, 0, sizeof(*h));
+		memcpy(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic));
+		h->ino = st.st_ino;
+		h->interval = CHECKPOINT_INTERVAL;
+	}
+
+	if (h->size == (uint64_t)st.st_size) {
+		free(index);
+		return 0;
+	}
+
+	/* read what was added since */
+	if (lseek(reader->fd, h->size, SEEK_SET) == -1) {
+		free(index);
+		return -1;
+	}
+
+	reader->offset = h->size;
+	reader->length = reader->pos = 0;
+	reader->eof = 0;
+
+	TRACE_BEGIN("checkpoint_load");
+	while ((retval = read_file_note(reader, &note)) > 0) {
+		if (h->notes++ % CHECKPOINT_INTERVAL != 0)
+			continue;
+
+		if (h->count == ck->size) {
+			size_t size = ck->size ? ck->size * 2 : 64;
+			uint64_t *grown = (uint64_t *)realloc(ck->offsets,
+				size * sizeof(uint64_t));
+
+			if (grown == NULL) {
+				fail("%s: realloc failed\n", __func__);
+				retval = -1;
+				break;
+			}
+
+			ck->offsets = grown;
+			ck->size = size;
+		}
+
+		ck->offsets[h->count++] = note_offset(reader, &note);
+	}
+	TRACE_END();
+
+	h->size = reader->offset + reader->length;
+
+	/* store them for next time */
+	if (retval == 0)
+		checkpoint_store(category, ck);
+
+	free(index);
+
+	return retval;
+}
+
+
+/* Store the checkpoints ck of category, not being able to is no failure */
+static void checkpoint_store(char *category, const struct Checkpoints *ck)
+{
+	char *index = index_path(category, CHECKPOINT_SUFFIX);
+	char *tmp = NULL;
+	FILE *fp;
+
+	if (index != NULL && (fp = stamp_fopen_tmp(index, &tmp)) != NULL) {
+		fwrite(&ck->header, sizeof(ck->header), 1, fp);
+		fwrite(ck->offsets, sizeof(uint64_t), ck->header.count, fp);
+
+		if (ferror(fp) | fclose(fp) || stamp_rename(tmp, index) == -1)
+			remove(tmp);
+	}
+
+	free(tmp);
+	free(index);
+}
+
+
+/* Move reader to the last checkpoint at or before note offset, which
+ * counts from 0 like --offset.
+ *
+ * Returns the number of notes skipped, 0 when it had to stay at the
+ * start of the file.
+ */
+static int checkpoint_seek(struct NoteReader *reader, char *category,
+	long offset)
+{
+	struct Checkpoints ck;
+	uint64_t k = offset / CHECKPOINT_INTERVAL;
+	int skipped = 0;
+
+	memset(&ck, 0, sizeof(ck));
+
+	/* checkpoints are offsets in the category file alone */
+	if (reader->archive_fd == -1 &&
+	    checkpoint_load(reader, category, &ck) == 0 && ck.header.count > 0) {
+		if (k >= ck.header.count)
+			k = ck.header.count - 1;
+
+		if (lseek(reader->fd, ck.offsets[k], SEEK_SET) != -1) {
+			reader->offset = ck.offsets[k];
+			reader->length = reader->pos = 0;
+			reader->eof = 0;
+			skipped = k * CHECKPOINT_INTERVAL;
+		}
+	}
+
+	if (skipped == 0 && note_reader_rewind(reader) == -1)
+		fail("%s: rewinding failed\n", __func__);
+
+	free(ck.offsets);
+
+	return skipped;
+}
+
+
+/* Show all categories of notes
+ *
+ * Basically just lists files of stamp directory.
+ * Returns number of categories on success or -1 if function fails.
+ */
+static int show_categories()
+{
+	char *path = get_memo_file_path("");
+	if (path == NULL) {
+		fail("%s: error getting stamp path\n",
+			__func__);
+		return -1;
+	}
+
+	DIR *dir = opendir(path);
+
+	free(path);
+	if (dir == NULL) {
+		fail("%s: could not open stamp path\n", __func__);
+		return -1;
+	}
+
+	struct dirent *ent;
+	FILE *fp;
+	int categories = 0;
+	while ((ent = readdir(dir)) != NULL) {
+		/* only files */
+		if (ent->d_type != DT_REG)
+			continue;
+
+		fp = get_memo_file_ptr(ent->d_name, "r", "");
+		output_bytes(&output, ent->d_name, strlen(ent->d_name));
+
+		if (fp == NULL) {
+			output_char(&output, '\n');
+			continue;
+		}
+
+		categories++;
+
+		int num = count_file_lines(fp);
+		if (num < 0)
+			output_str(&output, " (empty)\n");
+		else {
+			num++;
+			output_str(&output, " (");
+			output_int(&output, num);
+			if (num != 1)
+				output_str(&output, " notes)\n");
+			else
+				output_str(&output, " note)\n");
+		}
+
+		fclose(fp);
+	}
+
+	output_flush(&output);
+	closedir(dir);
+
+	return categories;
+}
+
+
+/* Space-saving top-k: the TOP_TERMS_CAPACITY most frequent words are
+ * counted in a min-heap by count. A new word takes over the least
+ * counted one, inheriting its count as error, so counts are never
+ * underestimated by more than the error and memory stays fixed.
+ */
+static void top_terms_init(struct TopTerms *top)
+{
+	memset(top, 0, sizeof(*top));
+
+	for (int i = 0; i < TOP_TERMS_BUCKETS; i++)
+		top->buckets[i] = -1;
+}
+
+
+static int top_terms_less(const struct TopTerms *top, int a, int b)
+{
+	return top->counters[a].count < top->counters[b].count;
+}
+
+
+/* Restore the heap from position i down after its count grew */
+static void top_terms_sift(struct TopTerms *top, int i)
+{
+	int slot = top->heap[i];
+
+	for (;;) {
+		int child = 2 * i + 1;
+
+		if (child >= top->count)
+			break;
+		if (child + 1 < top->count &&
+		    top_terms_less(top, top->heap[child + 1], top->heap[child]))
+			child++;
+		if (!top_terms_less(top, top->heap[child], slot))
+			break;
+
+		top->heap[i] = top->heap[child];
+		top->counters[top->heap[i]].heap = i;
+		i = child;
+	}
+
+	top->heap[i] = slot;
+	top->counters[slot].heap = i;
+}
+
+
+static void top_terms_unlink(struct TopTerms *top, int slot)
+{
+	int *link = &top->buckets[top->counters[slot].hash % TOP_TERMS_BUCKETS];
+
+	while (*link != slot)
+		link = &top->counters[*link].next;
+
+	*link = top->counters[slot].next;
+}
+
+
+static void top_terms_add(struct TopTerms *top, const char *word, size_t len)
+{
+	uint32_t hash = bm25_hash(word, len);
+	int *bucket = &top->buckets[hash % TOP_TERMS_BUCKETS];
+	struct TopTerm *term;
+	int slot;
+
+	for (slot = *bucket; slot != -1; slot = top->counters[slot].next) {
+		term = &top->counters[slot];
+
+		if (term->hash == hash && term->length == len &&
+		    memcmp(term->word, word, len) == 0) {
+			term->count++;
+			top_terms_sift(top, term->heap);
+			return;
+		}
+	}
+
+	if (top->count < TOP_TERMS_CAPACITY) {
+		/* the new count of 1 is as low as any, it goes last */
+		slot = top->count++;
+		term = &top->counters[slot];
+		term->count = 0;
+		term->heap = slot;
+		top->heap[slot] = slot;
+	} else {
+		slot = top->heap[0];
+		term = &top->counters[slot];
+		top_terms_unlink(top, slot);
+	}
+
+	memcpy(term->word, word, len);
+	term->length = len;
+	term->hash = hash;
+	term->error = term->count;
+	term->count++;
+	term->next = *bucket;
+	*bucket = slot;
+
+	top_terms_sift(top, term->heap);
+}
+
+
+static int top_term_cmp(const void *a, const void *b)
+{
+	const struct TopTerm *ta = *(const struct TopTerm * const *)a;
+	const struct TopTerm *tb = *(const struct TopTerm * const *)b;
+
+	size_t len = ta->length < tb->length ? ta->length : tb->length;
+	int diff;
+
+	if (ta->count != tb->count)
+		return ta->count < tb->count ? 1 : -1;
+
+	if ((diff = memcmp(ta->word, tb->word, len)) != 0)
+		return diff;
+
+	return (ta->length > tb->length) - (ta->length < tb->length);
+}
+
+
+static void note_stats_init(struct NoteStats *ns)
+{
+	memset(ns, 0, sizeof(*ns));
+	ns->min_length = SIZE_MAX;
+	top_terms_init(&ns->terms);
+}
+
+
+static void note_stats_free(struct NoteStats *ns)
+{
+	free(ns->days);
+	ns->days = NULL;
+}
+
+
+/* Count a note dated day, growing the histogram of days either way */
+static int note_stats_day(struct NoteStats *ns, int day)
+{
+	if (ns->ndays == 0) {
+		if ((ns->days = (uint32_t *)calloc(1, sizeof(uint32_t))) == NULL)
+			goto fail;
+		ns->first_day = day;
+		ns->ndays = 1;
+	} else if (day < ns->first_day || day >= ns->first_day + ns->ndays) {
+		int first = day < ns->first_day ? day : ns->first_day;
+		int last = day >= ns->first_day + ns->ndays ? day :
+			ns->first_day + ns->ndays - 1;
+		uint32_t *days = (uint32_t *)calloc(last - first + 1, sizeof(uint32_t));
+
+		if (days == NULL)
+			goto fail;
+
+		memcpy(days + (ns->first_day - first), ns->days,
+			ns->ndays * sizeof(uint32_t));
+		free(ns->days);
+		ns->days = days;
+		ns->first_day = first;
+		ns->ndays = last - first + 1;
+	}
+
+	ns->days[day - ns->first_day]++;
+	return 0;
+
+fail:
+	fail("%s: calloc failed\n", __func__);
+	return -1;
+}
+
+
+/* Collect statistics of the notes in the category file at path into
+ * ns, in one pass with the note reader.
+ *
+ * Returns the number of notes read or -1 on failure.
+ */
+static int note_stats_collect(struct NoteStats *ns, const char *path)
+{
+	struct NoteReader reader;
+	struct NoteView note;
+	char word[BM25_MAX_WORD];
+	int notes = 0;
+	int got;
+
+	if (note_reader_open_path(&reader, path) == -1)
+		return -1;
+
+	TRACE_BEGIN("note_stats_collect");
+	while ((got = read_file_note(&reader, &note)) > 0) {
+		const char *end = note.message + note.length;
+		const char *p = note.message;
+		size_t len;
+		int bucket = 0;
+
+		notes++;
+
+		if (note.date != NOTE_NO_DATE && note_stats_day(ns, note.date) == -1) {
+			got = -1;
+			break;
+		}
+
+		for (len = note.length; len > 0 && bucket < NOTE_STATS_LENGTHS - 1; len >>= 1)
+			bucket++;
+		ns->lengths[bucket]++;
+
+		ns->bytes += note.length;
+		if (note.length < ns->min_length)
+			ns->min_length = note.length;
+		if (note.length > ns->max_length)
+			ns->max_length = note.length;
+
+		if (note.message == NULL)
+			continue;
+
+		while ((p = bm25_next_word(p, end, word, &len)) != NULL)
+			top_terms_add(&ns->terms, word, len);
+	}
+	TRACE_END();
+
+	note_reader_close(&reader);
+	ns->notes += notes;
+
+	return got == -1 ? -1 : notes;
+}
+
+
+/* Output label, value and a bar of value relative to max */
+static void note_stats_bar(const char *label, uint32_t value, uint32_t max)
+{
+	char buf[64];
+	int width = max ? (int)((uint64_t)value * NOTE_STATS_BAR / max) : 0;
+
+	snprintf(buf, sizeof(buf), "  %-12s %8u ", label, value);
+	output_str(&output, buf);
+
+	for (int i = 0; i < width; i++)
+		output_char(&output, '#');
+	output_char(&output, '\n');
+}
+
+
+static void note_stats_report(const struct NoteStats *ns)
+{
+	const struct TopTerm *top[TOP_TERMS_CAPACITY];
+	char buf[128];
+	char date[DATE_LEN + 1];
+	uint32_t active = 0, busiest = 0, max = 0;
+	int busiest_day = 0;
+
+	snprintf(buf, sizeof(buf), "notes          %llu\n",
+		(unsigned long long)ns->notes);
+	output_str(&output, buf);
+
+	if (ns->notes == 0)
+		return;
+
+	for (uint32_t i = 0; i < ns->ndays; i++) {
+		if (ns->days[i] > 0)
+			active++;
+		if (ns->days[i] > busiest) {
+			busiest = ns->days[i];
+			busiest_day = ns->first_day + i;
+		}
+	}
+
+	if (active > 0) {
+		format_date(ns->first_day, date);
+		snprintf(buf, sizeof(buf), "first date     %s\n", date);
+		output_str(&output, buf);
+		format_date(ns->first_day + ns->ndays - 1, date);
+		snprintf(buf, sizeof(buf), "last date      %s\n", date);
+		output_str(&output, buf);
+		format_date(busiest_day, date);
+		snprintf(buf, sizeof(buf), "busiest day    %s (%u notes)\n",
+			date, busiest);
+		output_str(&output, buf);
+		snprintf(buf, sizeof(buf), "notes per day  %.1f over %u days\n",
+			(double)ns->notes / active, active);
+		output_str(&output, buf);
+	}
+
+	snprintf(buf, sizeof(buf), "length         %.1f average, %zu to %zu\n",
+		(double)ns->bytes / ns->notes, ns->min_length, ns->max_length);
+	output_str(&output, buf);
+
+	/* length distribution in powers of two */
+	output_str(&output, "\nlength\n");
+	for (int i = 0; i < NOTE_STATS_LENGTHS; i++)
+		if (ns->lengths[i] > max)
+			max = ns->lengths[i];
+
+	for (int i = 0; i < NOTE_STATS_LENGTHS; i++) {
+		if (ns->lengths[i] == 0)
+			continue;
+
+		if (i <= 1)
+			snprintf(buf, sizeof(buf), "%d", i);
+		else if (i == NOTE_STATS_LENGTHS - 1)
+			snprintf(buf, sizeof(buf), "%lu+", 1ul << (i - 1));
+		else
+			snprintf(buf, sizeof(buf), "%lu-%lu", 1ul << (i - 1), (1ul << i) - 1);
+
+		note_stats_bar(buf, ns->lengths[i], max);
+	}
+
+	/* notes per month, summed from the days */
+	if (active > 0) {
+		int y, m, d;
+
+		civil_from_days(ns->first_day, &y, &m, &d);
+
+		int first_month = y * 12 + m - 1;
+		int nmonths = ns->ndays / 28 + 2;
+		uint32_t *months = (uint32_t *)calloc(nmonths, sizeof(uint32_t));
+
+		if (months == NULL) {
+			fail("%s: calloc failed\n", __func__);
+			return;
+		}
+
+		for (uint32_t i = 0; i < ns->ndays; i++) {
+			if (ns->days[i] == 0)
+				continue;
+
+			civil_from_days(ns->first_day + i, &y, &m, &d);
+			months[y * 12 + m - 1 - first_month] += ns->days[i];
+		}
+
+		max = 0;
+		for (int i = 0; i < nmonths; i++)
+			if (months[i] > max)
+				max = months[i];
+
+		/* months without notes are left out */
+		output_str(&output, "\nmonth\n");
+		for (int i = 0; i < nmonths; i++) {
+			int month = first_month + i;
+
+			if (months[i] == 0)
+				continue;
+
+			snprintf(buf, sizeof(buf), "%04d-%02d", month / 12, month % 12 + 1);
+			note_stats_bar(buf, months[i], max);
+		}
+
+		free(months);
+	}
+
+	/* most frequent words, counts may be over by their error */
+	int count = ns->terms.count;
+
+	for (int i = 0; i < count; i++)
+		top[i] = &ns->terms.counters[i];
+	qsort(top, count, sizeof(top[0]), top_term_cmp);
+
+	if (count > NOTE_STATS_TOP_TERMS)
+		count = NOTE_STATS_TOP_TERMS;
+
+	if (count > 0)
+		output_str(&output, "\nwords\n");
+
+	for (int i = 0; i < count; i++) {
+		output_str(&output, "  ");
+		output_bytes(&output, top[i]->word, top[i]->length);
+		snprintf(buf, sizeof(buf), " %u", top[i]->count);
+		output_str(&output, buf);
+		if (top[i]->error > 0) {
+			snprintf(buf, sizeof(buf), " (at most %u over)", top[i]->error);
+			output_str(&output, buf);
+		}
+		output_char(&output, '\n');
+	}
+}
+
+
+/* Show statistics of the notes of category: how they spread over
+ * dates and lengths and their most frequent words. Without category,
+ * all categories are taken together.
+ *
+ * Returns the number of notes or -1 on failure.
+ */
+static int show_note_stats(char *category)
+{
+	struct NoteStats *ns;
+	int retval = 0;
+
+	/* the top terms make it too big for the stack */
+	if ((ns = (struct NoteStats *)malloc(sizeof(*ns))) == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	note_stats_init(ns);
+
+	if (category != NULL) {
+		char *path = get_memo_file_path(category);
+
+		if (path == NULL || note_stats_collect(ns, path) == -1)
+			retval = -1;
+
+		free(path);
+	} else {
+		char *stamp_path = get_memo_file_path("");
+		struct dirent *ent;
+		DIR *dir;
+		int categories = 0;
+
+		if (stamp_path == NULL || (dir = opendir(stamp_path)) == NULL) {
+			fail("%s: could not open stamp path\n", __func__);
+			note_stats_free(ns);
+			free(ns);
+			free(stamp_path);
+			return -1;
+		}
+
+		while (retval != -1 && (ent = readdir(dir)) != NULL) {
+			char *path;
+
+			if (ent->d_type != DT_REG || ent->d_name[0] == '.')
+				continue;
+
+			if ((path = path_join(stamp_path, ent->d_name)) == NULL ||
+			    note_stats_collect(ns, path) == -1)
+				retval = -1;
+			else
+				categories++;
+
+			free(path);
+		}
+
+		closedir(dir);
+		free(stamp_path);
+
+		output_str(&output, "categories     ");
+		output_int(&output, categories);
+		output_char(&output, '\n');
+	}
+
+	if (retval == 0) {
+		note_stats_report(ns);
+		retval = ns->notes > INT_MAX ? INT_MAX : (int)ns->notes;
+	}
+
+	output_flush(&output);
+	note_stats_free(ns);
+	free(ns);
+
+	return retval;
+}
+
+
+/* Find needle in text ignoring ASCII case, without folding copies of
+ * either. Eight candidate positions are tested at once: a position can
+ * only match when both its byte and the byte needle_len - 1 further
+ * equal the first and last byte of needle. Setting bit 0x20 folds
+ * letters to lower case; other bytes it folds together are weeded out
+ * when comparing the candidate.
+ *
+ * Returns a pointer to the first match or NULL.
+ */
+static const char *find_ignore_case(const char *text, size_t len,
+	const char *needle, size_t needle_len)
+{
+	if (needle_len == 0)
+		return text;
+
+	if (needle_len > len)
+		return NULL;
+
+	unsigned char first = (unsigned char)needle[0];
+	unsigned char last = (unsigned char)needle[needle_len - 1];
+	uint64_t first_fold = isalpha(first) ? SWAR_ONES * 0x20 : 0;
+	uint64_t last_fold = isalpha(last) ? SWAR_ONES * 0x20 : 0;
+	uint64_t first_word = SWAR_ONES * (first | (first_fold & 0xff));
+	uint64_t last_word = SWAR_ONES * (last | (last_fold & 0xff));
+	size_t starts = len - needle_len + 1;
+	size_t i = 0;
+
+	while (i < starts) {
+		/* skip blocks of 8 starts without candidates */
+		while (starts - i >= 8) {
+			uint64_t head, tail;
+
+			memcpy(&head, text + i, sizeof(head));
+			memcpy(&tail, text + i + needle_len - 1, sizeof(tail));
+			head = (head | first_fold) ^ first_word;
+			tail = (tail | last_fold) ^ last_word;
+
+			if (SWAR_HAS_ZERO(head | tail))
+				break;
+			i += 8;
+		}
+
+		size_t block_end = i + 8 < starts ? i + 8 : starts;
+
+		for (; i < block_end; i++) {
+			size_t j = 0;
+
+			while (j < needle_len && tolower((unsigned char)text[i + j]) ==
+			       tolower((unsigned char)needle[j]))
+				j++;
+
+			if (j == needle_len)
+				return text + i;
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Search if a note contains the search term.
+ * Returns the count of found notes or -1 if function fails.
+ */
+static int search_notes(char *category, const char *search)
+{
+	int count = 0;
+	int notes = 0;
+	int handled = 0;
+	size_t search_len = strlen(search);
+	struct NoteReader reader;
+	struct NoteView note;
+
+	/* use the substring index when there is one */
+	if (!ignore_case && !include_archive) {
+		count = sa_search(category, search, &handled);
+		if (handled)
+			return count;
+		count = 0;
+	}
+
+	if (note_reader_open_archived(&reader, category) == -1)
+		return -1;
+
+	TRACE_BEGIN("search_notes");
+	while (!output_broken(&output) && read_file_note(&reader, &note) > 0) {
+		notes++;
+
+		if (note.message == NULL)
+			continue;
+
+		if (count_only) {
+			count += count_occurrences(note.message, search);
+			continue;
+		}
+
+		/* Check if the search term matches */
+		PHASE_BEGIN(PHASE_FILTER);
+		const char *match;
+		if (ignore_case)
+			match = find_ignore_case(note.message, note.length,
+				search, search_len);
+		else
+			match = strstr(note.message, search);
+		PHASE_END();
+
+		if (match != NULL) {
+			output_default(&note);
+			count++;
+		}
+	}
+	TRACE_END();
+
+	if (count_only) {
+		output_int(&output, count);
+		output_char(&output, '\n');
+	}
+
+	output_flush(&output);
+	note_reader_close(&reader);
+
+	/* Ignore empty note file */
+	if (notes == 0)
+		return -1;
+
+	return count;
+}
+
+
+/* Number of times needle occurs in text, overlapping ones included */
+static int count_occurrences(const char *text, const char *needle)
+{
+	int count = 0;
+
+	if (*needle == '\0')
+		return 0;
+
+	while ((text = strstr(text, needle)) != NULL) {
+		count++;
+		text++;
+	}
+
+	return count;
+}
+
+
+/* Read the next token of the query. Terms are words or "quoted
+ * phrases", AND, OR and NOT are only operators in upper case.
+ */
+static QueryToken_t query_next(struct Query *q, const char **start,
+	size_t *len)
+{
+	const char *p = q->pos;
+
+	while (isspace((unsigned char)*p))
+		p++;
+
+	*start = p;
+	*len = 0;
+
+	if (*p == '\0') {
+		q->pos = p;
+		return QUERY_TOKEN_END;
+	}
+
+	if (*p == '(' || *p == ')') {
+		q->pos = p + 1;
+		return *p == '(' ? QUERY_TOKEN_OPEN : QUERY_TOKEN_CLOSE;
+	}
+
+	/* quotes are checked to be balanced by query_compile */
+	if (*p == '"') {
+		const char *end = strchr(p + 1, '"');
+
+		*start = p + 1;
+		*len = end - *start;
+		q->pos = end + 1;
+
+		return QUERY_TOKEN_TERM;
+	}
+
+	while (*p && !isspace((unsigned char)*p) && *p != '(' && *p != ')' &&
+	       *p != '"')
+		p++;
+
+	*len = p - *start;
+	q->pos = p;
+
+	if (*len == 3 && strncmp(*start, "AND", 3) == 0)
+		return QUERY_TOKEN_AND;
+	if (*len == 2 && strncmp(*start, "OR", 2) == 0)
+		return QUERY_TOKEN_OR;
+	if (*len == 3 && strncmp(*start, "NOT", 3) == 0)
+		return QUERY_TOKEN_NOT;
+
+	return QUERY_TOKEN_TERM;
+}
+
+
+static QueryToken_t query_peek(struct Query *q)
+{
+	const char *pos = q->pos;
+	const char *start;
+	size_t len;
+	QueryToken_t token = query_next(q, &start, &len);
+
+	q->pos = pos;
+
+	return token;
+}
+
+
+static void query_emit(struct Query *q, QueryOp_t op, int term)
+{
+	q->program[q->length].op = op;
+	q->program[q->length].term = term;
+	q->length++;
+}
+
+
+/* Index of term in the query, adding it when it's new */
+static int query_term(struct Query *q, const char *term, size_t len)
+{
+	if (len == 0) {
+		fail("%s: empty term in query\n", __func__);
+		return -1;
+	}
+
+	for (int i = 0; i < q->nterms; i++) {
+		if (q->term_lengths[i] == len && memcmp(q->terms[i], term, len) == 0)
+			return i;
+	}
+
+	if (q->nterms == QUERY_MAX_TERMS) {
+		fail("%s: more than %d terms in query\n", __func__, QUERY_MAX_TERMS);
+		return -1;
+	}
+
+	if ((q->terms[q->nterms] = strndup(term, len)) == NULL)
+		return -1;
+
+	q->term_lengths[q->nterms] = len;
+
+	return q->nterms++;
+}
+
+
+/* not := NOT not | ( or ) | term */
+static int query_parse_not(struct Query *q)
+{
+	const char *start;
+	size_t len;
+	int term;
+
+	switch (query_next(q, &start, &len)) {
+	case QUERY_TOKEN_NOT:
+		if (query_parse_not(q) == -1)
+			return -1;
+		query_emit(q, QUERY_NOT, 0);
+		return 0;
+	case QUERY_TOKEN_OPEN:
+		if (query_parse_or(q) == -1)
+			return -1;
+		if (query_next(q, &start, &len) != QUERY_TOKEN_CLOSE) {
+			fail("%s: missing ) in query\n", __func__);
+			return -1;
+		}
+		return 0;
+	case QUERY_TOKEN_TERM:
+		if ((term = query_term(q, start, len)) == -1)
+			return -1;
+		query_emit(q, QUERY_TERM, term);
+		return 0;
+	default:
+		fail("%s: expected a term at '%s'\n", __func__, start);
+		return -1;
+	}
+}
+
+
+/* and := not ([AND] not)* */
+static int query_parse_and(struct Query *q)
+{
+	if (query_parse_not(q) == -1)
+		return -1;
+
+	for (;;) {
+		const char *start;
+		size_t len;
+
+		switch (query_peek(q)) {
+		case QUERY_TOKEN_AND:
+			query_next(q, &start, &len);
+			break;
+		case QUERY_TOKEN_TERM:
+		case QUERY_TOKEN_NOT:
+		case QUERY_TOKEN_OPEN:
+			/* juxtaposed terms are and'ed */
+			break;
+		default:
+			return 0;
+		}
+
+		if (query_parse_not(q) == -1)
+			return -1;
+		query_emit(q, QUERY_AND, 0);
+	}
+}
+
+
+/* or := and (OR and)* */
+static int query_parse_or(struct Query *q)
+{
+	if (query_parse_and(q) == -1)
+		return -1;
+
+	while (query_peek(q) == QUERY_TOKEN_OR) {
+		const char *start;
+		size_t len;
+
+		query_next(q, &start, &len);
+		if (query_parse_and(q) == -1)
+			return -1;
+		query_emit(q, QUERY_OR, 0);
+	}
+
+	return 0;
+}
+
+
+/* Build the Aho-Corasick automaton of all query terms as a full
+ * transition table, so scanning costs one lookup per byte. out[state]
+ * has the bits of all terms ending in that state.
+ */
+static int query_build_automaton(struct Query *q)
+{
+	size_t max_states = 1;
+	int *fail_links = NULL;
+	int *queue = NULL;
+	int head = 0, tail = 0;
+
+	for (int i = 0; i < q->nterms; i++)
+		max_states += q->term_lengths[i];
+
+	q->delta = (int *)malloc(max_states * 256 * sizeof(int));
+	q->out = (uint64_t *)calloc(max_states, sizeof(uint64_t));
+	fail_links = (int *)calloc(max_states, sizeof(int));
+	queue = (int *)malloc(max_states * sizeof(int));
+
+	if (q->delta == NULL || q->out == NULL || fail_links == NULL ||
+	    queue == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		free(fail_links);
+		free(queue);
+		return -1;
+	}
+
+	memset(q->delta, -1, 256 * sizeof(int));
+	q->states = 1;
+
+	/* trie of the terms */
+	for (int i = 0; i < q->nterms; i++) {
+		int state = 0;
+
+		for (size_t j = 0; j < q->term_lengths[i]; j++) {
+			unsigned char c = (unsigned char)q->terms[i][j];
+			int *next;
+
+			if (ignore_case)
+				c = tolower(c);
+
+			next = &q->delta[state * 256 + c];
+
+			if (*next == -1) {
+				*next = q->states++;
+				memset(&q->delta[*next * 256], -1, 256 * sizeof(int));
+			}
+
+			state = *next;
+		}
+
+		q->out[state] |= (uint64_t)1 << i;
+	}
+
+	/* breadth first, fill in the missing transitions from the
+	 * failure links, which always point to shallower states
+	 */
+	for (int c = 0; c < 256; c++) {
+		if (q->delta[c] == -1)
+			q->delta[c] = 0;
+		else
+			queue[tail++] = q->delta[c];
+	}
+
+	while (head < tail) {
+		int state = queue[head++];
+
+		q->out[state] |= q->out[fail_links[state]];
+
+		for (int c = 0; c < 256; c++) {
+			int *next = &q->delta[state * 256 + c];
+			int fallback = q->delta[fail_links[state] * 256 + c];
+
+			if (*next == -1)
+				*next = fallback;
+			else {
+				fail_links[*next] = fallback;
+				queue[tail++] = *next;
+			}
+		}
+	}
+
+	/* upper case letters go where lower case ones do */
+	for (int state = 0; ignore_case && state < q->states; state++) {
+		for (int c = 'A'; c <= 'Z'; c++)
+			q->delta[state * 256 + c] = q->delta[state * 256 + tolower(c)];
+	}
+
+	free(fail_links);
+	free(queue);
+
+	return 0;
+}
+
+
+/* Parse query into a postfix program over its terms.
+ * Returns 0 on success and -1 on failure.
+ */
+static int query_parse(struct Query *q, const char *query)
+{
+	int quotes = 0;
+
+	memset(q, 0, sizeof(*q));
+	q->pos = query;
+
+	for (const char *p = query; *p; p++)
+		quotes += *p == '"';
+
+	if (quotes % 2) {
+		fail("%s: unterminated quote in query\n", __func__);
+		return -1;
+	}
+
+	/* every token emits at most two operations */
+	q->program = (struct QueryOp *)malloc((2 * strlen(query) + 2) *
+		sizeof(struct QueryOp));
+	q->stack = (char *)malloc(strlen(query) + 2);
+
+	if (q->program == NULL || q->stack == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	if (query_parse_or(q) == -1)
+		return -1;
+
+	if (query_peek(q) != QUERY_TOKEN_END) {
+		fail("%s: unexpected '%s' in query\n", __func__, q->pos);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Compile query into a postfix program over its terms and the
+ * automaton finding them. Returns 0 on success and -1 on failure.
+ */
+static int query_compile(struct Query *q, const char *query)
+{
+	if (query_parse(q, query) == -1)
+		return -1;
+
+	return query_build_automaton(q);
+}
+
+
+static void query_free(struct Query *q)
+{
+	for (int i = 0; i < q->nterms; i++)
+		free(q->terms[i]);
+
+	free(q->program);
+	free(q->stack);
+	free(q->delta);
+	free(q->out);
+}
+
+
+/* Scan text once and evaluate the query on the set of terms found */
+static int query_match(struct Query *q, const char *text, size_t len)
+{
+	const int *delta = q->delta;
+	const uint64_t *out = q->out;
+	uint64_t found = 0;
+	int state = 0;
+	int depth = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		state = delta[state * 256 + (unsigned char)text[i]];
+		found |= out[state];
+	}
+
+	for (int i = 0; i < q->length; i++) {
+		switch (q->program[i].op) {
+		case QUERY_TERM:
+			q->stack[depth++] = (found >> q->program[i].term) & 1;
+			break;
+		case QUERY_NOT:
+			q->stack[depth - 1] = !q->stack[depth - 1];
+			break;
+		case QUERY_AND:
+			depth--;
+			q->stack[depth - 1] = q->stack[depth - 1] && q->stack[depth];
+			break;
+		case QUERY_OR:
+			depth--;
+			q->stack[depth - 1] = q->stack[depth - 1] || q->stack[depth];
+			break;
+		}
+	}
+
+	return q->stack[0];
+}
+
+
+/* Find notes matching a boolean query of literal terms, such as
+ * 'disk AND (full OR quota) AND NOT test'. All terms are looked for
+ * in a single pass over each message.
+ *
+ * Returns the count of found notes or -1 if function fails.
+ */
+static int search_query(char *category, const char *query)
+{
+	int count = 0;
+	int notes = 0;
+	struct Query q;
+	struct NoteReader reader;
+	struct NoteView note;
+
+	if (query_compile(&q, query) == -1) {
+		query_free(&q);
+		return -1;
+	}
+
+	if (note_reader_open_archived(&reader, category) == -1) {
+		query_free(&q);
+		return -1;
+	}
+
+	TRACE_BEGIN("search_query");
+	while (!output_broken(&output) && read_file_note(&reader, &note) > 0) {
+		notes++;
+
+		if (note.message == NULL)
+			continue;
+
+		PHASE_BEGIN(PHASE_FILTER);
+		int match = query_match(&q, note.message, note.length);
+		PHASE_END();
+
+		if (match) {
+			output_default(&note);
+			count++;
+		}
+	}
+	TRACE_END();
+
+	output_flush(&output);
+	note_reader_close(&reader);
+	query_free(&q);
+
+	/* Ignore empty note file */
+	if (notes == 0)
+		return -1;
+
+	return count;
+}
+
+
+/* Path of the index of category with the given suffix, in a hidden
+ * directory of the stamp path. Returns a newly allocated string or
+ * NULL on failure.
+ */
+static char *index_path(char *category, const char *suffix)
+{
+	char *stamp_path = get_memo_file_path("");
+	char *dir;
+	char *path;
+	size_t len;
+
+	if (stamp_path == NULL)
+		return NULL;
+
+	dir = path_join(stamp_path, INDEX_DIR);
+	free(stamp_path);
+	if (dir == NULL)
+		return NULL;
+
+	stamp_mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+
+	len = strlen(dir) + strlen(category) + strlen(suffix) + 2;
+	if ((path = (char *)malloc(len)) != NULL)
+		snprintf(path, len, "%s/%s%s", dir, category, suffix);
+	else
+		fail("%s: malloc failed\n", __func__);
+
+	free(dir);
+
+	return path;
+}
+
+
+/* Check if category has an index with the given suffix */
+static int index_exists(char *category, const char *suffix)
+{
+	char *path = index_path(category, suffix);
+	int exists = path && file_exists(path);
+
+	free(path);
+
+	return exists;
+}
+
+
+/* Find the next word in text: a run of letters, digits and non-ASCII
+ * bytes. It's copied to word folded to lower case and truncated to
+ * BM25_MAX_WORD bytes.
+ *
+ * Returns a pointer past the word, or NULL when there are no more.
+ */
+static const char *bm25_next_word(const char *text, const char *end,
+	char *word, size_t *len)
+{
+	while (text < end && !BM25_WORD_CHAR(*text))
+		text++;
+
+	if (text == end)
+		return NULL;
+
+	*len = 0;
+	for (; text < end && BM25_WORD_CHAR(*text); text++) {
+		if (*len < BM25_MAX_WORD)
+			word[(*len)++] = tolower((unsigned char)*text);
+	}
+
+	return text;
+}
+
+
+static float bm25_score(float idf, uint32_t tf, uint32_t length,
+	double avg_length)
+{
+	double norm = BM25_K1 * (1 - BM25_B + BM25_B * length / avg_length);
+
+	return (float)(idf * tf * (BM25_K1 + 1) / (tf + norm));
+}
+
+
+static uint32_t bm25_hash(const char *word, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)word[i]) * 16777619u;
+
+	return hash;
+}
+
+
+/* Count one more occurrence of word in doc */
+static int bm25_add_word(struct Bm25Builder *b, const char *word, size_t len,
+	uint32_t doc)
+{
+	uint32_t hash = bm25_hash(word, len);
+	uint32_t slot;
+
+	/* keep the table at most half full */
+	if (b->nwords * 2 >= b->table_size) {
+		uint32_t size = b->table_size ? b->table_size * 2 : 4096;
+		uint32_t *table = (uint32_t *)malloc(size * sizeof(uint32_t));
+
+		if (table == NULL) {
+			fail("%s: malloc failed\n", __func__);
+			return -1;
+		}
+
+		memset(table, 0xff, size * sizeof(uint32_t));
+		for (uint32_t i = 0; i < b->nwords; i++) {
+			slot = b->words[i].hash & (size - 1);
+			while (table[slot] != BM25_NONE)
+				slot = (slot + 1) & (size - 1);
+			table[slot] = i;
+		}
+
+		free(b->table);
+		b->table = table;
+		b->table_size = size;
+	}
+
+	slot = hash & (b->table_size - 1);
+	while (b->table[slot] != BM25_NONE) {
+		struct Bm25Word *w = &b->words[b->table[slot]];
+
+		if (w->hash == hash && w->length == len &&
+		    memcmp(w->word, word, len) == 0)
+			break;
+		slot = (slot + 1) & (b->table_size - 1);
+	}
+
+	if (b->table[slot] == BM25_NONE) {
+		if (b->nwords == b->words_size) {
+			uint32_t size = b->words_size ? b->words_size * 2 : 1024;
+			struct Bm25Word *words = (struct Bm25Word *)realloc(b->words,
+				size * sizeof(struct Bm25Word));
+
+			if (words == NULL) {
+				fail("%s: realloc failed\n", __func__);
+				return -1;
+			}
+
+			b->words = words;
+			b->words_size = size;
+		}
+
+		struct Bm25Word *w = &b->words[b->nwords];
+		memset(w, 0, sizeof(*w));
+		if ((w->word = arena_strndup(&b->arena, word, len)) == NULL)
+			return -1;
+		w->length = len;
+		w->hash = hash;
+		b->table[slot] = b->nwords++;
+	}
+
+	struct Bm25Word *w = &b->words[b->table[slot]];
+
+	if (w->count > 0 && w->postings[w->count - 1].doc == doc) {
+		w->postings[w->count - 1].tf++;
+		return 0;
+	}
+
+	if (w->count == w->size) {
+		uint32_t size = w->size ? w->size * 2 : 4;
+		struct Bm25Posting *postings = (struct Bm25Posting *)realloc(
+			w->postings, size * sizeof(struct Bm25Posting));
+
+		if (postings == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			return -1;
+		}
+
+		w->postings = postings;
+		w->size = size;
+	}
+
+	w->postings[w->count].doc = doc;
+	w->postings[w->count].tf = 1;
+	w->count++;
+
+	return 0;
+}
+
+
+static int bm25_word_cmp(const void *a, const void *b)
+{
+	const struct Bm25Word *wa = (const struct Bm25Word *)a;
+	const struct Bm25Word *wb = (const struct Bm25Word *)b;
+	size_t len = wa->length < wb->length ? wa->length : wb->length;
+	int cmp = memcmp(wa->word, wb->word, len);
+
+	if (cmp != 0)
+		return cmp;
+
+	return (int)wa->length - (int)wb->length;
+}
+
+
+static void bm25_builder_free(struct Bm25Builder *b)
+{
+	for (uint32_t i = 0; i < b->nwords; i++)
+		free(b->words[i].postings);
+
+	free(b->words);
+	free(b->table);
+	free(b->docs);
+	arena_free(&b->arena);
+}
+
+
+/* Write the BM25 index of the category file at path. The index is a
+ * header followed by fixed size records, meant to be mapped:
+ *
+ *   docs[notes]        line offset, id and length in words per note
+ *   terms[terms]       sorted, with document frequency, idf and the
+ *                      highest score of the term in any note
+ *   blocks[blocks]     per BM25_BLOCK_SIZE postings of a term, the
+ *                      last note and highest score in the block
+ *   postings[postings] note and term frequency, in note order per term
+ *   strings            the terms themselves
+ *
+ * The header holds inode, size and mtime of the category file, so a
+ * stale index is noticed and rebuilt.
+ */
+static int bm25_build(char *category, const char *path, const char *index)
+{
+	struct Bm25Builder b;
+	struct Bm25Header header;
+	struct NoteReader reader;
+	struct NoteView note;
+	struct stat st;
+	char word[BM25_MAX_WORD];
+	int retval = 0;
+	int got;
+
+	memset(&b, 0, sizeof(b));
+	memset(&header, 0, sizeof(header));
+
+	if (note_reader_open_path(&reader, path) == -1)
+		return -1;
+
+	if (fstat(reader.fd, &st) == -1) {
+		note_reader_close(&reader);
+		return -1;
+	}
+
+	TRACE_BEGIN("bm25_build");
+	while ((got = read_file_note(&reader, &note)) > 0) {
+		const char *p = note.message;
+		const char *end = note.message + note.length;
+		uint32_t length = 0;
+		size_t len;
+
+		if (b.ndocs == b.docs_size) {
+			uint32_t size = b.docs_size ? b.docs_size * 2 : 1024;
+			struct Bm25Doc *docs = (struct Bm25Doc *)realloc(b.docs,
+				size * sizeof(struct Bm25Doc));
+
+			if (docs == NULL) {
+				fail("%s: realloc failed\n", __func__);
+				got = -1;
+				break;
+			}
+
+			b.docs = docs;
+			b.docs_size = size;
+		}
+
+		while (p && (p = bm25_next_word(p, end, word, &len)) != NULL) {
+			if (bm25_add_word(&b, word, len, b.ndocs) == -1) {
+				got = -1;
+				break;
+			}
+			length++;
+		}
+
+		if (got == -1)
+			break;
+
+		b.docs[b.ndocs].offset = note_offset(&reader, &note);
+		b.docs[b.ndocs].id = note.id;
+		b.docs[b.ndocs].length = length;
+		b.ndocs++;
+		b.total_length += length;
+	}
+	note_reader_close(&reader);
+
+	if (got == -1) {
+		bm25_builder_free(&b);
+		TRACE_END();
+		return -1;
+	}
+
+	qsort(b.words, b.nwords, sizeof(struct Bm25Word), bm25_word_cmp);
+
+	memcpy(header.magic, BM25_MAGIC, sizeof(header.magic));
+	header.ino = st.st_ino;
+	header.size = st.st_size;
+	header.mtime = st.st_mtime;
+	header.notes = b.ndocs;
+	header.terms = b.nwords;
+	header.avg_length = b.ndocs ? (double)b.total_length / b.ndocs : 1;
+	if (header.avg_length == 0)
+		header.avg_length = 1;
+
+	for (uint32_t i = 0; i < b.nwords; i++) {
+		header.blocks += (b.words[i].count + BM25_BLOCK_SIZE - 1) / BM25_BLOCK_SIZE;
+		header.postings += b.words[i].count;
+		header.strings_length += b.words[i].length;
+	}
+
+	char *tmp = NULL;
+	FILE *fp = stamp_fopen_tmp(index, &tmp);
+
+	if (fp == NULL) {
+		fail("%s: could not write index of %s\n", __func__, category);
+		bm25_builder_free(&b);
+		free(tmp);
+		TRACE_END();
+		return -1;
+	}
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(b.docs, sizeof(struct Bm25Doc), b.ndocs, fp);
+
+	/* terms, and their blocks while the scores are at hand */
+	struct Bm25Block *blocks = (struct Bm25Block *)malloc(
+		(header.blocks + 1) * sizeof(struct Bm25Block));
+	uint32_t block = 0, posting = 0, string = 0;
+
+	if (blocks == NULL)
+		retval = -1;
+
+	for (uint32_t i = 0; retval == 0 && i < b.nwords; i++) {
+		struct Bm25Word *w = &b.words[i];
+		struct Bm25Term term;
+
+		term.string = string;
+		term.length = w->length;
+		term.df = w->count;
+		term.block = block;
+		term.posting = posting;
+		term.idf = (float)log(1 + (b.ndocs - w->count + 0.5) / (w->count + 0.5));
+		term.max_score = 0;
+
+		for (uint32_t j = 0; j < w->count; j++) {
+			float score = bm25_score(term.idf, w->postings[j].tf,
+				b.docs[w->postings[j].doc].length, header.avg_length);
+
+			if (j % BM25_BLOCK_SIZE == 0) {
+				blocks[block].max_score = 0;
+				block++;
+			}
+
+			blocks[block - 1].last_doc = w->postings[j].doc;
+			if (score > blocks[block - 1].max_score)
+				blocks[block - 1].max_score = score;
+			if (score > term.max_score)
+				term.max_score = score;
+		}
+
+		string += w->length;
+		posting += w->count;
+		fwrite(&term, sizeof(term), 1, fp);
+	}
+
+	if (retval == 0) {
+		fwrite(blocks, sizeof(struct Bm25Block), header.blocks, fp);
+
+		for (uint32_t i = 0; i < b.nwords; i++)
+			fwrite(b.words[i].postings, sizeof(struct Bm25Posting),
+				b.words[i].count, fp);
+
+		for (uint32_t i = 0; i < b.nwords; i++)
+			fwrite(b.words[i].word, 1, b.words[i].length, fp);
+	}
+
+	if (ferror(fp))
+		retval = -1;
+
+	if (fclose(fp) != 0 || retval == -1 || stamp_rename(tmp, index) == -1) {
+		fail("%s: could not write index of %s\n", __func__, category);
+		remove(tmp);
+		retval = -1;
+	}
+
+	free(blocks);
+	free(tmp);
+	bm25_builder_free(&b);
+	TRACE_END();
+
+	return retval;
+}
+
+
+/* Check that the records header counts fit in an index of size bytes,
+ * as they're mapped by those counts. The terms are checked as they're
+ * used, see bm25_term_valid.
+ */
+static int bm25_fits(const struct Bm25Header *header, size_t size)
+{
+	/* the counts are 32 bits, the products can't overflow */
+	uint64_t need = sizeof(*header) +
+		(uint64_t)header->notes * sizeof(struct Bm25Doc) +
+		(uint64_t)header->terms * sizeof(struct Bm25Term) +
+		(uint64_t)header->blocks * sizeof(struct Bm25Block) +
+		(uint64_t)header->postings * sizeof(struct Bm25Posting);
+
+	return need <= size && header->strings_length <= size - need;
+}
+
+
+/* Check that the string, blocks and postings of term are within index.
+ * The postings themselves aren't read, that would cost as much as the
+ * search skips; cursors stop at a note out of range instead.
+ */
+static int bm25_term_valid(const struct Bm25Index *index,
+	const struct Bm25Term *term)
+{
+	const struct Bm25Header *h = index->header;
+	uint32_t blocks;
+
+	if (term->string > h->strings_length ||
+	    term->length > h->strings_length - term->string ||
+	    term->df == 0 || term->df > h->notes ||
+	    term->posting > h->postings || term->df > h->postings - term->posting)
+		return 0;
+
+	blocks = term->df / BM25_BLOCK_SIZE + (term->df % BM25_BLOCK_SIZE != 0);
+
+	return term->block <= h->blocks && blocks <= h->blocks - term->block;
+}
+
+
+/* Map the BM25 index of category, building it first when it's missing,
+ * older than the category file at path or doesn't fit its size.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bm25_open(char *category, const char *path, struct Bm25Index *index)
+{
+	char *index_file = index_path(category, BM25_SUFFIX);
+	struct stat st, ist;
+	int fd = -1;
+
+	memset(index, 0, sizeof(*index));
+
+	if (index_file == NULL || stamp_stat(path, &st) == -1) {
+		free(index_file);
+		return -1;
+	}
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		const struct Bm25Header *header;
+
+		fd = open(index_file, O_RDONLY);
+		if (fd != -1 && fstat(fd, &ist) == 0 &&
+		    (size_t)ist.st_size >= sizeof(struct Bm25Header)) {
+			index->map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			index->map_size = ist.st_size;
+		}
+
+		if (fd != -1)
+			close(fd);
+
+		if (index->map == MAP_FAILED)
+			index->map = NULL;
+
+		header = (const struct Bm25Header *)index->map;
+		if (header && memcmp(header->magic, BM25_MAGIC, sizeof(header->magic)) == 0 &&
+		    header->ino == (uint64_t)st.st_ino &&
+		    header->size == (uint64_t)st.st_size &&
+		    header->mtime == (int64_t)st.st_mtime &&
+		    bm25_fits(header, index->map_size))
+			break;
+
+		if (index->map)
+			munmap(index->map, index->map_size);
+		index->map = NULL;
+
+		if (attempt == 0 && bm25_build(category, path, index_file) == -1)
+			break;
+	}
+
+	free(index_file);
+
+	if (index->map == NULL)
+		return -1;
+
+	index->header = (const struct Bm25Header *)index->map;
+	index->docs = (const struct Bm25Doc *)(index->header + 1);
+	index->terms = (const struct Bm25Term *)(index->docs + index->header->notes);
+	index->blocks = (const struct Bm25Block *)(index->terms + index->header->terms);
+	index->postings = (const struct Bm25Posting *)(index->blocks + index->header->blocks);
+	index->strings = (const char *)(index->postings + index->header->postings);
+
+	return 0;
+}
+
+
+/* Find the term word in index. A term whose string isn't within the
+ * index marks it corrupt.
+ */
+static const struct Bm25Term *bm25_lookup(struct Bm25Index *index,
+	const char *word, size_t len)
+{
+	uint32_t lo = 0, hi = index->header->terms;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const struct Bm25Term *term = &index->terms[mid];
+
+		if (term->string > index->header->strings_length ||
+		    term->length > index->header->strings_length - term->string) {
+			index->corrupt = 1;
+			return NULL;
+		}
+
+		size_t min = term->length < len ? term->length : len;
+		int cmp = memcmp(index->strings + term->string, word, min);
+
+		if (cmp == 0)
+			cmp = (int)term->length - (int)len;
+
+		if (cmp == 0)
+			return term;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+
+/* Move cursor to its first posting of a note >= doc, skipping whole
+ * blocks by their last note.
+ */
+static void bm25_advance(struct Bm25Cursor *c, uint32_t doc)
+{
+	uint32_t blocks = (c->term->df + BM25_BLOCK_SIZE - 1) / BM25_BLOCK_SIZE;
+
+	while (c->block < blocks && c->blocks[c->block].last_doc < doc)
+		c->block++;
+
+	if (c->block == blocks) {
+		c->doc = BM25_NONE;
+		return;
+	}
+
+	if (c->pos < c->block * BM25_BLOCK_SIZE)
+		c->pos = c->block * BM25_BLOCK_SIZE;
+
+	while (c->pos < c->term->df && c->postings[c->pos].doc < doc)
+		c->pos++;
+
+	/* only a corrupt index gets past its postings or notes */
+	if (c->pos == c->term->df || c->postings[c->pos].doc >= c->notes) {
+		c->doc = BM25_NONE;
+		return;
+	}
+
+	c->doc = c->postings[c->pos].doc;
+}
+
+
+/* Block of cursor that would hold doc, without moving the cursor */
+static uint32_t bm25_block_at(const struct Bm25Cursor *c, uint32_t doc)
+{
+	uint32_t blocks = (c->term->df + BM25_BLOCK_SIZE - 1) / BM25_BLOCK_SIZE;
+	uint32_t block = c->block;
+
+	while (block < blocks && c->blocks[block].last_doc < doc)
+		block++;
+
+	return block;
+}
+
+
+/* hits[0] is the lowest score, ties are broken by keeping earlier notes */
+static int bm25_hit_less(const struct Bm25Hit *a, const struct Bm25Hit *b)
+{
+	return a->score < b->score || (a->score == b->score && a->doc > b->doc);
+}
+
+
+static void bm25_heap_push(struct Bm25Hit *heap, int *count, int k,
+	struct Bm25Hit hit)
+{
+	int i;
+
+	if (*count == k) {
+		if (!bm25_hit_less(&heap[0], &hit))
+			return;
+
+		/* replace the root and sift down */
+		i = 0;
+		for (;;) {
+			int child = 2 * i + 1;
+
+			if (child >= k)
+				break;
+			if (child + 1 < k && bm25_hit_less(&heap[child + 1], &heap[child]))
+				child++;
+			if (!bm25_hit_less(&heap[child], &hit))
+				break;
+			heap[i] = heap[child];
+			i = child;
+		}
+		heap[i] = hit;
+		return;
+	}
+
+	i = (*count)++;
+	while (i > 0 && bm25_hit_less(&hit, &heap[(i - 1) / 2])) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = hit;
+}
+
+
+static int bm25_hit_cmp(const void *a, const void *b)
+{
+	const struct Bm25Hit *ha = (const struct Bm25Hit *)a;
+	const struct Bm25Hit *hb = (const struct Bm25Hit *)b;
+
+	if (bm25_hit_less(ha, hb))
+		return 1;
+	if (bm25_hit_less(hb, ha))
+		return -1;
+	return 0;
+}
+
+
+/* Top k notes for the cursors with block-max WAND: cursors are kept
+ * sorted by note, and only a note where the score bounds of the terms
+ * up to it can beat the k-th best score so far is scored. When the
+ * bounds of the blocks the note falls in can't, all cursors skip past
+ * the first of those blocks to end.
+ *
+ * Returns the number of hits, best first.
+ */
+static int bm25_top_k(const struct Bm25Index *index, struct Bm25Cursor *cursors,
+	int n, struct Bm25Hit *hits, int k)
+{
+	struct Bm25Cursor *sorted[BM25_MAX_TERMS];
+	int count = 0;
+
+	for (int i = 0; i < n; i++) {
+		sorted[i] = &cursors[i];
+		bm25_advance(sorted[i], 0);
+	}
+
+	for (;;) {
+		/* insertion sort, queries have few terms */
+		for (int i = 1; i < n; i++) {
+			struct Bm25Cursor *c = sorted[i];
+			int j = i;
+
+			while (j > 0 && sorted[j - 1]->doc > c->doc) {
+				sorted[j] = sorted[j - 1];
+				j--;
+			}
+			sorted[j] = c;
+		}
+
+		float threshold = count == k ? hits[0].score : 0;
+		float bound = 0;
+		int pivot = -1;
+
+		for (int i = 0; i < n && sorted[i]->doc != BM25_NONE; i++) {
+			bound += sorted[i]->term->max_score;
+			if (bound > threshold) {
+				pivot = i;
+				break;
+			}
+		}
+
+		if (pivot == -1)
+			break;
+
+		uint32_t doc = sorted[pivot]->doc;
+
+		while (pivot + 1 < n && sorted[pivot + 1]->doc == doc)
+			pivot++;
+
+		/* the bounds of the blocks holding doc */
+		uint32_t next = BM25_NONE;
+		bound = 0;
+
+		for (int i = 0; i <= pivot; i++) {
+			uint32_t block = bm25_block_at(sorted[i], doc);
+			uint32_t blocks = (sorted[i]->term->df + BM25_BLOCK_SIZE - 1) /
+				BM25_BLOCK_SIZE;
+
+			if (block == blocks)
+				continue;
+
+			bound += sorted[i]->blocks[block].max_score;
+			if (sorted[i]->blocks[block].last_doc + 1 < next)
+				next = sorted[i]->blocks[block].last_doc + 1;
+		}
+
+		if (bound * BM25_BOUND_SLACK <= threshold) {
+			if (pivot + 1 < n && sorted[pivot + 1]->doc < next)
+				next = sorted[pivot + 1]->doc;
+
+			for (int i = 0; i <= pivot; i++) {
+				if (sorted[i]->doc < next)
+					bm25_advance(sorted[i], next);
+			}
+			continue;
+		}
+
+		if (sorted[0]->doc != doc) {
+			for (int i = 0; i < pivot && sorted[i]->doc < doc; i++)
+				bm25_advance(sorted[i], doc);
+			continue;
+		}
+
+		struct Bm25Hit hit = { 0, doc };
+		uint32_t length = index->docs[doc].length;
+
+		for (int i = 0; i <= pivot; i++) {
+			hit.score += bm25_score(sorted[i]->term->idf,
+				sorted[i]->postings[sorted[i]->pos].tf, length,
+				index->header->avg_length);
+			bm25_advance(sorted[i], doc + 1);
+		}
+
+		STAT_ADD(notes_scored, 1);
+		bm25_heap_push(hits, &count, k, hit);
+	}
+
+	qsort(hits, count, sizeof(struct Bm25Hit), bm25_hit_cmp);
+
+	return count;
+}
+
+
+/* Show the k notes best matching the words of search, ranked by BM25
+ * using the per-category index, which is (re)built when needed.
+ *
+ * Returns the count of found notes or -1 if function fails.
+ */
+static int search_ranked(char *category, const char *search, int k)
+{
+	struct Bm25Index index;
+	struct Bm25Cursor cursors[BM25_MAX_TERMS];
+	struct Bm25Hit *hits;
+	struct NoteView note;
+	const char *p = search;
+	const char *end = search + strlen(search);
+	char word[BM25_MAX_WORD];
+	char *buffer = NULL;
+	size_t size = 0;
+	size_t len;
+	int n = 0;
+	int count;
+	int fd;
+
+	char *path = get_memo_file_path(category);
+	if (path == NULL)
+		return -1;
+
+	/* a corrupt index is removed and built again, once */
+	for (int attempt = 0; attempt < 2; attempt++) {
+		if (bm25_open(category, path, &index) == -1) {
+			free(path);
+			return -1;
+		}
+
+		for (p = search, n = 0; n < BM25_MAX_TERMS &&
+		     (p = bm25_next_word(p, end, word, &len)) != NULL;) {
+			const struct Bm25Term *term = bm25_lookup(&index, word, len);
+			int seen = 0;
+
+			for (int i = 0; term && i < n; i++)
+				seen |= cursors[i].term == term;
+
+			if (term == NULL || seen)
+				continue;
+
+			if (!bm25_term_valid(&index, term)) {
+				index.corrupt = 1;
+				break;
+			}
+
+			memset(&cursors[n], 0, sizeof(cursors[n]));
+			cursors[n].term = term;
+			cursors[n].postings = index.postings + term->posting;
+			cursors[n].blocks = index.blocks + term->block;
+			cursors[n].notes = index.header->notes;
+			n++;
+		}
+
+		if (!index.corrupt)
+			break;
+
+		munmap(index.map, index.map_size);
+
+		char *stale = index_path(category, BM25_SUFFIX);
+
+		if (stale)
+			unlink(stale);
+		free(stale);
+	}
+
+	if (index.corrupt) {
+		fail("%s: index of %s is corrupt\n", __func__, category);
+		munmap(index.map, index.map_size);
+		free(path);
+		return -1;
+	}
+
+	/* no more hits than notes, whatever k asks for */
+	if ((uint32_t)k > index.header->notes)
+		k = index.header->notes;
+
+	TRACE_BEGIN("search_ranked");
+	if ((hits = (struct Bm25Hit *)malloc((k + 1) * sizeof(struct Bm25Hit))) == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		munmap(index.map, index.map_size);
+		free(path);
+		TRACE_END();
+		return -1;
+	}
+
+	PHASE_BEGIN(PHASE_FILTER);
+	count = bm25_top_k(&index, cursors, n, hits, k);
+	PHASE_END();
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 && count > 0) {
+		fail("%s: error opening file: %s\n", __func__, strerror(errno));
+		count = -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (note_pread(fd, index.docs[hits[i].doc].offset, &buffer,
+			&size, &note) == 1)
+			output_default(&note);
+		output_flush(&output);
+	}
+	TRACE_END();
+
+	if (fd != -1)
+		close(fd);
+	free(buffer);
+	free(hits);
+	munmap(index.map, index.map_size);
+	free(path);
+
+	return count;
+}
+
+
+/* Find the container of r with key, creating it when create is set.
+ * Containers are kept sorted by key.
+ */
+static struct RoaringContainer *roaring_container(struct Roaring *r,
+	uint16_t key, int create)
+{
+	uint32_t lo = 0, hi = r->count;
+
+	/* ids mostly come in ascending order */
+	if (r->count && r->containers[r->count - 1].key < key)
+		lo = r->count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (r->containers[mid].key == key)
+			return &r->containers[mid];
+		if (r->containers[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (r->count == r->size) {
+		uint32_t size = r->size ? r->size * 2 : 4;
+		struct RoaringContainer *grown = (struct RoaringContainer *)realloc(
+			r->containers, size * sizeof(struct RoaringContainer));
+
+		if (grown == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			return NULL;
+		}
+
+		r->containers = grown;
+		r->size = size;
+	}
+
+	memmove(&r->containers[lo + 1], &r->containers[lo],
+		(r->count - lo) * sizeof(struct RoaringContainer));
+	memset(&r->containers[lo], 0, sizeof(struct RoaringContainer));
+	r->containers[lo].key = key;
+	r->count++;
+
+	return &r->containers[lo];
+}
+
+
+/* Turn an array container that grew too big into a bitmap */
+static int roaring_to_bitmap(struct RoaringContainer *c)
+{
+	uint64_t *bits = (uint64_t *)calloc(ROARING_BITMAP_WORDS, sizeof(uint64_t));
+
+	if (bits == NULL) {
+		fail("%s: calloc failed\n", __func__);
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < c->cardinality; i++)
+		bits[c->array[i] >> 6] |= (uint64_t)1 << (c->array[i] & 63);
+
+	free(c->array);
+	c->array = NULL;
+	c->bits = bits;
+	c->capacity = 0;
+
+	return 0;
+}
+
+
+static int roaring_add(struct Roaring *r, uint32_t id)
+{
+	struct RoaringContainer *c = roaring_container(r, id >> 16, 1);
+	uint16_t low = id & 0xffff;
+
+	if (c == NULL)
+		return -1;
+
+	if (c->bits) {
+		uint64_t bit = (uint64_t)1 << (low & 63);
+
+		if (!(c->bits[low >> 6] & bit)) {
+			c->bits[low >> 6] |= bit;
+			c->cardinality++;
+		}
+		return 0;
+	}
+
+	/* sorted array, appending is the common case */
+	uint32_t pos = c->cardinality;
+
+	if (pos && c->array[pos - 1] >= low) {
+		uint32_t lo = 0, hi = c->cardinality;
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			if (c->array[mid] < low)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo < c->cardinality && c->array[lo] == low)
+			return 0;
+		pos = lo;
+	}
+
+	if (c->cardinality == ROARING_ARRAY_MAX) {
+		if (roaring_to_bitmap(c) == -1)
+			return -1;
+		return roaring_add(r, id);
+	}
+
+	if (c->cardinality == c->capacity) {
+		uint32_t size = c->capacity ? c->capacity * 2 : 4;
+		uint16_t *grown = (uint16_t *)realloc(c->array, size * sizeof(uint16_t));
+
+		if (grown == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			return -1;
+		}
+
+		c->array = grown;
+		c->capacity = size;
+	}
+
+	memmove(&c->array[pos + 1], &c->array[pos],
+		(c->cardinality - pos) * sizeof(uint16_t));
+	c->array[pos] = low;
+	c->cardinality++;
+
+	return 0;
+}
+
+
+static void roaring_free(struct Roaring *r)
+{
+	for (uint32_t i = 0; i < r->count; i++) {
+		free(r->containers[i].array);
+		free(r->containers[i].bits);
+	}
+
+	free(r->containers);
+	memset(r, 0, sizeof(*r));
+}
+
+
+static void roaring_expand(const struct RoaringContainer *c, uint64_t *bits)
+{
+	if (c->bits) {
+		memcpy(bits, c->bits, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+		return;
+	}
+
+	memset(bits, 0, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+	for (uint32_t i = 0; i < c->cardinality; i++)
+		bits[c->array[i] >> 6] |= (uint64_t)1 << (c->array[i] & 63);
+}
+
+
+/* Add the low halves in bits to the container of out with key, as an
+ * array when there are few and as a bitmap otherwise.
+ */
+static int roaring_add_bits(struct Roaring *out, uint16_t key,
+	const uint64_t *bits)
+{
+	uint32_t cardinality = 0;
+
+	for (int i = 0; i < ROARING_BITMAP_WORDS; i++)
+		cardinality += __builtin_popcountll(bits[i]);
+
+	if (cardinality == 0)
+		return 0;
+
+	struct RoaringContainer *c = roaring_container(out, key, 1);
+	if (c == NULL)
+		return -1;
+
+	c->cardinality = cardinality;
+
+	if (cardinality > ROARING_ARRAY_MAX) {
+		c->bits = (uint64_t *)malloc(ROARING_BITMAP_WORDS * sizeof(uint64_t));
+		if (c->bits == NULL)
+			return -1;
+		memcpy(c->bits, bits, ROARING_BITMAP_WORDS * sizeof(uint64_t));
+		return 0;
+	}
+
+	c->array = (uint16_t *)malloc(cardinality * sizeof(uint16_t));
+	if (c->array == NULL)
+		return -1;
+	c->capacity = cardinality;
+
+	uint32_t n = 0;
+	for (int i = 0; i < ROARING_BITMAP_WORDS; i++) {
+		for (uint64_t w = bits[i]; w; w &= w - 1)
+			c->array[n++] = i * 64 + __builtin_ctzll(w);
+	}
+
+	return 0;
+}
+
+
+/* out = a op b. Containers are combined pairwise by key through
+ * bitmaps, except two arrays which are merged directly.
+ */
+static int roaring_op(const struct Roaring *a, const struct Roaring *b,
+	RoaringOp_t op, struct Roaring *out)
+{
+	static const struct RoaringContainer empty;
+	uint64_t abits[ROARING_BITMAP_WORDS];
+	uint64_t bbits[ROARING_BITMAP_WORDS];
+	uint32_t i = 0, j = 0;
+
+	memset(out, 0, sizeof(*out));
+
+	while (i < a->count || j < b->count) {
+		const struct RoaringContainer *ca = &empty, *cb = &empty;
+		uint16_t key;
+
+		if (j == b->count || (i < a->count && a->containers[i].key < b->containers[j].key)) {
+			ca = &a->containers[i++];
+			key = ca->key;
+		} else if (i == a->count || b->containers[j].key < a->containers[i].key) {
+			cb = &b->containers[j++];
+			key = cb->key;
+		} else {
+			ca = &a->containers[i++];
+			cb = &b->containers[j++];
+			key = ca->key;
+		}
+
+		if ((op == ROARING_AND && (!ca->cardinality || !cb->cardinality)) ||
+		    (op == ROARING_ANDNOT && !ca->cardinality))
+			continue;
+
+		if (!ca->bits && !cb->bits && op == ROARING_AND) {
+			uint32_t x = 0, y = 0;
+
+			/* small intersections stay arrays */
+			memset(abits, 0, sizeof(abits));
+			while (x < ca->cardinality && y < cb->cardinality) {
+				if (ca->array[x] < cb->array[y])
+					x++;
+				else if (ca->array[x] > cb->array[y])
+					y++;
+				else {
+					abits[ca->array[x] >> 6] |= (uint64_t)1 << (ca->array[x] & 63);
+					x++;
+					y++;
+				}
+			}
+		} else {
+			roaring_expand(ca, abits);
+			roaring_expand(cb, bbits);
+
+			for (int w = 0; w < ROARING_BITMAP_WORDS; w++) {
+				switch (op) {
+				case ROARING_AND:
+					abits[w] &= bbits[w];
+					break;
+				case ROARING_OR:
+					abits[w] |= bbits[w];
+					break;
+				case ROARING_ANDNOT:
+					abits[w] &= ~bbits[w];
+					break;
+				}
+			}
+		}
+
+		if (roaring_add_bits(out, key, abits) == -1) {
+			roaring_free(out);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+static uint32_t roaring_cardinality(const struct Roaring *r)
+{
+	uint32_t cardinality = 0;
+
+	for (uint32_t i = 0; i < r->count; i++)
+		cardinality += r->containers[i].cardinality;
+
+	return cardinality;
+}
+
+
+/* Store the ids in r in ascending order in ids, which must hold
+ * roaring_cardinality(r) of them.
+ */
+static void roaring_ids(const struct Roaring *r, uint32_t *ids)
+{
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < r->count; i++) {
+		const struct RoaringContainer *c = &r->containers[i];
+		uint32_t high = (uint32_t)c->key << 16;
+
+		if (c->bits) {
+			for (int w = 0; w < ROARING_BITMAP_WORDS; w++) {
+				for (uint64_t bits = c->bits[w]; bits; bits &= bits - 1)
+					ids[n++] = high | (w * 64 + __builtin_ctzll(bits));
+			}
+		} else {
+			for (uint32_t j = 0; j < c->cardinality; j++)
+				ids[n++] = high | c->array[j];
+		}
+	}
+}
+
+
+static int roaring_contains(const struct Roaring *r, uint32_t id)
+{
+	struct RoaringContainer *c = roaring_container((struct Roaring *)r,
+		id >> 16, 0);
+	uint16_t low = id & 0xffff;
+
+	if (c == NULL)
+		return 0;
+
+	if (c->bits)
+		return (c->bits[low >> 6] >> (low & 63)) & 1;
+
+	uint32_t lo = 0, hi = c->cardinality;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (c->array[mid] == low)
+			return 1;
+		if (c->array[mid] < low)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return 0;
+}
+
+
+/* Serialize r: the number of containers, then per container its key,
+ * type and cardinality followed by the array or the bitmap.
+ */
+static void roaring_write(const struct Roaring *r, FILE *fp)
+{
+	fwrite(&r->count, sizeof(r->count), 1, fp);
+
+	for (uint32_t i = 0; i < r->count; i++) {
+		const struct RoaringContainer *c = &r->containers[i];
+		uint16_t type = c->bits ? ROARING_BITMAP : ROARING_ARRAY;
+
+		fwrite(&c->key, sizeof(c->key), 1, fp);
+		fwrite(&type, sizeof(type), 1, fp);
+		fwrite(&c->cardinality, sizeof(c->cardinality), 1, fp);
+
+		if (c->bits)
+			fwrite(c->bits, sizeof(uint64_t), ROARING_BITMAP_WORDS, fp);
+		else
+			fwrite(c->array, sizeof(uint16_t), c->cardinality, fp);
+	}
+}
+
+
+/* Read a bitmap written by roaring_write from p. Returns a pointer past
+ * it, or NULL when it's truncated or damaged.
+ */
+static const char *roaring_read(struct Roaring *r, const char *p,
+	const char *end)
+{
+	uint32_t count;
+
+	memset(r, 0, sizeof(*r));
+
+	if (end - p < (ptrdiff_t)sizeof(count))
+		return NULL;
+	memcpy(&count, p, sizeof(count));
+	p += sizeof(count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint16_t key, type;
+		uint32_t cardinality;
+		size_t len;
+
+		if (end - p < 8)
+			goto damaged;
+		memcpy(&key, p, 2);
+		memcpy(&type, p + 2, 2);
+		memcpy(&cardinality, p + 4, 4);
+		p += 8;
+
+		len = type == ROARING_BITMAP ?
+			ROARING_BITMAP_WORDS * sizeof(uint64_t) :
+			cardinality * sizeof(uint16_t);
+
+		if ((size_t)(end - p) < len || cardinality > 65536)
+			goto damaged;
+
+		struct RoaringContainer *c = roaring_container(r, key, 1);
+		if (c == NULL || c->cardinality)
+			goto damaged;
+
+		if (type == ROARING_BITMAP)
+			c->bits = (uint64_t *)malloc(len);
+		else
+			c->array = (uint16_t *)malloc(len ? len : 1);
+
+		if (c->bits == NULL && c->array == NULL)
+			goto damaged;
+
+		memcpy(c->bits ? (void *)c->bits : (void *)c->array, p, len);
+		c->cardinality = cardinality;
+		c->capacity = c->bits ? 0 : cardinality;
+		p += len;
+	}
+
+	return p;
+
+damaged:
+	roaring_free(r);
+	return NULL;
+}
+
+
+/* Find the next #tag in text, copied to tag without the # and folded to
+ * lower case. A # only starts a tag at the start of text or after a
+ * character that can't be part of one.
+ *
+ * Returns a pointer past the tag, or NULL when there are no more.
+ */
+static const char *next_tag(const char *text, const char *end, char *tag,
+	size_t *len)
+{
+	const char *start = text;
+
+	for (; text < end; text++) {
+		if (*text != '#' || text + 1 == end || !TAG_CHAR(text[1]))
+			continue;
+
+		if (text > start && TAG_CHAR(text[-1]))
+			continue;
+
+		*len = 0;
+		for (text++; text < end && TAG_CHAR(*text); text++) {
+			if (*len < TAG_MAX_LENGTH)
+				tag[(*len)++] = tolower((unsigned char)*text);
+		}
+
+		return text;
+	}
+
+	return NULL;
+}
+
+
+/* Bitmap of the notes with tag, created when create is set */
+static struct Roaring *tag_index_bitmap(struct TagIndex *idx, const char *tag,
+	size_t len, int create)
+{
+	uint32_t hash = bm25_hash(tag, len);
+	uint32_t slot;
+
+	if (create && idx->ntags * 2 >= idx->table_size) {
+		uint32_t size = idx->table_size ? idx->table_size * 2 : 64;
+		uint32_t *table = (uint32_t *)malloc(size * sizeof(uint32_t));
+
+		if (table == NULL) {
+			fail("%s: malloc failed\n", __func__);
+			return NULL;
+		}
+
+		memset(table, 0xff, size * sizeof(uint32_t));
+		for (uint32_t i = 0; i < idx->ntags; i++) {
+			slot = bm25_hash(idx->tags[i].name, idx->tags[i].length) & (size - 1);
+			while (table[slot] != BM25_NONE)
+				slot = (slot + 1) & (size - 1);
+			table[slot] = i;
+		}
+
+		free(idx->table);
+		idx->table = table;
+		idx->table_size = size;
+	}
+
+	if (idx->table_size == 0)
+		return NULL;
+
+	slot = hash & (idx->table_size - 1);
+	while (idx->table[slot] != BM25_NONE) {
+		struct TagEntry *entry = &idx->tags[idx->table[slot]];
+
+		if (entry->length == len && memcmp(entry->name, tag, len) == 0)
+			return &entry->ids;
+		slot = (slot + 1) & (idx->table_size - 1);
+	}
+
+	if (!create)
+		return NULL;
+
+	if (idx->ntags == idx->tags_size) {
+		uint32_t size = idx->tags_size ? idx->tags_size * 2 : 32;
+		struct TagEntry *tags = (struct TagEntry *)realloc(idx->tags,
+			size * sizeof(struct TagEntry));
+
+		if (tags == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			return NULL;
+		}
+
+		idx->tags = tags;
+		idx->tags_size = size;
+	}
+
+	struct TagEntry *entry = &idx->tags[idx->ntags];
+	memset(entry, 0, sizeof(*entry));
+	if ((entry->name = strndup(tag, len)) == NULL)
+		return NULL;
+	entry->length = len;
+	idx->table[slot] = idx->ntags++;
+
+	return &entry->ids;
+}
+
+
+/* Index note id, whose line starts at offset, with the tags in text */
+static int tag_index_add(struct TagIndex *idx, int id, off_t offset,
+	const char *text, size_t length)
+{
+	const char *p = text;
+	const char *end = text + length;
+	char tag[TAG_MAX_LENGTH];
+	size_t len;
+	int tagged = 0;
+
+	if (id < 0 || roaring_add(&idx->all, id) == -1)
+		return -1;
+
+	while (p && (p = next_tag(p, end, tag, &len)) != NULL) {
+		struct Roaring *ids = tag_index_bitmap(idx, tag, len, 1);
+
+		if (ids == NULL || roaring_add(ids, id) == -1)
+			return -1;
+		tagged = 1;
+	}
+
+	if (!tagged)
+		return 0;
+
+	if (idx->nnotes == idx->notes_size) {
+		uint32_t size = idx->notes_size ? idx->notes_size * 2 : 256;
+		struct TagNote *notes = (struct TagNote *)realloc(idx->notes,
+			size * sizeof(struct TagNote));
+
+		if (notes == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			return -1;
+		}
+
+		idx->notes = notes;
+		idx->notes_size = size;
+	}
+
+	idx->notes[idx->nnotes].id = id;
+	idx->notes[idx->nnotes].unused = 0;
+	idx->notes[idx->nnotes].offset = offset;
+	idx->nnotes++;
+
+	return 0;
+}
+
+
+static void tag_index_free(struct TagIndex *idx)
+{
+	for (uint32_t i = 0; i < idx->ntags; i++) {
+		free(idx->tags[i].name);
+		roaring_free(&idx->tags[i].ids);
+	}
+
+	roaring_free(&idx->all);
+	free(idx->tags);
+	free(idx->table);
+	free(idx->notes);
+	memset(idx, 0, sizeof(*idx));
+}
+
+
+/* Index all notes of the category file at path */
+static int tag_index_build(const char *path, struct TagIndex *idx)
+{
+	struct NoteReader reader;
+	struct NoteView note;
+	struct stat st;
+	int got;
+
+	memset(idx, 0, sizeof(*idx));
+
+	if (note_reader_open_path(&reader, path) == -1)
+		return -1;
+
+	TRACE_BEGIN("tag_index_build");
+	while ((got = read_file_note(&reader, &note)) > 0) {
+		if (tag_index_add(idx, note.id, note_offset(&reader, &note),
+		    note.message, note.length) == -1) {
+			got = -1;
+			break;
+		}
+	}
+	TRACE_END();
+
+	if (got == 0 && fstat(reader.fd, &st) == 0) {
+		idx->ino = st.st_ino;
+		idx->size = st.st_size;
+	} else
+		got = -1;
+
+	note_reader_close(&reader);
+
+	if (got == -1) {
+		tag_index_free(idx);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int tag_note_cmp(const void *a, const void *b)
+{
+	const struct TagNote *na = (const struct TagNote *)a;
+	const struct TagNote *nb = (const struct TagNote *)b;
+
+	return (na->id > nb->id) - (na->id < nb->id);
+}
+
+
+/* Write idx as the tag index of category and drop its log. The file
+ * is a TagHeader, the offsets of tagged notes sorted by id, the bitmap
+ * of all ids and per tag its name and bitmap.
+ */
+static int tag_index_write(char *category, struct TagIndex *idx)
+{
+	char *path = index_path(category, TAG_SUFFIX);
+	char *log = index_path(category, TAG_LOG_SUFFIX);
+	char *tmp = NULL;
+	struct TagHeader header;
+	FILE *fp = NULL;
+	int retval = 0;
+
+	if (path == NULL || log == NULL ||
+	    (fp = stamp_fopen_tmp(path, &tmp)) == NULL) {
+		fail("%s: could not write tag index of %s\n", __func__, category);
+		free(path);
+		free(log);
+		free(tmp);
+		return -1;
+	}
+
+	qsort(idx->notes, idx->nnotes, sizeof(struct TagNote), tag_note_cmp);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TAG_MAGIC, sizeof(header.magic));
+	header.ino = idx->ino;
+	header.size = idx->size;
+	header.tags = idx->ntags;
+	header.notes = idx->nnotes;
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(idx->notes, sizeof(struct TagNote), idx->nnotes, fp);
+	roaring_write(&idx->all, fp);
+
+	for (uint32_t i = 0; i < idx->ntags; i++) {
+		fwrite(&idx->tags[i].length, sizeof(idx->tags[i].length), 1, fp);
+		fwrite(idx->tags[i].name, 1, idx->tags[i].length, fp);
+		roaring_write(&idx->tags[i].ids, fp);
+	}
+
+	if (ferror(fp))
+		retval = -1;
+
+	if (fclose(fp) != 0 || retval == -1 || stamp_rename(tmp, path) == -1) {
+		fail("%s: could not write tag index of %s\n", __func__, category);
+		remove(tmp);
+		retval = -1;
+	} else if (unlink(log) == -1 && errno != ENOENT)
+		retval = -1;
+
+	free(path);
+	free(log);
+	free(tmp);
+
+	return retval;
+}
+
+
+/* Read the tag index of category and replay its log. Each line of the
+ * log is a note added since the index was written:
+ *
+ *   id<TAB>offset<TAB>size after adding<TAB>#tags
+ *
+ * The notes must have been appended right where the previous ones
+ * ended, and the last one where the category file at path ends now,
+ * else the index is stale.
+ *
+ * Returns the number of log lines replayed, or -1 when the index is
+ * missing, damaged or stale.
+ */
+static int tag_index_read(char *category, const char *path,
+	struct TagIndex *idx)
+{
+	char *index_file = index_path(category, TAG_SUFFIX);
+	char *log = index_path(category, TAG_LOG_SUFFIX);
+	struct TagHeader header;
+	struct stat st;
+	char *data = NULL;
+	const char *p, *end;
+	int lines = 0;
+	FILE *fp;
+
+	memset(idx, 0, sizeof(*idx));
+
+	if (index_file == NULL || log == NULL || stamp_stat(path, &st) == -1)
+		goto stale;
+
+	/* the index is read as a whole, it's small */
+	int fd = open(index_file, O_RDONLY);
+	struct stat ist;
+
+	if (fd == -1)
+		goto stale;
+
+	if (fstat(fd, &ist) == -1 || (size_t)ist.st_size < sizeof(header) ||
+	    (data = (char *)malloc(ist.st_size)) == NULL ||
+	    read(fd, data, ist.st_size) != ist.st_size) {
+		close(fd);
+		goto stale;
+	}
+
+	close(fd);
+	STAT_ADD(bytes_read, ist.st_size);
+
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, TAG_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.ino != (uint64_t)st.st_ino)
+		goto stale;
+
+	p = data + sizeof(header);
+	end = data + ist.st_size;
+
+	if ((size_t)(end - p) < header.notes * sizeof(struct TagNote))
+		goto stale;
+
+	idx->ino = header.ino;
+	idx->size = header.size;
+	idx->nnotes = idx->notes_size = header.notes;
+	idx->notes = (struct TagNote *)malloc((header.notes + 1) * sizeof(struct TagNote));
+	if (idx->notes == NULL)
+		goto stale;
+	memcpy(idx->notes, p, header.notes * sizeof(struct TagNote));
+	p += header.notes * sizeof(struct TagNote);
+
+	if ((p = roaring_read(&idx->all, p, end)) == NULL)
+		goto stale;
+
+	for (uint32_t i = 0; i < header.tags; i++) {
+		uint32_t len;
+		struct Roaring *ids;
+
+		if (end - p < (ptrdiff_t)sizeof(len))
+			goto stale;
+		memcpy(&len, p, sizeof(len));
+		p += sizeof(len);
+
+		if (len == 0 || len > TAG_MAX_LENGTH || (uint32_t)(end - p) < len ||
+		    (ids = tag_index_bitmap(idx, p, len, 1)) == NULL)
+			goto stale;
+		p += len;
+
+		if ((p = roaring_read(ids, p, end)) == NULL)
+			goto stale;
+	}
+
+	/* replay the notes added since */
+	if ((fp = stamp_fopen(log, "r")) != NULL) {
+		char *line = NULL;
+		size_t size = 0;
+		ssize_t got;
+
+		while ((got = getline(&line, &size, fp)) != -1) {
+			char *q = line;
+			int id = (int)strtol(q, &q, 10);
+			long long offset = strtoll(q, &q, 10);
+			long long after = strtoll(q, &q, 10);
+
+			if (*q == '\t')
+				q++;
+
+			if ((uint64_t)offset != idx->size ||
+			    tag_index_add(idx, id, offset, q, line + got - q) == -1) {
+				lines = -1;
+				break;
+			}
+
+			idx->size = after;
+			lines++;
+		}
+
+		free(line);
+		fclose(fp);
+	}
+
+	if (lines == -1 || idx->size != (uint64_t)st.st_size)
+		goto stale;
+
+	free(data);
+	free(index_file);
+	free(log);
+
+	return lines;
+
+stale:
+	tag_index_free(idx);
+	free(data);
+	free(index_file);
+	free(log);
+
+	return -1;
+}
+
+
+/* Read the tag index of category, (re)building it when it's missing or
+ * stale and writing it again when its log grew long.
+ */
+static int tag_index_load(char *category, const char *path,
+	struct TagIndex *idx)
+{
+	int lines = tag_index_read(category, path, idx);
+
+	if (lines == -1) {
+		if (tag_index_build(path, idx) == -1)
+			return -1;
+		lines = TAG_LOG_MAX;
+	}
+
+	/* best effort, the index in memory is fine either way */
+	if (lines >= TAG_LOG_MAX)
+		tag_index_write(category, idx);
+
+	return 0;
+}
+
+
+/* Record note id, added to category at offset, in the log of the tag
+ * index. Categories without tag index are left alone, it's built the
+ * first time it's used.
+ */
+static void tag_index_log(char *category, int id, off_t offset, off_t after,
+	const char *content)
+{
+	char *index_file = index_path(category, TAG_SUFFIX);
+	char *log = index_path(category, TAG_LOG_SUFFIX);
+	const char *p = content;
+	const char *end = content + strlen(content);
+	char tag[TAG_MAX_LENGTH];
+	size_t len;
+	FILE *fp;
+
+	if (index_file && log && file_exists(index_file) &&
+	    (fp = stamp_fopen(log, "a")) != NULL) {
+		fprintf(fp, "%d\t%lld\t%lld\t", id, (long long)offset,
+			(long long)after);
+
+		while (p && (p = next_tag(p, end, tag, &len)) != NULL)
+			fprintf(fp, "#%.*s ", (int)len, tag);
+
+		fputc('\n', fp);
+		fclose(fp);
+	}
+
+	free(index_file);
+	free(log);
+}
+
+
+/* Store tags, built while category was rewritten to path, as its new
+ * tag index. When building failed the old index is dropped instead,
+ * it would be rebuilt anyway as the file was replaced.
+ */
+static void tag_index_replace(char *category, const char *path,
+	struct TagIndex *tags, int built)
+{
+	struct stat st;
+
+	if (built && stamp_stat(path, &st) == 0) {
+		tags->ino = st.st_ino;
+		tags->size = st.st_size;
+		if (tag_index_write(category, tags) == 0)
+			return;
+	}
+
+	char *index_file = index_path(category, TAG_SUFFIX);
+	if (index_file)
+		unlink(index_file);
+	free(index_file);
+}
+
+
+/* Remove all indexes of category, when it's deleted */
+static void index_remove(char *category)
+{
+	static const char *suffixes[] = {
+		BM25_SUFFIX, TAG_SUFFIX, TAG_LOG_SUFFIX, SA_SUFFIX, CHECKPOINT_SUFFIX
+	};
+
+	for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		char *path = index_path(category, suffixes[i]);
+
+		if (path)
+			unlink(path);
+		free(path);
+	}
+}
+
+
+/* Answer a repeated command from the result cache in the .cache
+ * directory of the stamp path, enabled by setting STAMP_CACHE_SIZE to
+ * its maximum size. An entry is keyed by the command, its arguments and
+ * options and the inode, size and mtime of the category file, so
+ * changing the category makes its entries unreachable; they are evicted
+ * least recently used first.
+ *
+ * Returns the exit code the command had when it was cached, or -1 when
+ * it isn't. All output is then copied to the cache by output_flush(),
+ * to be stored by cache_store().
+ */
+static int cache_replay(char command, char *category, const char *query)
+{
+	char *conf = get_memo_conf_value("STAMP_CACHE_SIZE");
+	size_t max_size = conf ? parse_size(conf) : 0;
+	struct CacheHeader header;
+	struct stat st;
+	char name[17];
+	char *path;
+	int fd;
+
+	if (max_size == 0)
+		return -1;
+
+	if ((path = get_memo_file_path(category)) == NULL)
+		return -1;
+
+	if (stamp_stat(path, &st) == -1) {
+		free(path);
+		return -1;
+	}
+
+	const char *fmt = "%s\n%c\n%s\n%d %d %d %d %d %d %ld %ld\n%llu %llu %lld\n";
+	int len = snprintf(NULL, 0, fmt, path, command, query, ignore_case,
+		query_enabled, count_only, sort_key, sort_reverse, include_archive,
+		page.offset,
+		page.limit, (unsigned long long)st.st_ino,
+		(unsigned long long)st.st_size, (long long)st.st_mtime);
+
+	memset(&cache, 0, sizeof(cache));
+	cache.max_size = max_size;
+
+	if ((cache.key = (char *)malloc(len + 1)) == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		free(path);
+		return -1;
+	}
+
+	snprintf(cache.key, len + 1, fmt, path, command, query, ignore_case,
+		query_enabled, count_only, sort_key, sort_reverse, include_archive,
+		page.offset,
+		page.limit, (unsigned long long)st.st_ino,
+		(unsigned long long)st.st_size, (long long)st.st_mtime);
+	cache.key_length = len;
+	free(path);
+
+	uint64_t hash = 14695981039346656037ull;
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)cache.key[i]) * 1099511628211ull;
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+
+	if ((path = get_memo_file_path("")) == NULL ||
+	    (cache.dir = path_join(path, CACHE_DIR)) == NULL) {
+		free(path);
+		cache_free(&cache);
+		return -1;
+	}
+
+	free(path);
+
+	stamp_mkdir(cache.dir, S_IRUSR | S_IWUSR | S_IXUSR);
+
+	if ((cache.path = path_join(cache.dir, name)) == NULL) {
+		cache_free(&cache);
+		return -1;
+	}
+
+	if ((fd = open(cache.path, O_RDONLY)) != -1) {
+		char *data = NULL;
+		int retval = -1;
+
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header) &&
+		    (data = (char *)malloc(st.st_size)) != NULL &&
+		    read(fd, data, st.st_size) == st.st_size) {
+			memcpy(&header, data, sizeof(header));
+
+			if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+			    header.key_length == cache.key_length &&
+			    sizeof(header) + header.key_length + header.output_length ==
+			    (uint64_t)st.st_size &&
+			    memcmp(data + sizeof(header), cache.key, cache.key_length) == 0) {
+				STAT_ADD(bytes_read, st.st_size);
+				output_span(&output, data + sizeof(header) + header.key_length,
+					header.output_length);
+				output_flush(&output);
+
+				/* the mtime orders entries for eviction */
+				futimens(fd, NULL);
+				retval = header.ret;
+			}
+		}
+
+		free(data);
+		close(fd);
+
+		if (retval != -1) {
+			cache_free(&cache);
+			return retval;
+		}
+	}
+
+	cache.active = 1;
+	output.tee = &cache;
+
+	return -1;
+}
+
+
+/* Append the output about to be written to the entry being cached */
+static void cache_capture(struct Cache *ca, const struct iovec *iov, int iovcnt)
+{
+	for (int i = 0; i < iovcnt && !ca->failed; i++) {
+		size_t len = iov[i].iov_len;
+
+		/* output that would not fit in the cache isn't kept */
+		if (ca->length + len > ca->max_size) {
+			ca->failed = 1;
+			break;
+		}
+
+		if (ca->length + len > ca->size) {
+			size_t size = (ca->length + len) * 2;
+			char *grown = (char *)realloc(ca->data, size);
+
+			if (grown == NULL) {
+				ca->failed = 1;
+				break;
+			}
+
+			ca->data = grown;
+			ca->size = size;
+		}
+
+		memcpy(ca->data + ca->length, iov[i].iov_base, len);
+		ca->length += len;
+	}
+}
+
+
+/* Store the output captured since cache_replay() with exit code ret,
+ * then evict entries until the cache fits in its size again.
+ */
+static void cache_store(struct Cache *ca, int ret)
+{
+	struct CacheHeader header;
+	char *dot = NULL;
+	char *tmp = NULL;
+	FILE *fp;
+
+	output.tee = NULL;
+
+	/* eviction skips the tmp file, as its name starts with a dot */
+	if (ca->failed || output.broken ||
+	    sizeof(header) + ca->key_length + ca->length > ca->max_size ||
+	    (dot = path_join(ca->dir, ".tmp")) == NULL) {
+		cache_free(ca);
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.key_length = ca->key_length;
+	header.ret = ret;
+	header.output_length = ca->length;
+
+	if ((fp = stamp_fopen_tmp(dot, &tmp)) != NULL) {
+		fwrite(&header, sizeof(header), 1, fp);
+		fwrite(ca->key, 1, ca->key_length, fp);
+		fwrite(ca->data, 1, ca->length, fp);
+
+		if (ferror(fp) | fclose(fp) || stamp_rename(tmp, ca->path) == -1)
+			remove(tmp);
+		else
+			cache_evict(ca->dir, ca->max_size);
+	}
+
+	free(dot);
+	free(tmp);
+	cache_free(ca);
+}
+
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+	const struct CacheEntry *ea = (const struct CacheEntry *)a;
+	const struct CacheEntry *eb = (const struct CacheEntry *)b;
+
+	return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+
+/* Remove the least recently used entries of the cache in dir until
+ * their sizes add up to at most max_size.
+ */
+static void cache_evict(const char *dir, size_t max_size)
+{
+	struct CacheEntry *entries = NULL;
+	size_t count = 0, size = 0;
+	uint64_t total = 0;
+	struct dirent *ent;
+	DIR *dp;
+
+	if ((dp = opendir(dir)) == NULL)
+		return;
+
+	while ((ent = readdir(dp)) != NULL) {
+		struct stat st;
+		char *path;
+
+		if (ent->d_name[0] == '.' || (path = path_join(dir, ent->d_name)) == NULL)
+			continue;
+
+		if (stamp_stat(path, &st) == -1) {
+			free(path);
+			continue;
+		}
+
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			struct CacheEntry *grown = (struct CacheEntry *)realloc(entries,
+				size * sizeof(struct CacheEntry));
+
+			if (grown == NULL) {
+				free(path);
+				break;
+			}
+
+			entries = grown;
+		}
+
+		entries[count].path = path;
+		entries[count].mtime = st.st_mtime;
+		entries[count].size = st.st_size;
+		total += st.st_size;
+		count++;
+	}
+
+	closedir(dp);
+
+	if (total > max_size) {
+		qsort(entries, count, sizeof(struct CacheEntry), cache_entry_cmp);
+
+		for (size_t i = 0; i < count && total > max_size; i++) {
+			if (unlink(entries[i].path) == 0)
+				total -= entries[i].size;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+		free(entries[i].path);
+	free(entries);
+}
+
+
+static void cache_free(struct Cache *ca)
+{
+	free(ca->key);
+	free(ca->dir);
+	free(ca->path);
+	free(ca->data);
+	memset(ca, 0, sizeof(*ca));
+}
+
+
+/* Show the notes of category whose tags match expr, such as
+ * 'work AND (urgent OR #today)'. The expression is evaluated on the
+ * bitmaps of the tag index, the category file is only read to output
+ * the notes found.
+ *
+ * Returns the count of found notes or -1 if function fails.
+ */
+static int search_tags(char *category, const char *expr)
+{
+	struct Query q;
+	struct TagIndex idx;
+	struct Roaring *stack = NULL;
+	struct Roaring result;
+	struct NoteView note;
+	char *buffer = NULL;
+	size_t size = 0;
+	uint32_t *ids = NULL;
+	int depth = 0;
+	int count = -1;
+	int fd = -1;
+
+	char *path = get_memo_file_path(category);
+	if (path == NULL)
+		return -1;
+
+	if (query_parse(&q, expr) == -1) {
+		query_free(&q);
+		free(path);
+		return -1;
+	}
+
+	/* tags are matched without # and in lower case */
+	for (int i = 0; i < q.nterms; i++) {
+		char *term = q.terms[i];
+
+		if (term[0] == '#') {
+			memmove(term, term + 1, q.term_lengths[i]);
+			q.term_lengths[i]--;
+		}
+
+		for (char *c = term; *c; c++)
+			*c = tolower((unsigned char)*c);
+	}
+
+	PHASE_BEGIN(PHASE_FILTER);
+	if (tag_index_load(category, path, &idx) == -1) {
+		PHASE_END();
+		query_free(&q);
+		free(path);
+		return -1;
+	}
+
+	TRACE_BEGIN("search_tags");
+	stack = (struct Roaring *)calloc(q.length + 1, sizeof(struct Roaring));
+
+	for (int i = 0; stack && i < q.length; i++) {
+		struct QueryOp *op = &q.program[i];
+		struct Roaring tmp;
+		int ok = 0;
+
+		switch (op->op) {
+		case QUERY_TERM: {
+			struct Roaring *tagged = tag_index_bitmap(&idx,
+				q.terms[op->term], q.term_lengths[op->term], 0);
+			static const struct Roaring none;
+
+			/* copy by or'ing with nothing */
+			ok = roaring_op(tagged ? tagged : &none, &none, ROARING_OR,
+				&stack[depth]) == 0;
+			depth++;
+			break;
+		}
+		case QUERY_NOT:
+			ok = roaring_op(&idx.all, &stack[depth - 1], ROARING_ANDNOT, &tmp) == 0;
+			roaring_free(&stack[depth - 1]);
+			stack[depth - 1] = tmp;
+			break;
+		case QUERY_AND:
+		case QUERY_OR:
+			ok = roaring_op(&stack[depth - 2], &stack[depth - 1],
+				op->op == QUERY_AND ? ROARING_AND : ROARING_OR, &tmp) == 0;
+			roaring_free(&stack[depth - 2]);
+			roaring_free(&stack[depth - 1]);
+			stack[depth - 2] = tmp;
+			depth--;
+			break;
+		}
+
+		if (!ok) {
+			depth = -1;
+			break;
+		}
+	}
+	PHASE_END();
+
+	if (stack && depth == 1) {
+		result = stack[0];
+		count = roaring_cardinality(&result);
+		ids = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+		if (ids)
+			roaring_ids(&result, ids);
+		else
+			count = -1;
+	}
+
+	if (count > 0 && (fd = open(path, O_RDONLY)) == -1) {
+		fail("%s: error opening file: %s\n", __func__, strerror(errno));
+		count = -1;
+	}
+
+	/* Notes found by tag have their offset in the index. Only
+	 * NOT finds others, then the file is read from the first of
+	 * those on. So is it when many notes were found, reading it
+	 * through is faster than seeking then.
+	 */
+	uint32_t n = 0;
+	uint32_t at = 0;
+	int seek = count > 0 &&
+		(uint32_t)count <= roaring_cardinality(&idx.all) / TAG_SEEK_FRACTION;
+
+	for (; seek && n < (uint32_t)count && !output_broken(&output); n++) {
+		while (at < idx.nnotes && (uint32_t)idx.notes[at].id < ids[n])
+			at++;
+
+		if (at == idx.nnotes || (uint32_t)idx.notes[at].id != ids[n])
+			break;
+
+		if (note_pread(fd, idx.notes[at].offset, &buffer, &size, &note) == 1)
+			output_default(&note);
+		output_flush(&output);
+	}
+
+	if (count > 0 && n < (uint32_t)count && !output_broken(&output)) {
+		struct NoteReader reader;
+
+		if (note_reader_open_path(&reader, path) == 0) {
+			while (!output_broken(&output) &&
+			       read_file_note(&reader, &note) > 0) {
+				if ((uint32_t)note.id >= ids[n] &&
+				    roaring_contains(&result, note.id))
+					output_default(&note);
+			}
+			output_flush(&output);
+			note_reader_close(&reader);
+		}
+	}
+	TRACE_END();
+
+	if (fd != -1)
+		close(fd);
+	for (int i = 0; stack && i < q.length + 1; i++)
+		roaring_free(&stack[i]);
+	free(stack);
+	free(ids);
+	free(buffer);
+	tag_index_free(&idx);
+	query_free(&q);
+	free(path);
+
+	return count;
+}
+
+
+static void sais_buckets(const void *text, int32_t *bkt, int32_t n,
+	int32_t k, int cs, int end)
+{
+	int32_t sum = 0;
+
+	memset(bkt, 0, k * sizeof(int32_t));
+
+	for (int32_t i = 0; i < n; i++)
+		bkt[SAIS_CHR(i)]++;
+
+	for (int32_t i = 0; i < k; i++) {
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum - bkt[i];
+	}
+}
+
+
+/* Sort the L type suffixes from the sorted LMS ones, then the S type
+ * suffixes from those.
+ */
+static void sais_induce(const void *text, int32_t *sa, const unsigned char *t,
+	int32_t *bkt, int32_t n, int32_t k, int cs)
+{
+	sais_buckets(text, bkt, n, k, cs, 0);
+	for (int32_t i = 0; i < n; i++) {
+		int32_t j = sa[i] - 1;
+
+		if (sa[i] > 0 && !t[j])
+			sa[bkt[SAIS_CHR(j)]++] = j;
+	}
+
+	sais_buckets(text, bkt, n, k, cs, 1);
+	for (int32_t i = n - 1; i >= 0; i--) {
+		int32_t j = sa[i] - 1;
+
+		if (sa[i] > 0 && t[j])
+			sa[--bkt[SAIS_CHR(j)]] = j;
+	}
+}
+
+
+/* Build the suffix array of text of n characters from an alphabet of k
+ * by induced sorting (SA-IS), in linear time. Characters are bytes when
+ * cs is 1 and int32_t otherwise, the last one must be a unique 0.
+ *
+ * Returns 0 on success and -1 when out of memory.
+ */
+static int sais(const void *text, int32_t *sa, int32_t n, int32_t k, int cs)
+{
+	unsigned char *t;
+	int32_t *bkt;
+	int32_t n1 = 0;
+	int32_t name = 0;
+	int32_t prev = -1;
+	int32_t i, j;
+
+	if (n == 1) {
+		sa[0] = 0;
+		return 0;
+	}
+
+	t = (unsigned char *)malloc(n);
+	bkt = (int32_t *)malloc(k * sizeof(int32_t));
+
+	if (t == NULL || bkt == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		free(t);
+		free(bkt);
+		return -1;
+	}
+
+	/* S type (1) or L type (0) of every suffix */
+	t[n - 1] = 1;
+	t[n - 2] = 0;
+	for (i = n - 3; i >= 0; i--)
+		t[i] = SAIS_CHR(i) < SAIS_CHR(i + 1) ||
+			(SAIS_CHR(i) == SAIS_CHR(i + 1) && t[i + 1]);
+
+	/* sort the LMS substrings */
+	sais_buckets(text, bkt, n, k, cs, 1);
+	for (i = 0; i < n; i++)
+		sa[i] = -1;
+	for (i = 1; i < n; i++) {
+		if (SAIS_LMS(i))
+			sa[--bkt[SAIS_CHR(i)]] = i;
+	}
+	sais_induce(text, sa, t, bkt, n, k, cs);
+
+	/* name them, equal substrings get equal names */
+	for (i = 0; i < n; i++) {
+		if (SAIS_LMS(sa[i]))
+			sa[n1++] = sa[i];
+	}
+
+	for (i = n1; i < n; i++)
+		sa[i] = -1;
+
+	for (i = 0; i < n1; i++) {
+		int32_t pos = sa[i];
+		int diff = 0;
+
+		for (int32_t d = 0; d < n; d++) {
+			if (prev == -1 || SAIS_CHR(pos + d) != SAIS_CHR(prev + d) ||
+			    t[pos + d] != t[prev + d]) {
+				diff = 1;
+				break;
+			}
+			if (d > 0 && (SAIS_LMS(pos + d) || SAIS_LMS(prev + d)))
+				break;
+		}
+
+		if (diff) {
+			name++;
+			prev = pos;
+		}
+
+		sa[n1 + pos / 2] = name - 1;
+	}
+
+	for (i = n - 1, j = n - 1; i >= n1; i--) {
+		if (sa[i] >= 0)
+			sa[j--] = sa[i];
+	}
+
+	/* sort the LMS suffixes, recursing when names aren't unique */
+	int32_t *s1 = sa + n - n1;
+
+	if (name < n1) {
+		if (sais(s1, sa, n1, name, sizeof(int32_t)) == -1) {
+			free(t);
+			free(bkt);
+			return -1;
+		}
+	} else {
+		for (i = 0; i < n1; i++)
+			sa[s1[i]] = i;
+	}
+
+	/* and induce the order of all suffixes from them */
+	sais_buckets(text, bkt, n, k, cs, 1);
+	for (i = 1, j = 0; i < n; i++) {
+		if (SAIS_LMS(i))
+			s1[j++] = i;
+	}
+	for (i = 0; i < n1; i++)
+		sa[i] = s1[sa[i]];
+	for (i = n1; i < n; i++)
+		sa[i] = -1;
+	for (i = n1 - 1; i >= 0; i--) {
+		j = sa[i];
+		sa[i] = -1;
+		sa[--bkt[SAIS_CHR(j)]] = j;
+	}
+	sais_induce(text, sa, t, bkt, n, k, cs);
+
+	free(t);
+	free(bkt);
+
+	return 0;
+}
+
+
+/* Build the substring index of category: the messages of all notes,
+ * each followed by a newline, and their suffix array. The file is
+ *
+ *   header            inode, size and mtime of the category file
+ *   notes[notes]      line offset, id and start in the text per note
+ *   text[length]      ending in a 0, padded to 4 bytes
+ *   sa[length]
+ *
+ * Returns the number of notes indexed or -1 on failure.
+ */
+static int sa_build(char *category)
+{
+	struct SaHeader header;
+	struct SaNote *notes = NULL;
+	struct NoteReader reader;
+	struct NoteView note;
+	struct stat st;
+	char *text = NULL;
+	int32_t *sa = NULL;
+	size_t length = 0, size = 0;
+	uint32_t count = 0, notes_size = 0;
+	int retval = -1;
+	int got;
+
+	char *path = get_memo_file_path(category);
+	char *index = index_path(category, SA_SUFFIX);
+	char *tmp = NULL;
+
+	if (path == NULL || index == NULL ||
+	    note_reader_open_path(&reader, path) == -1)
+		goto out;
+
+	TRACE_BEGIN("sa_build");
+	while ((got = read_file_note(&reader, &note)) > 0) {
+		if (length + note.length + 2 > size || count == notes_size) {
+			size_t grown_size = (length + note.length + 2) * 2;
+			char *grown = (char *)realloc(text, grown_size);
+			struct SaNote *grown_notes = (struct SaNote *)realloc(notes,
+				(notes_size * 2 + 1024) * sizeof(struct SaNote));
+
+			if (grown)
+				text = grown;
+			if (grown_notes)
+				notes = grown_notes;
+
+			if (grown == NULL || grown_notes == NULL) {
+				fail("%s: realloc failed\n", __func__);
+				got = -1;
+				break;
+			}
+
+			size = grown_size;
+			notes_size = notes_size * 2 + 1024;
+		}
+
+		if (length + note.length + 2 > SA_MAX_LENGTH) {
+			fail("%s: category %s is too big to index\n", __func__, category);
+			got = -1;
+			break;
+		}
+
+		notes[count].offset = note_offset(&reader, &note);
+		notes[count].start = length;
+		notes[count].id = note.id;
+		count++;
+
+		memcpy(text + length, note.message, note.length);
+		length += note.length;
+		text[length++] = '\n';
+	}
+
+	if (got == 0 && fstat(reader.fd, &st) == -1)
+		got = -1;
+	note_reader_close(&reader);
+
+	if (got == -1) {
+		TRACE_END();
+		goto out;
+	}
+
+	if (text == NULL && (text = (char *)malloc(1)) == NULL) {
+		TRACE_END();
+		goto out;
+	}
+	text[length++] = '\0';
+
+	if ((sa = (int32_t *)malloc(length * sizeof(int32_t))) == NULL ||
+	    sais(text, sa, length, 256, 1) == -1) {
+		fail("%s: could not sort suffixes\n", __func__);
+		TRACE_END();
+		goto out;
+	}
+	TRACE_END();
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SA_MAGIC, sizeof(header.magic));
+	header.ino = st.st_ino;
+	header.size = st.st_size;
+	header.length = length;
+	header.notes = count;
+
+	FILE *fp = stamp_fopen_tmp(index, &tmp);
 	if (fp == NULL) {
+		fail("%s: could not write index of %s\n", __func__, category);
+		goto out;
+	}
+
+	static const char padding[4];
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(notes, sizeof(struct SaNote), count, fp);
+	fwrite(text, 1, length, fp);
+	fwrite(padding, 1, SA_PADDING(length), fp);
+	fwrite(sa, sizeof(int32_t), length, fp);
+
+	if (ferror(fp) | fclose(fp) || stamp_rename(tmp, index) == -1) {
+		fail("%s: could not write index of %s\n", __func__, category);
+		remove(tmp);
+		goto out;
+	}
+
+	retval = count;
+
+out:
+	free(text);
+	free(sa);
+	free(notes);
+	free(path);
+	free(index);
+	free(tmp);
+
+	return retval;
+}
+
+
+/* Drop the substring index of category when its file is rewritten.
+ * It can't be used anymore then, -f scans the notes until -I builds it
+ * again. Appends and -R keep it.
+ */
+static void sa_invalidate(char *category)
+{
+	char *path = index_path(category, SA_SUFFIX);
+
+	if (path)
+		unlink(path);
+	free(path);
+}
+
+
+/* Map the substring index of category. It can be used as long as the
+ * category file is the one it was built from and wasn't truncated;
+ * notes appended since are outside of the index.
+ *
+ * Returns 0 on success and -1 when there's no usable index.
+ */
+static int sa_open(char *category, const char *path, struct SaIndex *idx)
+{
+	char *index = index_path(category, SA_SUFFIX);
+	struct stat st, ist;
+	int fd;
+
+	memset(idx, 0, sizeof(*idx));
+
+	if (index == NULL || (fd = open(index, O_RDONLY)) == -1) {
+		free(index);
+		return -1;
+	}
+
+	free(index);
+
+	if (fstat(fd, &ist) == -1 || (size_t)ist.st_size < sizeof(struct SaHeader) ||
+	    stamp_stat(path, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	idx->map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	idx->map_size = ist.st_size;
+	close(fd);
+
+	if (idx->map == MAP_FAILED) {
+		idx->map = NULL;
+		return -1;
+	}
+
+	idx->header = (const struct SaHeader *)idx->map;
+
+	const struct SaHeader *h = idx->header;
+	size_t expected = sizeof(*h) + h->notes * sizeof(struct SaNote) +
+		h->length + SA_PADDING(h->length) + h->length * sizeof(int32_t);
+
+	if (memcmp(h->magic, SA_MAGIC, sizeof(h->magic)) != 0 ||
+	    expected != (size_t)ist.st_size) {
+		sa_close(idx);
+		return -1;
+	}
+
+	if (h->ino != (uint64_t)st.st_ino || h->size > (uint64_t)st.st_size) {
+		fail("%s: substring index of %s is stale, rebuild it with "
+			"stamp -I %s\n", __func__, category, category);
+		sa_close(idx);
+		return -1;
+	}
+
+	idx->notes = (const struct SaNote *)(h + 1);
+	idx->text = (const char *)(idx->notes + h->notes);
+	idx->sa = (const int32_t *)(idx->text + h->length + SA_PADDING(h->length));
+
+	return 0;
+}
+
+
+static void sa_close(struct SaIndex *idx)
+{
+	if (idx->map)
+		munmap(idx->map, idx->map_size);
+
+	memset(idx, 0, sizeof(*idx));
+}
+
+
+/* Compare the suffix at pos with pattern, as far as pattern goes */
+static int sa_compare(const struct SaIndex *idx, int32_t pos,
+	const char *pattern, size_t len)
+{
+	const unsigned char *suffix = (const unsigned char *)idx->text + pos;
+	size_t avail = idx->header->length - pos;
+
+	for (size_t i = 0; i < len; i++) {
+		if (i == avail)
+			return -1;
+		if (suffix[i] != (unsigned char)pattern[i])
+			return suffix[i] < (unsigned char)pattern[i] ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+/* Range [lo, hi) of suffixes starting with pattern, by two binary
+ * searches over the suffix array in O(m log n).
+ */
+static void sa_range(const struct SaIndex *idx, const char *pattern,
+	size_t len, uint32_t *lo, uint32_t *hi)
+{
+	uint32_t l = 0, h = idx->header->length;
+
+	while (l < h) {
+		uint32_t mid = l + (h - l) / 2;
+
+		if (sa_compare(idx, idx->sa[mid], pattern, len) < 0)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+
+	*lo = l;
+	h = idx->header->length;
+
+	while (l < h) {
+		uint32_t mid = l + (h - l) / 2;
+
+		if (sa_compare(idx, idx->sa[mid], pattern, len) <= 0)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+
+	*hi = l;
+}
+
+
+/* Index of the note whose message holds text position pos */
+static uint32_t sa_note(const struct SaIndex *idx, uint32_t pos)
+{
+	uint32_t lo = 0, hi = idx->header->notes;
+
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (idx->notes[mid].start <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+static int sa_note_cmp(const void *a, const void *b)
+{
+	uint32_t na = *(const uint32_t *)a;
+	uint32_t nb = *(const uint32_t *)b;
+
+	return (na > nb) - (na < nb);
+}
+
+
+/* Answer -f from the substring index of category, when it has one.
+ * Notes appended after the index was built are searched by reading
+ * them. With --count only the number of matches is output, straight
+ * from the size of the suffix range.
+ *
+ * Returns the count of found notes, or matches with --count, and sets
+ * *handled. When there's no usable index, *handled is left 0.
+ */
+static int sa_search(char *category, const char *search, int *handled)
+{
+	struct SaIndex idx;
+	struct NoteReader reader;
+	struct NoteView note;
+	size_t len = strlen(search);
+	uint32_t *found = NULL;
+	uint32_t lo, hi, nfound = 0;
+	int count = 0;
+
+	/* messages never hold newlines, the index separates them so */
+	if (len == 0 || strchr(search, '\n'))
+		return 0;
+
+	char *path = get_memo_file_path(category);
+	if (path == NULL || sa_open(category, path, &idx) == -1) {
+		free(path);
+		return 0;
+	}
+
+	*handled = 1;
+
+	TRACE_BEGIN("sa_search");
+	PHASE_BEGIN(PHASE_FILTER);
+	sa_range(&idx, search, len, &lo, &hi);
+	PHASE_END();
+
+	if (count_only)
+		count = hi - lo;
+	else if (hi > lo) {
+		/* notes in file order, each once */
+		found = (uint32_t *)malloc((hi - lo) * sizeof(uint32_t));
+		if (found == NULL) {
+			fail("%s: malloc failed\n", __func__);
+			count = -1;
+			goto out;
+		}
+
+		for (uint32_t i = lo; i < hi; i++)
+			found[i - lo] = sa_note(&idx, idx.sa[i]);
+
+		qsort(found, hi - lo, sizeof(uint32_t), sa_note_cmp);
+
+		for (uint32_t i = 0; i < hi - lo; i++) {
+			if (nfound == 0 || found[nfound - 1] != found[i])
+				found[nfound++] = found[i];
+		}
+	}
+
+	if (note_reader_open_path(&reader, path) == -1) {
+		count = -1;
+		goto out;
+	}
+
+	/* Few notes are fetched one by one, the file is read through
+	 * for many. Either way, reading continues past the indexed part.
+	 */
+	if (nfound <= idx.header->notes / SA_SEEK_FRACTION) {
+		char *buffer = NULL;
+		size_t size = 0;
+
+		for (uint32_t i = 0; i < nfound && !output_broken(&output); i++) {
+			if (note_pread(reader.fd, idx.notes[found[i]].offset,
+			    &buffer, &size, &note) == 1) {
+				output_default(&note);
+				count++;
+			}
+			output_flush(&output);
+		}
+
+		free(buffer);
+
+		if (lseek(reader.fd, idx.header->size, SEEK_SET) != -1)
+			reader.offset = idx.header->size;
+	} else {
+		uint32_t ordinal = 0;
+		uint32_t next = 0;
+
+		while (!output_broken(&output) && next < nfound &&
+		       read_file_note(&reader, &note) > 0) {
+			if (ordinal++ == found[next]) {
+				output_default(&note);
+				count++;
+				next++;
+			}
+		}
+
+		if (lseek(reader.fd, idx.header->size, SEEK_SET) != -1) {
+			reader.offset = idx.header->size;
+			reader.length = reader.pos = 0;
+			reader.eof = 0;
+		}
+	}
+
+	while (!output_broken(&output) && read_file_note(&reader, &note) > 0) {
+		if (note.message == NULL)
+			continue;
+
+		if (count_only)
+			count += count_occurrences(note.message, search);
+		else if (strstr(note.message, search)) {
+			output_default(&note);
+			count++;
+		}
+	}
+
+	note_reader_close(&reader);
+
+	if (count_only) {
+		output_int(&output, count);
+		output_char(&output, '\n');
+	}
+
+out:
+	TRACE_END();
+	output_flush(&output);
+	free(found);
+	sa_close(&idx);
+	free(path);
+
+	return count;
+}
+
+
+/* Search using regular expressions (POSIX Basic Regular Expression syntax)
+ * Returns the count of found notes or -1 if functions fails.
+ */
+static int search_regexp(char *category, const char *regexp)
+{
+	int count = 0;
+	int notes = 0;
+	regex_t regex;
+	int ret;
+	char buffer[100];
+	struct NoteReader reader;
+	struct NoteView note;
+
+	ret = regcomp(&regex, regexp, REG_ICASE);
+
+	if (ret != 0) {
+		fail("%s: invalid regexp\n", __func__);
+		return -1;
+	}
+
+	if (note_reader_open_archived(&reader, category) == -1) {
+		regfree(&regex);
+		return -1;
+	}
+
+	TRACE_BEGIN("search_regexp");
+	while (!output_broken(&output) && read_file_note(&reader, &note) > 0) {
+		notes++;
+
+		if (note.message == NULL)
+			continue;
+
+		PHASE_BEGIN(PHASE_FILTER);
+		ret = regexec(&regex, note.message, 0, NULL, 0);
+		PHASE_END();
+
+		if (ret == 0) {
+			output_default(&note);
+			count++;
+		} else if (ret != 0 && ret != REG_NOMATCH) {
+			/* Something went wrong while executing
+			   regexp. Clean up and exit loop. */
+			regerror(ret, &regex, buffer, sizeof(buffer));
+			fail("%s: %s\n", __func__, buffer);
+			break;
+		}
+	}
+	TRACE_END();
+
+	regfree(&regex);
+	output_flush(&output);
+	note_reader_close(&reader);
+
+	/* Ignore empty note file */
+	if (notes == 0)
+		return -1;
+
+	return count;
+}
+
+
+/* Prepare pattern for fuzzy_distance: a bitmask per byte value of the
+ * positions it occurs at in pattern. Letters match either case.
+ *
+ * Returns 0 on success and -1 when pattern is empty or longer than
+ * FUZZY_MAX_LENGTH.
+ */
+static int fuzzy_compile(const char *pattern, struct FuzzyPattern *fp)
+{
+	size_t len = strlen(pattern);
+
+	if (len == 0 || len > FUZZY_MAX_LENGTH)
+		return -1;
+
+	memset(fp->peq, 0, sizeof(fp->peq));
+	fp->length = (int)len;
+	fp->high = (uint64_t)1 << (len - 1);
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)pattern[i];
+
+		fp->peq[c] |= (uint64_t)1 << i;
+		fp->peq[tolower(c)] |= (uint64_t)1 << i;
+		fp->peq[toupper(c)] |= (uint64_t)1 << i;
+	}
+
+	return 0;
+}
+
+
+/* Smallest edit distance between the pattern and any substring of
+ * text, using Myers' bit-parallel algorithm: the whole column of the
+ * dynamic programming matrix is kept as vertical deltas in two words,
+ * so each byte of text costs a handful of word operations.
+ */
+static int fuzzy_distance(const struct FuzzyPattern *fp, const char *text,
+	size_t len)
+{
+	uint64_t pv = ~(uint64_t)0;
+	uint64_t mv = 0;
+	int score = fp->length;
+	int best = fp->length;
+	size_t i = 0;
+
+	while (i < len && best > 0) {
+		/* Bytes that don't occur in the pattern leave the
+		 * initial column as it is, skip them in a tight loop
+		 */
+		if (pv == ~(uint64_t)0 && mv == 0) {
+			while (i < len && fp->peq[(unsigned char)text[i]] == 0)
+				i++;
+
+			if (i == len)
+				break;
+		}
+
+		/* after length bytes not in the pattern, the column is
+		 * back at its initial state
+		 */
+		size_t miss = 0;
+
+		for (; i < len && miss < (size_t)fp->length; i++) {
+			uint64_t eq = fp->peq[(unsigned char)text[i]];
+			uint64_t xv = eq | mv;
+			uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+			uint64_t ph = mv | ~(xh | pv);
+			uint64_t mh = pv & xh;
+
+			score += (int)((ph & fp->high) != 0) - (int)((mh & fp->high) != 0);
+
+			/* a match may start anywhere in text, so the top
+			 * row stays zero and nothing is shifted in
+			 */
+			ph <<= 1;
+			mh <<= 1;
+			pv = mh | ~(xv | ph);
+			mv = ph & xv;
+
+			if (score < best && (best = score) == 0)
+				return 0;
+
+			miss = eq ? 0 : miss + 1;
+		}
+
+		if (miss == (size_t)fp->length) {
+			pv = ~(uint64_t)0;
+			mv = 0;
+			score = fp->length;
+		}
+	}
+
+	return best;
+}
+
+
+/* Find notes containing term with at most k typos (insertions,
+ * deletions or substitutions), ignoring case. Notes are output ranked
+ * by edit distance and in file order within the same distance. Exact
+ * matches are output right away, the others are kept in the arena until
+ * all notes are read.
+ *
+ * Returns the count of found notes or -1 if function fails.
+ */
+static int fuzzy_search(char *category, const char *term, int k)
+{
+	int count = 0;
+	int notes = 0;
+	struct FuzzyPattern fp;
+	struct FuzzyBucket *buckets;
+	struct NoteReader reader;
+	struct NoteView note;
+	struct Arena arena = { NULL };
+
+	if (fuzzy_compile(term, &fp) == -1) {
+		fail("%s: search term must be 1 to %d bytes\n", __func__,
+			FUZZY_MAX_LENGTH);
+		return -1;
+	}
+
+	/* as many typos as bytes would match any note */
+	if (k >= fp.length)
+		k = fp.length - 1;
+
+	buckets = (struct FuzzyBucket *)calloc(k + 1, sizeof(*buckets));
+	if (buckets == NULL) {
+		fail("%s: calloc failed\n", __func__);
+		return -1;
+	}
+
+	if (note_reader_open_archived(&reader, category) == -1) {
+		free(buckets);
+		return -1;
+	}
+
+	TRACE_BEGIN("fuzzy_search");
+	while (!output_broken(&output) && read_file_note(&reader, &note) > 0) {
+		notes++;
+
+		if (note.message == NULL)
+			continue;
+
+		PHASE_BEGIN(PHASE_FILTER);
+		int distance = fuzzy_distance(&fp, note.message, note.length);
+		PHASE_END();
+
+		if (distance > k)
+			continue;
+
+		count++;
+
+		if (distance == 0) {
+			output_default(&note);
+			continue;
+		}
+
+		struct TreeNote *tn = (struct TreeNote *)arena_alloc(&arena, sizeof(*tn));
+		if (tn == NULL || (tn->note = note_view_copy(&arena, &note)) == NULL) {
+			count = -1;
+			break;
+		}
+
+		tn->next = NULL;
+		if (buckets[distance].tail)
+			buckets[distance].tail->next = tn;
+		else
+			buckets[distance].head = tn;
+		buckets[distance].tail = tn;
+	}
+	TRACE_END();
+
+	note_reader_close(&reader);
+
+	for (int d = 1; count > 0 && d <= k; d++) {
+		for (struct TreeNote *tn = buckets[d].head; tn; tn = tn->next)
+			output_default(tn->note);
+	}
+
+	/* the notes are output straight from the arena */
+	output_flush(&output);
+	arena_free(&arena);
+	free(buckets);
+
+	/* Ignore empty note file */
+	if (notes == 0)
+		return -1;
+
+	return count;
+}
+
+
+/* This functions handles the output of one line.
+ * Postponed notes are ignored.
+ */
+static void output_default(const struct NoteView *note)
+{
+	if (sorter.active) {
+		sorter_add(&sorter, note);
+		return;
+	}
+
+	if (!page_take())
+		return;
+
+	PHASE_BEGIN(PHASE_OUTPUT);
+	output_int(&output, note->id);
+	output_char(&output, '\t');
+	output_date(&output, note);
+	output_char(&output, '\t');
+	output_span(&output, note->message, note->length);
+	output_char(&output, '\n');
+	PHASE_END();
+}
+
+
+/* Parse a size in bytes with an optional k, m or g suffix.
+ * Returns 0 when str isn't one.
+ */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	unsigned long long v = strtoull(str, &end, 10);
+
+	switch (tolower((unsigned char)*end)) {
+		case 'g':
+			v <<= 10;
+			/* fall through */
+		case 'm':
+			v <<= 10;
+			/* fall through */
+		case 'k':
+			v <<= 10;
+			end++;
+			break;
+	}
+
+	if (end == str || *end != '\0')
+		return 0;
+
+	return (size_t)v;
+}
+
+
+/* Start collecting what output_default is given for --sort. Notes are
+ * copied into one block of at most STAMP_SORT_MEMORY bytes: lines from
+ * the front, their records from the back. A full block is sorted and
+ * spilled to a temporary file as a run.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int sorter_begin(struct Sorter *so)
+{
+	char *conf = get_memo_conf_value("STAMP_SORT_MEMORY");
+	size_t memory = SORT_MEMORY;
+
+	if (conf != NULL && (memory = parse_size(conf)) < SORT_MIN_MEMORY) {
+		fail("%s: invalid STAMP_SORT_MEMORY: %s\n", __func__, conf);
+		return -1;
+	}
+
+	memset(so, 0, sizeof(*so));
+	so->memory = memory & ~(size_t)(sizeof(struct SortRecord) - 1);
+
+	if ((so->block = (char *)malloc(so->memory)) == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	so->active = 1;
+
+	return 0;
+}
+
+
+static int sort_record_cmp(const void *a, const void *b)
+{
+	const struct SortRecord *ra = (const struct SortRecord *)a;
+	const struct SortRecord *rb = (const struct SortRecord *)b;
+	int diff = (ra->key > rb->key) - (ra->key < rb->key);
+
+	/* equal keys stay in the order they came in */
+	if (diff == 0)
+		diff = (ra->seq > rb->seq) - (ra->seq < rb->seq);
+
+	return sort_reverse ? -diff : diff;
+}
+
+
+/* Sort the notes in the block and write them to a new run */
+static int sorter_spill(struct Sorter *so)
+{
+	struct SortRecord *records = (struct SortRecord *)(so->block + so->memory) -
+		so->count;
+	FILE *fp;
+
+	if (so->nruns == so->runs_size) {
+		int size = so->runs_size ? so->runs_size * 2 : 16;
+		FILE **grown = (FILE **)realloc(so->runs, size * sizeof(FILE *));
+
+		if (grown == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			return -1;
+		}
+
+		so->runs = grown;
+		so->runs_size = size;
+	}
+
+	if ((fp = tmpfile()) == NULL) {
+		fail("%s: could not create a temporary file: %s\n", __func__,
+			strerror(errno));
+		return -1;
+	}
+
+	so->runs[so->nruns++] = fp;
+
+	TRACE_BEGIN("sorter_spill");
+	qsort(records, so->count, sizeof(struct SortRecord), sort_record_cmp);
+
+	for (size_t i = 0; i < so->count; i++) {
+		fwrite(&records[i], sizeof(struct SortRecord), 1, fp);
+		fwrite(so->block + records[i].offset, 1, records[i].length, fp);
+	}
+	TRACE_END();
+
+	so->count = 0;
+	so->used = 0;
+
+	if (fflush(fp) != 0 || ferror(fp) || fseek(fp, 0, SEEK_SET) == -1) {
+		fail("%s: could not write a sort run: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void sorter_add(struct Sorter *so, const struct NoteView *note)
+{
+	struct SortRecord record;
+	size_t need = note->line_length + sizeof(struct SortRecord);
+
+	if (so->failed)
+		return;
+
+	if (need > so->memory) {
+		fail("%s: STAMP_SORT_MEMORY is too small for note %d\n", __func__,
+			note->id);
+		so->failed = 1;
+		return;
+	}
+
+	if (so->used + (so->count * sizeof(struct SortRecord)) + need > so->memory &&
+	    sorter_spill(so) == -1) {
+		so->failed = 1;
+		return;
+	}
+
+	switch (sort_key) {
+		case SORT_DATE:
+			record.key = note->date;
+			break;
+		case SORT_LENGTH:
+			record.key = note->length;
+			break;
+		default:
+			record.key = note->id;
+			break;
+	}
+
+	record.seq = so->seq++;
+	record.offset = so->used;
+	record.length = note->line_length;
+
+	memcpy(so->block + so->used, note->line, note->line_length);
+	so->used += note->line_length;
+	so->count++;
+	((struct SortRecord *)(so->block + so->memory))[-(ptrdiff_t)so->count] = record;
+}
+
+
+/* Read the next note of run into its cursor, 0 at the end of it */
+static int sort_run_next(struct SortRun *run)
+{
+	if (fread(&run->record, sizeof(struct SortRecord), 1, run->fp) != 1)
+		return 0;
+
+	if (run->record.length > run->size) {
+		char *grown = (char *)realloc(run->line, run->record.length);
+
+		if (grown == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			return -1;
+		}
+
+		run->line = grown;
+		run->size = run->record.length;
+	}
+
+	if (fread(run->line, 1, run->record.length, run->fp) != run->record.length) {
+		fail("%s: sort run is truncated\n", __func__);
+		return -1;
+	}
+
+	return 1;
+}
+
+
+static int sort_run_less(const struct SortRun *a, const struct SortRun *b)
+{
+	return sort_record_cmp(&a->record, &b->record) < 0;
+}
+
+
+static void sort_output(const char *line, size_t len)
+{
+	struct NoteView note;
+
+	if (parse_note(line, len, &note) == 0)
+		output_default(&note);
+}
+
+
+/* Output the collected notes in order: straight from the block when
+ * they all fit, otherwise by a k-way merge of the runs using a heap.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int sorter_end(struct Sorter *so)
+{
+	struct SortRun *runs = NULL;
+	int *heap = NULL;
+	int nheap = 0;
+	int retval = so->failed ? -1 : 0;
+
+	so->active = 0;
+
+	if (retval == -1)
+		goto out;
+
+	if (so->nruns == 0) {
+		struct SortRecord *records = (struct SortRecord *)(so->block +
+			so->memory) - so->count;
+
+		qsort(records, so->count, sizeof(struct SortRecord), sort_record_cmp);
+
+		for (size_t i = 0; i < so->count && !output_broken(&output); i++)
+			sort_output(so->block + records[i].offset, records[i].length);
+
+		goto out;
+	}
+
+	if (so->count > 0 && sorter_spill(so) == -1) {
+		retval = -1;
+		goto out;
+	}
+
+	/* the block isn't needed anymore while merging */
+	free(so->block);
+	so->block = NULL;
+
+	runs = (struct SortRun *)calloc(so->nruns, sizeof(struct SortRun));
+	heap = (int *)malloc(so->nruns * sizeof(int));
+	if (runs == NULL || heap == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		retval = -1;
+		goto out;
+	}
+
+	TRACE_BEGIN("sorter_merge");
+	for (int i = 0; i < so->nruns && retval == 0; i++) {
+		int got;
+
+		runs[i].fp = so->runs[i];
+		if ((got = sort_run_next(&runs[i])) == -1)
+			retval = -1;
+		else if (got == 1) {
+			int j = nheap++;
+
+			while (j > 0 && sort_run_less(&runs[i], &runs[heap[(j - 1) / 2]])) {
+				heap[j] = heap[(j - 1) / 2];
+				j = (j - 1) / 2;
+			}
+			heap[j] = i;
+		}
+	}
+
+	while (retval == 0 && nheap > 0 && !output_broken(&output)) {
+		struct SortRun *top = &runs[heap[0]];
+		int run = heap[0];
+		int got;
+
+		sort_output(top->line, top->record.length);
+
+		if ((got = sort_run_next(top)) == -1) {
+			retval = -1;
+			break;
+		}
+
+		/* an exhausted run is replaced by the last one */
+		if (got == 0)
+			run = heap[--nheap];
+
+		int i = 0;
+		for (;;) {
+			int child = 2 * i + 1;
+
+			if (child >= nheap)
+				break;
+			if (child + 1 < nheap &&
+			    sort_run_less(&runs[heap[child + 1]], &runs[heap[child]]))
+				child++;
+			if (!sort_run_less(&runs[heap[child]], &runs[run]))
+				break;
+			heap[i] = heap[child];
+			i = child;
+		}
+		if (nheap > 0)
+			heap[i] = run;
+	}
+	TRACE_END();
+
+out:
+	output_flush(&output);
+
+	if (runs != NULL) {
+		for (int i = 0; i < so->nruns; i++)
+			free(runs[i].line);
+	}
+
+	for (int i = 0; i < so->nruns; i++)
+		fclose(so->runs[i]);
+
+	free(runs);
+	free(heap);
+	free(so->runs);
+	free(so->block);
+	memset(so, 0, sizeof(*so));
+
+	return retval;
+}
+
+
+/* Pick the export format by name, or by the extension of path when
+ * name is NULL. Returns 0 when name is not a known format.
+ */
+static ExportFormat_t export_format(const char *name, const char *path)
+{
+	if (name == NULL) {
+		const char *ext = strrchr(path, '.');
+
+		if (ext && (strcmp(ext, ".json") == 0 || strcmp(ext, ".jsonl") == 0))
+			return EXPORT_JSON;
+		if (ext && strcmp(ext, ".csv") == 0)
+			return EXPORT_CSV;
+
+		return EXPORT_HTML;
+	}
+
+	if (strcmp(name, "html") == 0)
+		return EXPORT_HTML;
+	if (strcmp(name, "json") == 0)
+		return EXPORT_JSON;
+	if (strcmp(name, "csv") == 0)
+		return EXPORT_CSV;
+
+	return 0;
+}
+
+
+static void export_header(struct Output *out, char *category,
+	ExportFormat_t format)
+{
+	switch (format) {
+	case EXPORT_HTML:
+		output_str(out, "<!DOCTYPE html>\n<html>\n<head>\n"
+			"<meta charset=\"UTF-8\">\n<title>Stamp notes: ");
+		output_escaped(out, category, strlen(category), format);
+		output_str(out, "</title>\n<style>td{font-family: monospace; "
+			"white-space: pre;}</style>\n</head>\n<body>\n"
+			"<h1>Notes from Stamp, ");
+		output_escaped(out, category, strlen(category), format);
+		output_str(out, "</h1>\n<table>\n");
+		break;
+	case EXPORT_CSV:
+		output_str(out, "id,date,message\n");
+		break;
+	case EXPORT_JSON:
+		break;
+	}
+}
+
+
+static void export_note(struct Output *out, const struct NoteView *note,
+	ExportFormat_t format)
+{
+	size_t length;
+
+	switch (format) {
+	case EXPORT_HTML:
+		output_str(out, "<tr><td>");
+		output_int(out, note->id);
+		output_str(out, "</td><td>");
+		output_date(out, note);
+		output_str(out, "</td><td>");
+		output_escaped(out, note->message, note->length, format);
+		output_str(out, "</td></tr>\n");
+		break;
+	case EXPORT_JSON:
+		output_str(out, "{\"id\":");
+		output_int(out, note->id);
+		note_date_text(note, &length);
+		if (length == 0)
+			output_str(out, ",\"date\":null");
+		else {
+			output_str(out, ",\"date\":\"");
+			output_escaped(out, note_date_text(note, &length), length,
+				format);
+			output_char(out, '"');
+		}
+		output_str(out, ",\"message\":\"");
+		output_escaped(out, note->message, note->length, format);
+		output_str(out, "\"}\n");
+		break;
+	case EXPORT_CSV:
+		output_int(out, note->id);
+		output_char(out, ',');
+		output_date(out, note);
+		output_str(out, ",\"");
+		output_escaped(out, note->message, note->length, format);
+		output_str(out, "\"\n");
+		break;
+	}
+}
+
+
+static void export_footer(struct Output *out, ExportFormat_t format)
+{
+	if (format == EXPORT_HTML)
+		output_str(out, "</table>\n</body>\n</html>\n");
+}
+
+
+/* Path of the watermark file of category, which lives in a hidden
+ * directory of the stamp path so it isn't listed as a category.
+ * Returns a newly allocated string or NULL on failure.
+ */
+static char *watermark_path(char *category)
+{
+	char *stamp_path = get_memo_file_path("");
+	char *dir;
+	char *path;
+
+	if (stamp_path == NULL)
+		return NULL;
+
+	dir = path_join(stamp_path, WATERMARK_DIR);
+	free(stamp_path);
+	if (dir == NULL)
+		return NULL;
+
+	stamp_mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+	path = path_join(dir, category);
+	free(dir);
+
+	return path;
+}
+
+
+/* Look up the watermark of the export of category to target, the
+ * resolved path of the exported file. The watermark file has a line
+ * per export target:
+ *
+ *   format<TAB>last id<TAB>offset<TAB>inode<TAB>out inode<TAB>out offset<TAB>target
+ *
+ * where offset is the number of bytes of the category file that were
+ * exported and out offset where the footer of the exported file starts.
+ *
+ * Returns 0 when found and -1 otherwise.
+ */
+static int watermark_read(char *category, const char *target,
+	struct Watermark *mark)
+{
+	char *path = watermark_path(category);
+	char *line = NULL;
+	size_t size = 0;
+	int retval = -1;
+	FILE *fp;
+
+	if (path == NULL)
+		return -1;
+
+	fp = stamp_fopen(path, "r");
+	free(path);
+
+	if (fp == NULL)
+		return -1;
+
+	while (retval == -1 && getline(&line, &size, fp) != -1) {
+		char *p = line;
+
+		mark->format = (ExportFormat_t)strtol(p, &p, 10);
+		mark->last_id = (int)strtol(p, &p, 10);
+		mark->offset = (off_t)strtoll(p, &p, 10);
+		mark->ino = (ino_t)strtoull(p, &p, 10);
+		mark->out_ino = (ino_t)strtoull(p, &p, 10);
+		mark->out_offset = (off_t)strtoll(p, &p, 10);
+
+		if (*p++ != '\t')
+			continue;
+
+		p[strcspn(p, "\n")] = '\0';
+
+		if (strcmp(p, target) == 0)
+			retval = 0;
+	}
+
+	free(line);
+	fclose(fp);
+
+	return retval;
+}
+
+
+/* Store the watermark of the export of category to target, replacing
+ * its previous watermark and keeping those of other targets.
+ */
+static int watermark_write(char *category, const char *target,
+	const struct Watermark *mark)
+{
+	char *path = watermark_path(category);
+	char *tmp_path;
+	char *line = NULL;
+	size_t size = 0;
+	FILE *in, *out;
+	int retval = 0;
+
+	if (path == NULL)
+		return -1;
+
+	if ((out = stamp_fopen_tmp(path, &tmp_path)) == NULL) {
+		fail("%s: failed to open a tmp file for %s\n", __func__, path);
+		free(path);
+		return -1;
+	}
+
+	/* copy the watermarks of other targets */
+	if ((in = stamp_fopen(path, "r")) != NULL) {
+		ssize_t got;
+
+		while ((got = getline(&line, &size, in)) != -1) {
+			char *target_field = strrchr(line, '\t');
+
+			if (target_field == NULL)
+				continue;
+
+			target_field++;
+			if (strncmp(target_field, target, strlen(target)) == 0 &&
+			    target_field[strlen(target)] == '\n')
+				continue;
+
+			fwrite(line, 1, got, out);
+		}
+
+		free(line);
+		fclose(in);
+	}
+
+	fprintf(out, "%d\t%d\t%lld\t%llu\t%llu\t%lld\t%s\n", (int)mark->format,
+		mark->last_id, (long long)mark->offset,
+		(unsigned long long)mark->ino, (unsigned long long)mark->out_ino,
+		(long long)mark->out_offset, target);
+
+	if (fclose(out) != 0 || stamp_rename(tmp_path, path) == -1) {
+		fail("%s: failed to write %s\n", __func__, path);
+		remove(tmp_path);
+		retval = -1;
+	}
+
+	free(tmp_path);
+	free(path);
+
+	return retval;
+}
+
+
+/* Drop all export watermarks of category. Called whenever notes are
+ * deleted or replaced, since exported files no longer match the
+ * category then and the next export needs to be a full one.
+ */
+static void watermark_invalidate(char *category)
+{
+	char *path = watermark_path(category);
+
+	if (path == NULL)
+		return;
+
+	if (unlink(path) == -1 && errno != ENOENT)
+		fail("%s: could not remove %s: %s\n", __func__, path,
+			strerror(errno));
+
+	free(path);
+}
+
+
+/* Check if the export of category to target can be continued from its
+ * watermark: the category file must be the same file, not shorter than
+ * what was exported, and the exported file must be the one that was
+ * written last time. When it can, the reader is moved past the
+ * exported notes.
+ *
+ * Returns 1 when the export can be resumed and 0 otherwise.
+ */
+static int watermark_resume(char *category, const char *target,
+	ExportFormat_t format, struct NoteReader *reader, struct Watermark *mark)
+{
+	struct stat st;
+
+	if (watermark_read(category, target, mark) == -1 || mark->format != format)
+		return 0;
+
+	if (fstat(reader->fd, &st) == -1 || st.st_ino != mark->ino ||
+	    st.st_size < mark->offset)
+		return 0;
+
+	if (stamp_stat(target, &st) == -1 || st.st_ino != mark->out_ino ||
+	    st.st_size < mark->out_offset)
+		return 0;
+
+	if (lseek(reader->fd, mark->offset, SEEK_SET) == -1)
+		return 0;
+
+	reader->offset = mark->offset;
+
+	return 1;
+}
+
+
+/* Export the notes of category to a file at path as HTML, JSON lines
+ * or CSV. Notes are streamed from the reader's buffer into the file's
+ * output buffer, escaped on the way, so memory use doesn't depend on
+ * the size of the category.
+ *
+ * Every export leaves a watermark behind. With --incremental, notes
+ * added since then are appended to the exported file, replacing its
+ * footer, instead of writing it all over again. It falls back to a
+ * full export when the watermark is missing or no longer matches.
+ *
+ * Return the path of the exported file, or NULL on failure.
+ */
+static const char *export_notes(char *category, const char *path,
+	ExportFormat_t format)
+{
+	int fd;
+	int got;
+	int resume = 0;
+	char *target = NULL;
+	struct Output out;
+	struct NoteReader reader;
+	struct NoteView note;
+	struct Watermark mark;
+	struct stat st;
+
+	memset(&mark, 0, sizeof(mark));
+
+	if (note_reader_open(&reader, category) == -1)
+		return NULL;
+
+	if (export_incremental && (target = realpath(path, NULL)) != NULL)
+		resume = watermark_resume(category, target, format, &reader, &mark);
+
+	got = read_file_note(&reader, &note);
+
+	/* notes before the watermark changed, start over */
+	if (resume && got > 0 && note.id <= mark.last_id) {
+		resume = 0;
+		if (note_reader_rewind(&reader) == 0)
+			got = read_file_note(&reader, &note);
+	}
+
+	if (got <= 0) {
+		note_reader_close(&reader);
+		free(target);
+
+		if (resume) {
+			printf("Nothing new to export.\n");
+			return path;
+		}
+
+		printf("Nothing to export.\n");
+		return NULL;
+	}
+
+	fd = open(path, resume ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1 && resume && (ftruncate(fd, mark.out_offset) == -1 ||
+	    lseek(fd, 0, SEEK_END) == -1)) {
+		close(fd);
+		fd = -1;
+	}
+
+	if (fd == -1 || output_open(&out, fd) == -1) {
+		fail("%s: failed to open %s\n", __func__, path);
+		if (fd != -1)
+			close(fd);
+		note_reader_close(&reader);
+		free(target);
+		return NULL;
+	}
+
+	STAT_ADD(files_opened, 1);
+	reader.sink = &out;
+
+	TRACE_BEGIN("export_notes");
+	if (!resume)
+		export_header(&out, category, format);
+
+	do {
+		export_note(&out, &note, format);
+		mark.last_id = note.id;
+	} while (!output_broken(&out) && (got = read_file_note(&reader, &note)) > 0);
+
+	/* the watermark sits right before the footer */
+	output_flush(&out);
+	mark.format = format;
+	mark.offset = lseek(reader.fd, 0, SEEK_CUR);
+	mark.out_offset = lseek(out.fd, 0, SEEK_CUR);
+	if (fstat(reader.fd, &st) == 0)
+		mark.ino = st.st_ino;
+	if (fstat(out.fd, &st) == 0)
+		mark.out_ino = st.st_ino;
+
+	export_footer(&out, format);
+	TRACE_END();
+
+	if (output_close(&out) == -1 || got == -1) {
+		fail("%s: failed writing %s\n", __func__, path);
+		path = NULL;
+	} else {
+		if (target == NULL)
+			target = realpath(path, NULL);
+
+		if (target && mark.offset != -1 && mark.out_offset != -1)
+			watermark_write(category, target, &mark);
+	}
+
+	note_reader_close(&reader);
+	free(target);
+
+	return path;
+}
+
+
+/* Join dir and name into a newly allocated path, NULL on failure */
+static char *path_join(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *path = (char *)malloc(len);
+
+	if (path == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return NULL;
+	}
+
+	snprintf(path, len, "%s/%s", dir, name);
+
+	return path;
+}
+
+
+/* Percent-encode every byte of name but letters, digits, '-' and '_',
+ * for category directories of a site. Without dots they can't be
+ * index.html or the manifest, and encoding them once more gives their
+ * href. Returns a newly allocated string or NULL on failure.
+ */
+static char *site_encode(const char *name)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char *encoded = (char *)malloc(strlen(name) * 3 + 1);
+	char *p = encoded;
+
+	if (encoded == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return NULL;
+	}
+
+	for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+		if (isalnum(*c) || *c == '-' || *c == '_')
+			*p++ = *c;
+		else {
+			*p++ = '%';
+			*p++ = hex[*c >> 4];
+			*p++ = hex[*c & 15];
+		}
+	}
+
+	*p = '\0';
+
+	return encoded;
+}
+
+
+/* Path of page number page of category, the first page is
+ * <dir>/<category>/index.html, the others <dir>/<category>/<n>.html,
+ * with the category directory as site_encode makes it.
+ * Returns a newly allocated string or NULL on failure.
+ */
+static char *site_page_path(struct SiteExport *site, struct SiteCategory *cat,
+	int page)
+{
+	size_t len = strlen(site->dir) + strlen(cat->dir) + 32;
+	char *path = (char *)malloc(len);
+
+	if (path == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return NULL;
+	}
+
+	if (page == 1)
+		snprintf(path, len, "%s/%s/index.html", site->dir, cat->dir);
+	else
+		snprintf(path, len, "%s/%s/%d.html", site->dir, cat->dir, page);
+
+	return path;
+}
+
+
+/* Open page number page of category for writing */
+static int site_page_open(struct SiteExport *site, struct SiteCategory *cat,
+	struct Output *out, int page)
+{
+	char *path = site_page_path(site, cat, page);
+	int fd;
+
+	if (path == NULL)
+		return -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fail("%s: failed to open %s: %s\n", __func__, path, strerror(errno));
+		free(path);
+		return -1;
+	}
+
+	free(path);
+	STAT_ADD(files_opened, 1);
+
+	if (output_open(out, fd) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	export_header(out, cat->name, EXPORT_HTML);
+
+	return 0;
+}
+
+
+static void output_page_link(struct Output *out, int page, const char *label)
+{
+	output_str(out, "<a href=\"");
+	if (page == 1)
+		output_str(out, "index");
+	else
+		output_int(out, page);
+	output_str(out, ".html\">");
+	output_str(out, label);
+	output_str(out, "</a>\n");
+}
+
+
+/* Finish page with links to its neighbours and the index */
+static int site_page_close(struct Output *out, int page, int has_next)
+{
+	output_str(out, "</table>\n<p>\n<a href=\"../index.html\">all categories</a>\n");
+
+	if (page > 1)
+		output_page_link(out, page - 1, "previous");
+
+	if (has_next)
+		output_page_link(out, page + 1, "next");
+
+	output_str(out, "</p>\n</body>\n</html>\n");
+
+	return output_close(out);
+}
+
+
+/* Render all pages of one category. Runs on a worker thread. */
+static int site_export_category(struct SiteExport *site,
+	struct SiteCategory *cat)
+{
+	struct NoteReader reader;
+	struct NoteView note;
+	struct Output out;
+	int retval = 0;
+	int open = 0;
+	char *dir;
+
+	TRACE_BEGIN("site_export_category");
+
+	if ((dir = path_join(site->dir, cat->dir)) == NULL) {
+		TRACE_END();
+		return -1;
+	}
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		fail("%s: could not create %s: %s\n", __func__, dir, strerror(errno));
+		free(dir);
+		TRACE_END();
+		return -1;
+	}
+
+	free(dir);
+
+	if (note_reader_open_path(&reader, cat->path) == -1) {
+		TRACE_END();
+		return -1;
+	}
+
+	cat->notes = 0;
+	cat->pages = 1;
+
+	while (read_file_note(&reader, &note) > 0) {
+		if (open && cat->notes % site->page_size == 0) {
+			if (site_page_close(&out, cat->pages, 1) == -1)
+				retval = -1;
+			open = 0;
+			cat->pages++;
+		}
+
+		if (!open) {
+			if (site_page_open(site, cat, &out, cat->pages) == -1) {
+				retval = -1;
+				break;
+			}
+			reader.sink = &out;
+			open = 1;
+		}
+
+		export_note(&out, &note, EXPORT_HTML);
+		cat->notes++;
+	}
+
+	/* empty categories still get their (empty) page */
+	if (retval == 0 && !open && site_page_open(site, cat, &out, 1) == 0)
+		open = 1;
+
+	if (open && site_page_close(&out, cat->pages, 0) == -1)
+		retval = -1;
+
+	note_reader_close(&reader);
+
+	/* drop pages left over from a bigger previous export */
+	for (int page = cat->pages + 1; page <= cat->prev_pages; page++) {
+		char *path = site_page_path(site, cat, page);
+
+		if (path)
+			unlink(path);
+		free(path);
+	}
+
+	TRACE_END();
+
+	return retval;
+}
+
+
+static void *site_worker(void *arg)
+{
+	struct SiteExport *site = (struct SiteExport *)arg;
+
+	for (;;) {
+		int i = __sync_fetch_and_add(&site->next, 1);
+
+		if (i >= site->count)
+			break;
+
+		struct SiteCategory *cat = &site->categories[i];
+
+		if (!cat->skip && site_export_category(site, cat) == -1)
+			cat->failed = 1;
+	}
+
+	return NULL;
+}
+
+
+static int site_category_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct SiteCategory *)a)->name,
+		((const struct SiteCategory *)b)->name);
+}
+
+
+/* The manifest in the export directory remembers size, mtime, the
+ * page size and the note and page count of every category, one per
+ * line:
+ *
+ *   inode<TAB>size<TAB>mtime<TAB>page size<TAB>notes<TAB>pages<TAB>category
+ *
+ * Categories whose file has the same inode, size and mtime and that
+ * were paged the same are not rendered again. Rewrites replace the
+ * file, so the inode catches changes within the mtime resolution.
+ */
+static void site_read_manifest(struct SiteExport *site)
+{
+	char *path = path_join(site->dir, SITE_MANIFEST);
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	if (path == NULL)
+		return;
+
+	fp = stamp_fopen(path, "r");
+	free(path);
+
+	if (fp == NULL)
+		return;
+
+	while ((len = getline(&line, &size, fp)) != -1) {
+		char *p = line;
+		long long ino = strtoll(p, &p, 10);
+		long long fsize = strtoll(p, &p, 10);
+		long long mtime = strtoll(p, &p, 10);
+		int page_size = (int)strtol(p, &p, 10);
+		int notes = (int)strtol(p, &p, 10);
+		int pages = (int)strtol(p, &p, 10);
+
+		if (*p++ != '\t')
+			continue;
+
+		p[strcspn(p, "\n")] = '\0';
+
+		for (int i = 0; i < site->count; i++) {
+			struct SiteCategory *cat = &site->categories[i];
+
+			if (strcmp(cat->name, p) != 0)
+				continue;
+
+			cat->prev_pages = pages;
+			if ((long long)cat->ino == ino && cat->size == fsize &&
+			    (long long)cat->mtime == mtime &&
+			    page_size == site->page_size) {
+				cat->skip = 1;
+				cat->notes = notes;
+				cat->pages = pages;
+			}
+			break;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+
+static int site_write_index(struct SiteExport *site)
+{
+	struct Output out;
+	char *path = path_join(site->dir, "index.html");
+	int fd;
+
+	if (path == NULL)
+		return -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	free(path);
+
+	if (fd == -1 || output_open(&out, fd) == -1) {
+		fail("%s: failed to write index: %s\n", __func__, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	output_str(&out, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"UTF-8\">\n"
+		"<title>Stamp notes</title>\n</head>\n<body>\n"
+		"<h1>Notes from Stamp</h1>\n<ul>\n");
+
+	for (int i = 0; i < site->count; i++) {
+		struct SiteCategory *cat = &site->categories[i];
+
+		if (cat->failed)
+			continue;
+
+		char *href = site_encode(cat->dir);
+
+		if (href == NULL) {
+			output_close(&out);
+			return -1;
+		}
+
+		output_str(&out, "<li><a href=\"");
+		output_str(&out, href);
+		output_str(&out, "/index.html\">");
+		free(href);
+		output_escaped(&out, cat->name, strlen(cat->name), EXPORT_HTML);
+		output_str(&out, "</a> (");
+		output_int(&out, cat->notes);
+		output_str(&out, cat->notes != 1 ? " notes)</li>\n" : " note)</li>\n");
+	}
+
+	output_str(&out, "</ul>\n</body>\n</html>\n");
+
+	return output_close(&out);
+}
+
+
+static int site_write_manifest(struct SiteExport *site)
+{
+	char *path = path_join(site->dir, SITE_MANIFEST);
+	FILE *fp;
+
+	if (path == NULL)
+		return -1;
+
+	fp = stamp_fopen(path, "w");
+	free(path);
+
+	if (fp == NULL)
+		return -1;
+
+	for (int i = 0; i < site->count; i++) {
+		struct SiteCategory *cat = &site->categories[i];
+
+		if (cat->failed)
+			continue;
+
+		fprintf(fp, "%lld\t%lld\t%lld\t%d\t%d\t%d\t%s\n",
+			(long long)cat->ino, (long long)cat->size,
+			(long long)cat->mtime, site->page_size, cat->notes,
+			cat->pages, cat->name);
+	}
+
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+
+/* Number of threads to render categories with */
+static int site_threads(int categories)
+{
+	long cpus = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > SITE_MAX_THREADS)
+		cpus = SITE_MAX_THREADS;
+	if (cpus > categories)
+		cpus = categories;
+
+	return (int)cpus;
+}
+
+
+/* Export all categories as a static site in dir: an index page with
+ * the note count of every category and per category HTML pages of
+ * STAMP_EXPORT_PAGE_SIZE notes (1000 by default). Categories are
+ * rendered in parallel, one per worker thread at a time, and skipped
+ * when their file didn't change since the previous export to dir.
+ *
+ * Returns the number of categories rendered or -1 on failure.
+ */
+static int export_site(const char *dir)
+{
+	struct SiteExport site;
+	char *stamp_path;
+	char *conf;
+	DIR *dp;
+	struct dirent *ent;
+	int exported = 0;
+	int failed = 0;
+	int retval = 0;
+	int size = 0;
+
+	memset(&site, 0, sizeof(site));
+	site.dir = dir;
+	site.page_size = SITE_PAGE_SIZE;
+
+	if ((conf = get_memo_conf_value("STAMP_EXPORT_PAGE_SIZE")) != NULL &&
+	    atoi(conf) > 0)
+		site.page_size = atoi(conf);
+
+	if (stamp_mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		fail("%s: could not create %s: %s\n", __func__, dir, strerror(errno));
+		return -1;
+	}
+
+	if ((stamp_path = get_memo_file_path("")) == NULL)
+		return -1;
+
+	if ((dp = opendir(stamp_path)) == NULL) {
+		fail("%s: could not open stamp path\n", __func__);
+		free(stamp_path);
+		return -1;
+	}
+
+	/* Collect categories, paths are resolved here because the
+	 * configuration can't be read from worker threads
+	 */
+	while ((ent = readdir(dp)) != NULL) {
+		struct stat st;
+		char *path;
+
+		if (ent->d_type != DT_REG || ent->d_name[0] == '.')
+			continue;
+
+		if ((path = path_join(stamp_path, ent->d_name)) == NULL)
+			continue;
+
+		if (stamp_stat(path, &st) == -1) {
+			free(path);
+			continue;
+		}
+
+		if (site.count == size) {
+			size = size ? size * 2 : 16;
+			struct SiteCategory *grown = (struct SiteCategory *)realloc(
+				site.categories, size * sizeof(struct SiteCategory));
+
+			if (grown == NULL) {
+				fail("%s: realloc failed\n", __func__);
+				free(path);
+				break;
+			}
+
+			site.categories = grown;
+		}
+
+		struct SiteCategory *cat = &site.categories[site.count];
+		memset(cat, 0, sizeof(*cat));
+
+		if ((cat->name = strdup(ent->d_name)) == NULL ||
+		    (cat->dir = site_encode(ent->d_name)) == NULL) {
+			free(cat->name);
+			free(path);
+			break;
+		}
+
+		site.count++;
+		cat->path = path;
+		cat->ino = st.st_ino;
+		cat->size = st.st_size;
+		cat->mtime = st.st_mtime;
+	}
+
+	closedir(dp);
+	free(stamp_path);
+
+	if (site.count > 0)
+		qsort(site.categories, site.count, sizeof(struct SiteCategory),
+			site_category_cmp);
+
+	site_read_manifest(&site);
+
+	int nthreads = site_threads(site.count);
+	pthread_t threads[SITE_MAX_THREADS];
+	int started = 0;
+
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, site_worker, &site) != 0)
+			break;
+		started++;
+	}
+
+	/* no threads at all, render here */
+	if (started == 0)
+		site_worker(&site);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (int i = 0; i < site.count; i++) {
+		if (site.categories[i].failed)
+			failed++;
+		else if (!site.categories[i].skip)
+			exported++;
+	}
+
+	if (site_write_index(&site) == -1 || site_write_manifest(&site) == -1)
+		retval = -1;
+
+	if (failed)
+		printf("exported %d of %d categories to %s, %d failed\n", exported,
+			site.count, dir, failed);
+	else
+		printf("exported %d of %d categories to %s\n", exported,
+			site.count, dir);
+
+	for (int i = 0; i < site.count; i++) {
+		free(site.categories[i].name);
+		free(site.categories[i].dir);
+		free(site.categories[i].path);
+	}
+	free(site.categories);
+
+	return failed || retval == -1 ? -1 : exported;
+}
+
+
+/* Follow category, or all categories when it's NULL, printing the
+ * notes appended to them prefixed by their category as they come in.
+ * inotify tells which files changed, only the bytes past what was read
+ * before are read then. Rewrites by delete, replace and the like
+ * rename a new file over the category; it's reopened then and only its
+ * notes with ids past the last one printed are. When there are none,
+ * what's appended next is past the last note of the new file, which
+ * may have a lower id after renumbering.
+ *
+ * Runs until interrupted or the reader of the output goes away.
+ * Returns -1 on failure.
+ */
+static int watch_notes(char *category)
+{
+#ifdef __linux__
+	struct Watch w;
+	union {
+		struct inotify_event event;
+		char buffer[4096];
+	} events;
+	int retval = 0;
+
+	memset(&w, 0, sizeof(w));
+	w.only = category;
+
+	if ((w.dir = get_memo_file_path("")) == NULL) {
+		fail("%s: can't retrieve path\n", __func__);
+		return -1;
+	}
+
+	int fd = inotify_init();
+
+	if (fd == -1 || inotify_add_watch(fd, w.dir, IN_CREATE | IN_MODIFY |
+	    IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1) {
+		fail("%s: can't watch %s: %s\n", __func__, w.dir, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		free(w.dir);
+		return -1;
+	}
+
+	/* what's there already isn't printed */
+	DIR *dir = opendir(w.dir);
+	struct dirent *ent;
+
+	while (dir && (ent = readdir(dir)) != NULL) {
+		struct WatchFile *wf;
+
+		if (ent->d_type == DT_REG && watch_wanted(&w, ent->d_name) &&
+		    (wf = watch_file(&w, ent->d_name)) != NULL)
+			watch_open(&w, wf, 1);
+	}
+
+	if (dir)
+		closedir(dir);
+
+	while (retval == 0 && !output_broken(&output)) {
+		ssize_t n = read(fd, events.buffer, sizeof(events.buffer));
+
+		if (n == -1 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			fail("%s: read failed: %s\n", __func__, strerror(errno));
+			retval = -1;
+			break;
+		}
+
+		for (char *p = events.buffer; p < events.buffer + n;
+		     p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			struct WatchFile *wf;
+
+			if (ev->len == 0 || !watch_wanted(&w, ev->name) ||
+			    (wf = watch_file(&w, ev->name)) == NULL)
+				continue;
+
+			/* a file created under the name starts from scratch,
+			 * one renamed to it is a rewrite
+			 */
+			if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				if (wf->fd != -1)
+					close(wf->fd);
+				wf->fd = -1;
+			} else if (ev->mask & IN_CREATE) {
+				if (wf->fd != -1)
+					close(wf->fd);
+				wf->fd = -1;
+				wf->last_id = 0;
+				watch_open(&w, wf, 0);
+			} else if (ev->mask & IN_MOVED_TO || wf->fd == -1)
+				watch_open(&w, wf, 0);
+			else
+				watch_read(&w, wf);
+		}
+
+		output_flush(&output);
+	}
+
+	for (int i = 0; i < w.count; i++) {
+		if (w.files[i].fd != -1)
+			close(w.files[i].fd);
+		free(w.files[i].name);
+	}
+
+	free(w.files);
+	free(w.buffer);
+	free(w.dir);
+	close(fd);
+
+	return retval;
+#else
+	fail("%s: following categories needs inotify, which is Linux only\n",
+		__func__);
+
+	return -1;
+#endif
+}
+
+
+#ifdef __linux__
+/* Category files only, no tmp files of rewrites */
+static int watch_wanted(struct Watch *w, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (w->only)
+		return strcmp(name, w->only) == 0;
+
+	return name[0] != '.' && (len < 4 || strcmp(name + len - 4, ".tmp") != 0);
+}
+
+
+static struct WatchFile *watch_file(struct Watch *w, const char *name)
+{
+	for (int i = 0; i < w->count; i++) {
+		if (strcmp(w->files[i].name, name) == 0)
+			return &w->files[i];
+	}
+
+	struct WatchFile *grown = (struct WatchFile *)realloc(w->files,
+		(w->count + 1) * sizeof(struct WatchFile));
+
+	if (grown == NULL) {
+		fail("%s: realloc failed\n", __func__);
+		return NULL;
+	}
+
+	w->files = grown;
+
+	struct WatchFile *wf = &w->files[w->count];
+	memset(wf, 0, sizeof(*wf));
+	wf->fd = -1;
+
+	if ((wf->name = strdup(name)) == NULL) {
+		fail("%s: strdup failed\n", __func__);
+		return NULL;
+	}
+
+	w->count++;
+
+	return wf;
+}
+
+
+/* Read length bytes at offset of fd into the watch buffer, or less at
+ * the end of the file. Returns the number of bytes read or -1.
+ */
+static ssize_t watch_pread(struct Watch *w, int fd, off_t offset, size_t length)
+{
+	size_t got = 0;
+
+	if (length > w->size) {
+		char *grown = (char *)realloc(w->buffer, length);
+
+		if (grown == NULL) {
+			fail("%s: realloc failed\n", __func__);
+			return -1;
+		}
+
+		w->buffer = grown;
+		w->size = length;
+	}
+
+	while (got < length) {
+		ssize_t n = pread(fd, w->buffer + got, length - got, offset + got);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+
+		if (n == -1) {
+			fail("%s: read failed: %s\n", __func__, strerror(errno));
+			return -1;
+		}
+
+		if (n == 0)
+			break;
+
+		got += n;
+	}
+
+	STAT_ADD(bytes_read, got);
+
+	return got;
+}
+
+
+/* (Re)open the category file of wf after it was created or renamed
+ * over. At startup, with skip, its notes are taken as printed.
+ * Otherwise the notes past wf->last_id are looked for from the end of
+ * the file, in windows twice as large each time until one starts at an
+ * older note, as ids only grow down a file, and printed.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int watch_open(struct Watch *w, struct WatchFile *wf, int skip)
+{
+	char *path = path_join(w->dir, wf->name);
+	struct stat st;
+	int fd;
+
+	if (path == NULL)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		/* gone again already */
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	STAT_ADD(files_opened, 1);
+
+	if (wf->fd != -1) {
+		close(wf->fd);
+
+		if (st.st_ino == wf->ino) {
+			wf->fd = fd;
+			return watch_read(w, wf);
+		}
+	}
+
+	wf->fd = fd;
+	wf->ino = st.st_ino;
+	wf->offset = 0;
+
+	if (!skip && wf->last_id == 0)
+		return watch_read(w, wf);
+
+	for (size_t window = WATCH_READ_SIZE; ; window *= 2) {
+		off_t start = st.st_size > (off_t)window ? st.st_size - (off_t)window : 0;
+		ssize_t n = watch_pread(w, fd, start, st.st_size - start);
+		char *p = w->buffer;
+		char *end = w->buffer + (n > 0 ? n : 0);
+		char *nl;
+		struct NoteView note;
+
+		if (n == -1)
+			return -1;
+
+		/* the window may start in the middle of a line */
+		if (start > 0) {
+			if ((nl = memchr(p, '\n', end - p)) == NULL)
+				continue;
+			p = nl + 1;
+		}
+
+		if (skip) {
+			/* the last whole line holds the last id */
+			for (char *line = p; line < end &&
+			     (nl = memchr(line, '\n', end - line)) != NULL; line = nl + 1) {
+				if (parse_note(line, nl - line, &note) == 0)
+					wf->last_id = note.id;
+				wf->offset = start + (nl + 1 - w->buffer);
+			}
+
+			if (wf->offset == 0 && start > 0)
+				continue;
+
+			return 0;
+		}
+
+		/* find the first note past the last one printed */
+		char *line = p;
+		int older = 0;
+		int newer = 0;
+		int last = 0;
+
+		while (line < end && (nl = memchr(line, '\n', end - line)) != NULL) {
+			if (parse_note(line, nl - line, &note) == 0) {
+				if (note.id > wf->last_id) {
+					newer = 1;
+					break;
+				}
+				older = 1;
+				last = note.id;
+			}
+			line = nl + 1;
+		}
+
+		if (older || start == 0) {
+			/* without new notes the ids go on from the last one in
+			 * the file, lower than those printed after -R or after
+			 * the last notes were deleted
+			 */
+			if (!newer)
+				wf->last_id = last;
+			wf->offset = start + (line - w->buffer);
+			return watch_read(w, wf);
+		}
+	}
+}
+
+
+/* Print the whole lines appended to the file of wf since it was last
+ * read, those of notes past wf->last_id that is. A line still being
+ * written is left for the next time.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int watch_read(struct Watch *w, struct WatchFile *wf)
+{
+	struct stat st;
+	size_t length = WATCH_READ_SIZE;
+
+	if (fstat(wf->fd, &st) == -1)
+		return -1;
+
+	while (wf->offset < st.st_size) {
+		size_t want = st.st_size - wf->offset < (off_t)length ?
+			(size_t)(st.st_size - wf->offset) : length;
+		ssize_t n = watch_pread(w, wf->fd, wf->offset, want);
+		char *line = w->buffer;
+		char *end = w->buffer + (n > 0 ? n : 0);
+		char *nl;
+		struct NoteView note;
+
+		if (n <= 0)
+			return n;
+
+		while ((nl = memchr(line, '\n', end - line)) != NULL) {
+			if (parse_note(line, nl - line, &note) == 0 &&
+			    note.id > wf->last_id) {
+				output_str(&output, wf->name);
+				output_char(&output, '\t');
+				output_bytes(&output, line, nl - line + 1);
+				wf->last_id = note.id;
+			}
+			line = nl + 1;
+		}
+
+		/* no whole line in a full window, it must be longer */
+		if (line == w->buffer) {
+			if ((size_t)n < want || wf->offset + n >= st.st_size)
+				break;
+			length *= 2;
+			continue;
+		}
+
+		wf->offset += line - w->buffer;
+	}
+
+	return 0;
+}
+#endif
+
+
+/* Show latest n notes */
+static void show_latest(char *category, int n)
+{
+	struct NoteReader reader;
+	struct NoteView note;
+	int notes = 0;
+	int start;
+	int current = 0;
+
+	if (note_reader_open_archived(&reader, category) == -1)
+		return;
+
+	/* count the notes first, then skip all but the last n */
+	while (read_file_note(&reader, &note) > 0)
+		notes++;
+
+	/* If n is bigger than the count of notes or smaller
+	 * than zero we will show all the notes.
+	 */
+	if (n > notes || n < 0)
+		start = 0;
+	else
+		start = notes - n;
+
+	if (note_reader_rewind(&reader) == -1) {
+		fail("%s: rewinding failed\n", __func__);
+		note_reader_close(&reader);
+		return;
+	}
+
+	while (!output_broken(&output) && read_file_note(&reader, &note) > 0) {
+		if (current++ >= start)
+			output_default(&note);
+	}
+
+	output_flush(&output);
+	note_reader_close(&reader);
+}
+
+
+/* Deletes all notes. Function actually
+ * simply removes category file in .stamp directory
+ * Returns 0 on success, -1 on failure.
+ */
+static int delete_all(char *category)
+{
+	char *confirm = NULL;
+	int ask = 1;
+
+	confirm = get_memo_conf_value("STAMP_CONFIRM_DELETE");
+
+	if (confirm && strcmp(confirm, "no") == 0)
+		ask = 0;
+
+	char *path = get_memo_file_path(category);
+
+	if (path == NULL) {
+		fail("%s error getting stamp file path\n", __func__);
+		return -1;
+	}
+
+	if (ask) {
+		printf("Really delete (y/N)? ");
+		char ch = getc(stdin);
+		if (ch == 'y' || ch == 'Y') {
+			if (remove(path) != 0) {
+				fail(
+					"%s error removing %s\n", __func__, 
+					path);
+			}
+		}
+	} else {
+		if (remove(path) != 0)
+			fail("%s error removing %s\n", __func__, path);
+	}
+
+	if (!file_exists(path)) {
+		watermark_invalidate(category);
+		index_remove(category);
+	}
+
+	free(path);
+
+	return 0;
+}
+
+
+/* Delete a note by id.
+ * This functions loops over all lines from original file,
+ * adds them to a temporary file, except the line you want delete,
+ * and moves the temporary file over the original file
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int delete_note(char *category, int id)
+{
+	FILE *tmpfp = NULL;
+	char *memofile = NULL;
+	char *tmpfile = NULL;
+	struct NoteReader reader;
+	int lock;
+
+	/* held until the tmp file replaces the category */
+	if ((lock = category_lock(category, 0)) == -1)
+		return -1;
+
+	tmpfp = get_memo_file_ptr(category, "w", ".tmp");
+	if (tmpfp == NULL) {
+		close(lock);
+		return -1;
+	}
+
+	if (note_reader_open(&reader, category) == -1) {
+		fclose(tmpfp);
+		close(lock);
+		return -1;
+	}
+
+	memofile = get_memo_file_path(category);
+	if (memofile == NULL) {
+		fail("%s failed to get stamp file path\n", __func__);
+		note_reader_close(&reader);
+		fclose(tmpfp);
+		close(lock);
+
+		return -1;
+	}
+
+	tmpfile = get_temp_memo_path(category);
+	if (tmpfile == NULL) {
+		fail("%s failed to get stamp tmp path\n", __func__);
+		note_reader_close(&reader);
 		fclose(tmpfp);
+		close(lock);
+
+		free(memofile);
+
+		return -1;
+	}
+
+	int retval = 0;
+	int found = 0;
+	struct NoteView note;
+	struct TagIndex tags;
+	off_t offset = 0;
+
+	/* the tag index is rebuilt on the way */
+	int keep_tags = index_exists(category, TAG_SUFFIX);
+	memset(&tags, 0, sizeof(tags));
+
+	TRACE_BEGIN("delete_note rewrite");
+	while (read_file_note(&reader, &note) > 0) {
+		/* when ID is found, skip this line  */
+		if (note.id == id)
+			found = 1;
+		else {
+			if (keep_tags && tag_index_add(&tags, note.id, offset,
+			    note.message, note.length) == -1)
+				keep_tags = 0;
+			offset += note.line_length + 1;
+
+			/* copy the line to tmpfile as is */
+			if (fwrite(note.line, 1, note.line_length, tmpfp) != note.line_length ||
+			    fputc('\n', tmpfp) == EOF) {
+				fail("%s: failed writing tmpfile: %s (%d)\n",
+					__func__, strerror(errno), errno);
+				retval = -1;
+				break;
+			}
+
+			STAT_ADD(bytes_written, note.line_length + 1);
+		}
+	}
+	TRACE_END();
+
+	note_reader_close(&reader);
+
+	if (fflush(tmpfp) != 0)
+		retval = -1;
+
+	/* if writing to tmpfile went OK, proceed */
+	if (retval == 0) {
+		/* did we find the ID we were looking for */
+		if (found == 1) {
+			retval = stamp_rename(tmpfile, memofile);
+			/* move tmpfile over memofile */
+			if (retval == 0) {
+				watermark_invalidate(category);
+				sa_invalidate(category);
+				tag_index_replace(category, memofile, &tags, keep_tags);
+			}
+			else {
+				fail("could not rename %s to %s\n", tmpfile, memofile);
+				if (remove(tmpfile) != 0)
+					fail("could not clean up %s either\n", tmpfile);
+			}
+		} else {
+			/* ID not found, remove tmpfile */
+			remove(tmpfile);
+			fail("note with ID %d not found in category %s\n", id, category);
+			retval = -1;
+		}
+	} else
+		remove(tmpfile);
+
+	close(lock);
+	tag_index_free(&tags);
+	free(memofile);
+	free(tmpfile);
+	fclose(tmpfp);
+
+	return retval;
+}
+
+
+/* Compile the selection of -m and -c: a list of ids and ranges of
+ * them, such as 3,5,10-20, or else a search as -f takes it, with
+ * --query and --ignore-case.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int note_filter_compile(struct NoteFilter *f, const char *selection)
+{
+	const char *p = selection;
+
+	memset(f, 0, sizeof(*f));
+
+	/* digits are ids unless --search says they're searched for */
+	if (select_search || *p < '0' || *p > '9' ||
+	    strspn(p, "0123456789,-") < strlen(p)) {
+		f->search = selection;
+		f->search_length = strlen(selection);
+
+		return query_enabled ? query_compile(&f->query, selection) : 0;
+	}
+
+	while (*p) {
+		char *end;
+		long from = strtol(p, &end, 10);
+		long to = from;
+
+		if (*end == '-')
+			to = strtol(end + 1, &end, 10);
+
+		if (from < 1 || to < from || to > INT_MAX || (*end && *end != ',')) {
+			fail("invalid list of ids: %s\n", selection);
+			return -1;
+		}
+
+		if (f->count % 16 == 0) {
+			struct IdRange *grown = (struct IdRange *)realloc(f->ranges,
+				(f->count + 16) * sizeof(struct IdRange));
+
+			if (grown == NULL) {
+				fail("%s: realloc failed\n", __func__);
+				return -1;
+			}
+
+			f->ranges = grown;
+		}
+
+		f->ranges[f->count].from = from;
+		f->ranges[f->count].to = to;
+		f->count++;
+		p = *end ? end + 1 : end;
+	}
+
+	qsort(f->ranges, f->count, sizeof(struct IdRange), id_range_cmp);
+
+	return 0;
+}
+
+
+static int id_range_cmp(const void *a, const void *b)
+{
+	const struct IdRange *x = (const struct IdRange *)a;
+	const struct IdRange *y = (const struct IdRange *)b;
+
+	return (x->from > y->from) - (x->from < y->from);
+}
+
+
+/* Check if note is selected by f. Notes have to be given in the order
+ * of the category file, as ranges are passed by once ids are beyond.
+ */
+static int note_filter_match(struct NoteFilter *f, const struct NoteView *note)
+{
+	if (note->message == NULL)
+		return 0;
+
+	if (f->search == NULL) {
+		while (f->next < f->count && f->ranges[f->next].to < note->id)
+			f->next++;
+
+		/* ranges may overlap, any of the following ones may match */
+		for (int i = f->next; i < f->count && f->ranges[i].from <= note->id; i++) {
+			if (f->ranges[i].to >= note->id)
+				return 1;
+		}
+
+		return 0;
+	}
+
+	if (query_enabled)
+		return query_match(&f->query, note->message, note->length);
+
+	if (ignore_case)
+		return find_ignore_case(note->message, note->length, f->search,
+			f->search_length) != NULL;
+
+	return strstr(note->message, f->search) != NULL;
+}
+
+
+static void note_filter_free(struct NoteFilter *f)
+{
+	if (f->search && query_enabled)
+		query_free(&f->query);
+
+	free(f->ranges);
+	memset(f, 0, sizeof(*f));
+}
+
+
+/* Move, or copy when keep is set, the notes of source selected by
+ * selection to destination, with their dates, in one pass over source.
+ * They're numbered on from the last note of destination, as ids only
+ * grow down a category file.
+ *
+ * Both categories are rewritten to their tmp files, which are renamed
+ * over them destination first: when interrupted in between, the notes
+ * are in both rather than in neither.
+ *
+ * Returns the number of notes moved or copied, or -1 on failure.
+ */
+static int transfer_notes(char *source, char *destination,
+	const char *selection, int keep)
+{
+	struct NoteFilter filter;
+	struct NoteReader reader;
+	struct NoteView note;
+	struct TagIndex tags[2];
+	int keep_tags[2] = { 0, 0 };
+	off_t offset[2] = { 0, 0 };
+	char *paths[2] = { NULL, NULL };
+	char *tmp_paths[2] = { NULL, NULL };
+	FILE *fps[2] = { NULL, NULL };
+	int locks[2] = { -1, -1 };
+	int existed = 0;
+	int id = 0;
+	int count = 0;
+	int retval = 0;
+
+	if (strcmp(source, destination) == 0) {
+		fail("%s: %s is both source and destination\n", __func__, source);
+		return -1;
+	}
+
+	if (note_filter_compile(&filter, selection) == -1) {
+		note_filter_free(&filter);
+		return -1;
+	}
+
+	char *categories[2] = { source, destination };
+
+	memset(tags, 0, sizeof(tags));
+
+	for (int i = 0; i < 2 && retval == 0; i++) {
+		paths[i] = get_memo_file_path(categories[i]);
+		tmp_paths[i] = get_temp_memo_path(categories[i]);
+
+		if (paths[i] == NULL || tmp_paths[i] == NULL)
+			retval = -1;
+	}
+
+	/* Both are locked until renamed, in the order of their names so
+	 * that moves between the same two categories can't deadlock. The
+	 * lock creates destination, it's removed again when nothing went
+	 * there.
+	 */
+	if (retval == 0) {
+		int first = strcmp(source, destination) < 0 ? 0 : 1;
+
+		existed = file_exists(paths[1]);
+
+		for (int i = first, n = 0; n < 2 && retval == 0; i = !i, n++) {
+			if ((locks[i] = category_lock(categories[i], i == 1)) == -1)
+				retval = -1;
+		}
+	}
+
+	for (int i = 0; i < 2 && retval == 0; i++) {
+		keep_tags[i] = index_exists(categories[i], TAG_SUFFIX);
+
+		if ((i == 1 || !keep) &&
+		    (fps[i] = stamp_fopen(tmp_paths[i], "w")) == NULL) {
+			fail("%s: error opening file: %s\n", __func__, strerror(errno));
+			retval = -1;
+		}
+	}
+
+	TRACE_BEGIN("transfer_notes");
+
+	/* the notes of destination go first, the others are added to them */
+	if (retval == 0 && file_exists(paths[1])) {
+		if (note_reader_open(&reader, destination) == -1)
+			retval = -1;
+
+		while (retval == 0 && read_file_note(&reader, &note) > 0) {
+			if (keep_tags[1] && tag_index_add(&tags[1], note.id, offset[1],
+			    note.message, note.length) == -1)
+				keep_tags[1] = 0;
+			offset[1] += note.line_length + 1;
+			id = note.id;
+
+			if (fwrite(note.line, 1, note.line_length, fps[1]) != note.line_length ||
+			    fputc('\n', fps[1]) == EOF) {
+				fail("%s: failed writing tmpfile: %s (%d)\n", __func__,
+					strerror(errno), errno);
+				retval = -1;
+			}
+
+			STAT_ADD(bytes_written, note.line_length + 1);
+		}
+
+		note_reader_close(&reader);
+	}
+
+	if (retval == 0 && note_reader_open(&reader, source) == -1)
+		retval = -1;
+
+	while (retval == 0 && read_file_note(&reader, &note) > 0) {
+		int written;
+
+		if (note_filter_match(&filter, &note)) {
+			/* the date and message as they were, under the new id */
+			const char *tab = memchr(note.line, '\t', note.line_length);
+			size_t rest = note.line + note.line_length - tab;
+
+			written = fprintf(fps[1], "%d", ++id);
+			if (written < 0 || fwrite(tab, 1, rest, fps[1]) != rest ||
+			    fputc('\n', fps[1]) == EOF)
+				written = -1;
+			else
+				written += rest + 1;
+
+			if (keep_tags[1] && tag_index_add(&tags[1], id, offset[1],
+			    note.message, note.length) == -1)
+				keep_tags[1] = 0;
+			offset[1] += written;
+			count++;
+		} else if (!keep) {
+			if (keep_tags[0] && tag_index_add(&tags[0], note.id, offset[0],
+			    note.message, note.length) == -1)
+				keep_tags[0] = 0;
+			offset[0] += note.line_length + 1;
+
+			written = fwrite(note.line, 1, note.line_length, fps[0]) !=
+				note.line_length || fputc('\n', fps[0]) == EOF ?
+				-1 : (int)note.line_length + 1;
+		} else
+			continue;
+
+		if (written < 0) {
+			fail("%s: failed writing tmpfile: %s (%d)\n", __func__,
+				strerror(errno), errno);
+			retval = -1;
+			break;
+		}
+
+		STAT_ADD(bytes_written, written);
+	}
+
+	note_reader_close(&reader);
+	TRACE_END();
+
+	for (int i = 0; i < 2; i++) {
+		if (fps[i] && (fflush(fps[i]) != 0 || fsync(fileno(fps[i])) != 0 ||
+		    fclose(fps[i]) != 0))
+			retval = -1;
+	}
+
+	if (retval == 0 && count == 0) {
+		fail("no notes of %s match %s\n", source, selection);
+		retval = -1;
+	}
+
+	/* destination first, the notes are never lost */
+	for (int i = 1; i >= 0 && retval == 0; i--) {
+		if (i == 0 && keep)
+			break;
+
+		if ((retval = stamp_rename(tmp_paths[i], paths[i])) == -1) {
+			fail("could not rename %s to %s\n", tmp_paths[i], paths[i]);
+			break;
+		}
+
+		watermark_invalidate(categories[i]);
+		sa_invalidate(categories[i]);
+		tag_index_replace(categories[i], paths[i], &tags[i], keep_tags[i]);
+	}
+
+	if (retval != 0 && !existed && locks[1] != -1)
+		remove(paths[1]);
+
+	for (int i = 0; i < 2; i++) {
+		if (retval != 0 && fps[i])
+			remove(tmp_paths[i]);
+		if (locks[i] != -1)
+			close(locks[i]);
+
+		tag_index_free(&tags[i]);
+		free(paths[i]);
+		free(tmp_paths[i]);
+	}
+
+	note_filter_free(&filter);
+
+	return retval == 0 ? count : -1;
+}
+
+
+/* Give the notes of category the ids 1, 2, 3, ... in one rewrite,
+ * writing the old and new id of each note to map_path when it's given.
+ * Indexes are kept in the same pass: the tag index and checkpoints are
+ * rebuilt from the notes as they're written, while the note tables of
+ * the BM25 and substring indexes, whose texts don't change, are patched
+ * with the new ids and offsets. Stale ones are left to be rebuilt.
+ *
+ * Returns the number of ids changed or -1 on failure.
+ */
+static int renumber_notes(char *category, const char *map_path)
+{
+	struct NoteReader reader;
+	struct NoteView note;
+	struct TagIndex tags;
+	struct Checkpoints ck;
+	struct RenumberNote *notes = NULL;
+	size_t count = 0;
+	size_t size = 0;
+	struct stat st;
+	FILE *map = NULL;
+	int changed = 0;
+	int retval = 0;
+	int id = 0;
+	int lock = -1;
+	off_t offset = 0;
+
+	char *memofile = get_memo_file_path(category);
+	char *tmpfile = get_temp_memo_path(category);
+	FILE *tmpfp = NULL;
+
+	/* held until the tmp file replaces the category and its indexes
+	 * are patched, an append in between would be lost or misnumbered
+	 */
+	if (memofile == NULL || tmpfile == NULL ||
+	    (lock = category_lock(category, 0)) == -1 ||
+	    note_reader_open(&reader, category) == -1) {
+		if (lock != -1)
+			close(lock);
+		free(memofile);
+		free(tmpfile);
 		return -1;
 	}
 
-	int lines = count_file_lines(fp);
-	if (lines < 0) {
-		if (lines == -1)
-			fail("%s: counting lines failed\n", __func__);
-		fclose(fp);
-		fclose(tmpfp);
+	if (fstat(reader.fd, &st) == -1 ||
+	    (tmpfp = stamp_fopen(tmpfile, "w")) == NULL ||
+	    (map_path && (map = stamp_fopen(map_path, "w")) == NULL)) {
+		fail("%s: error opening file: %s\n", __func__, strerror(errno));
+		retval = -1;
+	}
+
+	/* only indexes of the file as it is now can be patched */
+	int patch_bm25 = renumber_index_fresh(category, BM25_SUFFIX, &st);
+	int patch_sa = renumber_index_fresh(category, SA_SUFFIX, &st);
+	int keep_tags = index_exists(category, TAG_SUFFIX);
+
+	memset(&tags, 0, sizeof(tags));
+	memset(&ck, 0, sizeof(ck));
+	memcpy(ck.header.magic, CHECKPOINT_MAGIC, sizeof(ck.header.magic));
+	ck.header.interval = CHECKPOINT_INTERVAL;
+
+	TRACE_BEGIN("renumber_notes");
+	while (retval == 0 && read_file_note(&reader, &note) > 0) {
+		const char *tab = memchr(note.line, '\t', note.line_length);
+		size_t rest = tab ? (size_t)(note.line + note.line_length - tab) : 0;
+		int written = fprintf(tmpfp, "%d", ++id);
+
+		if (written < 0 || (rest && fwrite(tab, 1, rest, tmpfp) != rest) ||
+		    fputc('\n', tmpfp) == EOF ||
+		    (map && fprintf(map, "%d\t%d\n", note.id, id) < 0)) {
+			fail("%s: failed writing: %s (%d)\n", __func__,
+				strerror(errno), errno);
+			retval = -1;
+			break;
+		}
+
+		if ((patch_bm25 || patch_sa) && count == size) {
+			size = size ? size * 2 : 4096;
+			struct RenumberNote *grown = (struct RenumberNote *)realloc(notes,
+				size * sizeof(struct RenumberNote));
+
+			if (grown == NULL) {
+				fail("%s: realloc failed\n", __func__);
+				retval = -1;
+				break;
+			}
+
+			notes = grown;
+		}
+
+		if (patch_bm25 || patch_sa) {
+			notes[count].old_id = note.id;
+			notes[count].new_id = id;
+			notes[count].old_offset = note_offset(&reader, &note);
+			notes[count].new_offset = offset;
+			count++;
+		}
+
+		if (keep_tags && tag_index_add(&tags, id, offset, note.message,
+		    note.length) == -1)
+			keep_tags = 0;
+
+		if (ck.header.notes++ % CHECKPOINT_INTERVAL == 0) {
+			if (ck.header.count == ck.size) {
+				size_t grown_size = ck.size ? ck.size * 2 : 64;
+				uint64_t *grown = (uint64_t *)realloc(ck.offsets,
+					grown_size * sizeof(uint64_t));
+
+				if (grown == NULL) {
+					fail("%s: realloc failed\n", __func__);
+					retval = -1;
+					break;
+				}
+
+				ck.offsets = grown;
+				ck.size = grown_size;
+			}
+
+			ck.offsets[ck.header.count++] = offset;
+		}
+
+		changed += note.id != id;
+		written += rest + 1;
+		offset += written;
+		STAT_ADD(bytes_written, written);
+	}
+	TRACE_END();
+
+	note_reader_close(&reader);
+
+	if (map && fclose(map) != 0)
+		retval = -1;
+	if (tmpfp && (fflush(tmpfp) != 0 || fsync(fileno(tmpfp)) != 0 ||
+	    fclose(tmpfp) != 0))
+		retval = -1;
+
+	if (retval == 0 && changed > 0) {
+		if ((retval = stamp_rename(tmpfile, memofile)) == 0 &&
+		    stamp_stat(memofile, &st) == 0) {
+			watermark_invalidate(category);
+			tag_index_replace(category, memofile, &tags, keep_tags);
+
+			ck.header.ino = st.st_ino;
+			ck.header.size = st.st_size;
+			checkpoint_store(category, &ck);
+
+			if (patch_bm25)
+				renumber_index(category, BM25_SUFFIX, notes, count, &st);
+			if (patch_sa)
+				renumber_index(category, SA_SUFFIX, notes, count, &st);
+		} else if (retval != 0)
+			fail("could not rename %s to %s\n", tmpfile, memofile);
+	}
+
+	if (retval != 0 || changed == 0)
+		remove(tmpfile);
+
+	close(lock);
+	tag_index_free(&tags);
+	free(ck.offsets);
+	free(notes);
+	free(memofile);
+	free(tmpfile);
+
+	return retval == 0 ? changed : -1;
+}
+
+
+/* Check if the BM25 or substring index of category, by suffix, is of
+ * the category file as st describes it. A substring index may cover
+ * only the notes up to some point.
+ */
+static int renumber_index_fresh(char *category, const char *suffix,
+	const struct stat *st)
+{
+	char *path = index_path(category, suffix);
+	int fd = path ? open(path, O_RDONLY) : -1;
+	int fresh = 0;
+
+	free(path);
+
+	if (fd == -1)
+		return 0;
+
+	if (strcmp(suffix, BM25_SUFFIX) == 0) {
+		struct Bm25Header h;
+
+		fresh = pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+			memcmp(h.magic, BM25_MAGIC, sizeof(h.magic)) == 0 &&
+			h.ino == (uint64_t)st->st_ino && h.size == (uint64_t)st->st_size &&
+			h.mtime == (int64_t)st->st_mtime;
+	} else {
+		struct SaHeader h;
+
+		fresh = pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+			memcmp(h.magic, SA_MAGIC, sizeof(h.magic)) == 0 &&
+			h.ino == (uint64_t)st->st_ino && h.size <= (uint64_t)st->st_size;
+	}
+
+	close(fd);
+
+	return fresh;
+}
+
+
+/* New id and offset of the note at old_offset in the category file
+ * before renumbering, notes have to be looked up in file order.
+ */
+static const struct RenumberNote *renumber_lookup(
+	const struct RenumberNote *notes, size_t count, size_t *cursor,
+	uint64_t old_offset)
+{
+	while (*cursor < count && notes[*cursor].old_offset < old_offset)
+		(*cursor)++;
+
+	if (*cursor < count && notes[*cursor].old_offset == old_offset)
+		return &notes[*cursor];
+
+	return NULL;
+}
+
+
+/* Patch the note table of the BM25 or substring index of category, by
+ * suffix, with the new ids and offsets of notes and tie it to the
+ * renumbered category file st describes. The header is written last,
+ * so an index left half patched is stale. When it can't be patched it's
+ * removed, to be rebuilt.
+ */
+static void renumber_index(char *category, const char *suffix,
+	const struct RenumberNote *notes, size_t count, const struct stat *st)
+{
+	char *path = index_path(category, suffix);
+	int bm25 = strcmp(suffix, BM25_SUFFIX) == 0;
+	union {
+		struct Bm25Header bm25;
+		struct SaHeader   sa;
+	} h;
+	size_t header_size = bm25 ? sizeof(h.bm25) : sizeof(h.sa);
+	size_t entry_size = bm25 ? sizeof(struct Bm25Doc) : sizeof(struct SaNote);
+	size_t id_at = bm25 ? offsetof(struct Bm25Doc, id) : offsetof(struct SaNote, id);
+	char *table = NULL;
+	size_t cursor = 0;
+	int patched = 0;
+	int fd;
+
+	if (path == NULL)
+		return;
+
+	if ((fd = open(path, O_RDWR)) != -1 &&
+	    pread(fd, &h, header_size, 0) == (ssize_t)header_size) {
+		uint32_t entries = bm25 ? h.bm25.notes : h.sa.notes;
+		size_t table_size = (size_t)entries * entry_size;
+
+		if ((table = (char *)malloc(table_size + 1)) != NULL &&
+		    pread(fd, table, table_size, header_size) == (ssize_t)table_size) {
+			patched = 1;
+
+			/* both tables start with the offset of a note */
+			for (uint32_t i = 0; i < entries && patched; i++) {
+				char *entry = table + i * entry_size;
+				uint64_t old_offset;
+				const struct RenumberNote *rn;
+
+				memcpy(&old_offset, entry, sizeof(old_offset));
+				if ((rn = renumber_lookup(notes, count, &cursor,
+				    old_offset)) == NULL) {
+					patched = 0;
+					break;
+				}
+
+				memcpy(entry, &rn->new_offset, sizeof(rn->new_offset));
+				memcpy(entry + id_at, &rn->new_id, sizeof(rn->new_id));
+			}
+
+			if (bm25) {
+				h.bm25.ino = st->st_ino;
+				h.bm25.size = st->st_size;
+				h.bm25.mtime = st->st_mtime;
+			} else {
+				/* the end of the indexed notes moved too */
+				const struct RenumberNote *rn = renumber_lookup(notes,
+					count, &cursor, h.sa.size);
+
+				h.sa.ino = st->st_ino;
+				h.sa.size = rn ? rn->new_offset : (uint64_t)st->st_size;
+			}
+
+			if (patched &&
+			    (pwrite(fd, table, table_size, header_size) != (ssize_t)table_size ||
+			     pwrite(fd, &h, header_size, 0) != (ssize_t)header_size))
+				patched = 0;
+		}
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	if (!patched)
+		unlink(path);
+
+	free(table);
+	free(path);
+}
+
+
+/* Next byte of a message normalized for duplicate detection: leading
+ * and trailing white space dropped, runs of it made one space and
+ * letters folded to lower case. Returns -1 at the end.
+ */
+static int dedup_getc(struct DedupCursor *c)
+{
+	while (c->p < c->end && isspace((unsigned char)*c->p)) {
+		c->p++;
+		c->space = c->started;
+	}
 
+	if (c->p == c->end)
 		return -1;
+
+	if (c->space) {
+		c->space = 0;
+		return ' ';
 	}
 
-	memofile = get_memo_file_path(category);
-	if (memofile == NULL) {
-		fail("%s failed to get stamp file path\n", __func__);
-		fclose(fp);
+	c->started = 1;
+
+	return tolower((unsigned char)*c->p++);
+}
+
+
+static uint64_t dedup_hash(const char *message, size_t len, int date)
+{
+	struct DedupCursor c = { message, message + len, 0, 0 };
+	uint64_t hash = 14695981039346656037ull;
+	int ch;
+
+	while ((ch = dedup_getc(&c)) != -1)
+		hash = (hash ^ ch) * 1099511628211ull;
+
+	if (dedup_same_date)
+		hash = (hash ^ (uint32_t)date) * 1099511628211ull;
+
+	/* 0 marks free slots */
+	return hash ? hash : 1;
+}
+
+
+static int dedup_equal(const char *a, size_t alen, const char *b, size_t blen)
+{
+	struct DedupCursor ca = { a, a + alen, 0, 0 };
+	struct DedupCursor cb = { b, b + blen, 0, 0 };
+	int ch;
+
+	while ((ch = dedup_getc(&ca)) == dedup_getc(&cb)) {
+		if (ch == -1)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/* Look up the note a message of len bytes dated date would duplicate.
+ * Only its hash and where to find it are kept: an offset in the
+ * category file, or in the memory of the notes being added. Matching
+ * hashes are confirmed by comparing the notes.
+ *
+ * Returns 1 and sets *id to the id of the earlier note (0 if it's being
+ * added) when there is one, 0 when there isn't and -1 on failure.
+ */
+static int dedup_find(struct DedupTable *t, uint64_t hash, const char *message,
+	size_t len, int date, int *id)
+{
+	if (t->size == 0)
+		return 0;
+
+	for (size_t i = hash & (t->size - 1); t->entries[i].hash != 0;
+	     i = (i + 1) & (t->size - 1)) {
+		struct DedupEntry *e = &t->entries[i];
+		struct NoteView note;
+
+		if (e->hash != hash)
+			continue;
+
+		if (e->where & DEDUP_MEMORY) {
+			const char *other = t->memory + (e->where & ~DEDUP_MEMORY);
+
+			memset(&note, 0, sizeof(note));
+			note.message = other;
+			note.length = strlen(other);
+			note.date = t->memory_date;
+		} else if (note_pread(t->fd, e->where, &t->buffer, &t->buffer_size,
+		    &note) != 1)
+			return -1;
+
+		if (dedup_same_date && note.date != date)
+			continue;
+
+		if (note.message && dedup_equal(note.message, note.length, message, len)) {
+			*id = note.id;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int dedup_insert(struct DedupTable *t, uint64_t hash, uint64_t where)
+{
+	/* keep the table at most half full */
+	if (t->count * 2 >= t->size) {
+		size_t size = t->size ? t->size * 2 : 4096;
+		struct DedupEntry *entries = (struct DedupEntry *)calloc(size,
+			sizeof(struct DedupEntry));
+
+		if (entries == NULL) {
+			fail("%s: calloc failed\n", __func__);
+			return -1;
+		}
+
+		for (size_t i = 0; i < t->size; i++) {
+			if (t->entries[i].hash == 0)
+				continue;
+
+			size_t j = t->entries[i].hash & (size - 1);
+			while (entries[j].hash != 0)
+				j = (j + 1) & (size - 1);
+			entries[j] = t->entries[i];
+		}
+
+		free(t->entries);
+		t->entries = entries;
+		t->size = size;
+	}
+
+	size_t i = hash & (t->size - 1);
+	while (t->entries[i].hash != 0)
+		i = (i + 1) & (t->size - 1);
+
+	t->entries[i].hash = hash;
+	t->entries[i].where = where;
+	t->count++;
+
+	return 0;
+}
+
+
+static void dedup_free(struct DedupTable *t)
+{
+	free(t->entries);
+	free(t->buffer);
+	memset(t, 0, sizeof(*t));
+}
+
+
+/* Report the notes of category that duplicate an earlier one, or
+ * remove them when drop is set, keeping the first of each. The
+ * category is read once; removing rewrites it on the way like
+ * delete_note.
+ *
+ * Returns the number of duplicates or -1 on failure.
+ */
+static int dedup_notes(char *category, int drop)
+{
+	struct DedupTable table;
+	struct NoteReader reader;
+	struct NoteView note;
+	struct TagIndex tags;
+	FILE *tmpfp = NULL;
+	char *memofile = NULL;
+	char *tmpfile = NULL;
+	off_t offset = 0;
+	int keep_tags = 0;
+	int duplicates = 0;
+	int retval = 0;
+	int lock = -1;
+	int got;
+
+	memset(&table, 0, sizeof(table));
+	memset(&tags, 0, sizeof(tags));
+
+	if (drop) {
+		memofile = get_memo_file_path(category);
+		tmpfile = get_temp_memo_path(category);
+
+		/* held until the tmp file replaces the category */
+		if (memofile == NULL || tmpfile == NULL ||
+		    (lock = category_lock(category, 0)) == -1 ||
+		    (tmpfp = get_memo_file_ptr(category, "w", ".tmp")) == NULL) {
+			if (lock != -1)
+				close(lock);
+			free(memofile);
+			free(tmpfile);
+			return -1;
+		}
+
+		/* the tag index is rebuilt on the way */
+		keep_tags = index_exists(category, TAG_SUFFIX);
+	}
+
+	if (note_reader_open(&reader, category) == -1) {
+		retval = -1;
+		goto out;
+	}
+
+	table.fd = reader.fd;
+
+	TRACE_BEGIN("dedup_notes");
+	while ((got = read_file_note(&reader, &note)) > 0) {
+		int duplicate = 0;
+		int id;
+
+		if (note.message != NULL) {
+			uint64_t hash = dedup_hash(note.message, note.length, note.date);
+			off_t where = note_offset(&reader, &note);
+
+			if ((duplicate = dedup_find(&table, hash, note.message,
+			    note.length, note.date, &id)) == 0)
+				duplicate = dedup_insert(&table, hash, where);
+
+			if (duplicate == -1) {
+				retval = -1;
+				break;
+			}
+		}
+
+		if (duplicate) {
+			duplicates++;
+			if (!drop)
+				output_default(&note);
+			continue;
+		}
+
+		if (!drop)
+			continue;
+
+		if (keep_tags && tag_index_add(&tags, note.id, offset,
+		    note.message, note.length) == -1)
+			keep_tags = 0;
+		offset += note.line_length + 1;
+
+		if (fwrite(note.line, 1, note.line_length, tmpfp) != note.line_length ||
+		    fputc('\n', tmpfp) == EOF) {
+			fail("%s: failed writing tmpfile: %s (%d)\n",
+				__func__, strerror(errno), errno);
+			retval = -1;
+			break;
+		}
+
+		STAT_ADD(bytes_written, note.line_length + 1);
+	}
+	TRACE_END();
+
+	if (got == -1)
+		retval = -1;
+
+	note_reader_close(&reader);
+	output_flush(&output);
+
+	if (drop && (fflush(tmpfp) != 0 || retval == -1)) {
+		retval = -1;
+		remove(tmpfile);
+	} else if (drop && duplicates == 0)
+		remove(tmpfile);
+	else if (drop) {
+		if (stamp_rename(tmpfile, memofile) == 0) {
+			watermark_invalidate(category);
+			sa_invalidate(category);
+			tag_index_replace(category, memofile, &tags, keep_tags);
+			printf("removed %d duplicate notes from category %s\n",
+				duplicates, category);
+		} else {
+			fail("could not rename %s to %s\n", tmpfile, memofile);
+			remove(tmpfile);
+			retval = -1;
+		}
+	}
+
+out:
+	if (tmpfp)
 		fclose(tmpfp);
+	if (lock != -1)
+		close(lock);
+	tag_index_free(&tags);
+	dedup_free(&table);
+	free(memofile);
+	free(tmpfile);
+
+	return retval == -1 ? -1 : duplicates;
+}
+
+
+/* Days of notes category keeps out of its archive: STAMP_RETAIN_DAYS_
+ * followed by the name of category, or else STAMP_RETAIN_DAYS.
+ *
+ * Returns 0 when there's no retention policy, or it's invalid.
+ */
+static int retain_days(char *category)
+{
+	size_t len = strlen(RETAIN_DAYS) + strlen(category) + 2;
+	char *prop = (char *)malloc(len);
+	char *conf = NULL;
+
+	if (prop == NULL) {
+		fail("%s: malloc failed\n", __func__);
+		return 0;
+	}
+
+	snprintf(prop, len, "%s_%s", RETAIN_DAYS, category);
+	conf = get_memo_conf_value(prop);
+	if (conf == NULL)
+		conf = get_memo_conf_value(RETAIN_DAYS);
+	free(prop);
+
+	if (conf == NULL)
+		return 0;
+
+	if (atoi(conf) <= 0) {
+		fail("%s: invalid retention for %s: %s\n", __func__, category, conf);
+		return 0;
+	}
+
+	return atoi(conf);
+}
+
+
+/* Path of the archive of category, in a hidden directory of the stamp
+ * path. Returns a newly allocated string or NULL on failure.
+ */
+static char *archive_path(char *category)
+{
+	char *stamp_path = get_memo_file_path("");
+	char *dir;
+	char *path;
 
+	if (stamp_path == NULL)
+		return NULL;
+
+	dir = path_join(stamp_path, ARCHIVE_DIR);
+	free(stamp_path);
+	if (dir == NULL)
+		return NULL;
+
+	stamp_mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+	path = path_join(dir, category);
+	free(dir);
+
+	return path;
+}
+
+
+/* Move the notes of category dated more than days before today to its
+ * archive, in one pass: those are appended to the archive and the rest
+ * copied to a tmp file, which then replaces the category. Notes without
+ * a valid date are kept.
+ *
+ * Returns the number of notes archived or -1 on failure.
+ */
+static int archive_notes(char *category, int days)
+{
+	struct NoteReader reader;
+	struct NoteView note;
+	struct TagIndex tags;
+	time_t t = time(NULL);
+	struct tm *ti = localtime(&t);
+	int cutoff = days_from_civil(ti->tm_year + 1900, ti->tm_mon + 1,
+		ti->tm_mday) - days;
+	int archived = 0;
+	int retval = 0;
+	off_t offset = 0;
+	int lock;
+
+	char *memofile = get_memo_file_path(category);
+	char *tmpfile = get_temp_memo_path(category);
+	char *archive = archive_path(category);
+
+	if (memofile == NULL || tmpfile == NULL || archive == NULL) {
+		fail("%s: failed to get stamp paths\n", __func__);
+		free(memofile);
+		free(tmpfile);
+		free(archive);
 		return -1;
 	}
 
-	tmpfile = get_temp_memo_path(category);
-	if (tmpfile == NULL) {
-		fail("%s failed to get stamp tmp path\n", __func__);
-		fclose(fp);
-		fclose(tmpfp);
+	FILE *tmpfp = NULL;
+	FILE *archivefp = NULL;
 
+	/* held for the whole pass, the archive included */
+	if ((lock = category_lock(category, 0)) == -1 ||
+	    note_reader_open(&reader, category) == -1) {
+		if (lock != -1)
+			close(lock);
 		free(memofile);
+		free(tmpfile);
+		free(archive);
+		return -1;
+	}
+
+	if ((tmpfp = stamp_fopen(tmpfile, "w")) == NULL ||
+	    (archivefp = stamp_fopen(archive, "a")) == NULL) {
+		fail("%s: error opening file: %s\n", __func__, strerror(errno));
+		retval = -1;
+	}
+
+	int keep_tags = index_exists(category, TAG_SUFFIX);
+	memset(&tags, 0, sizeof(tags));
+
+	TRACE_BEGIN("archive_notes");
+	while (retval == 0 && read_file_note(&reader, &note) > 0) {
+		FILE *fp = tmpfp;
+
+		if (note.date != NOTE_NO_DATE && note.date < cutoff) {
+			fp = archivefp;
+			archived++;
+		} else {
+			if (keep_tags && tag_index_add(&tags, note.id, offset,
+			    note.message, note.length) == -1)
+				keep_tags = 0;
+			offset += note.line_length + 1;
+		}
 
+		if (fwrite(note.line, 1, note.line_length, fp) != note.line_length ||
+		    fputc('\n', fp) == EOF) {
+			fail("%s: failed writing %s: %s (%d)\n", __func__,
+				fp == tmpfp ? tmpfile : archive, strerror(errno), errno);
+			retval = -1;
+		}
+
+		STAT_ADD(bytes_written, note.line_length + 1);
+	}
+	TRACE_END();
+
+	note_reader_close(&reader);
+
+	/* the archive has to be complete before the notes leave the
+	 * category
+	 */
+	if (archivefp && (fflush(archivefp) != 0 || fsync(fileno(archivefp)) != 0))
+		retval = -1;
+	if (archivefp && fclose(archivefp) != 0)
+		retval = -1;
+	if (tmpfp && fclose(tmpfp) != 0)
+		retval = -1;
+
+	if (retval == 0 && archived > 0) {
+		if ((retval = stamp_rename(tmpfile, memofile)) == 0) {
+			watermark_invalidate(category);
+			sa_invalidate(category);
+			tag_index_replace(category, memofile, &tags, keep_tags);
+		} else
+			fail("could not rename %s to %s\n", tmpfile, memofile);
+	}
+
+	if (retval != 0 || archived == 0)
+		remove(tmpfile);
+
+	close(lock);
+	tag_index_free(&tags);
+	free(memofile);
+	free(tmpfile);
+	free(archive);
+
+	return retval == 0 ? archived : -1;
+}
+
+
+/* Archive the expired notes of category, or of all categories with a
+ * retention policy when it's NULL, reporting how many.
+ *
+ * Returns the number of notes archived or -1 on failure.
+ */
+static int archive_expired(char *category)
+{
+	int total = 0;
+	int failed = 0;
+
+	if (category != NULL) {
+		int days = retain_days(category);
+
+		if (days == 0) {
+			fail("no retention policy for %s, see %s in stamp(1)\n",
+				category, RETAIN_DAYS);
+			return -1;
+		}
+
+		if ((total = archive_notes(category, days)) == -1)
+			return -1;
+
+		printf("archived %d notes of %s\n", total, category);
+
+		return total;
+	}
+
+	char *path = get_memo_file_path("");
+	DIR *dir = path ? opendir(path) : NULL;
+	struct dirent *ent;
+
+	free(path);
+	if (dir == NULL) {
+		fail("%s: could not open stamp path\n", __func__);
 		return -1;
 	}
 
-	int retval = 0;
-	int found = 0;
-	struct Note note;
-	for (int i = 0; i <= lines; i++) {
-		note = read_file_note(fp);
+	while ((ent = readdir(dir)) != NULL) {
+		size_t len = strlen(ent->d_name);
+		int days;
+		int n;
 
-		if (!note.id)
+		if (ent->d_type != DT_REG || ent->d_name[0] == '.' ||
+		    (len > 4 && strcmp(ent->d_name + len - 4, ".tmp") == 0) ||
+		    (days = retain_days(ent->d_name)) == 0)
 			continue;
 
-		/* when ID is found, skip this line  */
-		if (note.id == id)
-			found = 1;
+		if ((n = archive_notes(ent->d_name, days)) == -1)
+			failed++;
 		else {
-			/* write line to tmpfile */
-			int written;
-			if ((written = fprintf(tmpfp, NOTE_FMT,
-				note.id,
-				note.date,
-				note.message)) < 0) {
-				fail("%s: failed writing tmpfile: %s (%d)\n",
-					strerror(errno), errno);
-				retval = -1;
-			}
+			printf("archived %d notes of %s\n", n, ent->d_name);
+			total += n;
+		}
+	}
+
+	closedir(dir);
+
+	return failed ? -1 : total;
+}
+
+
+/* After notes dated day, or today when it's NOTE_NO_DATE, were added
+ * to category, archive its expired notes when they are or its first
+ * note is, which is the oldest unless dates were given out of order.
+ * Only a few bytes are read when there's nothing to do.
+ */
+static void archive_on_write(char *category, int day)
+{
+	int days = retain_days(category);
+	char *path;
+	char *buffer = NULL;
+	size_t size = 0;
+	struct NoteView note;
+	int fd;
+
+	if (days == 0 || (path = get_memo_file_path(category)) == NULL)
+		return;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+
+	if (fd == -1)
+		return;
+
+	time_t t = time(NULL);
+	struct tm *ti = localtime(&t);
+	int cutoff = days_from_civil(ti->tm_year + 1900, ti->tm_mon + 1,
+		ti->tm_mday) - days;
+	int expired = (day != NOTE_NO_DATE && day < cutoff) ||
+		(note_pread(fd, 0, &buffer, &size, &note) == 1 &&
+		 note.date != NOTE_NO_DATE && note.date < cutoff);
+
+	free(buffer);
+	close(fd);
 
-		}
+	if (expired)
+		archive_notes(category, days);
+}
 
-		FREENOTE(note);
-	}
 
-	fclose(fp);
+/* note_reader_open for the commands --include-archive applies to. With
+ * it the notes of the archive of category are read first, as if they
+ * were at the start of the category file. Offsets of notes are not
+ * those in the category file then, so such a reader isn't for seeking.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int note_reader_open_archived(struct NoteReader *reader, char *category)
+{
+	if (note_reader_open(reader, category) == -1)
+		return -1;
 
-	/* if writing to tmpfile went OK, proceed */
-	if (retval == 0) {
-		/* did we find the ID we were looking for */
-		if (found == 1) {
-			retval = rename(tmpfile, memofile);
-			/* move tmpfile over memofile */
-			if (retval == 0)
-				printf("note %d removed from category %s\n", id, category);
-			else {
-				fail("could not rename %s to %s\n", tmpfile, memofile);
-				if (remove(tmpfile) != 0)
-					fail("could not clean up %s either\n", tmpfile);
-			}
-		} else {
-			/* ID not found, remove tmpfile */
-			remove(tmpfile);
-			fail("note with ID %d not found in category %s\n", id, category);
-			retval = -1;
-		}
-	}
+	if (!include_archive)
+		return 0;
 
-	free(memofile);
-	free(tmpfile);
-	fclose(tmpfp);
+	char *path = archive_path(category);
+	int fd = path ? open(path, O_RDONLY) : -1;
 
-	return retval;
+	free(path);
+
+	if (fd == -1)
+		return 0;
+
+	STAT_ADD(files_opened, 1);
+	reader->category_fd = reader->fd;
+	reader->archive_fd = reader->fd = fd;
+
+	return 0;
 }
 
 
@@ -1041,14 +10365,18 @@ static char *get_memo_conf_value(const char *prop)
 		return retval;
 
 	/* config not found, check stamprc */
+	PHASE_BEGIN(PHASE_CONFIG);
 	conf_path = get_memo_conf_path();
-	if (conf_path == NULL)
+	if (conf_path == NULL) {
+		PHASE_END();
 		return NULL;
+	}
 
-	fp = fopen(conf_path, "r");
+	fp = stamp_fopen(conf_path, "r");
 
 	if (fp == NULL) {
 		free(conf_path);
+		PHASE_END();
 		return NULL;
 	}
 
@@ -1058,6 +10386,7 @@ static char *get_memo_conf_value(const char *prop)
 		fail("%s: counting lines failed\n", __func__);
 		fclose(fp);
 		free(conf_path);
+		PHASE_END();
 
 		return NULL;
 	}
@@ -1068,7 +10397,9 @@ static char *get_memo_conf_value(const char *prop)
 		if (!line)
 			continue;
 
-		if (strncmp(line, prop, strlen(prop)) == 0) {
+		/* the whole name, STAMP_RETAIN_DAYS isn't STAMP_RETAIN_DAYS_x */
+		if (strncmp(line, prop, strlen(prop)) == 0 &&
+		    (line[strlen(prop)] == '=' || isspace((unsigned char)line[strlen(prop)]))) {
 
 			/* Property found, get the value */
 			char *token = strtok(line, "=");
@@ -1106,6 +10437,7 @@ static char *get_memo_conf_value(const char *prop)
 
 	fclose(fp);
 	free(conf_path);
+	PHASE_END();
 
 	return retval;
 }
@@ -1149,29 +10481,51 @@ static char *get_memo_default_path()
  * reads $HOME/.stamprc file. If the file is not found $HOME/.stamprc is
  * used as a fallback path.
  *
- * Returns the path to category file in .stamp directory or NULL on failure.
- * Caller is responsible for freeing the return value.
+ * Returns the path to category file in .stamp directory, or the
+ * directory itself when category is "", or NULL on failure. Caller is
+ * responsible for freeing the return value either way.
  */
 static char *get_memo_file_path(char *category)
 {
-	char *path = get_memo_conf_value("STAMP_PATH");
-	if (!path)
+	TRACE_BEGIN("get_memo_file_path");
+	char *path = NULL;
+
+	/* a copy whichever it comes from, the environment included */
+	if (stamp_dir)
+		path = strdup(stamp_dir);
+	else if (getenv("STAMP_PATH"))
+		path = strdup(getenv("STAMP_PATH"));
+	else if ((path = get_memo_conf_value("STAMP_PATH")) == NULL)
 		path = get_memo_default_path();
 
+	if (path == NULL) {
+		TRACE_END();
+		return NULL;
+	}
+
 	/* prepare stamp path */
-	mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR);
+	stamp_mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR);
 	chmod(path, 0700);
 
-	if (strlen(category) == 0)
+	if (strlen(category) == 0) {
+		TRACE_END();
 		return path;
+	}
 
 	/* append category to stamp path
 	 * + 2 for leading slash and nul byte
 	 */
 	char *cat_path = (char *)malloc((strlen(path) + strlen(category) + 2) * sizeof(char));
-	strcpy(cat_path, path);
-	strcat(cat_path, "/");
-	strcat(cat_path, category);
+
+	if (cat_path != NULL) {
+		strcpy(cat_path, path);
+		strcat(cat_path, "/");
+		strcat(cat_path, category);
+	} else
+		fail("%s: malloc failed\n", __func__);
+
+	free(path);
+	TRACE_END();
 
 	return cat_path;
 }
@@ -1226,15 +10580,20 @@ static void remove_content_newlines(char *content)
 /* Replaces part of the note.
  * data is the new part defined by NotePart_t.
  *
- * Original note line is modified.
+ * The original note is left untouched.
  *
  * Caller is responsible for freeing the return value.
- * Returns new note line on success, NULL on failure.
+ * Returns new note line, without a newline, on success, NULL on failure.
  */
-static char *note_part_replace(NotePart_t part, char *note_line, const char *data)
+static char *note_part_replace(NotePart_t part, const struct NoteView *note,
+	const char *data)
 {
 	char *new_line = NULL;
-	int size = ((strlen(note_line) + strlen(data)) + 1) * sizeof(char);
+	size_t date_length;
+	const char *date = note_date_text(note, &date_length);
+	const char *message = note->message ? note->message : "";
+	int length = (int)note->length;
+	size_t size = note->line_length + strlen(data) + DATE_LEN + 16;
 
 	new_line = (char*)malloc(size);
 
@@ -1243,54 +10602,17 @@ static char *note_part_replace(NotePart_t part, char *note_line, const char *dat
 		return NULL;
 	}
 
-	char *token = NULL;
-
-	/* Get the id and copy it */
-	if ((token = strtok(note_line, "\t")) != NULL) {
-		if (sprintf(new_line, "%s\t", token) < 0)
-			goto error_clean_up;
-	}
-	else {
-		goto error_clean_up;
-	}
-
-	/* Get the original date */
-	if ((token = strtok(NULL, "\t")) == NULL)
-		goto error_clean_up;
-
 	if (part == NOTE_DATE) {
 		/* Copy data as the new date */
-		if (sprintf(new_line + strlen(new_line), "%s\t", data) < 0)
-			goto error_clean_up;
-	} else {
-		/* Copy the original date */
-		if (sprintf(new_line + strlen(new_line), "%s\t", token) < 0)
-			goto error_clean_up;
-	}
-
-	/* Get the original note content */
-	if ((token = strtok(NULL, "\t")) == NULL)
-		goto error_clean_up;
-
-	if (part == NOTE_CONTENT) {
-		/* Copy the data as new content */
-		if (sprintf(new_line + strlen(new_line), "%s", data) < 0)
-			goto error_clean_up;
+		snprintf(new_line, size, "%d\t%s\t%.*s", note->id, data,
+			length, message);
 	} else {
-		/* Copy the original note content, do not write \n because
-		 * the token has it already.
-		 */
-		if (sprintf(new_line + strlen(new_line), "%s", token) < 0)
-			goto error_clean_up;
+		/* Copy the data as new content, keeping the date as it was */
+		snprintf(new_line, size, "%d\t%.*s\t%s", note->id,
+			(int)date_length, date, data);
 	}
 
 	return new_line;
-
-error_clean_up:
-	fail("%s: replacing note data failed\n", __func__);
-	free(new_line);
-
-	return NULL;
 }
 
 
@@ -1304,177 +10626,558 @@ error_clean_up:
  *
  * Returns 0 on success, -1 on failure.
  */
-static int replace_note(char *category, int id, const char *data)
+static int replace_note(char *category, int id, const char *data)
+{
+	/* Check if user wants to replace the date by validating the
+	 * data as date. Otherwise assume content is being replaced.
+	 */
+	if (is_valid_date_format(data, 1) == 0)
+		return replace_note_part(category, id, NOTE_DATE, data);
+
+	return replace_note_part(category, id, NOTE_CONTENT, data);
+}
+
+
+/* Replace part of note id in category with data, rewriting the
+ * category file. Returns 0 on success and -1 on failure or when there
+ * is no such note.
+ */
+static int replace_note_part(char *category, int id, NotePart_t part,
+	const char *data)
+{
+	FILE *tmpfp = NULL;
+	char *memofile = NULL;
+	char *tmpfile = NULL;
+	struct NoteReader reader;
+	struct NoteView note;
+	struct TagIndex tags;
+	off_t offset = 0;
+	int found = 0;
+	int keep_tags;
+	int lock;
+
+	/* held until the tmp file replaces the category */
+	if ((lock = category_lock(category, 0)) == -1)
+		return -1;
+
+	tmpfp = get_memo_file_ptr(category, "w", ".tmp");
+
+	if (tmpfp == NULL) {
+		close(lock);
+		return -1;
+	}
+
+	if (note_reader_open(&reader, category) == -1) {
+		fclose(tmpfp);
+		close(lock);
+		return -1;
+	}
+
+	memofile = get_memo_file_path(category);
+
+	if (memofile == NULL) {
+		fail("%s failed to get stamp file path\n", __func__);
+		note_reader_close(&reader);
+		fclose(tmpfp);
+		close(lock);
+
+		return -1;
+	}
+
+	tmpfile = get_temp_memo_path(category);
+
+	if (tmpfile == NULL) {
+		fail("%s failed to get stamp tmp path\n", __func__);
+		note_reader_close(&reader);
+		fclose(tmpfp);
+		close(lock);
+
+		free(memofile);
+
+		return -1;
+	}
+
+	/* the tag index is rebuilt on the way */
+	keep_tags = index_exists(category, TAG_SUFFIX);
+	memset(&tags, 0, sizeof(tags));
+
+	TRACE_BEGIN("replace_note rewrite");
+	while (read_file_note(&reader, &note) > 0) {
+		if (note.id != id) {
+			if (keep_tags && tag_index_add(&tags, note.id, offset,
+			    note.message, note.length) == -1)
+				keep_tags = 0;
+			offset += note.line_length + 1;
+
+			fwrite(note.line, 1, note.line_length, tmpfp);
+			fputc('\n', tmpfp);
+			STAT_ADD(bytes_written, note.line_length + 1);
+			continue;
+		}
+
+		/* Found the note to be replaced */
+		char *new_line = note_part_replace(part, &note, data);
+
+		found = 1;
+
+		if (new_line == NULL) {
+			printf("Unable to replace note %d\n", id);
+
+			note_reader_close(&reader);
+			remove(tmpfile);
+			tag_index_free(&tags);
+			free(memofile);
+			free(tmpfile);
+			fclose(tmpfp);
+			close(lock);
+			TRACE_END();
+
+			return -1;
+		}
+
+		struct NoteView replaced;
+		size_t len = strlen(new_line);
+
+		if (keep_tags && parse_note(new_line, len, &replaced) == 0 &&
+		    tag_index_add(&tags, replaced.id, offset, replaced.message,
+		    replaced.length) == -1)
+			keep_tags = 0;
+		offset += len + 1;
+
+		stats_written(fprintf(tmpfp, "%s\n", new_line));
+
+		free(new_line);
+	}
+	TRACE_END();
+
+	note_reader_close(&reader);
+	fclose(tmpfp);
+
+	/* No such note, leave the file as it is */
+	if (found == 0) {
+		remove(tmpfile);
+		close(lock);
+		tag_index_free(&tags);
+		free(memofile);
+		free(tmpfile);
+
+		return -1;
+	}
+
+	/* renamed over it, as removing it first would let an append in
+	 * between go to a file that's replaced right after
+	 */
+	stamp_rename(tmpfile, memofile);
+	watermark_invalidate(category);
+	sa_invalidate(category);
+	tag_index_replace(category, memofile, &tags, keep_tags);
+	close(lock);
+	tag_index_free(&tags);
+
+	free(memofile);
+	free(tmpfile);
+
+	return 0;
+}
+
+
+/* .stamp file format is following:
+ *
+ * id     date           content
+ * |      |              |
+ * |- id  |- yyy-MM-dd   |- actual note
+ *
+ * sections are separated by a tab character
+ *
+ * Parameter date can be NULL. If date is given in valid
+ * format(yyyy-MM-dd) it will be used for creating the note. If date is
+ * NULL, current date will be used instead.
+ */
+static int add_note(char *category, char *content, const char *date)
+{
+	int id;
+	int lock;
+
+	/* Do not add an empty note */
+	if (strlen(content) == 0)
+		return -1;
+
+	if ((lock = category_lock(category, 1)) == -1)
+		return -1;
+
+	id = get_next_id(category);
+
+	if (id == -1)
+		id = 1;
+
+	if (append_notes(category, id, &content, 1, date, NULL) == -1)
+		id = -1;
+
+	close(lock);
+
+	return id;
+}
+
+
+/* Append count notes with contents numbered from id on to category,
+ * in one write. Empty contents are skipped, newlines in contents are
+ * replaced. When end isn't NULL, it's set to the offset just past the
+ * notes in the category file.
+ *
+ * Returns the id of the next note or -1 on failure.
+ */
+static int append_notes(char *category, int id, char **contents,
+	size_t count, const char *date, off_t *end)
+{
+	FILE *fp = NULL;
+	time_t t;
+	struct tm *ti;
+	char note_date[11];
+	int first = id;
+
+	fp = get_memo_file_ptr(category, "a", "");
+
+	if (fp == NULL) {
+		fail("%s: Error opening stamp path\n", __func__);
+		return -1;
+	}
+
+	if (date != NULL) {
+		/* Date is already validated, so just copy it
+		 * for later use.
+		 */
+		strcpy(note_date, date);
+	} else {
+
+		time(&t);
+		ti = localtime(&t);
+
+		strftime(note_date, 11, "%Y-%m-%d", ti);
+	}
+
+
+	struct stat st;
+	off_t offset = fstat(fileno(fp), &st) == 0 ? st.st_size : -1;
+	off_t *offsets = (off_t *)malloc((count + 1) * sizeof(off_t));
+	int failed = offsets == NULL;
+
+	for (size_t i = 0; i < count && !failed; i++) {
+		if (strlen(contents[i]) == 0)
+			continue;
+
+		remove_content_newlines(contents[i]);
+
+		int written = fprintf(fp, "%d\t%s\t%s\n", id, note_date, contents[i]);
+
+		stats_written(written);
+
+		if (written < 0)
+			failed = 1;
+		else if (offset != -1) {
+			offsets[id - first] = offset;
+			offset += written;
+		}
+
+		id++;
+	}
+
+	if (fclose(fp) != 0)
+		failed = 1;
+
+	/* the tag log is told about the notes once they're in the file */
+	if (!failed && offset != -1) {
+		for (size_t i = 0, n = 0; i < count; i++) {
+			if (strlen(contents[i]) == 0)
+				continue;
+
+			off_t next = n + 1 < (size_t)(id - first) ? offsets[n + 1] : offset;
+
+			tag_index_log(category, first + n, offsets[n], next, contents[i]);
+			n++;
+		}
+	}
+
+	free(offsets);
+
+	if (failed)
+		return -1;
+
+	if (end != NULL)
+		*end = offset;
+
+	return id;
+}
+
+
+/* libstamp, see libstamp.h. Each call runs the functions of the
+ * command line with stamp_dir pointing them at the handle's stamp path,
+ * holding the handle's lock, see STAMP_BEGIN.
+ */
+struct Stamp *stamp_open(const char *dir, const char *category)
+{
+	static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct Stamp *h;
+
+	if (category == NULL || *category == '\0' || *category == '.' ||
+	    strchr(category, '/') != NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((h = (struct Stamp *)calloc(1, sizeof(*h))) == NULL)
+		return NULL;
+
+	/* the configuration is read with strtok */
+	if (dir == NULL) {
+		pthread_mutex_lock(&config_lock);
+		h->dir = get_memo_file_path("");
+		pthread_mutex_unlock(&config_lock);
+	} else
+		h->dir = strdup(dir);
+
+	h->category = strdup(category);
+
+	if (h->dir == NULL || h->category == NULL) {
+		free(h->dir);
+		free(h->category);
+		free(h);
+		return NULL;
+	}
+
+	pthread_mutex_init(&h->lock, NULL);
+
+	return h;
+}
+
+
+void stamp_close(struct Stamp *h)
+{
+	if (h == NULL)
+		return;
+
+	pthread_mutex_destroy(&h->lock);
+	free(h->dir);
+	free(h->category);
+	free(h);
+}
+
+
+/* Find the id the next note gets. Only the part of the category file
+ * added since the last call is read, unless it was rewritten.
+ */
+static int stamp_next_id(struct Stamp *h)
 {
-	FILE *tmpfp = NULL;
-	FILE *fp = NULL;
-	char *memofile = NULL;
-	char *tmpfile = NULL;
-	int lines = 0;
-
-	tmpfp = get_memo_file_ptr(category, "w", ".tmp");
+	struct NoteReader reader;
+	struct NoteView note;
+	struct stat st;
+	char *path = get_memo_file_path(h->category);
+	int got;
 
-	if (tmpfp == NULL)
+	if (path == NULL)
 		return -1;
 
-	fp = get_memo_file_ptr(category, "r", "");
+	if (stamp_stat(path, &st) == -1) {
+		free(path);
 
-	lines = count_file_lines(fp);
+		if (errno != ENOENT)
+			return -1;
 
-	if (lines == -1) {
-		fail("%s: counting lines failed\n", __func__);
-		fclose(tmpfp);
+		h->ino = 0;
+		h->scanned = 0;
+		h->next_id = 1;
 
-		return -1;
+		return 1;
 	}
 
-	/* Empty file, ignore. */
-	if (lines == -2) {
-		fclose(fp);
-		fclose(tmpfp);
-
-		return -1;
+	if ((uint64_t)st.st_ino != h->ino || st.st_size < h->scanned) {
+		h->ino = st.st_ino;
+		h->scanned = 0;
+		h->next_id = 1;
 	}
 
-	memofile = get_memo_file_path(category);
+	if (st.st_size == h->scanned) {
+		free(path);
+		return h->next_id;
+	}
 
-	if (memofile == NULL) {
-		fail("%s failed to get stamp file path\n", __func__);
-		fclose(fp);
-		fclose(tmpfp);
+	got = note_reader_open_path(&reader, path);
+	free(path);
 
+	if (got == -1 || lseek(reader.fd, h->scanned, SEEK_SET) == -1) {
+		if (got != -1)
+			note_reader_close(&reader);
 		return -1;
 	}
 
-	tmpfile = get_temp_memo_path(category);
+	reader.offset = h->scanned;
 
-	if (tmpfile == NULL) {
-		fail("%s failed to get stamp tmp path\n", __func__);
-		fclose(fp);
-		fclose(tmpfp);
+	while ((got = read_file_note(&reader, &note)) > 0)
+		h->next_id = note.id + 1;
 
-		free(memofile);
+	if (got == 0)
+		h->scanned = reader.offset + reader.length;
 
-		return -1;
-	}
+	note_reader_close(&reader);
 
-	while (lines-- >= 0) {
-		char *line = read_file_line(fp);
+	return got == -1 ? -1 : h->next_id;
+}
 
-		if (!line)
-			continue;
-		char *endptr;
-		int curr_id = strtol(line, &endptr, 10);
-		if (curr_id != id) {
-			fprintf(tmpfp, "%s\n", line);
-			free(line);
-			continue;
-		}
 
-		/* Found the note to be replaced
-		 * Check if user wants to replace the date
-		 * by validating the data as date. Otherwise
-		 * assume content is being replaced.
-		 */
-		char *new_line = NULL;
-		if (is_valid_date_format(data, 1) == 0)
-			new_line = note_part_replace(NOTE_DATE,
-						line, data);
-		else
-			new_line = note_part_replace(NOTE_CONTENT,
-						line, data);
+int stamp_append(struct Stamp *h, const char *message, const char *date)
+{
+	return stamp_append_batch(h, &message, 1, date);
+}
 
-		if (new_line == NULL) {
-			printf("Unable to replace note %d\n", id);
 
-			free(line);
-			free(memofile);
-			free(tmpfile);
-			fclose(fp);
-			fclose(tmpfp);
+int stamp_append_batch(struct Stamp *h, const char *const *messages,
+	size_t count, const char *date)
+{
+	char **copies;
+	off_t end;
+	int id, next = -1;
+	int lock;
+	int retval = -1;
+
+	if (date != NULL && is_valid_date_format(date, 1) == -1) {
+		errno = EINVAL;
+		return -1;
+	}
 
-			return -1;
-		}
+	if ((copies = (char **)calloc(count + 1, sizeof(char *))) == NULL)
+		return -1;
+
+	/* contents are changed on the way */
+	for (size_t i = 0; i < count; i++) {
+		if ((copies[i] = strdup(messages[i])) == NULL)
+			goto out;
+	}
 
-		fprintf(tmpfp, "%s\n", new_line);
+	STAMP_BEGIN(h);
+	if ((lock = category_lock(h->category, 1)) != -1 &&
+	    (id = stamp_next_id(h)) != -1 &&
+	    (next = append_notes(h->category, id, copies, count, date, &end)) != -1) {
+		struct stat st;
+		char *path = get_memo_file_path(h->category);
 
-		free(new_line);
-		free(line);
+		/* unless someone else appended meanwhile, our notes needn't
+		 * be read back next time
+		 */
+		if (path && stamp_stat(path, &st) == 0 && st.st_size == end &&
+		    (uint64_t)st.st_ino == h->ino) {
+			h->scanned = end;
+			h->next_id = next;
+		}
+
+		free(path);
 	}
 
-	if (file_exists(memofile))
-		remove(memofile);
+	if (lock != -1)
+		close(lock);
+	STAMP_END(h);
 
-	rename(tmpfile, memofile);
-	remove(tmpfile);
+	if (next != -1)
+		retval = next > id ? id : 0;
 
-	free(memofile);
-	free(tmpfile);
-	fclose(fp);
-	fclose(tmpfp);
+out:
+	for (size_t i = 0; i < count; i++)
+		free(copies[i]);
+	free(copies);
 
-	return 0;
+	return retval;
 }
 
 
-/* .stamp file format is following:
- *
- * id     date           content
- * |      |              |
- * |- id  |- yyy-MM-dd   |- actual note
- *
- * sections are separated by a tab character
- *
- * Parameter date can be NULL. If date is given in valid
- * format(yyyy-MM-dd) it will be used for creating the note. If date is
- * NULL, current date will be used instead.
+/* Hand the notes of h that contain term, or all of them when term is
+ * NULL, to callback until it returns nonzero.
  */
-static int add_note(char *category, char *content, const char *date)
+static int stamp_scan(struct Stamp *h, const char *term,
+	StampCallback callback, void *arg)
 {
-	FILE *fp = NULL;
-	time_t t;
-	struct tm *ti;
-	int id = -1;
-	char note_date[11];
+	struct NoteReader reader;
+	struct NoteView note;
+	struct StampNote record;
+	int count = 0;
+	int got;
 
-	/* Do not add an empty note */
-	if (strlen(content) == 0)
+	STAMP_BEGIN(h);
+	if (note_reader_open(&reader, h->category) == -1) {
+		STAMP_END(h);
 		return -1;
+	}
 
-	remove_content_newlines(content);
+	while ((got = read_file_note(&reader, &note)) > 0) {
+		if (term != NULL && (note.message == NULL ||
+		    strstr(note.message, term) == NULL))
+			continue;
 
-	fp = get_memo_file_ptr(category, "a", "");
+		record.id = note.id;
+		record.date = note.date;
+		record.message = note.message ? note.message : "";
+		record.length = note.length;
+		record.line = note.line;
+		record.line_length = note.line_length;
+		count++;
 
-	if (fp == NULL) {
-		fail("%s: Error opening stamp path\n", __func__);
-		return -1;
+		if (callback(&record, arg) != 0)
+			break;
 	}
 
-	id = get_next_id(category);
+	note_reader_close(&reader);
+	STAMP_END(h);
 
-	if (id == -1)
-		id = 1;
+	return got == -1 ? -1 : count;
+}
 
-	if (date != NULL) {
-		/* Date is already validated, so just copy it
-		 * for later use.
-		 */
-		strcpy(note_date, date);
-	} else {
 
-		time(&t);
-		ti = localtime(&t);
+int stamp_iterate(struct Stamp *h, StampCallback callback, void *arg)
+{
+	return stamp_scan(h, NULL, callback, arg);
+}
 
-		strftime(note_date, 11, "%Y-%m-%d", ti);
+
+int stamp_search(struct Stamp *h, const char *term, StampCallback callback,
+	void *arg)
+{
+	return stamp_scan(h, term, callback, arg);
+}
+
+
+int stamp_delete(struct Stamp *h, int id)
+{
+	int retval;
+
+	STAMP_BEGIN(h);
+	retval = delete_note(h->category, id);
+	STAMP_END(h);
+
+	return retval;
+}
+
+
+int stamp_replace(struct Stamp *h, int id, const char *message,
+	const char *date)
+{
+	int retval = 0;
+
+	if (date != NULL && is_valid_date_format(date, 1) == -1) {
+		errno = EINVAL;
+		return -1;
 	}
 
+	STAMP_BEGIN(h);
+	if (message != NULL)
+		retval = replace_note_part(h->category, id, NOTE_CONTENT, message);
+	if (retval == 0 && date != NULL)
+		retval = replace_note_part(h->category, id, NOTE_DATE, date);
+	STAMP_END(h);
 
-	fprintf(fp, "%d\t%s\t%s\n", id, note_date,
-		content);
+	return retval;
+}
 
-	fclose(fp);
 
-	return id;
+int stamp_format_date(int day, char *buf)
+{
+	return format_date(day == STAMP_NO_DATE ? NOTE_NO_DATE : day, buf);
 }
 
 
@@ -1487,21 +11190,69 @@ static void usage()
 OPTIONS\n\
 \n\
     -a <category> <content> [yyyy-MM-dd]       Add a new note with optional date\n\
+    -A [category]                              Archive notes older than the\n\
+                                               retention of category, or of\n\
+                                               all categories\n\
+    -b <category> <search> [k]                 Show the k best matching notes\n\
+    -c <category> <to> <ids>/<search>          Copy notes to another category,\n\
+                                               digits, commas and dashes being\n\
+                                               ids unless --search is given\n\
     -d <category> <id>                         Delete note by id\n\
     -D <category>                              Delete all notes\n\
-    -e <category> <path>                       Export notes as html to a file\n\
+    -e <category> <path> [html|json|csv]       Export notes to a file\n\
+    -E <directory>                             Export all categories as a site\n\
     -f <category> <search>                     Find notes by search term\n\
     -F <category> <regex>                      Find notes by regular expression\n\
     -i <category>                              Read from stdin until ^D\n\
+    -I <category>                              Build the substring index used\n\
+                                               by -f\n\
     -l <category> <n>                          Show latest n notes\n\
     -L                                         List all categories\n\
+    -m <category> <to> <ids>/<search>          Move notes to another category,\n\
+                                               selected like -c\n\
     -o <category>                              Show all notes organized by date\n\
     -p                                         Show current stamp file path\n\
     -r <category> <id> [content]/[yyyy-MM-dd]  Replace note content or date\n\
+    -R <category> [path]                       Renumber notes from 1, writing\n\
+                                               old and new ids to path\n\
     -s <category>                              Show all notes\n\
+    -S [category]                              Show statistics of a category,\n\
+                                               or of all categories\n\
+    -t <category> <tags>                       Find notes by #tags, with AND,\n\
+                                               OR, NOT and parentheses\n\
+    -u <category>                              Show duplicate notes\n\
+    -U <category>                              Remove duplicate notes\n\
+    -w [category]                              Print notes added to category,\n\
+                                               or to all categories, as they\n\
+                                               come in\n\
+    -z <category> <search> [k]                 Find notes with at most k typos,\n\
+                                               fewer than search has bytes\n\
 \n\
     -h                                         Show short help and exit. This page\n\
     -V                                         Show version number of program\n\
+\n\
+    --stats                                    Report I/O counters and timings\n\
+                                               to stderr after each command\n\
+    --trace=<path>                             Write a Chrome trace of the run\n\
+    --incremental                              Let -e only append notes added\n\
+                                               since the last export to a path\n\
+    --query                                    Let -f take a query of terms with\n\
+                                               AND, OR, NOT and parentheses\n\
+    --sort=<date|id|length>                    Let -s, -f and -F output notes in\n\
+                                               this order\n\
+    --reverse                                  Reverse the order of --sort\n\
+    --offset <n> --limit <m>                   Let -s, -o, -f and -F skip n\n\
+                                               notes and show at most m\n\
+    --same-date                                Let -u, -U and --skip-duplicates\n\
+                                               only match notes of the same date\n\
+    --skip-duplicates                          Let -i skip notes already there\n\
+    --include-archive                          Let -s, -o, -f, -F, -l and -z\n\
+                                               read archived notes too\n\
+    --format=<csv|tsv|jsonl>                   Let -i import notes with their\n\
+                                               dates and ids\n\
+    --ignore-case                              Let -f ignore case\n\
+    --count                                    Let -f only count the matches\n\
+    --search                                   Let -m and -c search for numbers\n\
 \n\
 For more information and examples see man stamp(1).\n\
 \n\
@@ -1526,26 +11277,184 @@ static void show_memo_file_path()
 		fail("%s: can't retrieve path\n", __func__);
 	else
 		printf("%s\n", path);
+
+	free(path);
+}
+
+
+/* Long options are stripped from argv before getopt sees them, so the
+ * positional argv[2], argv[3], ... lookups in main keep working no matter
+ * where on the command line they were given.
+ */
+static void parse_long_options(int *argc, char *argv[])
+{
+	int kept = 1;
+
+	for (int i = 1; i < *argc; i++) {
+		if (strcmp(argv[i], "--stats") == 0) {
+			stats_enabled = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--count") == 0) {
+			count_only = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--ignore-case") == 0) {
+			ignore_case = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--query") == 0) {
+			query_enabled = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--incremental") == 0) {
+			export_incremental = 1;
+			continue;
+		}
+
+		if (strncmp(argv[i], "--sort=", 7) == 0) {
+			if (strcmp(argv[i] + 7, "date") == 0)
+				sort_key = SORT_DATE;
+			else if (strcmp(argv[i] + 7, "id") == 0)
+				sort_key = SORT_ID;
+			else if (strcmp(argv[i] + 7, "length") == 0)
+				sort_key = SORT_LENGTH;
+			else {
+				fail("invalid sort order: %s\n", argv[i] + 7);
+				exit(1);
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--offset") == 0 || strcmp(argv[i], "--limit") == 0) {
+			char *end = NULL;
+			long v = i + 1 < *argc ? strtol(argv[i + 1], &end, 10) : -1;
+
+			if (end == NULL || end == argv[i + 1] || *end != '\0' || v < 0) {
+				fail("%s needs a number of notes\n", argv[i]);
+				exit(1);
+			}
+
+			if (argv[i][2] == 'o')
+				page.offset = v;
+			else
+				page.limit = v;
+
+			i++;
+			continue;
+		}
+
+		if (strncmp(argv[i], "--format=", 9) == 0) {
+			if (strcmp(argv[i] + 9, "csv") == 0)
+				import_format = IMPORT_CSV;
+			else if (strcmp(argv[i] + 9, "tsv") == 0)
+				import_format = IMPORT_TSV;
+			else if (strcmp(argv[i] + 9, "jsonl") == 0)
+				import_format = IMPORT_JSONL;
+			else {
+				fail("invalid import format: %s\n", argv[i] + 9);
+				exit(1);
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--search") == 0) {
+			select_search = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--include-archive") == 0) {
+			include_archive = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--same-date") == 0) {
+			dedup_same_date = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--skip-duplicates") == 0) {
+			skip_duplicates = 1;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--reverse") == 0) {
+			sort_reverse = 1;
+			if (sort_key == SORT_NONE)
+				sort_key = SORT_ID;
+			continue;
+		}
+
+		if (strncmp(argv[i], "--trace=", 8) == 0) {
+			trace_open(argv[i] + 8);
+			continue;
+		}
+
+		argv[kept++] = argv[i];
+	}
+
+	argv[kept] = NULL;
+	*argc = kept;
 }
 
 
-/* Program entry point */
-int main(int argc, char *argv[])
+/* The command line, main() in main.c only calls this */
+int stamp_main(int argc, char *argv[])
 {
 	int c;
 	int has_valid_options = 0;
 	opterr = 0;
 
+	/* phases are only timed on this thread */
+	stats_main_thread = 1;
+
+	char *env_stats = getenv("STAMP_STATS");
+	if (env_stats && *env_stats && strcmp(env_stats, "0") != 0 &&
+	    strcmp(env_stats, "no") != 0)
+		stats_enabled = 1;
+
+	char *env_trace = getenv("STAMP_TRACE");
+	if (env_trace && *env_trace)
+		trace_open(env_trace);
+
+	parse_long_options(&argc, argv);
+
+	if (stats_enabled)
+		clock_gettime(CLOCK_MONOTONIC, &stats_command_start);
+
 	if (argc == 1) {
 		usage();
 		return -1;
 	}
 
+	/* a reader going away is noticed as EPIPE by output_flush */
+	signal(SIGPIPE, SIG_IGN);
+
 	int ret = 0;
 	int result;
-	while ((c = getopt(argc, argv, "a:d:D:e:f:F:hi:l:Lo:pr:s:V")) != -1){
+	while ((c = getopt(argc, argv, "Aa:b:c:d:D:e:E:f:F:hi:I:l:Lm:o:pr:R:s:St:u:U:Vwz:")) != -1){
 		has_valid_options = 1;
 
+		/* only -f counts matches */
+		if (count_only && c != 'f') {
+			fail("--count can only be used with -f\n");
+			return 1;
+		}
+
+		if (select_search && c != 'm' && c != 'c') {
+			fail("--search can only be used with -m and -c\n");
+			return 1;
+		}
+
+		/* --sort collects what these output and sorts it after */
+		if (sort_key != SORT_NONE && !count_only &&
+		    (c == 's' || c == 'f' || c == 'F') && sorter_begin(&sorter) == -1)
+			return 2;
+
 		switch(c) {
 
 			case 'a':
@@ -1558,27 +11467,99 @@ int main(int argc, char *argv[])
 						ret = 1;
 				} else
 					add_note(argv[2], argv[3], NULL);
+
+				if (ret == 0)
+					archive_on_write(argv[2], argc > 4 ?
+						parse_date(argv[4], strlen(argv[4])) : NOTE_NO_DATE);
+				break;
+			case 'A':
+				if (archive_expired(argc > 2 ? argv[2] : NULL) == -1)
+					ret = 2;
+				break;
+			case 'b': {
+				ARGCHECK("b", 4, "search string");
+				int k = argc > 4 ? atoi(argv[4]) : BM25_DEFAULT_K;
+
+				if (k <= 0) {
+					fail("invalid number of results: %s\n", argv[4]);
+					ret = 1;
+				} else if ((result = search_ranked(argv[2], argv[3], k)) <= 0)
+					ret = 2;
+				break;
+			}
+			case 'c':
+			case 'm':
+				ARGCHECK(c == 'c' ? "c" : "m", 5, "destination and ids or search");
+				if ((result = transfer_notes(argv[2], argv[3], argv[4],
+				    c == 'c')) == -1)
+					ret = 2;
+				else
+					printf("%s %d notes from %s to %s\n",
+						c == 'c' ? "copied" : "moved", result,
+						argv[2], argv[3]);
 				break;
 			case 'd':
 				ARGCHECK("d", 4, "ID");
 				if ((result = delete_note(argv[2], atoi(argv[3]))) != 0)
 					ret = 2;
+				else
+					printf("note %d removed from category %s\n", atoi(argv[3]),
+						argv[2]);
 				break;
 			case 'D':
 				if ((result = delete_all(optarg)) != 0)
 					ret = 2;
 				break;
-			case 'e':
+			case 'e': {
 				ARGCHECK("e", 4, "path");
-				export_html(argv[2], argv[3]);
+				ExportFormat_t format = export_format(argc > 4 ? argv[4] : NULL,
+					argv[3]);
+
+				if (format == 0) {
+					fail("invalid export format: %s\n", argv[4]);
+					ret = 1;
+				} else if (export_notes(argv[2], argv[3], format) == NULL)
+					ret = 2;
+				break;
+			}
+			case 'E':
+				if (export_site(optarg) == -1)
+					ret = 2;
 				break;
+			case 'z': {
+				ARGCHECK("z", 4, "search string");
+				int k = argc > 4 ? atoi(argv[4]) : FUZZY_DEFAULT_K(strlen(argv[3]));
+
+				if (k < 0) {
+					fail("invalid number of typos: %s\n", argv[4]);
+					ret = 1;
+				} else if ((result = fuzzy_search(argv[2], argv[3], k)) <= 0)
+					ret = 2;
+				break;
+			}
 			case 'f':
 				ARGCHECK("f", 4, "search string");
-				if ((result = search_notes(argv[2], argv[3])) == 0)
+				if ((result = cache_replay(c, argv[2], argv[3])) != -1) {
+					ret = result;
+					break;
+				}
+
+				if (query_enabled)
+					result = search_query(argv[2], argv[3]);
+				else
+					result = search_notes(argv[2], argv[3]);
+
+				/* a query that doesn't parse fails like -t */
+				if (result == 0 || (query_enabled && result == -1))
 					ret = 2;
 				break;
 			case 'F':
 				ARGCHECK("F", 4, "regex");
+				if ((result = cache_replay(c, argv[2], argv[3])) != -1) {
+					ret = result;
+					break;
+				}
+
 				if ((result = search_regexp(argv[2], argv[3])) == 0)
 					ret = 2;
 				break;
@@ -1586,9 +11567,27 @@ int main(int argc, char *argv[])
 				usage();
 				break;
 			case 'i':
-				add_notes_from_stdin(optarg);
+				if (import_format == IMPORT_NONE) {
+					add_notes_from_stdin(optarg);
+					archive_on_write(optarg, NOTE_NO_DATE);
+				} else if ((result = import_notes(optarg, import_format)) == -1)
+					ret = 2;
+				else if (result > 0 && (result = retain_days(optarg)) > 0)
+					/* imported notes can be of any date */
+					archive_notes(optarg, result);
+				break;
+			case 'I':
+				if ((result = sa_build(optarg)) == -1)
+					ret = 2;
+				else
+					printf("indexed %d notes of %s\n", result, optarg);
 				break;
 			case 'o':
+				if ((result = cache_replay(c, optarg, "")) != -1) {
+					ret = result;
+					break;
+				}
+
 				show_notes_tree(optarg);
 				break;
 			case 'l':
@@ -1606,14 +11605,43 @@ int main(int argc, char *argv[])
 				ARGCHECK("r", 5, "id, content or date");
 				replace_note(argv[2], atoi(argv[3]), argv[4]);
 				break;
+			case 'R':
+				if ((result = renumber_notes(optarg,
+				    argc > 3 ? argv[3] : NULL)) == -1)
+					ret = 2;
+				else
+					printf("renumbered notes of %s, %d ids changed\n",
+						optarg, result);
+				break;
 			case 's':
 				show_notes(optarg);
 				break;
+			case 'S':
+				if ((result = show_note_stats(argc > 2 ? argv[2] : NULL)) <= 0)
+					ret = 2;
+				break;
+			case 'u':
+				if ((result = dedup_notes(optarg, 0)) <= 0)
+					ret = 2;
+				break;
+			case 'U':
+				if ((result = dedup_notes(optarg, 1)) <= 0)
+					ret = 2;
+				break;
+			case 't':
+				ARGCHECK("t", 4, "tag expression");
+				if ((result = search_tags(argv[2], argv[3])) <= 0)
+					ret = 2;
+				break;
 			case 'V':
 				printf("Stamp version %.1f\n", VERSION);
 				break;
+			case 'w':
+				if (watch_notes(argc > 2 ? argv[2] : NULL) == -1)
+					ret = 2;
+				break;
 			case '?': {
-				char *copts = "adDefFilors";
+				char *copts = "abcdDeEfFiIlmorRstuUz";
 				int coptfound = 0;
 				for (int i = 0; i < strlen(copts); i++) {
 					if (copts[i] == optopt) {
@@ -1633,6 +11661,19 @@ int main(int argc, char *argv[])
 				break;
 			}
 		}
+
+		if (sorter.active && sorter_end(&sorter) == -1)
+			ret = 2;
+
+		output_flush(&output);
+
+		if (cache.active)
+			cache_store(&cache, ret);
+
+		output_flush(&output);
+
+		if (c != '?')
+			stats_report(c);
 	}
 
 	if (argc > 1 && !has_valid_options)
@@ -39,49 +39,997 @@ typedef enum {
 
 } NotePart_t;
 
-struct Note {
-    int  id;
-    char date[10];
-    char *message;
+typedef enum {
+    EXPORT_HTML = 1,
+    EXPORT_JSON,
+    EXPORT_CSV
+} ExportFormat_t;
+
+typedef enum {
+    IMPORT_NONE = 0,
+    IMPORT_CSV,
+    IMPORT_TSV,
+    IMPORT_JSONL
+} ImportFormat_t;
+
+typedef enum {
+    SORT_NONE = 0,
+    SORT_DATE,
+    SORT_ID,
+    SORT_LENGTH
+} SortKey_t;
+
+typedef enum {
+    ROARING_AND = 1,
+    ROARING_OR,
+    ROARING_ANDNOT
+} RoaringOp_t;
+
+typedef enum {
+    QUERY_TERM = 1,
+    QUERY_AND,
+    QUERY_OR,
+    QUERY_NOT
+} QueryOp_t;
+
+typedef enum {
+    QUERY_TOKEN_END = 0,
+    QUERY_TOKEN_TERM,
+    QUERY_TOKEN_AND,
+    QUERY_TOKEN_OR,
+    QUERY_TOKEN_NOT,
+    QUERY_TOKEN_OPEN,
+    QUERY_TOKEN_CLOSE
+} QueryToken_t;
+
+/* A note as found in a category file. Nothing is owned: message and
+ * line point into the buffer the note was parsed from and are not
+ * nul terminated by parse_note.
+ */
+struct NoteView {
+    int         id;
+    int         date;        /* days since 1970-01-01 or NOTE_NO_DATE */
+    const char *message;
+    size_t      length;      /* of message */
+    const char *line;        /* the whole line, without newline */
+    size_t      line_length;
+};
+
+#define NOTE_NO_DATE (-2147483647 - 1)
+#define DATE_LEN     10
+
+#define ARENA_ALIGN      16
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t             size;
+    size_t             used;
+    char               data[];
+};
+
+struct Arena {
+    struct ArenaBlock *head;
+};
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_IOV_MAX     64
+#define OUTPUT_SPAN_MIN    1024
+
+/* Output is collected in buffer and written with writev. Messages of
+ * OUTPUT_SPAN_MIN bytes or more are not copied but referenced by an
+ * iovec into the buffer they were read into.
+ */
+struct Cache;
+
+struct Output {
+    int          fd;
+    char        *buffer;
+    size_t       length;
+    size_t       mark;        /* buffer up to here is in iov already */
+    struct iovec iov[OUTPUT_IOV_MAX];
+    int          iovcnt;
+    int          broken;      /* EPIPE, stop producing output */
+    int          done;        /* no more output wanted, see page_take */
+    struct Cache *tee;        /* gets a copy of what's written */
+};
+
+/* Handle of libstamp */
+struct Stamp {
+    pthread_mutex_t lock;
+    char           *dir;
+    char           *category;
+    uint64_t        ino;      /* of the category file when last read */
+    off_t           scanned;  /* up to here */
+    int             next_id;  /* after the notes up to there */
+};
+
+/* Result cache (STAMP_CACHE_SIZE), see cache_replay */
+#define CACHE_DIR   ".cache"
+#define CACHE_MAGIC "stampca1"
+
+struct CacheHeader {
+    char     magic[8];
+    uint32_t key_length;      /* of the key that follows */
+    int32_t  ret;             /* exit code of the command */
+    uint64_t output_length;   /* of the output after the key */
+};
+
+struct Cache {
+    int    active;
+    int    failed;
+    size_t max_size;
+    char  *key;
+    size_t key_length;
+    char  *dir;
+    char  *path;              /* of the entry */
+    char  *data;              /* output captured */
+    size_t length;
+    size_t size;
+};
+
+struct CacheEntry {
+    char  *path;
+    time_t mtime;
+    off_t  size;
+};
+
+/* --offset and --limit */
+struct Page {
+    long offset;
+    long limit;               /* -1 for no limit */
+    long seen;
+    long shown;
+};
+
+/* Offset of every CHECKPOINT_INTERVAL-th note, see checkpoint_load */
+#define CHECKPOINT_SUFFIX   ".ckpt"
+#define CHECKPOINT_MAGIC    "stampck1"
+#define CHECKPOINT_INTERVAL 4096
+
+struct CheckpointHeader {
+    char     magic[8];
+    uint64_t ino;             /* of the category file */
+    uint64_t size;            /* read up to here */
+    uint64_t notes;           /* in that part */
+    uint32_t interval;
+    uint32_t count;           /* of offsets that follow */
+};
+
+struct Checkpoints {
+    struct CheckpointHeader header;
+    uint64_t               *offsets;
+    size_t                  size;
+};
+
+#define READER_BUFFER_SIZE (1024 * 1024)
+
+/* Reads a category file in large blocks, handing out NoteViews
+ * into its buffer.
+ */
+struct NoteReader {
+    int            fd;
+    struct Output *sink;      /* flushed before the buffer is reused */
+    char          *buffer;
+    size_t         size;
+    size_t         length;
+    size_t         pos;
+    int            eof;
+    off_t          offset;    /* of buffer[0] in the file */
+    int            archive_fd;  /* read before category_fd with */
+    int            category_fd; /* --include-archive, or -1 */
+};
+
+
+/* Where the last export of a category to a file left off */
+#define WATERMARK_DIR ".export"
+
+struct Watermark {
+    ExportFormat_t format;
+    int            last_id;
+    off_t          offset;       /* exported bytes of the category file */
+    ino_t          ino;          /* of the category file */
+    ino_t          out_ino;      /* of the exported file */
+    off_t          out_offset;   /* start of the footer */
+};
+
+/* export_site state, shared by its worker threads */
+#define SITE_PAGE_SIZE   1000
+#define SITE_MAX_THREADS 64
+#define SITE_MANIFEST    ".stamp-export"
+
+struct SiteCategory {
+    char   *name;
+    char   *dir;          /* in the export, see site_encode */
+    char   *path;         /* of the category file */
+    ino_t   ino;
+    off_t   size;
+    time_t  mtime;
+    int     notes;
+    int     pages;
+    int     prev_pages;   /* from the manifest */
+    int     skip;         /* unchanged since the last export */
+    int     failed;
+};
+
+struct SiteExport {
+    const char          *dir;
+    struct SiteCategory *categories;
+    int                  count;
+    int                  next;        /* claimed by workers atomically */
+    int                  page_size;
+};
+
+/* import_notes state. The main thread cuts stdin into chunks of whole
+ * records, worker threads parse them into the date and message of each
+ * note and the main thread writes them out in order.
+ */
+#define IMPORT_CHUNK       (1 << 20)
+#define IMPORT_MAX_THREADS 16
+
+struct ImportChunk {
+    char               *data;         /* records read from stdin */
+    size_t              length;
+    long                line;         /* of the first record */
+    long                lines;        /* newlines in data */
+    int                 first;        /* of the input, may be a header */
+    size_t              skip;         /* the header, see import_layout */
+    int                 parsed;       /* 0 queued, 1 claimed, 2 parsed */
+    char               *notes;        /* "yyyy-MM-dd\tmessage\n" each */
+    size_t              notes_length;
+    int                *ids;          /* given per note, 0 when not */
+    int                 count;
+    long                error;        /* line of a bad record, 0 if none */
+    const char         *reason;
+    struct ImportChunk *next;
+};
+
+struct Import {
+    ImportFormat_t      format;
+    char                today[DATE_LEN + 1];
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;         /* a chunk was queued or parsed */
+    struct ImportChunk *head;         /* in input order */
+    struct ImportChunk *tail;
+    int                 queued;
+    int                 done;         /* no more chunks are coming */
+    char               *buffer;       /* read from stdin, not cut yet */
+    size_t              size;
+    size_t              length;
+    size_t              scanned;
+    size_t              cut;          /* past the last whole record */
+    long                scanned_lines;
+    long                cut_lines;
+    long                line;
+    int                 quoted;       /* at scanned, for CSV */
+    int                 columns;      /* of CSV and TSV records, 2 or 3 */
+    int                 eof;
+};
+
+/* -w, one WatchFile per category file followed */
+#define WATCH_READ_SIZE (64 * 1024)
+
+struct WatchFile {
+    char  *name;
+    int    fd;
+    ino_t  ino;
+    off_t  offset;            /* past the last whole line read */
+    int    last_id;           /* printed */
+};
+
+struct Watch {
+    char             *dir;
+    const char       *only;   /* category, NULL for all */
+    struct WatchFile *files;
+    int               count;
+    char             *buffer;
+    size_t            size;
+};
+
+/* Boolean queries for -f --query, the terms found in a note are a
+ * bitset the postfix program is evaluated on
+ */
+#define QUERY_MAX_TERMS 64
+
+struct QueryOp {
+    QueryOp_t op;
+    int       term;
+};
+
+struct Query {
+    struct QueryOp *program;      /* postfix */
+    int             length;
+    char           *stack;        /* for evaluating program */
+    char           *terms[QUERY_MAX_TERMS];
+    size_t          term_lengths[QUERY_MAX_TERMS];
+    int             nterms;
+    int            *delta;        /* Aho-Corasick transitions, 256 per state */
+    uint64_t       *out;          /* terms found on entering each state */
+    int             states;
+    const char     *pos;          /* of the parser */
+};
+
+/* The notes -m and -c take: ids and ranges of them, such as 3,5,10-20,
+ * or a search as for -f
+ */
+struct IdRange {
+    int from;
+    int to;
+};
+
+struct NoteFilter {
+    struct IdRange *ranges;       /* sorted, NULL for a search */
+    int             count;
+    int             next;         /* first range the next id may be in */
+    const char     *search;
+    size_t          search_length;
+    struct Query    query;        /* with --query */
+};
+
+/* Where a note went when its category was renumbered (-R) */
+struct RenumberNote {
+    int32_t  old_id;
+    int32_t  new_id;
+    uint64_t old_offset;
+    uint64_t new_offset;
+};
+
+/* Indexes of a category live in <stamp path>/.index/<category><suffix> */
+#define INDEX_DIR ".index"
+
+/* Archived notes are moved to a hidden directory of the stamp path */
+#define ARCHIVE_DIR ".archive"
+#define RETAIN_DAYS "STAMP_RETAIN_DAYS"
+
+/* Ranked search, see bm25_build for the layout of the index */
+#define BM25_SUFFIX      ".bm25"
+#define BM25_MAGIC       "stampbm1"
+#define BM25_K1          1.2
+#define BM25_B           0.75
+#define BM25_BLOCK_SIZE  128
+#define BM25_MAX_WORD    64
+#define BM25_MAX_TERMS   32
+#define BM25_DEFAULT_K   10
+#define BM25_NONE        0xffffffffu
+/* float sums of bounds may round below the exact score */
+#define BM25_BOUND_SLACK 1.0001f
+#define BM25_WORD_CHAR(c) (isalnum((unsigned char)(c)) || (unsigned char)(c) >= 0x80)
+
+struct Bm25Header {
+    char     magic[8];
+    uint64_t ino;             /* of the category file indexed */
+    uint64_t size;
+    int64_t  mtime;
+    uint32_t notes;
+    uint32_t terms;
+    uint32_t blocks;
+    uint32_t postings;
+    uint64_t strings_length;
+    double   avg_length;      /* of notes, in words */
+};
+
+struct Bm25Doc {
+    uint64_t offset;          /* of the note's line */
+    int32_t  id;
+    uint32_t length;          /* in words */
+};
+
+struct Bm25Term {
+    uint32_t string;          /* offset in the strings */
+    uint32_t length;
+    uint32_t df;              /* notes containing the term */
+    uint32_t block;           /* first of its blocks */
+    uint32_t posting;         /* first of its postings */
+    float    idf;
+    float    max_score;
+};
+
+struct Bm25Block {
+    uint32_t last_doc;
+    float    max_score;
+};
+
+struct Bm25Posting {
+    uint32_t doc;             /* index in the docs */
+    uint32_t tf;
+};
+
+/* Terms while building the index */
+struct Bm25Word {
+    char               *word;
+    uint32_t            length;
+    uint32_t            hash;
+    struct Bm25Posting *postings;
+    uint32_t            count;
+    uint32_t            size;
+};
+
+struct Bm25Builder {
+    struct Arena     arena;       /* of the words */
+    struct Bm25Word *words;
+    uint32_t         nwords;
+    uint32_t         words_size;
+    uint32_t        *table;       /* open addressing, indexes of words */
+    uint32_t         table_size;
+    struct Bm25Doc  *docs;
+    uint32_t         ndocs;
+    uint32_t         docs_size;
+    uint64_t         total_length;
+};
+
+struct Bm25Index {
+    void                     *map;
+    size_t                    map_size;
+    const struct Bm25Header  *header;
+    const struct Bm25Doc     *docs;
+    const struct Bm25Term    *terms;
+    const struct Bm25Block   *blocks;
+    const struct Bm25Posting *postings;
+    const char               *strings;
+    int                       corrupt;  /* found out while searching */
+};
+
+struct Bm25Cursor {
+    const struct Bm25Term    *term;
+    const struct Bm25Posting *postings;
+    const struct Bm25Block   *blocks;
+    uint32_t                  pos;
+    uint32_t                  block;
+    uint32_t                  notes;   /* of the index */
+    uint32_t                  doc;     /* BM25_NONE when exhausted */
+};
+
+struct Bm25Hit {
+    float    score;
+    uint32_t doc;
+};
+
+/* Roaring style bitmaps of note ids: per 65536 ids a container that's
+ * a sorted array of the low halves up to ROARING_ARRAY_MAX of them and
+ * a bitmap beyond
+ */
+#define ROARING_ARRAY_MAX    4096
+#define ROARING_BITMAP_WORDS 1024
+#define ROARING_ARRAY        1
+#define ROARING_BITMAP       2
+
+struct RoaringContainer {
+    uint16_t  key;            /* high half of the ids */
+    uint32_t  cardinality;
+    uint32_t  capacity;       /* of array */
+    uint16_t *array;
+    uint64_t *bits;           /* set instead of array when full */
+};
+
+struct Roaring {
+    struct RoaringContainer *containers;   /* sorted by key */
+    uint32_t                 count;
+    uint32_t                 size;
+};
+
+/* Tag index (-t), see tag_index_write and tag_index_read */
+#define TAG_SUFFIX       ".tags"
+#define TAG_LOG_SUFFIX   ".tags.log"
+#define TAG_MAGIC        "stamptg1"
+#define TAG_MAX_LENGTH   64
+#define TAG_LOG_MAX      1024
+#define TAG_SEEK_FRACTION 64    /* seek to results when fewer notes match */
+#define TAG_CHAR(c) (isalnum((unsigned char)(c)) || (c) == '_' || (c) == '-' || \
+    (unsigned char)(c) >= 0x80)
+
+struct TagHeader {
+    char     magic[8];
+    uint64_t ino;             /* of the category file indexed */
+    uint64_t size;
+    uint32_t tags;
+    uint32_t notes;
+};
+
+/* Where to find a tagged note */
+struct TagNote {
+    int32_t  id;
+    uint32_t unused;
+    uint64_t offset;
+};
+
+struct TagEntry {
+    char          *name;
+    uint32_t       length;
+    struct Roaring ids;
+};
+
+struct TagIndex {
+    uint64_t         ino;
+    uint64_t         size;    /* of the category file covered */
+    struct Roaring   all;     /* ids of all notes, for NOT */
+    struct TagEntry *tags;
+    uint32_t         ntags;
+    uint32_t         tags_size;
+    uint32_t        *table;   /* open addressing, indexes of tags */
+    uint32_t         table_size;
+    struct TagNote  *notes;
+    uint32_t         nnotes;
+    uint32_t         notes_size;
+};
+
+/* Duplicate detection (-u, -U, --skip-duplicates), see dedup_find */
+#define DEDUP_MEMORY (1ull << 63)  /* where is in DedupTable.memory */
+
+struct DedupEntry {
+    uint64_t hash;
+    uint64_t where;
+};
+
+struct DedupTable {
+    struct DedupEntry *entries;
+    size_t             size;
+    size_t             count;
+    int                fd;          /* of the category file */
+    char              *buffer;      /* for note_pread */
+    size_t             buffer_size;
+    const char        *memory;      /* notes being added */
+    int                memory_date;
+};
+
+struct DedupCursor {
+    const char *p;
+    const char *end;
+    int         space;
+    int         started;
+};
+
+/* Sorted output (--sort), see sorter_begin */
+#define SORT_MEMORY      (64 << 20)
+#define SORT_MIN_MEMORY  4096
+
+struct SortRecord {
+    int64_t  key;
+    uint64_t seq;             /* order the note came in */
+    size_t   offset;          /* of the line in the block */
+    size_t   length;
+};
+
+struct Sorter {
+    int      active;
+    int      failed;
+    char    *block;
+    size_t   memory;          /* size of block */
+    size_t   used;            /* by lines at its front */
+    size_t   count;           /* records at its back */
+    uint64_t seq;
+    FILE   **runs;
+    int      nruns;
+    int      runs_size;
+};
+
+/* Cursor in a run while merging */
+struct SortRun {
+    FILE             *fp;
+    struct SortRecord record;
+    char             *line;
+    size_t            size;
+};
+
+/* Statistics of notes (-S), see note_stats_report */
+#define TOP_TERMS_CAPACITY   1024  /* words counted by space-saving */
+#define TOP_TERMS_BUCKETS    2048
+#define NOTE_STATS_TOP_TERMS 10
+#define NOTE_STATS_LENGTHS   16    /* powers of two */
+#define NOTE_STATS_BAR       40
+
+struct TopTerm {
+    char     word[BM25_MAX_WORD];
+    size_t   length;
+    uint32_t hash;
+    uint32_t count;
+    uint32_t error;           /* count may be over by this much */
+    int      heap;            /* position in TopTerms.heap */
+    int      next;            /* in the hash bucket, or -1 */
+};
+
+struct TopTerms {
+    struct TopTerm counters[TOP_TERMS_CAPACITY];
+    int            heap[TOP_TERMS_CAPACITY];    /* min-heap by count */
+    int            buckets[TOP_TERMS_BUCKETS];
+    int            count;
+};
+
+struct NoteStats {
+    uint64_t        notes;
+    uint64_t        bytes;
+    size_t          min_length;
+    size_t          max_length;
+    uint32_t        lengths[NOTE_STATS_LENGTHS];
+    uint32_t       *days;     /* notes per day from first_day */
+    int             first_day;
+    uint32_t        ndays;
+    struct TopTerms terms;
+};
+
+/* Substring index (-I), see sa_build */
+#define SA_SUFFIX         ".sa"
+#define SA_MAGIC          "stampsa1"
+#define SA_MAX_LENGTH     0x7fffffff
+#define SA_SEEK_FRACTION  64    /* seek to results when fewer notes match */
+#define SA_PADDING(len)   ((4 - (len) % 4) % 4)
+#define SAIS_CHR(i) (cs == 1 ? ((const unsigned char *)text)[i] : ((const int32_t *)text)[i])
+#define SAIS_LMS(i) ((i) > 0 && t[i] && !t[(i) - 1])
+
+struct SaHeader {
+    char     magic[8];
+    uint64_t ino;             /* of the category file indexed */
+    uint64_t size;
+    uint32_t length;          /* of the text, with its final 0 */
+    uint32_t notes;
+};
+
+struct SaNote {
+    uint64_t offset;          /* of the note's line */
+    uint32_t start;           /* of its message in the text */
+    int32_t  id;
+};
+
+struct SaIndex {
+    void                  *map;
+    size_t                 map_size;
+    const struct SaHeader *header;
+    const struct SaNote   *notes;
+    const char            *text;
+    const int32_t         *sa;
+};
+
+/* Patterns for fuzzy_search fit in a machine word */
+#define FUZZY_MAX_LENGTH 64
+#define FUZZY_DEFAULT_K(len) ((len) < 5 ? 1 : 2)
+
+struct FuzzyPattern {
+    uint64_t peq[256];
+    uint64_t high;        /* bit of the last pattern position */
+    int      length;
+};
+
+/* show_notes_tree groups notes per date */
+struct TreeNote {
+    struct NoteView *note;
+    struct TreeNote *next;
+};
+
+struct TreeDate {
+    int              date;
+    struct TreeNote *head;
+    struct TreeNote *tail;
+};
+
+/* fuzzy_search ranks matches per edit distance */
+struct FuzzyBucket {
+    struct TreeNote *head;
+    struct TreeNote *tail;
+};
+
+/* One complete ("ph":"X") event in the Chrome trace */
+struct TraceEvent {
+    const char *name;
+    uint64_t    start;
+    uint64_t    duration;
+};
+
+#define TRACE_CHUNK_EVENTS 4096
+
+struct TraceChunk {
+    struct TraceEvent  events[TRACE_CHUNK_EVENTS];
+    int                used;
+    struct TraceChunk *next;
+};
+
+/* Every thread records into its own buffer, so recording never
+ * takes a lock. Buffers are only walked once all work is done.
+ */
+struct TraceBuffer {
+    int                 tid;
+    struct TraceChunk  *head;
+    struct TraceChunk  *tail;
+    struct TraceBuffer *next;
+};
+
+struct TraceSpan {
+    const char *name;
+    uint64_t    start;
+};
+
+/* Phases wall time is attributed to by --stats */
+typedef enum {
+    PHASE_NONE = -1,
+    PHASE_CONFIG = 0,
+    PHASE_OPEN,
+    PHASE_PARSE,
+    PHASE_FILTER,
+    PHASE_OUTPUT,
+    PHASE_COUNT
+} Phase_t;
+
+struct Stats {
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long files_opened;
+    unsigned long stat_calls;
+    unsigned long mkdir_calls;
+    unsigned long rename_calls;
+    unsigned long note_allocs;
+    unsigned long notes_scored;
+    double        phase_time[PHASE_COUNT];
 };
 
 static char       *read_file_line(FILE *fp);
-static struct      Note read_file_note(FILE *fp);
+static int         read_file_note(struct NoteReader *reader, struct NoteView *note);
+static int         note_reader_open(struct NoteReader *reader, char *category);
+static int         note_reader_open_path(struct NoteReader *reader, const char *path);
+static void        note_reader_close(struct NoteReader *reader);
+static int         note_reader_rewind(struct NoteReader *reader);
+static int         note_reader_fill(struct NoteReader *reader);
+static off_t       note_offset(const struct NoteReader *reader, const struct NoteView *note);
+static int         note_pread(int fd, off_t offset, char **buffer, size_t *size, struct NoteView *note);
+static int         parse_note(const char *line, size_t len, struct NoteView *note);
+static int         parse_date(const char *str, size_t len);
+static int         format_date(int day, char *buf);
+static const char *note_date_text(const struct NoteView *note, size_t *len);
+static int         days_from_civil(int y, int m, int d);
+static void        civil_from_days(int days, int *y, int *m, int *d);
+static struct NoteView *note_view_copy(struct Arena *arena, const struct NoteView *note);
+static void       *arena_alloc(struct Arena *arena, size_t size);
+static char       *arena_strndup(struct Arena *arena, const char *str, size_t len);
+static void        arena_free(struct Arena *arena);
 static int         add_notes_from_stdin(char *category);
+static int         import_notes(char *category, ImportFormat_t format);
+static struct ImportChunk *import_read(struct Import *imp);
+static int         import_layout(struct Import *imp, struct ImportChunk *chunk);
+static void       *import_worker(void *arg);
+static void        import_parse(struct Import *imp, struct ImportChunk *chunk);
+static long        import_field(const char **p, const char *end, char sep, char *out, int *last);
+static const char *import_csv(struct Import *imp, struct ImportChunk *chunk, const char *p, const char *end, char sep);
+static const char *import_json_space(const char *p, const char *end);
+static long        import_json_string(const char **p, const char *end, char *out);
+static int         import_json_skip(const char **p, const char *end);
+static const char *import_json(struct Import *imp, struct ImportChunk *chunk, const char *p, const char *end);
+static void        import_chunk_free(struct ImportChunk *chunk);
+static int         import_threads();
 static char       *get_memo_file_path(char *category);
 static char       *get_memo_default_path();
 static char       *get_memo_conf_path();
 static char       *get_temp_memo_path(char *category);
 static char       *get_memo_conf_value(const char *prop);
 static int         is_valid_date_format(const char *date, int silent_errors);
+static int         is_valid_date(const char *str, size_t len);
 static int         file_exists(const char *path);
 static void        remove_content_newlines(char *content);
 static int         add_note(char *category, char *content, const char *date);
 static int         replace_note(char *category, int id, const char *data);
 static int         get_next_id(char *category);
+static int         category_lock(char *category, int create);
 static int         delete_note(char *category, int id);
+static int         replace_note_part(char *category, int id, NotePart_t part, const char *data);
+static int         append_notes(char *category, int id, char **contents, size_t count, const char *date, off_t *end);
+static int         stamp_next_id(struct Stamp *h);
+static int         stamp_scan(struct Stamp *h, const char *term, StampCallback callback, void *arg);
+static int         dedup_getc(struct DedupCursor *c);
+static uint64_t    dedup_hash(const char *message, size_t len, int date);
+static int         dedup_equal(const char *a, size_t alen, const char *b, size_t blen);
+static int         dedup_find(struct DedupTable *t, uint64_t hash, const char *message, size_t len, int date, int *id);
+static int         dedup_insert(struct DedupTable *t, uint64_t hash, uint64_t where);
+static void        dedup_free(struct DedupTable *t);
+static int         dedup_notes(char *category, int drop);
 static int         show_notes(char *category);
+static int         tree_date_is(const struct TreeDate *td, const struct NoteView *note);
 static int         show_notes_tree(char *category);
 static int         show_categories();
+static int         page_take(void);
+static int         checkpoint_load(struct NoteReader *reader, char *category, struct Checkpoints *ck);
+static void        checkpoint_store(char *category, const struct Checkpoints *ck);
+static int         checkpoint_seek(struct NoteReader *reader, char *category, long offset);
+static void        top_terms_init(struct TopTerms *top);
+static int         top_terms_less(const struct TopTerms *top, int a, int b);
+static void        top_terms_sift(struct TopTerms *top, int i);
+static void        top_terms_unlink(struct TopTerms *top, int slot);
+static void        top_terms_add(struct TopTerms *top, const char *word, size_t len);
+static int         top_term_cmp(const void *a, const void *b);
+static void        note_stats_init(struct NoteStats *ns);
+static void        note_stats_free(struct NoteStats *ns);
+static int         note_stats_day(struct NoteStats *ns, int day);
+static int         note_stats_collect(struct NoteStats *ns, const char *path);
+static void        note_stats_bar(const char *label, uint32_t value, uint32_t max);
+static void        note_stats_report(const struct NoteStats *ns);
+static int         show_note_stats(char *category);
 static int         count_file_lines(FILE *fp);
-static char       *note_part_replace(NotePart_t part, char *note_line, const char *data);
+static char       *note_part_replace(NotePart_t part, const struct NoteView *note, const char *data);
 static int         search_notes(char *category, const char *search);
 static int         search_regexp(char *category, const char *regexp);
-static const char *export_html(char *category, const char *path);
-static struct Note line_to_Note(char *line);
-static void        output_default(struct Note note);
-static void        output_without_date(struct Note note);
+static int         search_query(char *category, const char *query);
+static int         search_ranked(char *category, const char *search, int k);
+static int         search_tags(char *category, const char *expr);
+static int         count_occurrences(const char *text, const char *needle);
+static void        sais_buckets(const void *text, int32_t *bkt, int32_t n, int32_t k, int cs, int end);
+static void        sais_induce(const void *text, int32_t *sa, const unsigned char *t, int32_t *bkt, int32_t n, int32_t k, int cs);
+static int         sais(const void *text, int32_t *sa, int32_t n, int32_t k, int cs);
+static int         sa_build(char *category);
+static void        sa_invalidate(char *category);
+static int         sa_open(char *category, const char *path, struct SaIndex *idx);
+static void        sa_close(struct SaIndex *idx);
+static int         sa_compare(const struct SaIndex *idx, int32_t pos, const char *pattern, size_t len);
+static void        sa_range(const struct SaIndex *idx, const char *pattern, size_t len, uint32_t *lo, uint32_t *hi);
+static uint32_t    sa_note(const struct SaIndex *idx, uint32_t pos);
+static int         sa_note_cmp(const void *a, const void *b);
+static int         sa_search(char *category, const char *search, int *handled);
+static int         index_exists(char *category, const char *suffix);
+static void        index_remove(char *category);
+static int         cache_replay(char command, char *category, const char *query);
+static void        cache_capture(struct Cache *ca, const struct iovec *iov, int iovcnt);
+static void        cache_store(struct Cache *ca, int ret);
+static int         cache_entry_cmp(const void *a, const void *b);
+static void        cache_evict(const char *dir, size_t max_size);
+static void        cache_free(struct Cache *ca);
+static struct RoaringContainer *roaring_container(struct Roaring *r, uint16_t key, int create);
+static int         roaring_to_bitmap(struct RoaringContainer *c);
+static int         roaring_add(struct Roaring *r, uint32_t id);
+static void        roaring_free(struct Roaring *r);
+static void        roaring_expand(const struct RoaringContainer *c, uint64_t *bits);
+static int         roaring_add_bits(struct Roaring *out, uint16_t key, const uint64_t *bits);
+static int         roaring_op(const struct Roaring *a, const struct Roaring *b, RoaringOp_t op, struct Roaring *out);
+static uint32_t    roaring_cardinality(const struct Roaring *r);
+static void        roaring_ids(const struct Roaring *r, uint32_t *ids);
+static int         roaring_contains(const struct Roaring *r, uint32_t id);
+static void        roaring_write(const struct Roaring *r, FILE *fp);
+static const char *roaring_read(struct Roaring *r, const char *p, const char *end);
+static const char *next_tag(const char *text, const char *end, char *tag, size_t *len);
+static struct Roaring *tag_index_bitmap(struct TagIndex *idx, const char *tag, size_t len, int create);
+static int         tag_index_add(struct TagIndex *idx, int id, off_t offset, const char *text, size_t length);
+static void        tag_index_free(struct TagIndex *idx);
+static int         tag_index_build(const char *path, struct TagIndex *idx);
+static int         tag_note_cmp(const void *a, const void *b);
+static int         tag_index_write(char *category, struct TagIndex *idx);
+static int         tag_index_read(char *category, const char *path, struct TagIndex *idx);
+static int         tag_index_load(char *category, const char *path, struct TagIndex *idx);
+static void        tag_index_log(char *category, int id, off_t offset, off_t after, const char *content);
+static void        tag_index_replace(char *category, const char *path, struct TagIndex *tags, int built);
+static char       *index_path(char *category, const char *suffix);
+static const char *bm25_next_word(const char *text, const char *end, char *word, size_t *len);
+static float       bm25_score(float idf, uint32_t tf, uint32_t length, double avg_length);
+static uint32_t    bm25_hash(const char *word, size_t len);
+static int         bm25_add_word(struct Bm25Builder *b, const char *word, size_t len, uint32_t doc);
+static int         bm25_word_cmp(const void *a, const void *b);
+static void        bm25_builder_free(struct Bm25Builder *b);
+static int         bm25_build(char *category, const char *path, const char *index);
+static int         bm25_fits(const struct Bm25Header *header, size_t size);
+static int         bm25_term_valid(const struct Bm25Index *index, const struct Bm25Term *term);
+static int         bm25_open(char *category, const char *path, struct Bm25Index *index);
+static const struct Bm25Term *bm25_lookup(struct Bm25Index *index, const char *word, size_t len);
+static void        bm25_advance(struct Bm25Cursor *c, uint32_t doc);
+static uint32_t    bm25_block_at(const struct Bm25Cursor *c, uint32_t doc);
+static int         bm25_hit_less(const struct Bm25Hit *a, const struct Bm25Hit *b);
+static void        bm25_heap_push(struct Bm25Hit *heap, int *count, int k, struct Bm25Hit hit);
+static int         bm25_hit_cmp(const void *a, const void *b);
+static int         bm25_top_k(const struct Bm25Index *index, struct Bm25Cursor *cursors, int n, struct Bm25Hit *hits, int k);
+static const char *find_ignore_case(const char *text, size_t len, const char *needle, size_t needle_len);
+static QueryToken_t query_next(struct Query *q, const char **start, size_t *len);
+static QueryToken_t query_peek(struct Query *q);
+static void        query_emit(struct Query *q, QueryOp_t op, int term);
+static int         query_term(struct Query *q, const char *term, size_t len);
+static int         query_parse_not(struct Query *q);
+static int         query_parse_and(struct Query *q);
+static int         query_parse_or(struct Query *q);
+static int         query_build_automaton(struct Query *q);
+static int         query_parse(struct Query *q, const char *query);
+static int         query_compile(struct Query *q, const char *query);
+static void        query_free(struct Query *q);
+static int         query_match(struct Query *q, const char *text, size_t len);
+static const char *export_notes(char *category, const char *path, ExportFormat_t format);
+static ExportFormat_t export_format(const char *name, const char *path);
+static int         export_site(const char *dir);
+static char       *watermark_path(char *category);
+static int         watermark_read(char *category, const char *target, struct Watermark *mark);
+static int         watermark_write(char *category, const char *target, const struct Watermark *mark);
+static void        watermark_invalidate(char *category);
+static int         watermark_resume(char *category, const char *target, ExportFormat_t format, struct NoteReader *reader, struct Watermark *mark);
+static int         site_export_category(struct SiteExport *site, struct SiteCategory *cat);
+static char       *site_encode(const char *name);
+static char       *site_page_path(struct SiteExport *site, struct SiteCategory *cat, int page);
+static int         site_page_open(struct SiteExport *site, struct SiteCategory *cat, struct Output *out, int page);
+static int         site_page_close(struct Output *out, int page, int has_next);
+static void        output_page_link(struct Output *out, int page, const char *label);
+static void       *site_worker(void *arg);
+static int         site_category_cmp(const void *a, const void *b);
+static void        site_read_manifest(struct SiteExport *site);
+static int         site_write_index(struct SiteExport *site);
+static int         site_write_manifest(struct SiteExport *site);
+static int         site_threads(int categories);
+static char       *path_join(const char *dir, const char *name);
+static void        export_header(struct Output *out, char *category, ExportFormat_t format);
+static void        export_note(struct Output *out, const struct NoteView *note, ExportFormat_t format);
+static void        export_footer(struct Output *out, ExportFormat_t format);
+static int         output_open(struct Output *out, int fd);
+static int         output_close(struct Output *out);
+static int         utf8_length(const unsigned char *p, const unsigned char *end);
+static void        output_escaped(struct Output *out, const char *data, size_t len, ExportFormat_t format);
+static uint64_t    needs_escape(uint64_t w, ExportFormat_t format);
+static const char *escape_char(unsigned char c, ExportFormat_t format, char *buf);
+static int         fuzzy_compile(const char *pattern, struct FuzzyPattern *fp);
+static int         fuzzy_distance(const struct FuzzyPattern *fp, const char *text, size_t len);
+static int         fuzzy_search(char *category, const char *term, int k);
+static void        output_default(const struct NoteView *note);
+static int         output_flush(struct Output *out);
+static int         output_broken(struct Output *out);
+static void        output_bytes(struct Output *out, const char *data, size_t len);
+static void        output_span(struct Output *out, const char *data, size_t len);
+static void        output_str(struct Output *out, const char *str);
+static void        output_char(struct Output *out, char c);
+static void        output_int(struct Output *out, int v);
+static void        output_date(struct Output *out, const struct NoteView *note);
+static size_t      parse_size(const char *str);
+static int         sorter_begin(struct Sorter *so);
+static int         sort_record_cmp(const void *a, const void *b);
+static int         sorter_spill(struct Sorter *so);
+static void        sorter_add(struct Sorter *so, const struct NoteView *note);
+static int         sort_run_next(struct SortRun *run);
+static int         sort_run_less(const struct SortRun *a, const struct SortRun *b);
+static void        sort_output(const char *line, size_t len);
+static int         sorter_end(struct Sorter *so);
+static void        output_without_date(const struct NoteView *note);
 static void        show_latest(char *category, int count);
+static int         watch_notes(char *category);
+static int         note_filter_compile(struct NoteFilter *f, const char *selection);
+static int         id_range_cmp(const void *a, const void *b);
+static int         note_filter_match(struct NoteFilter *f, const struct NoteView *note);
+static void        note_filter_free(struct NoteFilter *f);
+static int         transfer_notes(char *source, char *destination, const char *selection, int keep);
+static int         renumber_notes(char *category, const char *map_path);
+static int         renumber_index_fresh(char *category, const char *suffix, const struct stat *st);
+static const struct RenumberNote *renumber_lookup(const struct RenumberNote *notes, size_t count, size_t *cursor, uint64_t old_offset);
+static void        renumber_index(char *category, const char *suffix, const struct RenumberNote *notes, size_t count, const struct stat *st);
+static int         retain_days(char *category);
+static char       *archive_path(char *category);
+static int         archive_notes(char *category, int days);
+static int         archive_expired(char *category);
+static void        archive_on_write(char *category, int day);
+static int         note_reader_open_archived(struct NoteReader *reader, char *category);
+#ifdef __linux__
+static int         watch_wanted(struct Watch *w, const char *name);
+static struct WatchFile *watch_file(struct Watch *w, const char *name);
+static ssize_t     watch_pread(struct Watch *w, int fd, off_t offset, size_t length);
+static int         watch_open(struct Watch *w, struct WatchFile *wf, int skip);
+static int         watch_read(struct Watch *w, struct WatchFile *wf);
+#endif
 static FILE       *get_memo_file_ptr();
 static void        usage();
 static void        fail(const char *fmt, ...);
 static int         delete_all(char *category);
 static void        show_memo_file_path();
+static Phase_t     stats_phase(Phase_t phase);
+static void        stats_report(int command);
+static void        stats_written(int written);
+static FILE       *stamp_fopen(const char *path, const char *mode);
+static FILE       *stamp_fopen_tmp(const char *path, char **tmp);
+static int         stamp_stat(const char *path, struct stat *st);
+static int         stamp_mkdir(const char *path, mode_t mode);
+static int         stamp_rename(const char *from, const char *to);
+static void        parse_long_options(int *argc, char *argv[]);
+static void        trace_open(const char *path);
+static struct TraceSpan trace_begin(const char *name);
+static void        trace_end(struct TraceSpan *span);
+static void        trace_write();
 
-#define NOTE_FMT "%d\t%s\t%s\n"
+/* libstamp calls run holding the lock of the handle, with the
+ * functions of the command line pointed at its stamp path
+ */
+#define STAMP_BEGIN(h) do { \
+    pthread_mutex_lock(&(h)->lock); \
+    stamp_dir = (h)->dir; \
+} while (0)
+
+#define STAMP_END(h) do { \
+    stamp_dir = NULL; \
+    pthread_mutex_unlock(&(h)->lock); \
+} while (0)
 
 #define ARGCHECK(x, y, z) if (argc < y) { \
-    char *err = (char *)malloc((19 + strlen(z)) * sizeof(char));\
+    char *err = (char *)malloc((32 + strlen(x) + strlen(z)) * sizeof(char));\
     sprintf(err, "Error: -%s missing an argument %s\n", x, z); \
     fail(err); \
     free(err); \
@@ -89,7 +1037,27 @@ static void        show_memo_file_path();
     return 1;\
 }
 
-#define FREENOTE(x) if (x.message) free(x.message);
+/* Counters are only touched when --stats or STAMP_STATS is given, so
+ * a disabled build pays a single well-predicted branch per update.
+ */
+#define STAT_ADD(field, n) do { \
+    if (stats_enabled) \
+        __sync_fetch_and_add(&stats.field, (n)); \
+} while (0)
+
+#define TRACE_BEGIN(n) struct TraceSpan trace_span = trace_enabled ? \
+    trace_begin(n) : (struct TraceSpan){ NULL, 0 }
+#define TRACE_END() do { \
+    if (trace_span.name) \
+        trace_end(&trace_span); \
+} while (0)
+
+#define PHASE_TIMED (stats_enabled && stats_main_thread)
+#define PHASE_BEGIN(p) Phase_t prev_phase = PHASE_TIMED ? stats_phase(p) : PHASE_NONE
+#define PHASE_END() do { \
+    if (PHASE_TIMED) \
+        stats_phase(prev_phase); \
+} while (0)
 
 #define VERSION 1.4
 
@@ -22,6 +22,7 @@ setup() {
 @test "create note" {
     run ${STAMP} -a foobar testing
     [ $status -eq 0 ]
+    [ -z "$(${STAMP} -a other testing 2>&1 >/dev/null)" ]
     run test -f ${STAMP_PATH}/foobar
     [ $status -eq 0 ]
     shouldbe=$(date "+1%t%Y-%m-%d%ttesting")
@@ -74,6 +75,35 @@ setup() {
     [ $status -eq 0 ]
 }
 
+@test "export notes to HTML escapes content" {
+    run ${STAMP} -a foobar "testing \"quotes\" & <tags>" 2014-12-10
+    run ${STAMP} -e foobar "${STAMP_PATH}/foobar.html"
+    [ $status -eq 0 ]
+    grep -q "<td>testing &quot;quotes&quot; &amp; &lt;tags&gt;</td>" "${STAMP_PATH}/foobar.html"
+}
+
+@test "export notes to JSON lines" {
+    run ${STAMP} -a foobar "testing \"quotes\" & <tags>" 2014-12-10
+    run ${STAMP} -e foobar "${STAMP_PATH}/foobar.json"
+    [ $status -eq 0 ]
+    run cmp "${STAMP_PATH}/foobar.json" ${FIXTURE_TXT}
+    [ $status -eq 0 ]
+    # bytes that aren't UTF-8 are replaced
+    run ${STAMP} -a other "$(printf 'a\377b')" 2014-12-10
+    run ${STAMP} -e other "${STAMP_PATH}/other.json"
+    [ "$(cat "${STAMP_PATH}/other.json")" = '{"id":1,"date":"2014-12-10","message":"a\ufffdb"}' ]
+}
+
+@test "export notes to CSV" {
+    run ${STAMP} -a foobar "testing \"quotes\" & <tags>" 2014-12-10
+    run ${STAMP} -e foobar "${STAMP_PATH}/foobar.out" csv
+    [ $status -eq 0 ]
+    run cmp "${STAMP_PATH}/foobar.out" ${FIXTURE_TXT}
+    [ $status -eq 0 ]
+    run ${STAMP} -e foobar "${STAMP_PATH}/foobar.out" xml
+    [ $status -eq 1 ]
+}
+
 @test "find searching for string" {
     run ${STAMP} -a foobar testing
     run ${STAMP} -a foobar foo
@@ -160,6 +190,519 @@ setup() {
     run ${STAMP} -s && [ $status -eq 1 ]
 }
 
+@test "show all notes" {
+    # more notes than fit in one parse batch
+    for i in $(seq 1 3000); do
+        printf "%d\t2014-12-10\tnote %d\n" ${i} ${i}
+    done > "${STAMP_PATH}/foobar"
+    run ${STAMP} -s foobar
+    [ $status -eq 0 ]
+    [ ${#lines[@]} -eq 3000 ]
+    [ "${lines[0]}" = "$(printf "1\t2014-12-10\tnote 1")" ]
+    [ "${lines[2999]}" = "$(printf "3000\t2014-12-10\tnote 3000")" ]
+    run ${STAMP} -a foobar testing
+    run ${STAMP} -l foobar 1
+    [ "${lines[0]}" = "$(date "+3001%t%Y-%m-%d%ttesting")" ]
+}
+
+@test "stop listing when output is closed" {
+    for i in $(seq 1 100000); do
+        printf "%d\t2014-12-10\tnote %d\n" ${i} ${i}
+    done > "${STAMP_PATH}/foobar"
+    run sh -c "${STAMP} -s foobar 2>&1 | head -n 1"
+    [ "${lines[0]}" = "$(printf "1\t2014-12-10\tnote 1")" ]
+    [ ${#lines[@]} -eq 1 ]
+}
+
+@test "show notes organized by date" {
+    run ${STAMP} -a foobar testing1 2014-12-10
+    run ${STAMP} -a foobar testing2 2014-12-09
+    run ${STAMP} -a foobar testing3 2014-12-10
+    run ${STAMP} -o foobar
+    [ $status -eq 0 ]
+    [ "${lines[0]}" = "2014-12-10" ]
+    [ "${lines[1]}" = "$(printf "\t1\ttesting1")" ]
+    [ "${lines[2]}" = "$(printf "\t3\ttesting3")" ]
+    [ "${lines[3]}" = "2014-12-09" ]
+    [ "${lines[4]}" = "$(printf "\t2\ttesting2")" ]
+}
+
+@test "replace note content and date" {
+    run ${STAMP} -a foobar testing1 2014-12-10
+    run ${STAMP} -a foobar testing2 2014-12-10
+    run ${STAMP} -r foobar 2 replaced
+    run ${STAMP} -r foobar 1 2014-12-09
+    run cat "${STAMP_PATH}/foobar"
+    [ "${lines[0]}" = "$(printf "1\t2014-12-09\ttesting1")" ]
+    [ "${lines[1]}" = "$(printf "2\t2014-12-10\treplaced")" ]
+}
+
+@test "replace notes while others are added" {
+    run ${STAMP} -a foobar testing 2014-12-10
+    for i in $(seq 1 100); do ${STAMP} -a foobar testing; done &
+    for i in $(seq 1 30); do ${STAMP} -r foobar 1 replaced$i; done
+    wait
+    [ "$(wc -l < "${STAMP_PATH}/foobar")" -eq 101 ]
+    [ "$(cut -f1 "${STAMP_PATH}/foobar" | sort -u | wc -l)" -eq 101 ]
+    [ "$(head -n1 "${STAMP_PATH}/foobar" | cut -f3)" = "replaced30" ]
+}
+
+@test "report stats" {
+    run ${STAMP} -a foobar testing
+    run ${STAMP} --stats -s foobar
+    [ $status -eq 0 ]
+    [ "${lines[0]}" = "$(date "+1%t%Y-%m-%d%ttesting")" ]
+    [ "${lines[1]}" = "stamp stats for -s" ]
+    echo "${output}" | grep -q "note allocations  0"
+    STAMP_STATS=1 run ${STAMP} -s foobar
+    echo "${output}" | grep -q "bytes read"
+}
+
+@test "write chrome trace" {
+    run ${STAMP} -a foobar testing
+    run ${STAMP} --trace="${STAMP_PATH}/trace.json" -f foobar test
+    [ $status -eq 0 ]
+    grep -q '"traceEvents"' "${STAMP_PATH}/trace.json"
+    grep -q '"name":"search_notes","cat":"stamp","ph":"X"' "${STAMP_PATH}/trace.json"
+}
+
+@test "find notes by tags" {
+    run ${STAMP} -a foobar "fix #disk on db1 #urgent" 2014-12-10
+    run ${STAMP} -a foobar "buy milk #home" 2014-12-10
+    run ${STAMP} -a foobar "#Disk quota" 2014-12-10
+    run ${STAMP} -t foobar "disk AND NOT urgent"
+    [ $status -eq 0 ]
+    [ ${#lines[@]} -eq 1 ]
+    [ "${lines[0]}" = "$(printf "3\t2014-12-10\t#Disk quota")" ]
+    # the index is kept up to date
+    run ${STAMP} -a foobar "call bob #urgent" 2014-12-11
+    run ${STAMP} -d foobar 1
+    run ${STAMP} -r foobar 2 "buy milk #urgent"
+    run ${STAMP} -t foobar "#urgent OR #home"
+    [ ${#lines[@]} -eq 2 ]
+    [ "${lines[0]}" = "$(printf "2\t2014-12-10\tbuy milk #urgent")" ]
+    [ "${lines[1]}" = "$(printf "4\t2014-12-11\tcall bob #urgent")" ]
+}
+
+@test "show best matching notes" {
+    run ${STAMP} -a foobar "disk full on db1" 2014-12-10
+    run ${STAMP} -a foobar "network down" 2014-12-10
+    run ${STAMP} -a foobar "the disk quota of user bob is full" 2014-12-10
+    run ${STAMP} -a foobar "full moon" 2014-12-10
+    run ${STAMP} -b foobar "disk full" 2
+    [ $status -eq 0 ]
+    [ ${#lines[@]} -eq 2 ]
+    [ "${lines[0]}" = "$(printf "1\t2014-12-10\tdisk full on db1")" ]
+    [ "${lines[1]}" = "$(printf "3\t2014-12-10\tthe disk quota of user bob is full")" ]
+    # the index follows changes of the category
+    run ${STAMP} -a foobar "disk full" 2014-12-11
+    run ${STAMP} -b foobar "disk full" 1
+    [ "${lines[0]}" = "$(printf "5\t2014-12-11\tdisk full")" ]
+    # an index cut short is built again, more results than notes are fine
+    truncate -s 100 "${STAMP_PATH}/.index/foobar.bm25"
+    run ${STAMP} -b foobar "disk full" 2000000000
+    [ $status -eq 0 ]
+    [ ${#lines[@]} -eq 4 ]
+    [ "${lines[0]}" = "$(printf "5\t2014-12-11\tdisk full")" ]
+}
+
+@test "search notes ignoring case" {
+    run ${STAMP} -a foobar "Disk FULL on server" 2014-12-10
+    run ${STAMP} -a foobar "network down" 2014-12-10
+    run ${STAMP} -f foobar "disk full"
+    [ ${#lines[@]} -eq 0 ]
+    run ${STAMP} --ignore-case -f foobar "disk full"
+    [ $status -eq 0 ]
+    [ ${#lines[@]} -eq 1 ]
+    [ "${lines[0]}" = "$(printf "1\t2014-12-10\tDisk FULL on server")" ]
+    run ${STAMP} --ignore-case --query -f foobar "DISK OR NETWORK"
+    [ ${#lines[@]} -eq 2 ]
+}
+
+@test "search notes with a boolean query" {
+    run ${STAMP} -a foobar "disk full" 2014-12-10
+    run ${STAMP} -a foobar "disk quota exceeded" 2014-12-10
+    run ${STAMP} -a foobar "test disk full" 2014-12-10
+    run ${STAMP} -a foobar "network down" 2014-12-10
+    run ${STAMP} --query -f foobar 'disk AND (full OR quota) AND NOT test'
+    [ $status -eq 0 ]
+    [ ${#lines[@]} -eq 2 ]
+    [ "${lines[0]}" = "$(printf "1\t2014-12-10\tdisk full")" ]
+    [ "${lines[1]}" = "$(printf "2\t2014-12-10\tdisk quota exceeded")" ]
+    run ${STAMP} --query -f foobar '"test disk" OR down'
+    [ ${#lines[@]} -eq 2 ]
+    [ "${lines[1]}" = "$(printf "4\t2014-12-10\tnetwork down")" ]
+    run ${STAMP} --query -f foobar 'disk AND (full'
+    [ $status -eq 2 ]
+}
+
+@test "fuzzy search ranked by typos" {
+    run ${STAMP} -a foobar "teh dsik is full" 2014-12-10
+    run ${STAMP} -a foobar "the Disk is full" 2014-12-10
+    run ${STAMP} -a foobar "the dissk is full" 2014-12-10
+    run ${STAMP} -a foobar "nothing here" 2014-12-10
+    run ${STAMP} -z foobar disk 2
+    [ $status -eq 0 ]
+    [ ${#lines[@]} -eq 3 ]
+    [ "${lines[0]}" = "$(printf "2\t2014-12-10\tthe Disk is full")" ]
+    [ "${lines[1]}" = "$(printf "3\t2014-12-10\tthe dissk is full")" ]
+    [ "${lines[2]}" = "$(printf "1\t2014-12-10\tteh dsik is full")" ]
+    run ${STAMP} -z foobar disk 0
+    [ ${#lines[@]} -eq 1 ]
+    run ${STAMP} -z foobar ""
+    [ $status -eq 2 ]
+    run ${STAMP} -z foobar "$(printf '%065d' 0)"
+    [ $status -eq 2 ]
+}
+
+@test "export all categories as a site" {
+    for i in 1 2 3; do
+        run ${STAMP} -a foobar testing${i} 2014-12-10
+    done
+    run ${STAMP} -a barfoo testing 2014-12-10
+    export STAMP_EXPORT_PAGE_SIZE=2
+    run ${STAMP} -E "${STAMP_PATH}/.site"
+    [ $status -eq 0 ]
+    [ "${lines[0]}" = "exported 2 of 2 categories to ${STAMP_PATH}/.site" ]
+    grep -q '<a href="foobar/index.html">foobar</a> (3 notes)' "${STAMP_PATH}/.site/index.html"
+    grep -q '<a href="2.html">next</a>' "${STAMP_PATH}/.site/foobar/index.html"
+    grep -q 'testing3' "${STAMP_PATH}/.site/foobar/2.html"
+    # unchanged categories are skipped
+    run ${STAMP} -a barfoo testing2
+    run ${STAMP} -E "${STAMP_PATH}/.site"
+    [ "${lines[0]}" = "exported 1 of 2 categories to ${STAMP_PATH}/.site" ]
+    # another page size renders them all again
+    export STAMP_EXPORT_PAGE_SIZE=3
+    run ${STAMP} -E "${STAMP_PATH}/.site"
+    [ "${lines[0]}" = "exported 2 of 2 categories to ${STAMP_PATH}/.site" ]
+    [ ! -f "${STAMP_PATH}/.site/foobar/2.html" ]
+    # category directories are encoded, in paths and once more in links
+    run ${STAMP} -a index.html testing 2014-12-10
+    run ${STAMP} -a 'a#b' testing 2014-12-10
+    run ${STAMP} -E "${STAMP_PATH}/.site"
+    [ $status -eq 0 ]
+    [ "${lines[0]}" = "exported 2 of 4 categories to ${STAMP_PATH}/.site" ]
+    [ -f "${STAMP_PATH}/.site/index%2Ehtml/index.html" ]
+    grep -q '<a href="a%2523b/index.html">a#b</a>' "${STAMP_PATH}/.site/index.html"
+}
+
+@test "export notes incrementally" {
+    run ${STAMP} -a foobar testing1 2014-12-10
+    run ${STAMP} -e foobar "${STAMP_PATH}/foobar.html"
+    run ${STAMP} -a foobar testing2 2014-12-10
+    run ${STAMP} --incremental -e foobar "${STAMP_PATH}/foobar.html"
+    [ $status -eq 0 ]
+    run ${STAMP} -e foobar "${STAMP_PATH}/full.html"
+    run cmp "${STAMP_PATH}/foobar.html" "${STAMP_PATH}/full.html"
+    [ $status -eq 0 ]
+    run ${STAMP} --incremental -e foobar "${STAMP_PATH}/foobar.html"
+    [ "${lines[0]}" = "Nothing new to export." ]
+    # replacing a note forces a full export
+    run ${STAMP} -r foobar 1 replaced
+    run ${STAMP} --incremental -e foobar "${STAMP_PATH}/foobar.html"
+    grep -q "replaced" "${STAMP_PATH}/foobar.html"
+}
+
+@test "search notes with a substring index" {
+    run ${STAMP} -a foobar "banana split" 2014-12-10
+    run ${STAMP} -a foobar "an apple" 2014-12-10
+    run ${STAMP} -I foobar
+    [ $status -eq 0 ]
+    [ "${lines[0]}" = "indexed 2 notes of foobar" ]
+    run ${STAMP} -a foobar "ananas" 2014-12-10
+    run ${STAMP} -f foobar "an"
+    [ ${#lines[@]} -eq 3 ]
+    run ${STAMP} --count -f foobar "ana"
+    [ "${lines[0]}" = "4" ]
+    run ${STAMP} --count -F foobar "ana"
+    [ $status -eq 1 ]
+    # a rewrite drops the index instead of leaving it stale
+    run ${STAMP} -d foobar 2
+    [ ! -f "${STAMP_PATH}/.index/foobar.sa" ]
+    run ${STAMP} -f foobar "an"
+    [ ${#lines[@]} -eq 2 ]
+}
+
+@test "show statistics of notes" {
+    run ${STAMP} -a foobar "one two two" 2014-12-10
+    run ${STAMP} -a foobar "two three" 2014-12-11
+    run ${STAMP} -a foobar "two" 2015-01-02
+    run ${STAMP} -S foobar
+    [ $status -eq 0 ]
+    [ "${lines[0]}" = "notes          3" ]
+    [ "${lines[1]}" = "first date     2014-12-10" ]
+    echo "$output" | grep -q "^  2014-12 *2 "
+    echo "$output" | grep -q "^  two 4$"
+    run ${STAMP} -S
+    [ "${lines[0]}" = "categories     1" ]
+}
+
+@test "show notes sorted by date" {
+    run ${STAMP} -a foobar later 2015-01-02
+    run ${STAMP} -a foobar earlier 2014-12-10
+    run ${STAMP} -a foobar between 2014-12-11
+    run ${STAMP} --sort=date -s foobar
+    [ "${lines[0]}" = "2	2014-12-10	earlier" ]
+    [ "${lines[2]}" = "1	2015-01-02	later" ]
+    # spill to sorted runs on disk
+    for i in $(seq 1 200); do echo "note number $i"; done | ${STAMP} -i foobar
+    STAMP_SORT_MEMORY=4k run ${STAMP} --sort=length --reverse -s foobar
+    [ ${#lines[@]} -eq 203 ]
+    [ "${lines[0]}" = "203	$(date +%Y-%m-%d)	note number 200" ]
+    [ "${lines[202]}" = "1	2015-01-02	later" ]
+}
+
+@test "remove duplicate notes" {
+    run ${STAMP} -a foobar "Buy  milk" 2014-12-10
+    run ${STAMP} -a foobar "buy milk" 2014-12-11
+    run ${STAMP} -a foobar "other" 2014-12-10
+    run ${STAMP} -u foobar
+    [ "${lines[0]}" = "2	2014-12-11	buy milk" ]
+    run ${STAMP} --same-date -u foobar
+    [ $status -eq 2 ]
+    skipped=$(printf 'other\nnew\nnew\n' | ${STAMP} --skip-duplicates -i foobar)
+    [ "$skipped" = "skipped 2 duplicate notes" ]
+    run ${STAMP} -U foobar
+    [ "${lines[0]}" = "removed 1 duplicate notes from category foobar" ]
+    run ${STAMP} -s foobar
+    [ ${#lines[@]} -eq 3 ]
+}
+
+@test "show a page of notes" {
+    seq 1 10000 | awk '{ print $1 "\t2014-12-10\tnote " $1 }' > "${STAMP_PATH}/foobar"
+    run ${STAMP} --offset 5000 --limit 2 -s foobar
+    [ ${#lines[@]} -eq 2 ]
+    [ "${lines[0]}" = "5001	2014-12-10	note 5001" ]
+    # checkpoints are rebuilt after a delete
+    run ${STAMP} -d foobar 1
+    run ${STAMP} --offset 5000 --limit 1 -s foobar
+    [ "${lines[0]}" = "5002	2014-12-10	note 5002" ]
+    run ${STAMP} --offset 1 --limit 1 -f foobar "note 99"
+    [ "${lines[0]}" = "990	2014-12-10	note 990" ]
+}
+
+@test "cache search results" {
+    export STAMP_CACHE_SIZE=1m
+    run ${STAMP} -a foobar testing1 2014-12-10
+    run ${STAMP} -f foobar testing
+    run ${STAMP} -f foobar testing
+    [ "${lines[0]}" = "1	2014-12-10	testing1" ]
+    [ $(ls "${STAMP_PATH}/.cache" | wc -l) -eq 1 ]
+    # a changed category isn't answered from the cache
+    run ${STAMP} -a foobar testing2 2014-12-10
+    run ${STAMP} -f foobar testing
+    [ ${#lines[@]} -eq 2 ]
+    run ${STAMP} -f foobar nothing
+    run ${STAMP} -f foobar nothing
+    [ $status -eq 2 ]
+    # searches storing at the same time don't share a tmp file
+    cached=$(ls -A "${STAMP_PATH}/.cache" | wc -l)
+    for i in $(seq 1 20); do ${STAMP} -f foobar "testing$i" > /dev/null & done
+    wait
+    [ $(ls -A "${STAMP_PATH}/.cache" | wc -l) -eq $((cached + 20)) ]
+}
+
+@test "use notes through libstamp" {
+    cat > "${STAMP_PATH}/api.c" <<EOF
+#include <stdio.h>
+#include "libstamp.h"
+
+static int print(const struct StampNote *note, void *arg)
+{
+    printf("%d %.*s\\n", note->id, (int)note->length, note->message);
+    return 0;
+}
+
+int main(void)
+{
+    const char *batch[] = { "one", "two", "three" };
+    struct Stamp *h = stamp_open("${STAMP_PATH}", "foobar");
+
+    stamp_append_batch(h, batch, 3, "2014-12-10");
+    stamp_replace(h, 2, "TWO", NULL);
+    stamp_delete(h, 1);
+    stamp_search(h, "T", print, NULL);
+    stamp_close(h);
+    return 0;
+}
+EOF
+    run cc -I. -o "${STAMP_PATH}/api" "${STAMP_PATH}/api.c" libstamp.a -lpthread -lm
+    [ $status -eq 0 ]
+    run "${STAMP_PATH}/api"
+    [ "${lines[0]}" = "2 TWO" ]
+    run ${STAMP} -s foobar
+    [ "${lines[1]}" = "3	2014-12-10	three" ]
+}
+
+@test "append through libstamp from threads" {
+    cat > "${STAMP_PATH}/threads.c" <<EOF
+#include <pthread.h>
+#include <stdio.h>
+#include "libstamp.h"
+
+static void *append(void *arg)
+{
+    struct Stamp *h = stamp_open("${STAMP_PATH}", (const char *)arg);
+
+    for (int i = 0; i < 100; i++)
+        stamp_append(h, "note", "2014-12-10");
+    stamp_close(h);
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[8];
+
+    for (int i = 0; i < 8; i++)
+        pthread_create(&threads[i], NULL, append, i % 2 ? "foobar" : "other");
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+    return 0;
+}
+EOF
+    run cc -I. -o "${STAMP_PATH}/threads" "${STAMP_PATH}/threads.c" libstamp.a -lpthread -lm
+    [ $status -eq 0 ]
+    run "${STAMP_PATH}/threads"
+    [ $status -eq 0 ]
+    for category in foobar other; do
+        [ "$(cut -f1 "${STAMP_PATH}/${category}" | sort -u | wc -l)" -eq 400 ]
+        [ "$(tail -n1 "${STAMP_PATH}/${category}" | cut -f1)" = "400" ]
+    done
+}
+
+@test "import notes with dates and ids" {
+    run ${STAMP} -a foobar testing1 2014-12-10
+    printf 'id,date,message\n5,2014-12-11,"one, ""two""\nthree"\n,2014-12-12,next\n' > "${STAMP_PATH}/in.csv"
+    run ${STAMP} --format=csv -i foobar < "${STAMP_PATH}/in.csv"
+    [ "${lines[0]}" = "imported 2 notes into foobar" ]
+    run ${STAMP} -s foobar
+    [ "${lines[1]}" = "5	2014-12-11	one, \"two\"three" ]
+    [ "${lines[2]}" = "6	2014-12-12	next" ]
+    # records have the fields of the header, none are guessed
+    printf 'id,date,message\n,2014-12-12,fine\n2014-12-13,two,fields\n' > "${STAMP_PATH}/in.csv"
+    run ${STAMP} --format=csv -i foobar < "${STAMP_PATH}/in.csv"
+    [ $status -eq 2 ]
+    [ "${lines[0]}" = "line 3: invalid id" ]
+    # a bad record leaves the category alone
+    run ${STAMP} --format=jsonl -i foobar <<< '{"id":7,"date":"2014-02-29","message":"leap"}'
+    [ $status -eq 2 ]
+    run ${STAMP} --format=jsonl -i foobar <<< '{"date":"2016-02-29","message":"leap \u00e9"}'
+    run ${STAMP} -s foobar
+    [ ${#lines[@]} -eq 4 ]
+    [ "${lines[3]}" = "7	2016-02-29	leap é" ]
+}
+
+@test "follow notes as they are added" {
+    run ${STAMP} -a foobar testing1 2014-12-10
+    ${STAMP} -w > "${STAMP_PATH}/watch" &
+    sleep 0.5
+    run ${STAMP} -a foobar testing2 2014-12-10
+    # a rewrite doesn't print the notes again
+    run ${STAMP} -d foobar 1
+    run ${STAMP} -a other testing3 2014-12-10
+    # nor does renumbering hide the notes added after it
+    run ${STAMP} -R foobar
+    sleep 0.5
+    run ${STAMP} -a foobar testing4 2014-12-10
+    sleep 0.5
+    kill $!
+    run cat "${STAMP_PATH}/watch"
+    [ ${#lines[@]} -eq 3 ]
+    [ "${lines[0]}" = "foobar	2	2014-12-10	testing2" ]
+    [ "${lines[1]}" = "other	1	2014-12-10	testing3" ]
+    [ "${lines[2]}" = "foobar	2	2014-12-10	testing4" ]
+}
+
+@test "archive notes past their retention" {
+    run ${STAMP} -a foobar testing1 2000-01-01
+    run ${STAMP} -a foobar testing2
+    run ${STAMP} -A foobar
+    [ $status -eq 2 ]
+    export STAMP_RETAIN_DAYS=30
+    run ${STAMP} -A foobar
+    [ "${lines[0]}" = "archived 1 notes of foobar" ]
+    run ${STAMP} -f foobar testing
+    [ ${#lines[@]} -eq 1 ]
+    run ${STAMP} --include-archive -f foobar testing
+    [ ${#lines[@]} -eq 2 ]
+    [ "${lines[0]}" = "1	2000-01-01	testing1" ]
+    # adding an old note archives it right away
+    export STAMP_RETAIN_DAYS_foobar=10
+    run ${STAMP} -a foobar testing3 2001-01-01
+    run ${STAMP} -s foobar
+    [ ${#lines[@]} -eq 1 ]
+    run ${STAMP} --include-archive -l foobar 2
+    [ "${lines[0]}" = "3	2001-01-01	testing3" ]
+}
+
+@test "archive notes while others are added" {
+    export STAMP_RETAIN_DAYS=30
+    for i in $(seq 1 100); do ${STAMP} -a foobar testing; done &
+    for i in $(seq 1 30); do ${STAMP} -a foobar old 2000-01-01; done
+    wait
+    [ "$(grep -c old "${STAMP_PATH}/foobar")" -eq 0 ]
+    [ "$(wc -l < "${STAMP_PATH}/foobar")" -eq 100 ]
+    [ "$(wc -l < "${STAMP_PATH}/.archive/foobar")" -eq 30 ]
+}
+
+@test "move and copy notes to another category" {
+    run ${STAMP} -a foobar testing1 2014-12-10
+    run ${STAMP} -a foobar testing2 2014-12-11
+    run ${STAMP} -a foobar testing3 2014-12-12
+    run ${STAMP} -a other testing4 2014-12-13
+    run ${STAMP} -m foobar other 1,3
+    [ "${lines[0]}" = "moved 2 notes from foobar to other" ]
+    run ${STAMP} -s other
+    [ ${#lines[@]} -eq 3 ]
+    [ "${lines[1]}" = "2	2014-12-10	testing1" ]
+    [ "${lines[2]}" = "3	2014-12-12	testing3" ]
+    run ${STAMP} -c foobar other testing
+    run ${STAMP} -s foobar
+    [ "${lines[0]}" = "2	2014-12-11	testing2" ]
+    [ ${#lines[@]} -eq 1 ]
+    run ${STAMP} -s other
+    [ "${lines[3]}" = "4	2014-12-11	testing2" ]
+    run ${STAMP} -m foobar other 5
+    [ $status -eq 2 ]
+    # numbers are searched for with --search
+    run ${STAMP} -a foobar "released in 2014" 2014-12-13
+    run ${STAMP} --search -m foobar other 2014
+    [ "${lines[0]}" = "moved 1 notes from foobar to other" ]
+    run ${STAMP} -s other
+    [ "${lines[4]}" = "5	2014-12-13	released in 2014" ]
+}
+
+@test "renumber notes and keep indexes" {
+    run ${STAMP} -a foobar "testing1 #one" 2014-12-10
+    run ${STAMP} -a foobar testing2 2014-12-11
+    run ${STAMP} -a foobar "testing3 #one" 2014-12-12
+    run ${STAMP} -d foobar 2
+    run ${STAMP} -I foobar
+    run ${STAMP} -R foobar "${STAMP_PATH}/map"
+    [ "${lines[0]}" = "renumbered notes of foobar, 1 ids changed" ]
+    [ "$(cat "${STAMP_PATH}/map")" = "$(printf '1\t1\n3\t2')" ]
+    run ${STAMP} -s foobar
+    [ "${lines[1]}" = "2	2014-12-12	testing3 #one" ]
+    run ${STAMP} -t foobar one
+    [ "${lines[1]}" = "2	2014-12-12	testing3 #one" ]
+    run ${STAMP} -f foobar testing3
+    [ "${lines[0]}" = "2	2014-12-12	testing3 #one" ]
+    run ${STAMP} -b foobar testing3
+    [ "${lines[0]}" = "2	2014-12-12	testing3 #one" ]
+}
+
+@test "show dates as they are stored" {
+    printf '1\t2014-02-30\tbad\n2\tsoon\tworse\n3\t2014-02-28\tfine\n4\tsoon\tagain\n' > "${STAMP_PATH}/foobar"
+    run ${STAMP} -s foobar
+    [ "${lines[0]}" = "1	2014-02-30	bad" ]
+    [ "${lines[1]}" = "2	soon	worse" ]
+    run ${STAMP} -o foobar
+    [ "${lines[0]}" = "2014-02-30" ]
+    [ "${lines[2]}" = "soon" ]
+    [ "${lines[4]}" = "	4	again" ]
+}
+
 teardown() {
     rm -r "${STAMP_PATH}"
 }